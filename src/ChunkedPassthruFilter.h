@@ -0,0 +1,118 @@
+//
+// ChunkedPassthruFilter.h
+//
+// Passes a chunked body along exactly as it came, chunk sizes and all.
+// The chunks are only followed far enough to know where the body ends, so
+// nothing is taken apart and put back together, and the data in a big
+// chunk goes out a read at a time.
+//
+
+#ifndef __FLATWORM_CHUNKEDPASSTHRUFILTER_H__
+#define __FLATWORM_CHUNKEDPASSTHRUFILTER_H__
+
+#include "parasock/Filter.h"
+
+class ChunkedPassthruFilter : public Filter {
+private:
+	enum ChunkedState {
+		ReadChunkSize,
+		ReadChunkData, // and the CRLF after it
+		ReadTrailer
+	};
+
+	ChunkedState state;
+	size_t remaining; // of the chunk being read, with its CRLF
+
+public:
+	ChunkedPassthruFilter (Parasock & parasock, FlowDirection whichInput) :
+		Filter (parasock, whichInput),
+		state (ReadChunkSize),
+		remaining (0)
+	{
+	}
+
+	Instruction firstInstruction() /* override */ {
+		return ThruDelimiterInstruction("\r\n", 0);
+	}
+
+private:
+	// The value of a hex digit, or -1 if it isn't one
+	static int hexValue(char c) {
+		if ((c >= '0') && (c <= '9'))
+			return c - '0';
+		if ((c >= 'a') && (c <= 'f'))
+			return c - 'a' + 10;
+		if ((c >= 'A') && (c <= 'F'))
+			return c - 'A' + 10;
+		return -1;
+	}
+
+public:
+	Instruction runFilter(
+		InputSpan const & uncommittedBytes,
+		size_t /* newDataOffset */,
+		size_t /* readSoFar */,
+		bool disconnected
+	) /* override */ {
+		if (disconnected) {
+			throw "Dropped chunked connection with pending known data.";
+		}
+
+		outputString(uncommittedBytes.str());
+		size_t length = uncommittedBytes.length();
+
+		switch (state) {
+
+		case ReadChunkSize: {
+			// the size, in hex, maybe followed by ";extension".  It has to
+			// fit with the CRLF after the data added on.
+			size_t size = 0;
+			size_t index = 0;
+			int digit;
+			while ((digit = hexValue(uncommittedBytes[index])) != -1) {
+				if (size > (static_cast<size_t>(-1) - 2 - digit) / 16)
+					throw "Chunk size too large in chunked data.";
+				size = size * 16 + digit;
+				index++;
+			}
+			char after = uncommittedBytes[index];
+			if (
+				(index == 0)
+				|| ((after != '\r') && (after != ';') && (after != ' ') && (after != '\t'))
+			) {
+				throw "Invalid chunk size in chunked data.";
+			}
+			if (size == 0) {
+				state = ReadTrailer;
+				return ThruDelimiterInstruction("\r\n", length);
+			}
+			state = ReadChunkData;
+			remaining = size + 2;
+			return BytesMaxInstruction(remaining, length);
+		}
+
+		case ReadChunkData:
+			Assert(length <= remaining);
+			remaining -= length;
+			if (remaining > 0)
+				return BytesMaxInstruction(remaining, length);
+			state = ReadChunkSize;
+			return ThruDelimiterInstruction("\r\n", length);
+
+		case ReadTrailer:
+			// trailer fields, until the blank line that ends the body
+			if (length > 2)
+				return ThruDelimiterInstruction("\r\n", length);
+			return QuitFilterInstruction(length);
+
+		default:
+			NotReached();
+			return QuitFilterInstruction(length);
+		}
+	}
+
+	~ChunkedPassthruFilter() /* override */ {
+	}
+};
+
+#endif
@@ -18,6 +18,10 @@ public:
 	bool transparent;
 	unsigned ckeepalive;
 	ProxyWorker * proxy;
+
+private:
+	HeaderRules const & rules;
+	HeaderRules::HostRules const * hostRules;
 	
 public:
 	ClientHeaderFilter (
@@ -27,43 +31,60 @@ public:
 		bool isconnect,
 		bool transparent,
 		unsigned ckeepalive,
-		ProxyWorker * proxy
+		ProxyWorker * proxy,
+		HeaderRules const & rules
 	) :
 		HeaderFilter (parasock, whichInput, isconnect),
 		requestOriginal (requestOriginal), 
 		isconnect (isconnect), 
 		transparent (transparent),
 		ckeepalive (ckeepalive),
-		proxy (proxy)
+		proxy (proxy),
+		rules (rules),
+		hostRules (NULL)
 	{
 	}
 
+	// Those for the host the request is going to, once the header is in.
+	// The response from it goes by the same host's rules.
+	HeaderRules::HostRules const * getHostRules() const {
+		return hostRules;
+	}
+
+	HeaderRuleTable const * rulesFor(HeaderBlock const & block) /* override */ {
+		TextSpan host (proxy->hostname.data(), proxy->hostname.length());
+		if (transparent) {
+			for (size_t index = 0; index < block.size(); index++) {
+				if (block[index].name == HeaderHost) {
+					host = block[index].value;
+					break;
+				}
+			}
+		}
+		hostRules = &rules.forHost(host);
+		return &hostRules->request;
+	}
+
 	void processHeaderLine(
 		std::string & header,
-		std::string const key,
-		std::string const value
+		HeaderLine const & line
 	) /* override */ {
-		size_t sb = 0;
-		if (transparent && !strncasecmplen(key, "Host")) {
+		if (transparent && (line.name == HeaderHost)) {
 
-			size_t se = value.find('\r', sb);
 			if (!ckeepalive) {
-				std::string sq = value.substr(0, se);
-				parsehostname(sq, proxy, 80);
+				parsehostname(line.value, proxy, 80, false);
 			}
-			std::ostringstream newReqStream;
 			size_t sp = requestOriginal.find('/', 1);
-			newReqStream << requestOriginal.substr(0, sp) << "http://" <<
-				value.substr(
-					0, se != std::string::npos ? se : std::string::npos
-				) << requestOriginal.substr(sp, std::string::npos);
-			requestOriginal = newReqStream.str();
-			header += key;
-			header += ": ";
-			header += value;
-			header += "\r\n";
+			std::string newRequest;
+			newRequest.reserve(requestOriginal.length() + line.value.length + 7);
+			newRequest.append(requestOriginal, 0, sp);
+			newRequest += "http://";
+			line.value.appendTo(newRequest);
+			newRequest.append(requestOriginal, sp, std::string::npos);
+			requestOriginal.swap(newRequest);
+			line.appendTo(header);
 
-		} else if (!strncasecmplen(key, "accept-encoding")) {
+		} else if (line.name == HeaderAcceptEncoding) {
 			// zip or gzip data is hard to filter, but apparently there
 			// is a streaming interface in zlib with z_stream_s:
 
@@ -74,10 +95,7 @@ public:
 
 		} else {
 
-			header += key;
-			header += ": ";
-			header += value;
-			header += "\r\n";
+			line.appendTo(header);
 		}
 	}
 
@@ -0,0 +1,106 @@
+//
+// ContentTypes.cpp
+//
+// The table of types whose bodies are filtered, and looking responses up
+// in it.
+//
+
+#include <string.h>
+#include <ctype.h>
+
+#include "ContentTypes.h"
+
+static char const * const DefaultFilteredTypes[] = {
+	"text/*",
+	"application/javascript",
+	"application/x-javascript",
+	"application/ecmascript",
+	"application/json",
+	"application/xml",
+	"application/xhtml+xml",
+	"application/rss+xml",
+	"application/atom+xml",
+	"image/svg+xml"
+};
+
+
+// The media type alone, lower case and without spaces or parameters
+static std::string MediaType(char const * data, size_t length) {
+	std::string type;
+	for (size_t index = 0; (index < length) && (data[index] != ';'); index++) {
+		unsigned char c = static_cast<unsigned char>(data[index]);
+		if (!isspace(c))
+			type += static_cast<char>(tolower(c));
+	}
+	return type;
+}
+
+
+ContentTypes::ContentTypes () {
+	for (
+		size_t index = 0;
+		index < sizeof(DefaultFilteredTypes) / sizeof(DefaultFilteredTypes[0]);
+		index++
+	) {
+		types[DefaultFilteredTypes[index]] = BodyFiltered;
+	}
+}
+
+
+bool ContentTypes::parse(char const * list, std::string & error) {
+	std::map<std::string, BodyHandling> parsed;
+	while (*list != '\0') {
+		char const * comma = strchr(list, ',');
+		size_t length = (comma != NULL) ? comma - list : strlen(list);
+		std::string type = MediaType(list, length);
+
+		size_t slash = type.find('/');
+		if (
+			(slash == std::string::npos)
+			|| (slash == 0)
+			|| (slash + 1 == type.length())
+			|| (type.find('/', slash + 1) != std::string::npos)
+			|| (type[0] == '*')
+		) {
+			error = "expected type/subtype or type/*, not \"" + type + "\"";
+			return false;
+		}
+		parsed[type] = BodyFiltered;
+
+		list += length;
+		if (*list == ',')
+			list++;
+	}
+
+	types.swap(parsed);
+	return true;
+}
+
+
+BodyHandling ContentTypes::handlingFor(
+	std::string const & contentType,
+	std::string const & contentEncoding
+) const {
+	// compressed, the rules couldn't find anything in it
+	std::string encoding = MediaType(
+		contentEncoding.data(), contentEncoding.length()
+	);
+	if (!encoding.empty() && (encoding != "identity"))
+		return BodyPassthru;
+
+	std::string type = MediaType(contentType.data(), contentType.length());
+	if (type.empty())
+		return BodyFiltered;
+
+	std::map<std::string, BodyHandling>::const_iterator it = types.find(type);
+	if (it != types.end())
+		return it->second;
+
+	size_t slash = type.find('/');
+	if (slash != std::string::npos) {
+		it = types.find(type.substr(0, slash) + "/*");
+		if (it != types.end())
+			return it->second;
+	}
+	return BodyPassthru;
+}
@@ -0,0 +1,53 @@
+//
+// ContentTypes.h
+//
+// Which response bodies go through the data filter, and which are passed
+// along untouched, going by their Content-Type.  There's nothing for the
+// rules to find in an image, a video or an archive, and nothing they could
+// find in a body that's been compressed, so running those through the
+// filter just costs time.  A body that isn't filtered keeps the length the
+// server gave it, and can be moved from socket to socket with splice().
+//
+// The types filtered are text/* and the usual script, JSON and XML types,
+// unless a list is given.  A list is separated by commas, and each is a
+// type/subtype or a type/* for all of a type.  A body with no Content-Type
+// at all is filtered, as every body used to be.
+//
+
+#ifndef __FLATWORM_CONTENTTYPES_H__
+#define __FLATWORM_CONTENTTYPES_H__
+
+#include <map>
+#include <string>
+
+enum BodyHandling {
+	BodyFiltered,
+	BodyPassthru
+};
+
+class ContentTypes {
+private:
+	// Lower case, without parameters; "text/*" stands for all of text
+	std::map<std::string, BodyHandling> types;
+
+public:
+	ContentTypes ();
+
+private:
+	// Disable copying C++98 style
+	ContentTypes (ContentTypes const & other);
+
+public:
+	// Replaces the types that are filtered.  False with a message saying
+	// what was wrong, if something was.
+	bool parse(char const * list, std::string & error);
+
+	// For a response with those Content-Type and Content-Encoding values
+	// (empty strings if it doesn't have them)
+	BodyHandling handlingFor(
+		std::string const & contentType,
+		std::string const & contentEncoding
+	) const;
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include "DataFilter.h"
+#include "parasock/ByteSearch.h"
 
 
 DataFilter::DataFilter (
@@ -71,7 +72,7 @@ void DataFilter::fulfillPlaceholder(
 }
 
 
-std::auto_ptr<Instruction> DataFilter::firstInstruction() {
+Instruction DataFilter::firstInstruction() {
 	// gets more complicated when we chunk output that was initially
 	// unchunked, or...when we don't chunk output that was chunked to
 	// begin with.
@@ -84,14 +85,12 @@ std::auto_ptr<Instruction> DataFilter::firstInstruction() {
 	subInstruction = firstInstructionSubCore();
 	chunkState = BeginChunk;
 
-	return std::auto_ptr<Instruction>(
-		new ThruDelimiterInstruction("\r\n", 0)
-	);
+	return ThruDelimiterInstruction("\r\n", 0);
 }		
 
 
-std::auto_ptr<Instruction> DataFilter::runFilter(
-	std::string const & uncommittedBytes,
+Instruction DataFilter::runFilter(
+	InputSpan const & uncommittedBytes,
 	size_t newDataOffset,
 	size_t readSoFar,
 	bool disconnected
@@ -136,7 +135,7 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 		commitSize = 0;
 		return;
 	} */
-	std::auto_ptr<Instruction> instruction;
+	Instruction instruction;
 
 	switch (chunkState) {
 
@@ -150,7 +149,7 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 
 			bool getMoreData = false;
 			while (!getMoreData) {
-				switch (subInstruction->type) {
+				switch (subInstruction.type) {
 
 					case Instruction::QuitFilter:
 						// filter needs to eat all the input for now.
@@ -158,10 +157,14 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 						break;
 
 					case Instruction::ThruDelimiter: {
-						ThruDelimiterInstruction* inst =
-							dynamic_cast<ThruDelimiterInstruction*>(subInstruction.get());
-						size_t delimPos = subUnfiltered.find(inst->delimiter);
-						if (delimPos != std::string::npos) {
+						char const * delim = FindBytes(
+							subUnfiltered.data(),
+							subUnfiltered.length(),
+							subInstruction.delimiter,
+							subInstruction.delimiterLength
+						);
+						if (delim != NULL) {
+							size_t delimPos = delim - subUnfiltered.data();
 							size_t offset = subUncommitted.length();
 							subUncommitted +=
 								subUnfiltered.substr(0, delimPos);
@@ -173,55 +176,50 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 								subReadSoFar,
 								disconnected
 							);
-							Assert(subInstruction->commitSize <= subUncommitted.length());
-							subUncommitted.erase(0, subInstruction->commitSize);
+							Assert(subInstruction.commitSize <= subUncommitted.length());
+							subUncommitted.erase(0, subInstruction.commitSize);
 						} else 
 							getMoreData = true;
 						break;
 					};
 
 					case Instruction::BytesExact: {
-						BytesExactInstruction* inst =
-							dynamic_cast<BytesExactInstruction*>(subInstruction.get());
-						if (subUnfiltered.length() >= inst->exactByteCount) {
+						if (subUnfiltered.length() >= subInstruction.exactByteCount) {
 							size_t offset = subUncommitted.length();
 							subUncommitted += 
-								subUnfiltered.substr(0, inst->exactByteCount);
-							subUnfiltered.erase(0, inst->exactByteCount);
-							subReadSoFar += inst->exactByteCount;
+								subUnfiltered.substr(0, subInstruction.exactByteCount);
+							subUnfiltered.erase(0, subInstruction.exactByteCount);
+							subReadSoFar += subInstruction.exactByteCount;
 							subInstruction = runSubCore(
 								subUncommitted,
 								offset,
 								subReadSoFar,
 								disconnected
 							);
-							Assert(subInstruction->commitSize <= subUncommitted.length());
-							subUncommitted.erase(0, subInstruction->commitSize);
+							Assert(subInstruction.commitSize <= subUncommitted.length());
+							subUncommitted.erase(0, subInstruction.commitSize);
 						} else
 							getMoreData = true;
 						break;
 					}
 
 					case Instruction::BytesMax: {
-						BytesMaxInstruction* inst =
-							dynamic_cast<BytesMaxInstruction*>(subInstruction.get());
-
 						if (subUnfiltered.length() > 0) {
 							size_t offset = subUncommitted.length();
-							if (subUnfiltered.length() > inst->maxByteCount) {
+							if (subUnfiltered.length() > subInstruction.maxByteCount) {
 								subUncommitted += subUnfiltered.substr(
-									0, inst->maxByteCount
+									0, subInstruction.maxByteCount
 								);
-								subUnfiltered.erase(0, inst->maxByteCount);
-								subReadSoFar += inst->maxByteCount;
+								subUnfiltered.erase(0, subInstruction.maxByteCount);
+								subReadSoFar += subInstruction.maxByteCount;
 								subInstruction = runSubCore(
 									subUncommitted,
 									offset,
 									subReadSoFar,
 									disconnected
 								);
-								Assert(subInstruction->commitSize <= subUncommitted.length());
-								subUncommitted.erase(0, subInstruction->commitSize);
+								Assert(subInstruction.commitSize <= subUncommitted.length());
+								subUncommitted.erase(0, subInstruction.commitSize);
 							} else {
 								subUncommitted += subUnfiltered;
 								subReadSoFar += subUnfiltered.length();
@@ -232,8 +230,8 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 									subReadSoFar,
 									disconnected
 								);
-								Assert(subInstruction->commitSize <= subUncommitted.length());
-								subUncommitted.erase(0, subInstruction->commitSize);
+								Assert(subInstruction.commitSize <= subUncommitted.length());
+								subUncommitted.erase(0, subInstruction.commitSize);
 							}
 						} else
 							getMoreData = true;
@@ -251,8 +249,8 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 							subReadSoFar,
 							disconnected
 						);
-						Assert(subInstruction->commitSize <= subUncommitted.length());
-						subUncommitted.erase(0, subInstruction->commitSize);
+						Assert(subInstruction.commitSize <= subUncommitted.length());
+						subUncommitted.erase(0, subInstruction.commitSize);
 						getMoreData = true;
 						break;
 					}
@@ -276,7 +274,7 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 		Assert(uncommittedBytes.find("\r\n") != std::string::npos);
 		Assert(uncommittedBytes[uncommittedBytes.length()-1] == '\n');
 		Assert(uncommittedBytes[uncommittedBytes.length()-2] == '\r');
-		std::string const & line = uncommittedBytes;
+		InputSpan const & line = uncommittedBytes;
 		int chunkSizeUnfilteredTemp = 0;
 		if (uncommittedBytes.length() < 3)
 				throw "Length field for chunked data less than for 0+CR+LF";
@@ -297,10 +295,10 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 
 			// REVIEW: What if we disconnected?
 
-			Assert(subInstruction->commitSize <= subUncommitted.length());
-			subUncommitted.erase(0, subInstruction->commitSize);
+			Assert(subInstruction.commitSize <= subUncommitted.length());
+			subUncommitted.erase(0, subInstruction.commitSize);
 
-			Assert(subInstruction->type == Instruction::QuitFilter);
+			Assert(subInstruction.type == Instruction::QuitFilter);
 			Assert(subUnfiltered.empty());
 			Assert(subUncommitted.empty());
 
@@ -312,9 +310,7 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 
 			contentLengthFiltered.setKnownValue(filteredCharsSent);
 
-			instruction = std::auto_ptr<Instruction>(
-				new QuitFilterInstruction(uncommittedBytes.length())
-			);
+			instruction = QuitFilterInstruction(uncommittedBytes.length());
 
 		} else {
 			// another chunk is coming...
@@ -328,11 +324,9 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 				uncommittedBytes.length()
 			); */
 
-			instruction = std::auto_ptr<Instruction>(
-				new BytesExactInstruction(
-					chunkSize.getKnownValue(),
-					uncommittedBytes.length()
-				)
+			instruction = BytesExactInstruction(
+				chunkSize.getKnownValue(),
+				uncommittedBytes.length()
 			);
 		}
 
@@ -346,15 +340,13 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 		// current semantics is "read up to"
 
 		Assert(chunkSize.isKnown());
-		chunkString += uncommittedBytes;
+		uncommittedBytes.appendTo(chunkString);
 		{
 			// new test... can we read EXACT bytes?
 			Assert(uncommittedBytes.length() == chunkSize.getKnownValue());
-			instruction = std::auto_ptr<Instruction>(
-				new ThruDelimiterInstruction(
-					"\r\n",
-					uncommittedBytes.length()
-				)
+			instruction = ThruDelimiterInstruction(
+				"\r\n",
+				uncommittedBytes.length()
 			);
 			chunkState = nextChunkState(chunkState);
 		}
@@ -385,12 +377,10 @@ std::auto_ptr<Instruction> DataFilter::runFilter(
 	case ReadChunkCrLf: {
 		Assert(uncommittedBytes == "\r\n");
 
-		instruction = std::auto_ptr<Instruction>(new 
-			ThruDelimiterInstruction(
+		instruction = ThruDelimiterInstruction(
 				"\r\n",
 				uncommittedBytes.length()
-			)
-		);
+			);
 		chunkState = nextChunkState(chunkState);
 		break;
 	}
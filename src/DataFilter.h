@@ -109,7 +109,7 @@ private:
 
 private:
 	std::auto_ptr<Chunk> currentChunk;
-	std::auto_ptr<Instruction> subInstruction;
+	Instruction subInstruction;
 	std::string subUncommitted;
 	std::string subUnfiltered;
 	size_t subReadSoFar;
@@ -139,18 +139,18 @@ protected:
 	) /* override */;
 
 public:
-	virtual std::auto_ptr<Instruction> firstInstructionSubCore() = 0;
-	virtual std::auto_ptr<Instruction> runSubCore(
-		std::string const & uncommittedBytes,
+	virtual Instruction firstInstructionSubCore() = 0;
+	virtual Instruction runSubCore(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
 	) = 0;
 
 public:
-	std::auto_ptr<Instruction> firstInstruction();
-	std::auto_ptr<Instruction> runFilter(
-		std::string const & uncommittedBytes,
+	Instruction firstInstruction();
+	Instruction runFilter(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
@@ -61,30 +61,24 @@ public:
 	{
 	}
 
-	std::auto_ptr<Instruction> FlvFilter::firstInstruction() {
-		std::auto_ptr<Instruction> instruction;
+	Instruction firstInstruction() {
+		Instruction instruction;
 		if (totalSize.isKnown()) {
 			if (totalSize.isKnownToBe(0)) {
-				instruction = std::auto_ptr<Instruction>(
-					new QuitFilterInstruction(0)
-				);
+				instruction = QuitFilterInstruction(0);
 			} else {
 				// 9 bytes for header, known size...
-				instruction = std::auto_ptr<Instruction>(
-					new BytesExactInstruction(9, 0)
-				);
+				instruction = BytesExactInstruction(9, 0);
 			}
 		} else {
-			instruction = std::auto_ptr<Instruction>(
-				new BytesUnknownInstruction(0)
-			);
+			instruction = BytesUnknownInstruction(0);
 		}
 	
 		return instruction;
 	}
 
-	std::auto_ptr<Instruction> FlvFilter::runFilter(
-		std::string const & uncommittedBytes,
+	Instruction runFilter(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
@@ -107,7 +101,7 @@ public:
 
 		Assert(!totalSize.isKnown() || readSoFar <= totalSize.getKnownValue());
 
-		std::auto_ptr<Instruction> instruction;
+		Instruction instruction;
 		switch (flvstate) {
 			case ReadFlvHeader: {
 				// we should have read the mandatory 9 bytes!
@@ -115,11 +109,9 @@ public:
 				FLV_HEADER const * flvHeader =
 					reinterpret_cast<FLV_HEADER const *>(uncommittedBytes.c_str());
 
-				instruction = std::auto_ptr<Instruction>(
-					new BytesExactInstruction(
-						DecodeEndian(flvHeader->Offset),
-						uncommittedBytes.length()
-					)
+				instruction = BytesExactInstruction(
+					DecodeEndian(flvHeader->Offset),
+					uncommittedBytes.length()
 				);
 				flvstate = nextFlvState(flvstate);
 				break;
@@ -127,21 +119,17 @@ public:
 
 			case SkipFlvHeader:
 				// don't want these bytes, want size
-				instruction = std::auto_ptr<Instruction>(
-					new BytesExactInstruction(
-						sizeof(FLV_PREVIOUS_TAG_SIZE),
-						uncommittedBytes.length()
-					)
+				instruction = BytesExactInstruction(
+					sizeof(FLV_PREVIOUS_TAG_SIZE),
+					uncommittedBytes.length()
 				);
 				flvstate = nextFlvState(flvstate);
 				break;
 
 			case ReadPreviousFlvTagSize:
-				instruction = std::auto_ptr<Instruction>(
-					new BytesExactInstruction(
-						sizeof(FLV_TAG_HEADER),
-						uncommittedBytes.length()
-					)
+				instruction = BytesExactInstruction(
+					sizeof(FLV_TAG_HEADER),
+					uncommittedBytes.length()
 				);
 				break;
 
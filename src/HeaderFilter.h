@@ -13,7 +13,8 @@
 #define __FLATWORM_HEADERFILTER_H__
 
 #include "ProxyServer.h"
-#include <sstream>
+#include "HttpHeader.h"
+#include "HeaderRules.h"
 
 class HeaderFilter : public Filter {
 private:
@@ -26,6 +27,8 @@ private:
 	bool keepAlive;
 	bool transparent;
 	bool isconnect;
+	size_t lines;
+	HeaderRewrite rewrite;
 	
 public:
 	HeaderFilter (
@@ -38,14 +41,13 @@ public:
 		contentLengthUnfiltered (UNKNOWN),
 		chunkedUnfiltered (false),
 		transparent (false),
-		isconnect (isconnect)
+		isconnect (isconnect),
+		lines (0)
 	{
 	}
 
-	std::auto_ptr<Instruction> firstInstruction() /* override */ {
-		return std::auto_ptr<Instruction>(
-			new ThruDelimiterInstruction("\r\n", 0)
-		);
+	Instruction firstInstruction() /* override */ {
+		return ThruDelimiterInstruction("\r\n", 0);
 	}
 
 	Knowable<size_t> getContentLengthUnfiltered() const {
@@ -79,15 +81,17 @@ public:
 		bool chunkedFiltered
 	) {
 
-		std::ostringstream bufStream;
+		char contentLength[64] = "";
 		if (contentLengthFiltered.isKnown()) {
 			Assert(!chunkedFiltered);
-			bufStream << "Content-Length: ";
-			bufStream << contentLengthFiltered.getKnownValue();
-			bufStream << "\r\n";
+			sprintf(
+				contentLength,
+				"Content-Length: %lu\r\n",
+				static_cast<unsigned long>(contentLengthFiltered.getKnownValue())
+			);
 		} else {
 			if (chunkedFiltered) {
-				bufStream << "Transfer-Encoding: chunked\r\n";
+				strcpy(contentLength, "Transfer-Encoding: chunked\r\n");
 			} else {
 				// bufstream should be empty, to indicate unknown content 
 				// length and not chunked.  the connection will need to be
@@ -95,21 +99,26 @@ public:
 			}
 		}
 
-		fulfillPlaceholder(contentLengthPlaceholder, bufStream.str());
+		fulfillPlaceholder(contentLengthPlaceholder, contentLength);
 
 		// instruction to signal end of header
 		fulfillPlaceholder(crlfPlaceholder, "\r\n");
 	}
 
-	// return the line to add, if empty no line
+	// Appends what (if anything) should go on in place of the line
 	virtual void processHeaderLine(
 		std::string & header,
-		std::string const key,
-		std::string const value
+		HeaderLine const & line
 	) = 0;
 
-	std::auto_ptr<Instruction> /* override */ runFilter(
-		std::string const & uncommittedBytes,
+	// The rules to apply to this header, NULL for none.  Asked once the
+	// whole header has been read.
+	virtual HeaderRuleTable const * rulesFor(HeaderBlock const & block) {
+		return NULL;
+	}
+
+	Instruction /* override */ runFilter(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
@@ -118,92 +127,82 @@ public:
 			throw "Socket disconnected before full header could be read.";
 		}
 
-		if ((uncommittedBytes.length() <= 2)) {
-			if (uncommittedBytes.length() == 0) {
-				NotReached();
+		// The lines are left uncommitted until the blank one comes in, and
+		// then the whole block is parsed where it lies
+		Assert(uncommittedBytes[uncommittedBytes.length()-1] == '\n');
+		if (uncommittedBytes.length() - newDataOffset > 2) {
+			if (++lines > MAXHEADERFIELDS) {
+				throw "Too many lines in header.";
 			}
+			return ThruDelimiterInstruction("\r\n", 0);
+		}
+		Assert(uncommittedBytes[newDataOffset] == '\r');
 
-			if (uncommittedBytes.length() == 1) {
-				Assert(uncommittedBytes[0] == '\n');
-			}
+		HeaderBlock block;
+		block.parse(uncommittedBytes.data(), uncommittedBytes.length());
 
-			if (uncommittedBytes.length() == 2) {
-				Assert(uncommittedBytes[0] == '\r');
-				Assert(uncommittedBytes[1] == '\n');
-			}
+		// most of it is going back out
+		header.reserve(header.length() + uncommittedBytes.length());
+		rewrite.begin(rulesFor(block));
+		for (size_t index = 0; index < block.size(); index++) {
+			processField(block[index]);
+		}
+		rewrite.finish(header);
 
-			// placeholder for all of "header"
-			placeholder = outputPlaceholder();
+		// placeholder for all of "header"
+		placeholder = outputPlaceholder();
 
-			// always fill in content length and encoding or "" for no length
-			contentLengthPlaceholder = outputPlaceholder();
+		// always fill in content length and encoding or "" for no length
+		contentLengthPlaceholder = outputPlaceholder();
 
-			// this will signal the end of the header
-			crlfPlaceholder = outputPlaceholder();
+		// this will signal the end of the header
+		crlfPlaceholder = outputPlaceholder();
 
-			return std::auto_ptr<Instruction>(
-				new QuitFilterInstruction(uncommittedBytes.length())
-			);
-		}
-
-		Assert(uncommittedBytes[uncommittedBytes.length()-1] == '\n');
-		size_t colonPosition = uncommittedBytes.find(':');
-		if (colonPosition == std::string::npos) {
-			throw "Malformed header, expected colon after attribute name.";
-		}
-
-		std::string key = TrimStr(uncommittedBytes.substr(0, colonPosition));
-		std::string value = TrimStr(
-			uncommittedBytes.substr(colonPosition+1, std::string::npos)
-		);
+		return QuitFilterInstruction(uncommittedBytes.length());
+	}
 
+private:
+	void processField(HeaderLine const & line) {
 		if (!isconnect && (
-			(!transparent && !strncasecmplen(key, "proxy-connection")) 
-			|| (transparent && (!strncasecmplen(key, "connection"))))
+			(!transparent && (line.name == HeaderProxyConnection))
+			|| (transparent && (line.name == HeaderConnection)))
 		) {
 
-			if (!strncasecmplen(value, "keep-alive")) {
+			if (line.value.beginsNoCase("keep-alive")) {
 				keepAlive = true;
 			}
 
-		} else if (!strncasecmplen(key, "content-length")) {
+		} else if (line.name == HeaderContentLength) {
 
-			if (value.empty())
+			if (line.value.empty())
 				throw "Invalid content-length in header.";
 
-			std::istringstream lengthStream (value.c_str());
-			int length;
-			lengthStream >> length;
-			if (length >= 0) {
+			// anything but plain digits leaves the length unknown
+			size_t length;
+			if (line.value.parseSize(length)) {
 				contentLengthUnfiltered.setKnownValue(length);
 			}
 
 			// We will add our own content-length to the header
 
-		} else if (!strncasecmplen(key, "transfer-encoding")) {
+		} else if (line.name == HeaderTransferEncoding) {
 
-			if (value.empty()) {
+			if (line.value.empty()) {
 				throw "Invalid transfer encoding in header.";
 			}
 
-			if (!strncasecmplen(value, "chunked")) {
+			if (line.value.beginsNoCase("chunked")) {
 				chunkedUnfiltered = true;
 			}
 
-		} else {
+		} else if (!rewrite.rewrite(header, line)) {
 
 			// dispatch to virtual method
-			processHeaderLine(header, key, value); 
+			processHeaderLine(header, line);
 		}
-
-		return std::auto_ptr<Instruction>(
-			new ThruDelimiterInstruction(
-				"\r\n",
-				uncommittedBytes.length()
-			)
-		);
 	}
 
+public:
 	~HeaderFilter() /* override */ {}
 };
 
@@ -0,0 +1,365 @@
+//
+// HeaderRules.cpp
+//
+// Reading the rules file, compiling its rules into hash tables, and
+// applying them to a header.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <set>
+
+#include "HeaderRules.h"
+#include "parasock/Helpers.h"
+
+// Longest line in a rules file
+#define HEADERRULELINE 4096
+
+
+static std::string LowerCopy(char const * data, size_t length) {
+	std::string lower (data, length);
+	for (size_t index = 0; index < length; index++) {
+		lower[index] = tolower(static_cast<unsigned char>(lower[index]));
+	}
+	return lower;
+}
+
+
+unsigned HeaderRuleTable::hashName(char const * name, size_t length) {
+	// FNV-1a, of the name in lower case
+	unsigned hash = 2166136261u;
+	for (size_t index = 0; index < length; index++) {
+		hash ^= static_cast<unsigned char>(
+			tolower(static_cast<unsigned char>(name[index]))
+		);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+void HeaderRuleTable::addRule(HeaderRule const & rule) {
+	if (rule.action == HeaderRuleAdd) {
+		added += rule.name + ": " + rule.value + "\r\n";
+		return;
+	}
+
+	std::string lower = LowerCopy(rule.name.data(), rule.name.length());
+	size_t index = 0;
+	while ((index < entries.size()) && (entries[index].name != lower)) {
+		index++;
+	}
+	if (index == entries.size()) {
+		entries.push_back(Entry ());
+		entries[index].name = lower;
+		entries[index].hash = hashName(lower.data(), lower.length());
+		entries[index].next = -1;
+	}
+
+	Entry & entry = entries[index];
+	entry.action = rule.action;
+	entry.line.clear();
+	if (rule.action != HeaderRuleRemove) {
+		entry.line = rule.name + ": " + rule.value + "\r\n";
+	}
+}
+
+
+void HeaderRuleTable::compile() {
+	// at least twice as many buckets as names, so chains stay short
+	size_t size = 1;
+	while (size < entries.size() * 2) {
+		size *= 2;
+	}
+	buckets.assign(size, -1);
+	mask = static_cast<unsigned>(size - 1);
+
+	for (size_t index = 0; index < entries.size(); index++) {
+		int & bucket = buckets[entries[index].hash & mask];
+		entries[index].next = bucket;
+		bucket = static_cast<int>(index);
+	}
+}
+
+
+int HeaderRuleTable::find(TextSpan const & key) const {
+	if (entries.empty())
+		return -1;
+
+	unsigned hash = hashName(key.data, key.length);
+	for (int index = buckets[hash & mask]; index != -1; index = entries[index].next) {
+		Entry const & entry = entries[index];
+		if ((entry.hash == hash) && key.equalsNoCase(entry.name.c_str()))
+			return index;
+	}
+	return -1;
+}
+
+
+void HeaderRewrite::begin(HeaderRuleTable const * table) {
+	if ((table != NULL) && table->empty()) {
+		table = NULL;
+	}
+	this->table = table;
+	if (table != NULL) {
+		seen.assign(table->entries.size(), false);
+	}
+}
+
+
+bool HeaderRewrite::rewrite(std::string & header, HeaderLine const & line) {
+	if (table == NULL)
+		return false;
+
+	int index = table->find(line.key);
+	if (index == -1)
+		return false;
+
+	HeaderRuleTable::Entry const & entry = table->entries[index];
+	if ((entry.action != HeaderRuleRemove) && !seen[index]) {
+		header += entry.line;
+	}
+	seen[index] = true;
+	return true;
+}
+
+
+void HeaderRewrite::finish(std::string & header) {
+	if (table == NULL)
+		return;
+
+	for (size_t index = 0; index < table->entries.size(); index++) {
+		HeaderRuleTable::Entry const & entry = table->entries[index];
+		if ((entry.action == HeaderRuleSet) && !seen[index]) {
+			header += entry.line;
+		}
+	}
+	header += table->added;
+}
+
+
+//
+// Loading
+//
+
+// The rules as written, before the sections are merged
+struct RuleSection {
+	std::vector<HeaderRule> rules[2]; // request, response
+};
+
+static bool IsTokenChar(char c) {
+	return (c > ' ') && (c < 127) && !strchr("()<>@,;:\\\"/[]?={}", c);
+}
+
+// The next word of the line, moving past it and the space after it
+static std::string NextWord(char const * & cursor) {
+	char const * start = cursor;
+	while ((*cursor != '\0') && !isspace(static_cast<unsigned char>(*cursor))) {
+		cursor++;
+	}
+	std::string word (start, cursor - start);
+	while (isspace(static_cast<unsigned char>(*cursor))) {
+		cursor++;
+	}
+	return word;
+}
+
+// The fields the proxy looks after itself, which would come out wrong if
+// rules changed them, and those the header filters take note of or drop
+// on the way through.  A rule takes a line before the filter sees it, so
+// the filter would miss those.
+static bool IsManagedField(std::string const & name) {
+	switch (HeaderBlock::lookup(name.data(), name.length())) {
+	case HeaderContentLength:
+	case HeaderTransferEncoding:
+	case HeaderConnection:
+	case HeaderProxyConnection:
+	case HeaderHost:
+	case HeaderAcceptEncoding:
+	case HeaderContentType:
+	case HeaderContentEncoding:
+	case HeaderWwwAuthenticate:
+	case HeaderProxyAuthenticate:
+	case HeaderProxyAuthorization:
+		return true;
+	default:
+		// the server's proxy-* fields are all dropped
+		return TextSpan (name.data(), name.length()).beginsNoCase("proxy-");
+	}
+}
+
+static void Compile(
+	HeaderRules::HostRules & host,
+	RuleSection const & defaults,
+	RuleSection const * section
+) {
+	for (int direction = 0; direction < 2; direction++) {
+		HeaderRuleTable & table = (direction == 0) ? host.request : host.response;
+
+		std::set<std::string> overridden;
+		if (section != NULL) {
+			for (size_t index = 0; index < section->rules[direction].size(); index++) {
+				std::string const & name = section->rules[direction][index].name;
+				overridden.insert(LowerCopy(name.data(), name.length()));
+			}
+		}
+
+		std::vector<HeaderRule> const & common = defaults.rules[direction];
+		for (size_t index = 0; index < common.size(); index++) {
+			std::string const & name = common[index].name;
+			if (!overridden.count(LowerCopy(name.data(), name.length())))
+				table.addRule(common[index]);
+		}
+		if (section != NULL) {
+			for (size_t index = 0; index < section->rules[direction].size(); index++) {
+				table.addRule(section->rules[direction][index]);
+			}
+		}
+
+		table.compile();
+	}
+}
+
+
+bool HeaderRules::load(char const * filename, std::string & error) {
+	FILE * file = fopen(filename, "r");
+	if (file == NULL) {
+		error = "could not open the file";
+		return false;
+	}
+
+	RuleSection defaults;
+	std::map<std::string, RuleSection> sections;
+	RuleSection * current = &defaults;
+
+	char buf[HEADERRULELINE];
+	unsigned lineNumber = 0;
+	char problem[64];
+	char const * complaint = NULL;
+
+	while ((complaint == NULL) && fgets(buf, sizeof(buf), file)) {
+		lineNumber++;
+		size_t length = strlen(buf);
+		if ((length == sizeof(buf) - 1) && (buf[length - 1] != '\n')) {
+			complaint = "line too long";
+			break;
+		}
+		while ((length > 0) && isspace(static_cast<unsigned char>(buf[length - 1]))) {
+			buf[--length] = '\0';
+		}
+
+		char const * cursor = buf;
+		while (isspace(static_cast<unsigned char>(*cursor))) {
+			cursor++;
+		}
+		if ((*cursor == '\0') || (*cursor == '#'))
+			continue;
+
+		if (*cursor == '[') {
+			char const * close = strchr(cursor, ']');
+			if ((close == NULL) || (close[1] != '\0') || (close == cursor + 1)) {
+				complaint = "expected [hostname]";
+			} else {
+				std::string host = LowerCopy(cursor + 1, close - cursor - 1);
+				current = &sections[host];
+			}
+			continue;
+		}
+
+		std::string direction = NextWord(cursor);
+		std::string action = NextWord(cursor);
+		HeaderRule rule;
+		rule.name = NextWord(cursor);
+		rule.value = cursor;
+
+		int which = 0;
+		if (direction == "request") {
+			which = 0;
+		} else if (direction == "response") {
+			which = 1;
+		} else {
+			complaint = "expected request or response";
+			continue;
+		}
+
+		if (action == "remove") {
+			rule.action = HeaderRuleRemove;
+		} else if (action == "replace") {
+			rule.action = HeaderRuleReplace;
+		} else if (action == "set") {
+			rule.action = HeaderRuleSet;
+		} else if (action == "add") {
+			rule.action = HeaderRuleAdd;
+		} else {
+			complaint = "expected remove, replace, set or add";
+			continue;
+		}
+
+		bool validName = !rule.name.empty();
+		for (size_t index = 0; index < rule.name.length(); index++) {
+			validName = validName && IsTokenChar(rule.name[index]);
+		}
+		if (!validName) {
+			complaint = "expected a header name";
+		} else if (IsManagedField(rule.name)) {
+			complaint = "that header is managed by the proxy";
+		} else if ((rule.action == HeaderRuleRemove) != rule.value.empty()) {
+			complaint = (rule.action == HeaderRuleRemove)
+				? "remove takes no value"
+				: "expected a value";
+		} else {
+			current->rules[which].push_back(rule);
+		}
+	}
+	fclose(file);
+
+	if (complaint != NULL) {
+		sprintf(problem, "line %u: ", lineNumber);
+		error = std::string (problem) + complaint;
+		return false;
+	}
+
+	// Each host gets the rules for every host compiled in with its own
+	this->defaults = HostRules ();
+	Compile(this->defaults, defaults, NULL);
+	hosts.clear();
+	for (
+		std::map<std::string, RuleSection>::const_iterator it = sections.begin();
+		it != sections.end();
+		++it
+	) {
+		Compile(hosts[it->first], defaults, &it->second);
+	}
+	return true;
+}
+
+
+HeaderRules::HostRules const & HeaderRules::forHost(TextSpan const & host) const {
+	if (hosts.empty())
+		return defaults;
+
+	size_t length = host.length;
+	char const * colon = static_cast<char const *>(memchr(host.data, ':', length));
+	if (colon != NULL) {
+		length = colon - host.data;
+	}
+	std::string name = LowerCopy(host.data, length);
+
+	std::map<std::string, HostRules>::const_iterator it = hosts.find(name);
+	if (it != hosts.end())
+		return it->second;
+
+	// then ".example.com" for example.com itself, and for www.example.com,
+	// and so on up
+	it = hosts.find("." + name);
+	if (it != hosts.end())
+		return it->second;
+
+	for (size_t dot = name.find('.'); dot != std::string::npos; dot = name.find('.', dot + 1)) {
+		it = hosts.find(name.substr(dot));
+		if (it != hosts.end())
+			return it->second;
+	}
+	return defaults;
+}
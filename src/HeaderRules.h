@@ -0,0 +1,161 @@
+//
+// HeaderRules.h
+//
+// Header fields to remove, replace or add, read from a rules file when the
+// proxy starts.  A rule applies to requests or responses, for every host or
+// just for one (or one and its subdomains):
+//
+//     # lines starting with # are comments
+//     request remove Accept-Language
+//     response add X-Filtered-By flatworm
+//
+//     [example.com]
+//     request set User-Agent Mozilla/5.0 (compatible)
+//
+//     [.example.org]
+//     response replace Server unknown
+//
+// remove drops every field of that name, replace changes the value of the
+// first one (and drops any others), set does the same but adds the field if
+// there wasn't one, and add puts a field on the end regardless.  A host's
+// rules for a name take the place of any for that name before the first
+// section, and the rest of those apply to the host as well.
+//
+// Each direction of each host is compiled into a table of the names it has
+// rules for, hashed, so a header line costs one lookup however many rules
+// there are.  The fields the proxy works out for itself (Content-Length,
+// Transfer-Encoding, Connection, Proxy-Connection and Host), and those it
+// decides things by or drops (Accept-Encoding, Content-Type,
+// Content-Encoding, WWW-Authenticate and anything starting Proxy-), can't
+// be given rules.
+//
+
+#ifndef __FLATWORM_HEADERRULES_H__
+#define __FLATWORM_HEADERRULES_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "HttpHeader.h"
+
+enum HeaderRuleAction {
+	HeaderRuleRemove,
+	HeaderRuleReplace,
+	HeaderRuleSet,
+	HeaderRuleAdd
+};
+
+
+struct HeaderRule {
+	HeaderRuleAction action;
+	std::string name; // as it was written, for adding
+	std::string value;
+};
+
+
+// The rules for one direction of one host
+class HeaderRuleTable {
+private:
+	struct Entry {
+		std::string name; // lower case
+		unsigned hash;
+		HeaderRuleAction action; // never HeaderRuleAdd
+		std::string line; // "Name: value\r\n", for replacing or setting
+		int next; // in the same bucket, or -1
+	};
+
+	std::vector<Entry> entries;
+	std::vector<int> buckets;
+	unsigned mask;
+
+	// everything the add rules add, one after the other
+	std::string added;
+
+	friend class HeaderRewrite;
+
+public:
+	HeaderRuleTable () :
+		mask (0)
+	{
+	}
+
+	// A later rule for a name takes the place of an earlier one, except
+	// that adds accumulate
+	void addRule(HeaderRule const & rule);
+
+	// Builds the hash table, once all the rules are in
+	void compile();
+
+	bool empty() const {
+		return entries.empty() && added.empty();
+	}
+
+	static unsigned hashName(char const * name, size_t length);
+
+private:
+	int find(TextSpan const & key) const;
+};
+
+
+// Applies a table to the fields of one header as they go by
+class HeaderRewrite {
+private:
+	HeaderRuleTable const * table;
+	std::vector<bool> seen;
+
+public:
+	HeaderRewrite () :
+		table (NULL)
+	{
+	}
+
+private:
+	// Disable copying C++98 style
+	HeaderRewrite (HeaderRewrite const & other);
+
+public:
+	// NULL for no rules
+	void begin(HeaderRuleTable const * table);
+
+	// True if a rule took care of the line, having added whatever goes in
+	// its place (which may be nothing)
+	bool rewrite(std::string & header, HeaderLine const & line);
+
+	// The fields being set that the header didn't have, then the adds
+	void finish(std::string & header);
+};
+
+
+class HeaderRules {
+public:
+	struct HostRules {
+		HeaderRuleTable request;
+		HeaderRuleTable response;
+	};
+
+private:
+	HostRules defaults;
+
+	// keyed by "example.com" for just that host, ".example.com" for it and
+	// everything under it
+	std::map<std::string, HostRules> hosts;
+
+public:
+	HeaderRules () {}
+
+private:
+	// Disable copying C++98 style
+	HeaderRules (HeaderRules const & other);
+
+public:
+	// False with a message saying which line was wrong, if one was.  The
+	// rules already loaded (if any) are kept in that case.
+	bool load(char const * filename, std::string & error);
+
+	// The most specific rules for a host name, or those for every host.
+	// The host may have a port on the end, which is ignored.
+	HostRules const & forHost(TextSpan const & host) const;
+};
+
+#endif
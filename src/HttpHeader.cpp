@@ -0,0 +1,219 @@
+//
+// HttpHeader.cpp
+//
+// Single pass header block parser, and the table of names it knows.
+//
+
+#include <string.h>
+
+#include "HttpHeader.h"
+#include "parasock/Helpers.h"
+
+
+static inline char LowerAscii(char c) {
+	return ((c >= 'A') && (c <= 'Z')) ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+static inline bool IsHeaderSpace(char c) {
+	return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+
+bool TextSpan::equalsNoCase(char const * literal) const {
+	size_t index = 0;
+	for (; index < length; index++) {
+		if ((literal[index] == '\0') || (LowerAscii(data[index]) != literal[index]))
+			return false;
+	}
+	return literal[index] == '\0';
+}
+
+
+bool TextSpan::beginsNoCase(char const * literal) const {
+	for (size_t index = 0; literal[index] != '\0'; index++) {
+		if ((index >= length) || (LowerAscii(data[index]) != literal[index]))
+			return false;
+	}
+	return true;
+}
+
+
+size_t TextSpan::find(char c, size_t from) const {
+	if (from >= length)
+		return std::string::npos;
+	char const * found = static_cast<char const *>(
+		memchr(data + from, c, length - from)
+	);
+	return (found != NULL) ? static_cast<size_t>(found - data) : std::string::npos;
+}
+
+
+bool TextSpan::parseSize(size_t & result) const {
+	if (length == 0)
+		return false;
+
+	size_t value = 0;
+	for (size_t index = 0; index < length; index++) {
+		char c = data[index];
+		if ((c < '0') || (c > '9'))
+			return false;
+		size_t digit = static_cast<size_t>(c - '0');
+		if (value > (static_cast<size_t>(-1) - digit) / 10)
+			return false;
+		value = value * 10 + digit;
+	}
+	result = value;
+	return true;
+}
+
+
+void HeaderLine::appendTo(std::string & out) const {
+	if (
+		(line.data == key.data)
+		&& (line.length == key.length + value.length + 4)
+		&& (key.data[key.length] == ':')
+		&& (key.data[key.length + 1] == ' ')
+		&& (line.data[line.length - 2] == '\r')
+	) {
+		line.appendTo(out);
+		return;
+	}
+
+	key.appendTo(out);
+	out += ": ";
+	value.appendTo(out);
+	out += "\r\n";
+}
+
+
+//
+// The hash is the length plus the first letter (in lower case), which
+// happens to put every name here in a slot of its own.  Adding a name means
+// checking that's still so, and growing the table (and mask) if not.
+//
+
+#define HEADERHASHSIZE 32
+
+struct KnownHeader {
+	char const * name;
+	HeaderName id;
+};
+
+static KnownHeader const KnownHeaders[HEADERHASHSIZE] = {
+	{ "proxy-connection", HeaderProxyConnection }, // 0
+	{ NULL, HeaderUnknown },
+	{ "proxy-authenticate", HeaderProxyAuthenticate }, // 2
+	{ "proxy-authorization", HeaderProxyAuthorization }, // 3
+	{ NULL, HeaderUnknown },
+	{ "transfer-encoding", HeaderTransferEncoding }, // 5
+	{ NULL, HeaderUnknown },
+	{ "www-authenticate", HeaderWwwAuthenticate }, // 7
+	{ NULL, HeaderUnknown },
+	{ NULL, HeaderUnknown },
+	{ NULL, HeaderUnknown },
+	{ NULL, HeaderUnknown },
+	{ "host", HeaderHost }, // 12
+	{ "connection", HeaderConnection }, // 13
+	{ NULL, HeaderUnknown },
+	{ "content-type", HeaderContentType }, // 15
+	{ "accept-encoding", HeaderAcceptEncoding }, // 16
+	{ "content-length", HeaderContentLength }, // 17
+	{ NULL, HeaderUnknown },
+	{ "content-encoding", HeaderContentEncoding }, // 19
+	{ NULL, HeaderUnknown },
+	{ "keep-alive", HeaderKeepAlive }, // 21
+	{ "te", HeaderTe }, // 22
+	{ NULL, HeaderUnknown },
+	{ NULL, HeaderUnknown },
+	{ NULL, HeaderUnknown },
+	{ NULL, HeaderUnknown },
+	{ "trailer", HeaderTrailer }, // 27
+	{ "upgrade", HeaderUpgrade }, // 28
+	{ NULL, HeaderUnknown },
+	{ NULL, HeaderUnknown },
+	{ NULL, HeaderUnknown }
+};
+
+
+HeaderName HeaderBlock::lookup(char const * name, size_t length) {
+	if (length == 0)
+		return HeaderUnknown;
+
+	size_t slot = (length + static_cast<unsigned char>(LowerAscii(name[0])))
+		& (HEADERHASHSIZE - 1);
+	KnownHeader const & known = KnownHeaders[slot];
+	if ((known.name == NULL) || !TextSpan (name, length).equalsNoCase(known.name))
+		return HeaderUnknown;
+	return known.id;
+}
+
+
+void HeaderBlock::parse(char const * block, size_t length) {
+	this->block = block;
+	count = 0;
+
+	size_t position = 0;
+	while (position < length) {
+		char const * newline = static_cast<char const *>(
+			memchr(block + position, '\n', length - position)
+		);
+		size_t lineEnd = (newline != NULL)
+			? static_cast<size_t>(newline - block) + 1
+			: length;
+
+		// the blank line at the end
+		size_t contentEnd = lineEnd;
+		while ((contentEnd > position) && IsHeaderSpace(block[contentEnd - 1]))
+			contentEnd--;
+		if (contentEnd == position)
+			break;
+
+		if (count == MAXHEADERFIELDS)
+			throw "Too many lines in header.";
+
+		char const * colon = static_cast<char const *>(
+			memchr(block + position, ':', contentEnd - position)
+		);
+		if (colon == NULL) {
+			throw "Malformed header, expected colon after attribute name.";
+		}
+
+		size_t keyStart = position;
+		size_t keyEnd = static_cast<size_t>(colon - block);
+		while ((keyStart < keyEnd) && IsHeaderSpace(block[keyStart]))
+			keyStart++;
+		while ((keyEnd > keyStart) && IsHeaderSpace(block[keyEnd - 1]))
+			keyEnd--;
+
+		size_t valueStart = static_cast<size_t>(colon - block) + 1;
+		while ((valueStart < contentEnd) && IsHeaderSpace(block[valueStart]))
+			valueStart++;
+
+		Field & field = fields[count++];
+		field.name = lookup(block + keyStart, keyEnd - keyStart);
+		field.lineStart = static_cast<unsigned>(keyStart);
+		field.keyLength = static_cast<unsigned>(keyEnd - keyStart);
+		field.valueStart = static_cast<unsigned>(valueStart);
+		field.valueLength = static_cast<unsigned>(contentEnd - valueStart);
+		field.lineEnd = static_cast<unsigned>(lineEnd);
+
+		position = lineEnd;
+	}
+}
+
+
+HeaderLine HeaderBlock::operator[](size_t index) const {
+	Assert(index < count);
+	Field const & field = fields[index];
+
+	// a line only starts somewhere other than its key if there was leading
+	// whitespace, which goes along with the line as it was
+	size_t lineStart = (index == 0) ? 0 : fields[index - 1].lineEnd;
+
+	HeaderLine line;
+	line.name = field.name;
+	line.key = TextSpan (block + field.lineStart, field.keyLength);
+	line.value = TextSpan (block + field.valueStart, field.valueLength);
+	line.line = TextSpan (block + lineStart, field.lineEnd - lineStart);
+	return line;
+}
@@ -0,0 +1,143 @@
+//
+// HttpHeader.h
+//
+// Splits a header block (the lines after the request or response line, up
+// to and including the blank one) into its fields in one pass, copying
+// nothing.  The table it makes is just offsets into the block, so the block
+// has to stay put for as long as the table is used.
+//
+// The names the proxy does anything with are recognized on the way through,
+// by a perfect hash made for that fixed set, so the filters can switch on a
+// HeaderName instead of comparing each key against a list of strings.
+//
+
+#ifndef __FLATWORM_HTTPHEADER_H__
+#define __FLATWORM_HTTPHEADER_H__
+
+#include <string>
+#include <stddef.h>
+
+// Most fields a header may have; more than this is refused
+#define MAXHEADERFIELDS 128
+
+// Keep in step with the table in HttpHeader.cpp
+enum HeaderName {
+	HeaderUnknown,
+	HeaderAcceptEncoding,
+	HeaderConnection,
+	HeaderContentEncoding,
+	HeaderContentLength,
+	HeaderContentType,
+	HeaderHost,
+	HeaderKeepAlive,
+	HeaderProxyAuthenticate,
+	HeaderProxyAuthorization,
+	HeaderProxyConnection,
+	HeaderTe,
+	HeaderTrailer,
+	HeaderTransferEncoding,
+	HeaderUpgrade,
+	HeaderWwwAuthenticate,
+	HeaderNameMax
+};
+
+
+// Some characters belonging to a string somewhere else
+class TextSpan {
+public:
+	char const * data;
+	size_t length;
+
+public:
+	TextSpan () :
+		data (NULL),
+		length (0)
+	{
+	}
+
+	TextSpan (char const * data, size_t length) :
+		data (data),
+		length (length)
+	{
+	}
+
+	bool empty() const {
+		return length == 0;
+	}
+
+	// Case-insensitive, against a lower case literal
+	bool equalsNoCase(char const * literal) const;
+	bool beginsNoCase(char const * literal) const;
+
+	// Where the character first is at or after from, or std::string::npos
+	size_t find(char c, size_t from = 0) const;
+
+	// Decimal digits and nothing else.  False if there aren't any, or the
+	// number won't fit.
+	bool parseSize(size_t & result) const;
+
+	std::string str() const {
+		return std::string (data, length);
+	}
+
+	void appendTo(std::string & out) const {
+		out.append(data, length);
+	}
+};
+
+
+// One field as the filters see it
+struct HeaderLine {
+	HeaderName name;
+	TextSpan key; // without the whitespace around it
+	TextSpan value; // likewise
+	TextSpan line; // all of it as received, CRLF and all
+
+	// Adds "key: value" and a CRLF.  That's usually the line as it came,
+	// which is copied in one go; anything else is written out tidied up.
+	void appendTo(std::string & out) const;
+};
+
+
+class HeaderBlock {
+private:
+	struct Field {
+		HeaderName name;
+		unsigned lineStart; // the key starts here too, less any whitespace
+		unsigned keyLength;
+		unsigned valueStart;
+		unsigned valueLength;
+		unsigned lineEnd; // just past the CRLF
+	};
+
+	char const * block;
+	Field fields[MAXHEADERFIELDS];
+	size_t count;
+
+public:
+	HeaderBlock () :
+		block (NULL),
+		count (0)
+	{
+	}
+
+private:
+	// Disable copying C++98 style
+	HeaderBlock (HeaderBlock const & other);
+
+public:
+	// The block runs through the blank line that ends it.  Throws for a line
+	// with no colon, or for too many lines.
+	void parse(char const * block, size_t length);
+
+	size_t size() const {
+		return count;
+	}
+
+	HeaderLine operator[](size_t index) const;
+
+	// HeaderUnknown for anything not in the table
+	static HeaderName lookup(char const * name, size_t length);
+};
+
+#endif
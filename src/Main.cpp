@@ -11,15 +11,57 @@
 #include "parasock/Filter.h"
 
 #include "DataFilter.h"
+#include "parasock/Reactor.h"
+#include "parasock/WorkerPool.h"
+
+#include <signal.h>
+
+// Threads started up front when running a thread per connection; more are
+// added as needed, up to the connection limit
+#define INITIALWORKERS 16
+
+// Stack for each of those threads
+#define WORKERSTACKSIZE 16384
 
 EXTPARAM conf;
 
+
+// Another listener on the same address, for the system to spread incoming
+// connections over.  INVALID_SOCKET if that can't be had, in which case
+// the caller can share the one it already has.
+static SOCKET OpenSharedListener(struct sockaddr_in const & sin, int backlog) {
+#ifdef SO_REUSEPORT
+	SOCKET sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == INVALID_SOCKET) {
+		return INVALID_SOCKET;
+	}
+
+	int opt = 1;
+	unsigned long ul = 1;
+	ioctlsocket(sock, FIONBIO, &ul);
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(int));
+	if (
+		setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&opt, sizeof(int))
+		|| (-1 == bind(sock, (struct sockaddr *)&sin, sizeof(sin)))
+		|| (-1 == listen(sock, backlog))
+	) {
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+	return sock;
+#else
+	(void)sin;
+	(void)backlog;
+	return INVALID_SOCKET;
+#endif
+}
+
+
 int main(int argc, char** argv) {
 
 	SOCKET sock = INVALID_SOCKET;
 	int i = 0;
 	SASIZETYPE size;
-	pthread_t thread;
 	ProxyWorker defparam;
 	SRVPARAM srv;
 	ProxyWorker * newparam;
@@ -30,24 +72,63 @@ int main(int argc, char** argv) {
 	int opt = 1;
 	int isudp = 1;
 	FILE *fp = NULL;
-	int nlog = 5000;
+	time_t warned = 0;
+	AdmissionWait admission;
+	int backlog = SOMAXCONN;
+	int originIdle = 8;
+	int nameservers = 0;
+	struct sockaddr_in listenAddress;
+	std::vector<SOCKET> listeners;
+	Reactor reactor;
+	int reactorThreads = Reactor::defaultThreadCount();
+	WorkerPool pool;
+	bool useUring = false;
+	char * headerRules = NULL;
+	char * dataRules = NULL;
+	char * bodyTypes = NULL;
 
 	char loghelp[] =
 	" -u never ask for username\n"
 	" -fFORMAT logging format (see documentation)\n"
 	" -l log to stderr\n"
 	" -lFILENAME log to FILENAME\n"
-	" -bBUFSIZE size of network buffer (default 4096 for TCP, 16384 for UDP)\n"
+	" -bBUFSIZE largest single read from a socket (default and most 16384)\n"
+	" -wBYTES output waiting for one side of a connection before the other\n"
+	"   side stops being read (default 262144)\n"
 	" -t be silent (do not log service start/stop)\n"
 	" -iIP ip address or internal interface (clients are expected to connect)\n"
-	" -eIP ip address or external interface (outgoing connection will have this)\n";
-
-	unsigned long ul;
-
-	struct linger lg;
-	HANDLE h;
+	" -eIP ip address or external interface (outgoing connection will have this)\n"
+	" -rTHREADS number of event loop threads (0 for a thread per connection,\n"
+	"   from a pool that is kept and reused)\n"
+	" -mMAXCHILD maximum number of simultaneous connections\n"
+	" -qBACKLOG connections the system queues up waiting to be accepted\n"
+	"   (default SOMAXCONN)\n"
+	" -kCONNECTIONS idle connections kept open to each origin server, for\n"
+	"   requests from any client to reuse (default 8, 0 for none)\n"
+	" -sIP[:PORT] nameserver to look names up with, instead of the system's\n"
+	"   resolver (up to 5, asked in turn; answers are cached for their TTL)\n"
+	" -gENGINE event loop engine, epoll (default) or uring\n"
+	" -cBYTES capture the last BYTES of each connection's traffic, written\n"
+	"   out as a pcap file if the connection fails (default 0, no capture)\n"
+	" -HFILENAME header fields to remove, replace or add, per host (see\n"
+	"   HeaderRules.h for the format)\n"
+	" -RFILENAME substitutions to make in bodies, a regular expression and its\n"
+	"   replacement on each line (see RuleSet.h for the format)\n"
+	" -TTYPES content types whose response bodies are filtered, comma separated\n"
+	"   (type/* for all of a type); others are passed through untouched\n"
+	"   (default text/* and the script, JSON and XML types)\n";
+
+	unsigned long ul = 1;
+
+#ifdef _WIN32
 	WSADATA wd;
 	WSAStartup(MAKEWORD( 1, 1 ), &wd);
+#else
+	// Neither splice() into a socket nor the blocking send() has
+	// MSG_NOSIGNAL, and a peer going away should be an EPIPE and not the
+	// end of the process
+	signal(SIGPIPE, SIG_IGN);
+#endif
 
 	srv.silent = 0;
 	srv.logfunc = &logstdout;
@@ -105,6 +186,9 @@ int main(int argc, char** argv) {
 			case 'b':
 				srv.bufsize = atoi(argv[i]+2);
 				break;
+			case 'w':
+				srv.highwater = atoi(argv[i]+2);
+				break;
 			case 'n':
 				srv.usentlm = 0;
 				break;
@@ -117,6 +201,55 @@ int main(int argc, char** argv) {
 			case 'u':
 				srv.nouser = 1;
 				break;
+			case 'r':
+				reactorThreads = atoi(argv[i]+2);
+				break;
+			case 'm':
+				srv.maxchild = atoi(argv[i]+2);
+				break;
+			case 'q':
+				backlog = atoi(argv[i]+2);
+				break;
+			case 'k':
+				originIdle = atoi(argv[i]+2);
+				break;
+			case 's':
+				if (nameservers < MAXNSERVERS) {
+					std::string server (argv[i]+2);
+					struct sockaddr_in & sin = nservers[nameservers++];
+					sin.sin_family = AF_INET;
+					sin.sin_port = htons(53);
+					size_t colon = server.find(':');
+					if (colon != std::string::npos) {
+						sin.sin_port = htons(atoi(server.c_str() + colon + 1));
+						server.resize(colon);
+					}
+					sin.sin_addr.s_addr = getnumericip(server.c_str());
+					if (!sin.sin_addr.s_addr) {
+						error = 1;
+					}
+				} else {
+					error = 1;
+				}
+				break;
+			case 'c':
+				srv.capturesize = atoi(argv[i]+2);
+				break;
+			case 'g':
+				if (!strcmp(argv[i]+2, "uring"))
+					useUring = true;
+				else if (strcmp(argv[i]+2, "epoll"))
+					error = 1;
+				break;
+			case 'H':
+				headerRules = argv[i] + 2;
+				break;
+			case 'R':
+				dataRules = argv[i] + 2;
+				break;
+			case 'T':
+				bodyTypes = argv[i] + 2;
+				break;
 			default:
 				error = 1;
 				break;
@@ -144,6 +277,44 @@ int main(int argc, char** argv) {
 	if (!srv.logtarget.empty())
 		srv.logtarget = srv.logtarget;
 
+	if (headerRules) {
+		std::string problem;
+		if (!srv.headerRules.load(headerRules, problem)) {
+			fprintf(stderr, "%s: %s\n", headerRules, problem.c_str());
+			return (2);
+		}
+	}
+
+	// compiled once here, rather than by each request's filters
+	if (dataRules) {
+		std::string problem;
+		if (!srv.dataRules.load(dataRules, problem)) {
+			fprintf(stderr, "%s: %s\n", dataRules, problem.c_str());
+			return (2);
+		}
+	} else {
+		srv.dataRules.add("\\b[Tt]he\\b", "Flatworm");
+		srv.dataRules.compile();
+	}
+
+	if (bodyTypes) {
+		std::string problem;
+		if (!srv.bodyTypes.parse(bodyTypes, problem)) {
+			fprintf(stderr, "-T: %s\n", problem.c_str());
+			return (2);
+		}
+	}
+
+	if (nameservers && initresolver(DNSCACHESIZE)) {
+		fprintf(stderr, "Could not start the resolver\n");
+		return (2);
+	}
+
+	srv.origins.configure(
+		(originIdle > 0) ? originIdle : 0,
+		conf.timeouts[ORIGINIDLE_TO].getSeconds()
+	);
+
 	if (!srv.intip) {
 		srv.intip = conf.intip;
 	}
@@ -174,10 +345,37 @@ int main(int argc, char** argv) {
 
 	conf.threadinit = 0;
 
+	if (useUring && !Reactor::uringSupported()) {
+		if (!srv.silent) {
+			(*srv.logfunc)(&defparam, "io_uring not available, using epoll");
+		}
+		useUring = false;
+	}
+
+	if ((reactorThreads > 0) && !reactor.start(reactorThreads, useUring)) {
+		if (!srv.silent) {
+			(*srv.logfunc)(&defparam, "Could not start event loops");
+		}
+		return -5;
+	}
+
+	if (
+		!reactor.isRunning()
+		&& !pool.start(
+			std::min(INITIALWORKERS, srv.maxchild),
+			srv.maxchild,
+			WORKERSTACKSIZE,
+			(WORKERPOOLFUNC)srv.pf
+		)
+	) {
+		if (!srv.silent) {
+			(*srv.logfunc)(&defparam, "Could not start worker threads");
+		}
+		return -5;
+	}
+
 	if (srv.srvsock == INVALID_SOCKET) {
 		if (!isudp) {
-			lg.l_onoff = 1;
-			lg.l_linger = conf.timeouts[STRING_L].getSeconds();
 			sock=socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 		} else {
 			sock=socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -235,7 +433,7 @@ int main(int argc, char** argv) {
 	}
 
 	if (!isudp) {
-		if (listen(sock, 1 + (srv.maxchild >> 4)) == -1) {
+		if (listen(sock, backlog) == -1) {
 			int errorno = WSAGetLastError();
 			sprintf((char *)buf, "listen(): %s", strerror(errorno));
 			if (!srv.silent) {
@@ -257,6 +455,8 @@ int main(int argc, char** argv) {
 		(*srv.logfunc)(&defparam, buf);
 	}
 
+	listenAddress = defparam.parasock.sockbuf[Parasock::ClientConnection]->sin;
+
 	defparam.parasock.sockbuf[Parasock::ClientConnection]->sin.sin_addr.s_addr = 0;
 	defparam.parasock.sockbuf[Parasock::ServerConnection]->sin.sin_addr.s_addr = 0;
 
@@ -266,27 +466,55 @@ int main(int argc, char** argv) {
 	srv.fds.fd = sock;
 	srv.fds.events = POLLIN;
 
+	if (reactor.isRunning()) {
+		// Each loop accepts for itself, on a listener of its own where the
+		// system will share the port out between them
+		for (size_t loop = 0; loop < reactor.getLoopCount(); loop++) {
+			SOCKET listener = sock;
+			if (loop > 0) {
+				listener = OpenSharedListener(listenAddress, backlog);
+				if (listener == INVALID_SOCKET) {
+					listener = sock;
+				} else {
+					listeners.push_back(listener);
+				}
+			}
+			reactor.adoptOn(
+				loop,
+				new ProxyAcceptor(&defparam, listener, &reactor, loop)
+			);
+		}
 
-	for (;;) {
+		while (conf.paused == srv.version) {
+			usleep(SLEEPTIME * 100);
+			srv.origins.sweep(time(NULL));
+		}
+	}
+
+	// Without event loops, the accepting is all done here
+	while (!reactor.isRunning()) {
 		for (;;) {
-			while (
+			if (
 				(conf.paused == srv.version)
 				&& (srv.childcount >= srv.maxchild)
 			) {
-				nlog++;			
-				if (nlog > 5000) {
+				if (time(NULL) - warned >= 5) {
 					sprintf(
 						(char *)buf,
 						"Warning: too many connected clients (%d/%d)",
-						srv.childcount,
+						(int)srv.childcount,
 						srv.maxchild
 					);
 					if (!srv.silent) {
 						(*srv.logfunc)(&defparam, buf);
 					}
-					nlog = 0;
+					warned = time(NULL);
 				}
-				usleep(SLEEPTIME);
+				// until a connection closes, unless one just has
+				if (srv.waitForChild(&admission)) {
+					admission.wait();
+				}
+				continue;
 			}
 			if (conf.paused != srv.version) {
 				break;
@@ -302,6 +530,7 @@ int main(int argc, char** argv) {
 				break;
 			}
 			if (error == 0) {
+				srv.origins.sweep(time(NULL));
 				continue;
 			}
 
@@ -325,81 +554,46 @@ int main(int argc, char** argv) {
 			break;
 		}
 
-		SOCKET new_sock = INVALID_SOCKET;
-		if (!isudp) {
-			size = sizeof(defparam.parasock.sockbuf[Parasock::ClientConnection]->sin);
-			new_sock = accept(
-				sock,
-				(struct sockaddr*)&defparam.parasock.sockbuf[Parasock::ClientConnection]->sin,
-				&size
-			);
-			if (new_sock == INVALID_SOCKET) {
-				int errorno = WSAGetLastError();
-				sprintf((char *)buf, "accept(): %s", strerror(errorno));
-				if (!srv.silent) {
-					(*srv.logfunc)(&defparam, buf);
+		if (isudp) {
+			if (srv.reserveChild()) {
+				srv.fds.events = 0;
+				newparam = ProxyWorker::forConnection(
+					&defparam,
+					sock,
+					defparam.parasock.sockbuf[Parasock::ClientConnection]->sin
+				);
+				if (!pool.submit(newparam)) {
+					newparam->recycle();
 				}
-				continue;
+				while (!srv.fds.events)usleep(SLEEPTIME);
 			}
-			ioctlsocket(new_sock, FIONBIO, &ul);
-			setsockopt(
-				new_sock,
-				SOL_SOCKET,
-				SO_LINGER,
-				(char *)&lg,
-				sizeof(lg)
-			);
-			setsockopt(
-				new_sock,
-				SOL_SOCKET,
-				SO_OOBINLINE,
-				(char *)&opt,
-				sizeof(int)
-			);
-		} else { 
-			srv.fds.events = 0;
-		}
-		newparam = new ProxyWorker(&defparam);
-		if (!defparam.hostname.empty()) {
-			newparam->hostname= defparam.hostname;
-		}
-		if (!isudp) {
-			newparam->parasock.sockbuf[Parasock::ClientConnection]->sock = new_sock;
+			continue;
 		}
 
-		newparam->prev = newparam->next = NULL;
-		pthread_mutex_lock(&srv.counter_mutex);
-		if (!srv.child){
-			srv.child = newparam;
-		} else {
-			newparam->next = srv.child;
-			srv.child = srv.child->prev = newparam;
-		}
+		// Take everything that's waiting, as long as there's room for it
+		for (int count = 0; count < ACCEPTBATCH; count++) {
+			if (!srv.reserveChild()) {
+				break;
+			}
 
-		h = (HANDLE)_beginthreadex(
-			(LPSECURITY_ATTRIBUTES)NULL,
-			(unsigned)16384,
-			(BEGINTHREADFUNC)srv.pf,
-			(void *)newparam,
-			0,
-			&thread
-		);
-		newparam->threadid = (unsigned)thread;
-		if (h) {
-			srv.childcount++;
-			CloseHandle(h);
-		}
-		else {
-			delete(newparam);
-		}
-		pthread_mutex_unlock(&srv.counter_mutex);
-		memset(
-			&defparam.parasock.sockbuf[Parasock::ClientConnection]->sin,
-			0,
-			sizeof(defparam.parasock.sockbuf[Parasock::ClientConnection]->sin)
-		);
-		if (isudp) {
-			while (!srv.fds.events)usleep(SLEEPTIME);
+			struct sockaddr_in peer;
+			SOCKET new_sock = sockacceptready(sock, &peer);
+			if (new_sock == INVALID_SOCKET) {
+				int errorno = WSAGetLastError();
+				srv.releaseChild();
+				if (errorno != EAGAIN) {
+					sprintf((char *)buf, "accept(): %s", strerror(errorno));
+					if (!srv.silent) {
+						(*srv.logfunc)(&defparam, buf);
+					}
+				}
+				break;
+			}
+
+			newparam = ProxyWorker::forConnection(&defparam, new_sock, peer);
+			if (!pool.submit(newparam)) {
+				newparam->recycle();
+			}
 		}
 	}
 
@@ -414,10 +608,13 @@ int main(int argc, char** argv) {
 	if (srv.srvsock != INVALID_SOCKET) {
 		closesocket(srv.srvsock);
 	}
+	for (size_t index = 0; index < listeners.size(); index++) {
+		closesocket(listeners[index]);
+	}
 
 	srv.srvsock = INVALID_SOCKET;
 	srv.service = S_ZOMBIE;
-	while (srv.child) {
+	while (srv.childcount > 0) {
  		usleep(SLEEPTIME * 100);
  	}
 
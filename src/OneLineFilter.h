@@ -17,16 +17,14 @@ public:
 	{
 	}
 
-	std::auto_ptr<Instruction> firstInstruction() /* override */ {
-		return std::auto_ptr<Instruction>(
-			new ThruDelimiterInstruction("\r\n", 0)
-		);
+	Instruction firstInstruction() /* override */ {
+		return ThruDelimiterInstruction("\r\n", 0);
 	}
 
-	virtual void processTheLine(std::string const & line) = 0;
+	virtual void processTheLine(InputSpan const & line) = 0;
 
-	virtual std::auto_ptr<Instruction> runFilter(
-		std::string const & uncommittedBytes,
+	virtual Instruction runFilter(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
@@ -39,19 +37,15 @@ public:
 		Assert(lineFeedPos != std::string::npos);
 
 		if (lineFeedPos == 0) {
-			return std::auto_ptr<Instruction>(
-				new ThruDelimiterInstruction(
-					"\r\n",
-					uncommittedBytes.length()
-				)
+			return ThruDelimiterInstruction(
+				"\r\n",
+				uncommittedBytes.length()
 			);
 		} 
 
 		processTheLine(uncommittedBytes);
 
-		return std::auto_ptr<Instruction>(
-			new QuitFilterInstruction(uncommittedBytes.length())
-		);
+		return QuitFilterInstruction(uncommittedBytes.length());
 	}
 
 	virtual ~OneLineFilter() /* override */ {}
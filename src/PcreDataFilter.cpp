@@ -5,190 +5,60 @@
 // on regular expressions.  Built on the Perl Compatible Regular Expressions
 // library (PCRE)
 //
-// Lack of comments/etc. is basically due to copying example code and making
-// only minor modifications to get it to work.  It's C, it's error-prone, and
-// I definitely would seek to use something better... the library just
-// happened to be included in the 3Proxy source.
+// The rules are compiled once, when the proxy starts (see RuleSet.h), and
+// the filter just runs each buffer through them.
 //
 
-#include "pcre/pcreposix.h"
-
 #include "PcreDataFilter.h"
 
 int wday = 0;
 time_t basetime = 0;
 
-#ifndef isnumber
-#define isnumber(i_n_arg) ((i_n_arg>='0') && (i_n_arg<='9'))
-#endif
-
 PcreDataFilter::PcreDataFilter (
 	Parasock & parasock,
 	FlowDirection whichInput,
 	HeaderFilter const & headerFilterServer,
-	std::string const regularExpression,
-	std::string const replaceString
+	RuleSet const & rules
 ) :
 	DataFilter (parasock, whichInput, headerFilterServer),
-	replace (replaceString)
+	rules (rules),
+	context (0)
 {
-	pcre *re = NULL;
-
-	int offset = 4;	
-	{
-		char const * errptr;
-		this->re = pcre_compile(
-			regularExpression.c_str(),
-			0 /* pcre_options */,
-			&errptr,
-			&offset,
-			NULL
-		);
-		if (!this->re) {
-			throw "Regular expression compilation error";
-		}
-	}
 }
 
 
-void PcreDataFilter::filterBuffer(std::string & buf){
-
-	int ovector[48];
-	int count = 0;
-	
-	size_t replen, num;
-	std::string replace;
-	int nreplaces=0;
-
-	if (!this->re) {
-		throw "No regular expression supplied in filterBuffer";
-	}
-
-	size_t offset = 0;
-	size_t length = buf.length();
-	for(; offset < length; nreplaces++){
-
-		count = pcre_exec(
-			this->re,
-			NULL, buf.c_str(),
-			static_cast<int>(length),
-			static_cast<int>(offset),
-			0,
-			ovector,
-			48
-		);
-
-		if (count <= 0) {
-			break;
-		}
-
-		replace = this->replace;
-
-		replen = length - ovector[1];
-		{
-			std::string::iterator it = replace.begin();
-			while (it != replace.end()){
-				if ((*it == '\\') && (it + 1 != replace.end())) {
-					it += 2;
-					++replen;
-				}
-				else if (
-					(*it == '$')
-					&& (it + 1 != replace.end())
-					&& isnumber(*(it+1))
-				) {
-					it++;
-					std::string::iterator itFirst = it;
-					while ((it != replace.end()) && isnumber(*it)) {
-						it++;
-					}
-					std::string numString(itFirst,it);
-					num = atoi(numString.c_str());
-					if (num > (static_cast<size_t>(count) - 1)) {
-						continue;
-					}
-					replen += (ovector[(num<<1) + 1] - ovector[(num<<1)]);
-				} else {
-					it++;
-					replen++;
-				}
-			}
-		}
-
-		char* tmpbuf = new char[replen];
-		char* target = tmpbuf;
-		{
-			std::string::iterator it = replace.begin();
-			while (it != replace.end() ){
-				if (((*it) == '\\') && (it + 1 != replace.end())) {
-					*target++ = *(it+1);
-					it += 2;
-				}
-				else if (
-					((*it) == '$')
-					&& (it + 1 != replace.end())
-					&& isnumber(*(it+1))
-				) {
-					it++;
-					std::string::iterator itFirst = it;
-
-					while ((it != replace.end()) && isnumber(*it)) {
-						it++;
-					}
-					std::string numString(itFirst,it);
-					num = atoi(numString.c_str());
-					if (num > (static_cast<size_t>(count) - 1)) {
-						continue;
-					}
-					memcpy(
-						target,
-						buf.c_str() + ovector[(num<<1)],
-						ovector[(num<<1) + 1] - ovector[(num<<1)]
-					);
-					target += (ovector[(num<<1) + 1] - ovector[(num<<1)]);
-				}
-				else {
-					*target++ = *it++;
-				}
-			}
-		}
-		memcpy(target, buf.c_str() + ovector[1], length - ovector[1]);
-		buf.resize(ovector[0]);
-		buf.append(tmpbuf, replen);
-		/* buf.replace(ovector[0], replen, tmpbuf); */
-		delete[] tmpbuf;
-		length = ovector[0] + replen;
-		if (ovector[0] + replen <= offset) {
-			break;
-		}
-		offset = ovector[0] + this->replace.length();
-	}
-	// nreplaces is how many replaces we did.  does it matter?
+size_t PcreDataFilter::filterBuffer(
+	InputSpan const & buf,
+	std::string & filtered,
+	bool final
+) {
+	return rules.substitute(
+		filtered, buf.data(), buf.length(), context, final, scratch
+	);
 }
 
 
-std::auto_ptr<Instruction> PcreDataFilter::firstInstructionSubCore() {
-	std::auto_ptr<Instruction> instruction;
+Instruction PcreDataFilter::firstInstructionSubCore() {
+	Instruction instruction;
 	if (contentLengthUnfiltered.isKnown()) {
 		if (contentLengthUnfiltered.isKnownToBe(0)) {
-			instruction.reset(new QuitFilterInstruction(0));
+			instruction = QuitFilterInstruction(0);
 		} else {
-			instruction.reset(new BytesMaxInstruction(
+			instruction = BytesMaxInstruction(
 				contentLengthUnfiltered.getKnownValue(),
 				0
-			));
+			);
 		}
 	} else {
-		instruction.reset(new BytesUnknownInstruction(0));
+		instruction = BytesUnknownInstruction(0);
 	}
 
-	Assert(NULL != instruction.get());
 	return instruction;
 }
 
 
-std::auto_ptr<Instruction> PcreDataFilter::runSubCore(
-	std::string const & uncommittedBytes,
+Instruction PcreDataFilter::runSubCore(
+	InputSpan const & uncommittedBytes,
 	size_t newDataOffset,
 	size_t readSoFar,
 	bool disconnected
@@ -199,28 +69,29 @@ std::auto_ptr<Instruction> PcreDataFilter::runSubCore(
 		|| readSoFar <= contentLengthUnfiltered.getKnownValue()
 	);
 
-	std::auto_ptr<Instruction> instruction;
-	std::string filteredOutput = uncommittedBytes;
-	filterBuffer(filteredOutput);
+	Instruction instruction;
+	bool final = contentLengthUnfiltered.isKnownToBe(readSoFar);
+	std::string filteredOutput;
+	size_t commitSize = filterBuffer(uncommittedBytes, filteredOutput, final);
 	outputString(filteredOutput);
 
-	if (contentLengthUnfiltered.isKnownToBe(readSoFar)) {
-		instruction.reset(new QuitFilterInstruction(uncommittedBytes.length()));
+	// What isn't committed is still in the buffer next time, which the
+	// maximum for BytesMax counts
+	size_t held = uncommittedBytes.length() - commitSize;
+	if (final) {
+		instruction = QuitFilterInstruction(uncommittedBytes.length());
 	} else {
 		if (contentLengthUnfiltered.isKnown()) {
-			instruction.reset(new BytesMaxInstruction(
+			instruction = BytesMaxInstruction(
 				SafeSubtractSize(
 					contentLengthUnfiltered.getKnownValue(), readSoFar
-				),
-				uncommittedBytes.length()
-			)); 
-		} else {
-			instruction.reset(
-				new BytesUnknownInstruction(uncommittedBytes.length())
+				) + held,
+				commitSize
 			);
+		} else {
+			instruction = BytesUnknownInstruction(commitSize);
 		}
 	}
-	Assert(NULL != instruction.get());
 	return instruction;
 }
 
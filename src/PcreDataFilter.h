@@ -10,32 +10,40 @@
 #define __FLATWORM_PCREDATAFILTER_H__
 
 #include "DataFilter.h"
-
-#include "pcre/config.h"
-#include "pcre/pcre.h"
-#include "pcre/pcreposix.h"
+#include "RuleSet.h"
 
 class PcreDataFilter : public DataFilter {
 private:
-	pcre * re;
-	std::string replace;
+	RuleSet const & rules;
+
+	// How much of the uncommitted bytes has been filtered already, and is
+	// only kept for the pattern to look behind
+	size_t context;
+
+	RuleScratch scratch;
 
 protected:
-	void filterBuffer(std::string & buf);
+	// Appends buf to filtered with the substitutions made, as far as they
+	// can be until there's more (or it's final).  Returns how much of buf
+	// can be committed.
+	size_t filterBuffer(
+		InputSpan const & buf,
+		std::string & filtered,
+		bool final
+	);
 
 public:
 	PcreDataFilter(
 		Parasock & parasock,
 		FlowDirection whichInput,
 		HeaderFilter const & headerFilterServer,
-		std::string const regularExpression,
-		std::string const replaceString
+		RuleSet const & rules
 	);
 
 public:
-	std::auto_ptr<Instruction> firstInstructionSubCore() /* override */;
-	std::auto_ptr<Instruction> runSubCore(
-		std::string const & uncommittedBytes,
+	Instruction firstInstructionSubCore() /* override */;
+	Instruction runSubCore(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
@@ -3,9 +3,9 @@
 //
 // This is the workhorse of the proxying process.  The function proxychild
 // gets the proxy object passed by the client, and then most of the work is
-// done as methods on the ProxyWorker class.  The handleIncomingRequest is a
-// monster of a monolithic function, but it's broken up into scopes and
-// should be easy to modularize if-and-when that becomes necessary.
+// done as methods on the ProxyWorker class.  The advanceRequest is a
+// monster of a monolithic function, but it's broken up into stages so that
+// an event loop can suspend it whenever it would have to wait.
 //
 
 #include <memory>
@@ -16,6 +16,7 @@
 #include "parasock/Filter.h"
 #include "parasock/DeadFilter.h"
 #include "parasock/PassthruFilter.h"
+#include "parasock/Resumable.h"
 #include "base64.h"
 
 #include "RequestLineFilter.h"
@@ -24,32 +25,53 @@
 #include "ServerHeaderFilter.h"
 
 #include "PcreDataFilter.h"
+#include "ChunkedPassthruFilter.h"
 #include "FlvFilter.h"
 
 int parsehostname(
-	std::string const hostname,
+	TextSpan const & hostname,
 	ProxyWorker * proxy,
-	unsigned short port
+	unsigned short port,
+	bool resolve
 ) {
-	size_t sp = std::string::npos;
-
 	if (hostname.empty())
 		return 1;
-	sp = hostname.find(':');
-	proxy->hostname = hostname.substr(
-		0, sp != std::string::npos ? sp : std::string::npos
+	size_t sp = hostname.find(':');
+	proxy->hostname.assign(
+		hostname.data, (sp != std::string::npos) ? sp : hostname.length
 	);
 	if (sp != std::string::npos) {
-		port = atoi(hostname.c_str() + sp + 1);
+		// the digits, as atoi would take them
+		unsigned long number = 0;
+		for (
+			size_t index = sp + 1;
+			(index < hostname.length) && isdigit(static_cast<unsigned char>(hostname.data[index]));
+			index++
+		) {
+			number = number * 10 + (hostname.data[index] - '0');
+		}
+		port = static_cast<unsigned short>(number);
 	}
 	proxy->req.sin_port=htons(port);
-	proxy->req.sin_addr.s_addr = getip(proxy->hostname.c_str());
+	proxy->req.sin_addr.s_addr = resolve ? getip(proxy->hostname.c_str()) : 0;
 	proxy->parasock.sockbuf[Parasock::ServerConnection]->sin.sin_addr.s_addr = 0;
 	proxy->parasock.sockbuf[Parasock::ServerConnection]->sin.sin_port = 0;
 	return 0;
 }
 
 
+int parsehostname(
+	std::string const & hostname,
+	ProxyWorker * proxy,
+	unsigned short port,
+	bool resolve
+) {
+	return parsehostname(
+		TextSpan (hostname.data(), hostname.length()), proxy, port, resolve
+	);
+}
+
+
 int parseusername(std::string const & username, ProxyWorker * proxy, int extpasswd) {
 	size_t sb = std::string::npos;
 	size_t se = std::string::npos;
@@ -93,7 +115,8 @@ int parseconnusername(
 	std::string const & username,
 	ProxyWorker * proxy,
 	int extpasswd,
-	unsigned short port){
+	unsigned short port,
+	bool resolve){
 	size_t sb = std::string::npos;
 	size_t se = std::string::npos;
 	if (username.empty())
@@ -117,7 +140,9 @@ int parseconnusername(
 		return 3;
 	}
 
-	if (parsehostname(username.substr(sb+1, std::string::npos), proxy, port)) {
+	if (parsehostname(
+		username.substr(sb+1, std::string::npos), proxy, port, resolve
+	)) {
 		return 4;
 	}
 
@@ -166,14 +191,12 @@ int scanaddr(char const *s, unsigned long * ip, unsigned long * mask) {
 
 RESOLVFUNC resolvfunc = NULL;
 
-unsigned long getip(char const *name){
-	unsigned long retval;
+struct sockaddr_in nservers[MAXNSERVERS];
+Resolver * dnsresolver = NULL;
+
+unsigned long getnumericip(char const *name){
 	int i;
 	int ndots = 0;
-	struct hostent *hp = NULL;
-
-	if (strlen(name) > 255)
-		return 0; // used to truncate
 
 	for (i = 0; name[i]; i++){
 		if (name[i] == '.'){
@@ -193,6 +216,21 @@ unsigned long getip(char const *name){
 			return ip;
 		}
 	}
+	return 0;
+}
+
+
+unsigned long getip(char const *name){
+	unsigned long retval;
+	struct hostent *hp = NULL;
+
+	if (strlen(name) > 255)
+		return 0; // used to truncate
+
+	retval = getnumericip(name);
+	if (retval) {
+		return retval;
+	}
 	if (resolvfunc){
 		retval = (*resolvfunc)(name);
 		if (retval) {
@@ -213,6 +251,34 @@ unsigned long getip(char const *name){
 }
 
 
+unsigned long myresolver(char const *name){
+	return dnsresolver->resolve(name);
+}
+
+
+int initresolver(unsigned cachesize){
+	std::vector<struct sockaddr_in> servers;
+	for (int i = 0; i < MAXNSERVERS; i++) {
+		if (nservers[i].sin_addr.s_addr != 0) {
+			servers.push_back(nservers[i]);
+		}
+	}
+	if (servers.empty()) {
+		return 1;
+	}
+
+	// like the event loops, it lasts as long as the process
+	dnsresolver = new Resolver(cachesize, conf.timeouts[DNS_TO].getSeconds());
+	if (!dnsresolver->start(servers)) {
+		delete dnsresolver;
+		dnsresolver = NULL;
+		return 2;
+	}
+	resolvfunc = myresolver;
+	return 0;
+}
+
+
 void file2url(
 	char *sb,
 	char *buf,
@@ -247,64 +313,112 @@ void file2url(
 
 
 void * proxychild(ProxyWorker * proxy) {
-	// I wasn't sure which of these variables might affect the course of the
-	// next loop.  Sort it out later
-	std::string lastRequest;
-	std::string lastRequestOriginal;
-	unsigned ckeepalive = 0;
-	size_t prefix = 0;
-	bool isconnect = false;
-	bool transparent = false;
-	bool redirect = false;
-	bool firstRequest = true;
+	// A thread of its own, so it can just sit in poll while it waits
+	short revents[FlowDirectionMax] = {0, 0};
+	while (proxy->resumeRequest(revents)) {
+		proxy->parasock.pollFilteredProxy(revents);
+	}
+
+	proxy->recycle();
+	return NULL;
+}
 
-	do {
-		std::string request;
-		std::string requestOriginal;
-		bool success = proxy->handleIncomingRequest(
-			request,
-			requestOriginal,
-			ckeepalive,
-			prefix,
-			isconnect,
-			transparent,
-			redirect,
-			lastRequest,
-			lastRequestOriginal
-		);
-		if (!success) {
-			break;
-		}
 
-		lastRequest = request;
-		lastRequestOriginal = requestOriginal;
-		if (!firstRequest) {
-			// first request has an implicit keepalive, if we bump ckeepalive
-			// then we'll keep it open...
-			ckeepalive--; 
-		} else {
-			firstRequest = false;
-		}
 
-		std::cout <<
-			"REQUEST END shouldKeepAlive(" << ckeepalive << ")" <<
-			" w/requestOriginal: " << 
-			(lastRequestOriginal.empty() ? "(empty)" : lastRequestOriginal) << 
-			"\r\n" <<
-			" w/request: " <<
-			(lastRequest.empty() ? "(empty)" : lastRequest) << 
-			"\r\n";
+//
+// The filters and results of each stage of a request, which have to stick
+// around while a stage is waiting on the network.  The stage is where
+// advanceRequest picks up again, named for the filtered proxy operation
+// being waited on.
+//
 
-	} while (ckeepalive);
+struct RequestContext {
+	enum Stage {
+		Start,
+		RequestLine,
+		ClientHeader,
+		Resolve,
+		Connect,
+		Tunnel,
+		SendRequest,
+		SendConnectHeader,
+		ConnectTunnel,
+		ClientBody,
+		SendClientHeader,
+		ResponseLine,
+		ServerHeader,
+		ServerBody,
+		HeaderOnly,
+		PassthruBody,
+		ChunkedBody,
+		Flush
+	};
+	Stage stage;
+
+	std::string request;
+	std::string requestOriginal;
+	int operation;
+	bool keepaliveClient;
+	int httpStatusCode;
+	bool authenticate;
+	bool keepaliveServer;
+	bool persistentServer; // the server connection, not what the client's told
+	bool headerOnly;
+	bool connectEarly; // the host is known without waiting on the header
+
+	// These all live in the worker's arena, along with the context
+	RequestLineFilter * requestFilter;
+	ClientHeaderFilter * clientHeaderFilter;
+	ResponseLineFilter * responseFilter;
+	ServerHeaderFilter * serverHeaderFilter;
+	PcreDataFilter * clientDataFilter;
+	PcreDataFilter * serverDataFilter; // NULL when passed through
+
+	// The response body's filter if it goes to the client as it came, with
+	// its own length, instead of through the server data filter
+	Filter * passthruFilter;
+
+	time_t started;
+
+	RequestContext () :
+		stage (Start),
+		operation (0),
+		keepaliveClient (false),
+		httpStatusCode (0),
+		authenticate (false),
+		keepaliveServer (false),
+		persistentServer (false),
+		headerOnly (false),
+		connectEarly (false),
+		requestFilter (NULL),
+		clientHeaderFilter (NULL),
+		responseFilter (NULL),
+		serverHeaderFilter (NULL),
+		clientDataFilter (NULL),
+		serverDataFilter (NULL),
+		passthruFilter (NULL),
+		started (time(NULL))
+	{
+	}
 
-	delete proxy;
-	return NULL;
-}
+	// The length the client is told the response body has
+	Knowable<size_t> responseLength() const {
+		return (passthruFilter != NULL)
+			? serverHeaderFilter->getContentLengthUnfiltered()
+			: serverDataFilter->getContentLengthFiltered();
+	}
 
+	// Whether the client is told the response body is chunked
+	bool responseChunked() const {
+		return (passthruFilter != NULL)
+			? serverHeaderFilter->getChunkedUnfiltered()
+			: serverDataFilter->getChunkedFiltered();
+	}
+};
 
 
 //
-// ProxyWorker methods are run on its own thread.
+// ProxyWorker methods are run on its own thread, or on an event loop's.
 //
 
 ProxyWorker::ProxyWorker() {
@@ -335,9 +449,36 @@ ProxyWorker::ProxyWorker() {
 	extport = 0;
 
 	time_start = (time_t)0;
+
+	ckeepalive = 0;
+	prefix = 0;
+	isconnect = false;
+	transparent = false;
+	redirect = false;
+	firstRequest = true;
+	serverReusable = false;
+	resolving = false;
+	resolvedAddress = 0;
+
+	context = NULL;
+	active = false;
 }
 
 ProxyWorker::ProxyWorker(ProxyWorker const * clientproxy) {
+	this->context = NULL;
+	this->active = false;
+
+	this->parasock.sockbuf[Parasock::ClientConnection].reset(new SockBuf());
+	this->parasock.sockbuf[Parasock::ServerConnection].reset(new SockBuf());
+
+	setup(clientproxy);
+}
+
+
+void ProxyWorker::setup(ProxyWorker const * clientproxy) {
+	Assert(!this->active);
+	Assert(this->context == NULL);
+
 	this->srv = clientproxy->srv;
 	this->redirectfunc = clientproxy->redirectfunc;
 
@@ -345,8 +486,8 @@ ProxyWorker::ProxyWorker(ProxyWorker const * clientproxy) {
 
 	this->ctrlsock = clientproxy->ctrlsock;
 
-	this->next = clientproxy->next;
-	this->prev = clientproxy->prev;
+	this->next = NULL;
+	this->prev = NULL;
 
 	this->redirtype = clientproxy->redirtype;
 
@@ -367,17 +508,117 @@ ProxyWorker::ProxyWorker(ProxyWorker const * clientproxy) {
 
 	this->time_start = clientproxy->time_start;
 
-	SockBuf* sockbufClient = new SockBuf();
-	*sockbufClient = *clientproxy->parasock.sockbuf[Parasock::ClientConnection];
-	this->parasock.sockbuf[Parasock::ClientConnection].reset(sockbufClient);
+	// a recycled worker mustn't keep anything from its last connection
+	this->hostname.clear();
+	this->username.clear();
+	this->password.clear();
+	this->extusername.clear();
+	this->extpassword.clear();
+
+	this->lastRequest.clear();
+	this->lastRequestOriginal.clear();
+	this->ckeepalive = 0;
+	this->prefix = 0;
+	this->isconnect = false;
+	this->transparent = false;
+	this->redirect = false;
+	this->firstRequest = true;
+	this->serverReusable = false;
+	this->resolving = false;
+
+	// the sockets come later, it's the addresses that are wanted
+	this->parasock.sockbuf[Parasock::ClientConnection]->sin =
+		clientproxy->parasock.sockbuf[Parasock::ClientConnection]->sin;
+	this->parasock.sockbuf[Parasock::ServerConnection]->sin =
+		clientproxy->parasock.sockbuf[Parasock::ServerConnection]->sin;
+
+	if ((this->srv != NULL) && (this->srv->bufsize > 0))
+		this->parasock.setReceiveLimit(this->srv->bufsize);
+
+	if ((this->srv != NULL) && (this->srv->highwater > 0)) {
+		this->parasock.setOutputWaterMarks(
+			this->srv->highwater,
+			this->srv->highwater / 4
+		);
+	}
+
+	if (
+		(this->srv != NULL)
+		&& (this->srv->capturesize > 0)
+		&& !this->parasock.isCapturing()
+	) {
+		this->parasock.startCapture(this->srv->capturesize);
+	}
+
+	this->active = true;
+}
+
+
+ProxyWorker * ProxyWorker::forConnection(
+	ProxyWorker const * defaults,
+	SOCKET sock,
+	struct sockaddr_in const & peer
+) {
+	struct linger lg;
+	lg.l_onoff = 1;
+	lg.l_linger = conf.timeouts[STRING_L].getSeconds();
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&lg, sizeof(lg));
+
+	int opt = 1;
+	setsockopt(sock, SOL_SOCKET, SO_OOBINLINE, (char *)&opt, sizeof(int));
+
+	ProxyWorker * worker = defaults->srv->spareWorkers.pop();
+	if (worker == NULL) {
+		worker = new ProxyWorker(defaults);
+	} else {
+		worker->setup(defaults);
+	}
+	if (!defaults->hostname.empty()) {
+		worker->hostname = defaults->hostname;
+	}
+	worker->parasock.sockbuf[Parasock::ClientConnection]->sock = sock;
+	worker->parasock.sockbuf[Parasock::ClientConnection]->sin = peer;
+	return worker;
+}
+
+
+void ProxyWorker::resolveStage() {
+	// nothing to do unless the request named a host we haven't an address
+	// or a connection for, or aren't already finding
+	if (
+		resolving
+		|| hostname.empty()
+		|| (req.sin_addr.s_addr != 0)
+		|| (parasock.sockbuf[Parasock::ServerConnection]->sock != INVALID_SOCKET)
+	) {
+		return;
+	}
+
+	req.sin_addr.s_addr = getnumericip(hostname.c_str());
+	if (req.sin_addr.s_addr != 0) {
+		return;
+	}
+
+	if (!parasock.isAttached() || (dnsresolver == NULL)) {
+		// on a thread of our own, where waiting holds up nobody else
+		req.sin_addr.s_addr = getip(hostname.c_str());
+		return;
+	}
 
-	SockBuf* sockbufServer = new SockBuf();
-	*sockbufServer = *clientproxy->parasock.sockbuf[Parasock::ServerConnection];
-	this->parasock.sockbuf[Parasock::ServerConnection].reset(sockbufServer);
+	unsigned long address;
+	if (dnsresolver->lookup(hostname.c_str(), address, this)) {
+		req.sin_addr.s_addr = address;
+	} else {
+		resolving = true;
+	}
 }
 
 
 void ProxyWorker::connectToServer(const int operation) {
+	// whatever this request does with the connection, it's its own now
+	serverReusable = false;
+
+	bool opened = false;
 	if (
 		(parasock.sockbuf[Parasock::ServerConnection]->sock == INVALID_SOCKET)
 		&& (operation != DNSRESOLVE && operation != ADMIN)
@@ -394,15 +635,26 @@ void ProxyWorker::connectToServer(const int operation) {
 		if (parasock.sockbuf[Parasock::ServerConnection]->sin.sin_port == 0)
 			parasock.sockbuf[Parasock::ServerConnection]->sin.sin_port = req.sin_port;
 
-		SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-		if (sock == INVALID_SOCKET)
-			throw "Error opening socket to server";
+		// Some other connection may have left one to this origin open,
+		// though one that's been speaking HTTP is no good for a tunnel
+		SOCKET sock = INVALID_SOCKET;
+		if (operation & HTTP) {
+			sock = srv->origins.take(
+				parasock.sockbuf[Parasock::ServerConnection]->sin
+			);
+		}
+		if (sock == INVALID_SOCKET) {
+			sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (sock == INVALID_SOCKET)
+				throw "Error opening socket to server";
+			opened = true;
+		}
 		parasock.sockbuf[Parasock::ServerConnection]->sock = sock;
 	}
 
-	if (extip == 0) {
+	if (opened) {
 		// we need to bind and optionally connect
-		// ...unless the connection was kept alive
+		// ...unless the connection was kept alive (or came from the pool)
 
 		struct linger lg;
 		setsockopt(
@@ -442,24 +694,28 @@ void ProxyWorker::connectToServer(const int operation) {
 				errorno = WSAGetLastError();
 				throw "Could not bind socket connection from client to server";
 			}
-		} else {
-			Assert(extip == 0);
 		}
 
 		parasock.sockbuf[Parasock::ServerConnection]->sin.sin_family = AF_INET;
 		if ((operation >= 256) || (operation & CONNECT)) {
-			unsigned long ul;
+			// The handshake isn't waited for here.  The request gets on
+			// with whatever it can, and waits in its Connect stage.
+			unsigned long ul = 1;
+			ioctlsocket(parasock.sockbuf[Parasock::ServerConnection]->sock, FIONBIO, &ul);
+
 			int res = connect(
 				parasock.sockbuf[Parasock::ServerConnection]->sock,
 				(struct sockaddr *)&parasock.sockbuf[Parasock::ServerConnection]->sin,
 				sizeof(parasock.sockbuf[Parasock::ServerConnection]->sin)
 			);
 			if (res != 0) {
-				throw "Could not connect bound socket from client to server";
+				int errorno = WSAGetLastError();
+				if ((errorno != EINPROGRESS) && (errorno != EAGAIN)) {
+					throw "Could not connect bound socket from client to server";
+				}
+				parasock.sockbuf[Parasock::ServerConnection]->setConnecting();
 			}
 
-			ioctlsocket(parasock.sockbuf[Parasock::ServerConnection]->sock, FIONBIO, &ul);
-
 			SASIZETYPE size = sizeof(parasock.sockbuf[Parasock::ServerConnection]->sin);
 			if (-1 == getsockname(
 				parasock.sockbuf[Parasock::ServerConnection]->sock,
@@ -485,642 +741,699 @@ void ProxyWorker::connectToServer(const int operation) {
 		) {
 			throw &Proxyerror_Recursion_Detected;
 		}
-		SASIZETYPE sasize = sizeof(struct sockaddr_in);
-		if (0 != getpeername(
-			parasock.sockbuf[Parasock::ServerConnection]->sock,
-			(struct sockaddr *)&parasock.sockbuf[Parasock::ServerConnection]->sin,
-			&sasize)
-		) {
-			throw "Get peer name returned non-zero (apparently not good...)";
+
+		// (a connect still going has no peer yet; sin is where it's going)
+		if (!parasock.sockbuf[Parasock::ServerConnection]->isConnecting()) {
+			SASIZETYPE sasize = sizeof(struct sockaddr_in);
+			if (0 != getpeername(
+				parasock.sockbuf[Parasock::ServerConnection]->sock,
+				(struct sockaddr *)&parasock.sockbuf[Parasock::ServerConnection]->sin,
+				&sasize)
+			) {
+				throw "Get peer name returned non-zero (apparently not good...)";
+			}
 		}
 	}
 }
 
 
-bool ProxyWorker::handleIncomingRequest(
-	std::string &requestNonConst,
-	std::string &requestOriginalNonConst,
-	unsigned& ckeepalive,
-	size_t& prefix,
-	bool & isconnect,
-	bool & transparent,
-	bool & redirect,
-	std::string const lastRequest,
-	std::string const lastRequestOriginal
+void ProxyWorker::beginEarlyConnect() {
+	if ((context == NULL) || !context->connectEarly || resolving)
+		return;
+	context->connectEarly = false;
+
+	// a host that didn't resolve is reported once the header is in
+	if (
+		(parasock.sockbuf[Parasock::ServerConnection]->sock == INVALID_SOCKET)
+		&& (parasock.sockbuf[Parasock::ServerConnection]->sin.sin_addr.s_addr == 0)
+		&& (req.sin_addr.s_addr == 0)
+	) {
+		return;
+	}
+	connectToServer(context->operation);
+}
+
+
+void ProxyWorker::poolServerConnection() {
+	if (!serverReusable || (srv == NULL))
+		return;
+	serverReusable = false;
+
+	// not if there's anything left of the last response, or it's been sent
+	// something we didn't ask for
+	SOCKET sock = parasock.sockbuf[Parasock::ServerConnection]->detachIdle();
+	if (sock != INVALID_SOCKET) {
+		srv->origins.give(parasock.sockbuf[Parasock::ServerConnection]->sin, sock);
+	}
+}
+
+
+Filter * ProxyWorker::stageFilter(FlowDirection which, Filter * filter) {
+	// no filter given means no interest in that direction
+	if (filter == NULL)
+		filter = new (arena) DeadFilter (parasock, which);
+	return arena.own(filter);
+}
+
+
+void ProxyWorker::proxyStage(
+	Filter * clientFilter,
+	Filter * serverFilter,
+	Timeout timeout,
+	time_t deadline
 ) {
+	Filter* filter[FlowDirectionMax] = {
+		(clientFilter != NULL) ? clientFilter : stageFilter(ClientToServer, NULL),
+		(serverFilter != NULL) ? serverFilter : stageFilter(ServerToClient, NULL)
+	};
+	parasock.beginFilteredProxy(filter, timeout, stageDeadline(deadline));
+}
 
-	try {
-		
-		// Read and filter the request
-		RequestLineFilter requestFilter (
-			parasock,
-			ClientToServer,
-			ckeepalive,
-			lastRequest,
-			lastRequestOriginal,
-			this
-		);
-		{
-			// Note here I don't know what it means:
-			//    "(?i)^\\s*Accept-encoding:*$", "Accept-Encoding:\n"
-
-			size_t readSoFar[FlowDirectionMax];
-			{
-				FlowDirection whichZero;
-				ForEachDirection(whichZero)
-					readSoFar[whichZero] = 0;
-			}
 
-			DeadFilter deadServerFilter(parasock, ServerToClient);
+void ProxyWorker::flushStage(Timeout timeout) {
+	// Both directions get dead filters, so just what's queued goes out
+	proxyStage(NULL, NULL, timeout);
+}
 
-			Filter* filter[FlowDirectionMax] = {
-				&requestFilter,
-				&deadServerFilter
-			};
-			parasock.doBidirectionalFilteredProxy(
-				readSoFar,
-				conf.timeouts[CONNECTION_L],
-				filter
-			);
-		}
 
-		// buffer and req are preserved across loops, for redirects?  hmm.
-		int operation = requestFilter.operation;
-		isconnect = requestFilter.isconnect;
-		requestNonConst = requestFilter.request;
-		requestOriginalNonConst = requestFilter.requestOriginal;
-		transparent = requestFilter.transparent;
-		prefix = requestFilter.prefix;
-		redirect = requestFilter.redirect;
-
-		if (requestNonConst.length() < 9) {
-			throw "The request is too short";
-		}
-		if (!lastRequestOriginal.empty()) { 
-			// Note: may not be correct semantics, 3Proxy also checked NULL
-			std::string reqPrefix = lastRequestOriginal.substr(0, prefix);
-			if (
-				(requestOriginalNonConst.length() <= prefix)
-				|| strncasecmplen(
-					requestOriginalNonConst,
-					lastRequestOriginal.c_str(),
-					0,
-					NULL
-				)
-			) {
-				// can't serve requests for anything not on the same server
-				// using this same socket!
-				ckeepalive = 0; 
-				parasock.sockbuf[Parasock::ServerConnection].reset(new SockBuf);
-				redirected = 0;
-			} else if (ckeepalive && (parasock.sockbuf[Parasock::ServerConnection].get() != NULL)) {
-				MYPOLLFD fds;
-
-				fds.fd = parasock.sockbuf[Parasock::ServerConnection]->sock;
-				fds.events = POLLIN;
-				int resPoll = poll(&fds, 1, Timeout (0));
-				if (resPoll < 0) {
-					throw "Poll returned negative one.  Hmmm.";
-				}
+void ProxyWorker::connectStage(Timeout timeout) {
+	parasock.beginConnectWait(timeout, stageDeadline(0));
+}
 
-				if (resPoll > 0) {
-					ckeepalive = 0;
-					parasock.sockbuf[Parasock::ServerConnection].reset(new SockBuf);
-					redirected = 0;
-				}
-			}
-		}	
 
-		// Now read the client header; clientHeaderFilter
-		ClientHeaderFilter clientHeaderFilter(
-			parasock,
-			ClientToServer,
-			/* ref */ requestOriginalNonConst,
-			isconnect,
-			transparent,
-			ckeepalive,
-			this
-		);
-		{
-			size_t readSoFar[FlowDirectionMax];
-			{
-				FlowDirection whichZero;
-				ForEachDirection(whichZero)
-					readSoFar[whichZero] = 0;
-			}
+time_t ProxyWorker::stageDeadline(time_t deadline) const {
+	int limit = conf.timeouts[REQUEST_TO].getSeconds();
+	if (limit > 0) {
+		time_t total = context->started + limit;
+		if ((deadline == 0) || (total < deadline))
+			deadline = total;
+	}
+	return deadline;
+}
 
-			DeadFilter deadServerFilter (parasock, ServerToClient);
 
-			Filter* filter[FlowDirectionMax] = {
-				&clientHeaderFilter,
-				&deadServerFilter
-			};
-			parasock.doBidirectionalFilteredProxy(
-				readSoFar,
-				conf.timeouts[CONNECTION_L],
-				filter
-			);
-		}
+// Each AWAIT_STAGE is a point advanceRequest can return from and resume at
+#define AWAIT_STAGE(label, operation) \
+	RESUMABLE_AWAIT( \
+		ctx.stage, \
+		RequestContext::label, \
+		operation, \
+		parasock.isProxying() \
+	)
 
-		/* BeginSockWatch(parasock.sockbuf[Parasock::ClientConnection]->sock); */
+bool ProxyWorker::advanceRequest() {
 
-		bool keepaliveClient = clientHeaderFilter.shouldKeepAlive();
-	
-		// with hostname/etc. encoded into it
-		std::string const requestOriginal = requestOriginalNonConst;
-
-		// adjusted so it makes sense to send to server
-		std::string const request = requestNonConst;
-
-		connectToServer(operation);
-		
-		// For non-HTTP connections, just copy the sockets to each other.
-		// This means, of course, that you will not be able to run the
-		// filters on HTTPS traffic.  That would require somehow
-		// sabotaging the client's browser to accept bad certificates.
-		// If that form of hackery interests you, see mitmproxy:
-		//
-		//     http://mitmproxy.org/doc/howmitmproxy.html
-		// 
-		if (isconnect && this->redirtype != R_HTTP) {
-
-			// connect wasn't an instruction for the server.  it was an
-			// instruction for us, the proxy...so don't pass it along.
-			// consume everything.
-			requestFilter.consume();
-			clientHeaderFilter.consume();
-
-			size_t readSoFar[FlowDirectionMax];
-			{
-				FlowDirection whichZero;
-				ForEachDirection(whichZero)
-					readSoFar[whichZero] = 0;
-			}
+	if (context == NULL)
+		context = arena.own(new (arena) RequestContext);
+	RequestContext & ctx = *context;
 
-			PassthruFilter passServerToClient (
-				parasock,
-				ServerToClient,
-				UNKNOWN,
-				Proxyerror_Connection_Established.html
-			);
+	if (resolving) {
+		// the resolver has the request's host (looked up early, perhaps, and
+		// not back by the time the header was in)
+		return false;
+	}
 
-			PassthruFilter passClientToServer (parasock, ClientToServer, UNKNOWN);
-			Filter* filter[FlowDirectionMax] = {
-				&passClientToServer,
-				&passServerToClient
-			};
-			parasock.doBidirectionalFilteredProxy(
-				readSoFar,
-				conf.timeouts[CONNECTION_L],
-				filter
-			);
+	// Reads as if each filtered proxy operation were waited for.  When one
+	// can't finish without waiting on the network we return, and get called
+	// again when it's done, picking up just after the AWAIT that started it.
+	RESUMABLE_BEGIN(ctx.stage)
+
+	// Read and filter the request
+	ctx.requestFilter = arena.own(new (arena) RequestLineFilter (
+		parasock,
+		ClientToServer,
+		ckeepalive,
+		lastRequest,
+		lastRequestOriginal,
+		this
+	));
+
+	// Note here I don't know what it means:
+	//    "(?i)^\\s*Accept-encoding:*$", "Accept-Encoding:\n"
+
+	// A client dribbling out its header a byte at a time is making
+	// progress, so the header has a deadline of its own
+	AWAIT_STAGE(RequestLine, proxyStage(
+		ctx.requestFilter,
+		NULL,
+		conf.timeouts[CONNECTION_L],
+		ctx.started + conf.timeouts[HEADER_TO].getSeconds()
+	));
+	if (parasock.hasTimedOut()) {
+		throw "Timed out waiting for the request line";
+	}
 
-			parasock.cleanCheckpoint();
-			return true;
-		}
-		
-
-		// Send the request to the server, with the modifications we've made
-		{ 
-			if (requestOriginal.empty() || (redirtype != R_HTTP)) {
-				// BUGBUG: We only filtered requestOriginal.  (?)
-				parasock.sockbuf[Parasock::ServerConnection]->fulfillPlaceholder(
-					requestFilter.placeholder,
-					request
-				);
-			} else {
-				redirect = true;
-				parasock.sockbuf[Parasock::ServerConnection]->fulfillPlaceholder(
-					requestFilter.placeholder,
-					requestOriginal
-				);
+	// buffer and req are preserved across loops, for redirects?  hmm.
+	ctx.operation = ctx.requestFilter->operation;
+	isconnect = ctx.requestFilter->isconnect;
+	ctx.request = ctx.requestFilter->request;
+	ctx.requestOriginal = ctx.requestFilter->requestOriginal;
+	transparent = ctx.requestFilter->transparent;
+	prefix = ctx.requestFilter->prefix;
+	redirect = ctx.requestFilter->redirect;
+
+	if (ctx.request.length() < 9) {
+		throw "The request is too short";
+	}
+	if (!lastRequestOriginal.empty()) {
+		// Note: may not be correct semantics, 3Proxy also checked NULL
+		std::string reqPrefix = lastRequestOriginal.substr(0, prefix);
+		if (
+			(ctx.requestOriginal.length() <= prefix)
+			|| strncasecmplen(
+				ctx.requestOriginal,
+				lastRequestOriginal.c_str(),
+				0,
+				NULL
+			)
+		) {
+			// can't serve requests for anything not on the same server
+			// using this same socket!  but another connection might.
+			ckeepalive = 0;
+			poolServerConnection();
+			parasock.sockbuf[Parasock::ServerConnection].reset(new SockBuf);
+			redirected = 0;
+		} else if (ckeepalive && (parasock.sockbuf[Parasock::ServerConnection].get() != NULL)) {
+			MYPOLLFD fds;
+
+			fds.fd = parasock.sockbuf[Parasock::ServerConnection]->sock;
+			fds.events = POLLIN;
+			int resPoll = poll(&fds, 1, Timeout (0));
+			if (resPoll < 0) {
+				throw "Poll returned negative one.  Hmmm.";
 			}
-			size_t bytesSent = parasock.doUnidirectionalProxy(
-				ServerToClient,
-				conf.timeouts[STRING_L]
-			);
-		}
 
-		// Tack on a few things to the client header before sending
-		{ 
-			std::ostringstream outputBuf;
-			if (keepaliveClient) {
-				if (redirect) {
-					outputBuf << "Proxy-Connection";
-				} else {
-					outputBuf << "Connection";
-				}
-				outputBuf << ": Keep-Alive\r\n";
+			if (resPoll > 0) {
+				ckeepalive = 0;
+				parasock.sockbuf[Parasock::ServerConnection].reset(new SockBuf);
+				redirected = 0;
 			}
+		}
+	}
 
-			if (!extusername.empty()) {
-				if (redirect) {
-					outputBuf << "Proxy-Authorization";
-				} else {
-					outputBuf << "Authorization";
-				}
-				outputBuf << ": basic ";
-				std::string username = extusername + ":" + extpassword;
-				outputBuf << en64(username.c_str(), username.length());
-				outputBuf << "\r\n";
-			}
+	// A request line that names the host, rather than leaving it to the
+	// Host header, is enough to start finding it and connecting to it.
+	// That can go on while the rest of the header comes in.
+	if (!transparent) {
+		ctx.connectEarly = true;
+		resolveStage();
+		beginEarlyConnect();
+	}
 
-			// Don't accept any encodings.
-			outputBuf << "Accept-Encoding:\r\n";
+	// Now read the client header; clientHeaderFilter
+	ctx.clientHeaderFilter = arena.own(new (arena) ClientHeaderFilter (
+		parasock,
+		ClientToServer,
+		/* ref */ ctx.requestOriginal,
+		isconnect,
+		transparent,
+		ckeepalive,
+		this,
+		srv->headerRules
+	));
+	AWAIT_STAGE(ClientHeader, proxyStage(
+		ctx.clientHeaderFilter,
+		NULL,
+		conf.timeouts[CONNECTION_L],
+		ctx.started + conf.timeouts[HEADER_TO].getSeconds()
+	));
+	if (parasock.hasTimedOut()) {
+		throw "Timed out waiting for the request header";
+	}
 
-			clientHeaderFilter.getHeaderString() += outputBuf.str();
-		}
+	/* BeginSockWatch(parasock.sockbuf[Parasock::ClientConnection]->sock); */
 
-		// Connect requests are just fed along, with the client and server 
-		// copying data to each other.
-		{ 
-			if (isconnect) {
-				// Transfer the header received from the client to the server,
-				// since it's not still in the buffer.
+	ctx.keepaliveClient = ctx.clientHeaderFilter->shouldKeepAlive();
 
-				// REVIEW: If we left it in the buffer, this would be automatic
-				// in the MapWithoutFiltering
+	// The host was only parsed out of the request, and is looked up here
+	// where the request can wait for it (if that didn't start early)
+	RESUMABLE_AWAIT(
+		ctx.stage,
+		RequestContext::Resolve,
+		resolveStage(),
+		resolving
+	);
 
-				clientHeaderFilter.fullfillHeaderString();
-				size_t bytesSent = parasock.doUnidirectionalProxy(
+	connectToServer(ctx.operation);
+	AWAIT_STAGE(Connect, connectStage(conf.timeouts[CONNECTION_S]));
+	if (parasock.hasTimedOut()) {
+		throw "Timed out connecting to the server";
+	}
+
+	// For non-HTTP connections, just copy the sockets to each other.
+	// This means, of course, that you will not be able to run the
+	// filters on HTTPS traffic.  That would require somehow
+	// sabotaging the client's browser to accept bad certificates.
+	// If that form of hackery interests you, see mitmproxy:
+	//
+	//     http://mitmproxy.org/doc/howmitmproxy.html
+	//
+	if (isconnect && this->redirtype != R_HTTP) {
+
+		// connect wasn't an instruction for the server.  it was an
+		// instruction for us, the proxy...so don't pass it along.
+		// consume everything.
+		ctx.requestFilter->consume();
+		ctx.clientHeaderFilter->consume();
+
+		AWAIT_STAGE(Tunnel, proxyStage(
+			stageFilter(
+				ClientToServer,
+				new (arena) PassthruFilter (parasock, ClientToServer, UNKNOWN)
+			),
+			stageFilter(
+				ServerToClient,
+				new (arena) PassthruFilter (
+					parasock,
 					ServerToClient,
-					conf.timeouts[STRING_S]
-				);
-
-				size_t readSoFar[FlowDirectionMax];
-				{
-					FlowDirection whichZero;
-					ForEachDirection(whichZero)
-						readSoFar[whichZero] = 0;
-				}
+					UNKNOWN,
+					Proxyerror_Connection_Established.html
+				)
+			),
+			conf.timeouts[CONNECTION_L]
+		));
+		parasock.cleanCheckpoint();
+		return true;
+	}
 
-				PassthruFilter passServer(parasock, ServerToClient, UNKNOWN);
-				PassthruFilter passClient(parasock, ClientToServer, UNKNOWN);
-				Filter* filter[FlowDirectionMax] = { &passClient, &passServer };
-				parasock.doBidirectionalFilteredProxy(
-					readSoFar,
-					conf.timeouts[CONNECTION_L],
-					filter
-				);
-
-				parasock.sockbuf[Parasock::ClientConnection]->cleanCheckpoint();
-				parasock.sockbuf[Parasock::ServerConnection]->cleanCheckpoint();
-				return true;
+	// Send the request to the server, with the modifications we've made
+	if (ctx.requestOriginal.empty() || (redirtype != R_HTTP)) {
+		// BUGBUG: We only filtered requestOriginal.  (?)
+		parasock.sockbuf[Parasock::ServerConnection]->fulfillPlaceholder(
+			ctx.requestFilter->placeholder,
+			ctx.request
+		);
+	} else {
+		redirect = true;
+		parasock.sockbuf[Parasock::ServerConnection]->fulfillPlaceholder(
+			ctx.requestFilter->placeholder,
+			ctx.requestOriginal
+		);
+	}
+	AWAIT_STAGE(SendRequest, flushStage(conf.timeouts[STRING_L]));
+
+	// Tack on a few things to the client header before sending
+	{
+		std::string & header = ctx.clientHeaderFilter->getHeaderString();
+		if (ctx.keepaliveClient) {
+			if (redirect) {
+				header += "Proxy-Connection";
+			} else {
+				header += "Connection";
 			}
+			header += ": Keep-Alive\r\n";
 		}
 
-		bool clientChunked = false;
-		PcreDataFilter clientDataFilter (
-			parasock,
-			ClientToServer,
-			clientHeaderFilter,
-			"\\b[Tt]he\\b",
-			"Flatworm"
-		);
-
-		// Fix up content length and send client's header to server
-		{ 
-			if (clientDataFilter.getContentLengthFiltered().isKnown()) {
-				// Note: We do not have to do it this way.  We can set the
-				// transfer encoding mode to chunked in HTTP1.1 and above.
-				// We can also strip the length if we so choose.
-
-				DeadFilter deadServerFilter (parasock, ServerToClient);
-
-				// NOTE: until we change to a chunked mode or something
-				// that doesn't require reading all the client data, the
-				// statements above have already sent the data...
-				// There is no more!
-				Filter* filterData[FlowDirectionMax];
-				filterData[Parasock::ServerConnection] = &deadServerFilter;
-				filterData[Parasock::ClientConnection] = &clientDataFilter;
-
-				size_t readSoFar[FlowDirectionMax];
-				FlowDirection which;
-				ForEachDirection(which)
-					readSoFar[which] = 0;
-
-				// only read the client data here if we didn't already, and
-				// won't read server data if we're chunking
-				parasock.doBidirectionalFilteredProxy(
-					readSoFar,
-					conf.timeouts[CONNECTION_S],
-					filterData
-				);
-				clientHeaderFilter.fulfillContentLength(
-					clientDataFilter.getContentLengthFiltered().getKnownValue(),
-					false
-				);
+		if (!extusername.empty()) {
+			if (redirect) {
+				header += "Proxy-Authorization";
 			} else {
-				clientHeaderFilter.fulfillContentLength(
-					UNKNOWN,
-					clientHeaderFilter.getChunkedUnfiltered()
-				);
+				header += "Authorization";
 			}
+			header += ": basic ";
+			std::string username = extusername + ":" + extpassword;
+			header += en64(username.c_str(), username.length());
+			header += "\r\n";
 		}
 
-		// Send the client request, with or without a content length...
-		{ 
-			clientHeaderFilter.fullfillHeaderString();
-			size_t bytesSent = parasock.doUnidirectionalProxy(
+		// Don't accept any encodings.
+		header += "Accept-Encoding:\r\n";
+	}
+
+	// Connect requests are just fed along, with the client and server
+	// copying data to each other.
+	if (isconnect) {
+		// Transfer the header received from the client to the server,
+		// since it's not still in the buffer.
+
+		// REVIEW: If we left it in the buffer, this would be automatic
+		// in the MapWithoutFiltering
+
+		ctx.clientHeaderFilter->fullfillHeaderString();
+		AWAIT_STAGE(SendConnectHeader, flushStage(conf.timeouts[STRING_S]));
+
+		AWAIT_STAGE(ConnectTunnel, proxyStage(
+			stageFilter(
+				ClientToServer,
+				new (arena) PassthruFilter (parasock, ClientToServer, UNKNOWN)
+			),
+			stageFilter(
 				ServerToClient,
-				conf.timeouts[STRING_S]
-			);
-		}
+				new (arena) PassthruFilter (parasock, ServerToClient, UNKNOWN)
+			),
+			conf.timeouts[CONNECTION_L]
+		));
+		parasock.cleanCheckpoint();
+		return true;
+	}
 
-		ResponseLineFilter responseFilter (parasock, ServerToClient);
+	ctx.clientDataFilter = arena.own(new (arena) PcreDataFilter (
+		parasock,
+		ClientToServer,
+		*ctx.clientHeaderFilter,
+		srv->dataRules
+	));
+
+	// Fix up content length and send client's header to server
+	if (ctx.clientDataFilter->getContentLengthFiltered().isKnown()) {
+		// Note: We do not have to do it this way.  We can set the
+		// transfer encoding mode to chunked in HTTP1.1 and above.
+		// We can also strip the length if we so choose.
+
+		// NOTE: until we change to a chunked mode or something
+		// that doesn't require reading all the client data, the
+		// statements above have already sent the data...
+		// There is no more!
+
+		// only read the client data here if we didn't already, and
+		// won't read server data if we're chunking
+		AWAIT_STAGE(ClientBody, proxyStage(
+			ctx.clientDataFilter,
+			NULL,
+			conf.timeouts[CONNECTION_S]
+		));
+
+		ctx.clientHeaderFilter->fulfillContentLength(
+			ctx.clientDataFilter->getContentLengthFiltered().getKnownValue(),
+			false
+		);
+	} else {
+		ctx.clientHeaderFilter->fulfillContentLength(
+			UNKNOWN,
+			ctx.clientHeaderFilter->getChunkedUnfiltered()
+		);
+	}
 
-		DeadFilter deadClientFilter (parasock, ClientToServer);
+	// Send the client request, with or without a content length...
+	ctx.clientHeaderFilter->fullfillHeaderString();
+	AWAIT_STAGE(SendClientHeader, flushStage(conf.timeouts[STRING_S]));
 
-		// We want to read the HTTP response, it's just one line.
-		// Followed by key/value pairs
-		{
-			size_t readSoFar[FlowDirectionMax];
-			{
-				FlowDirection whichZero;
-				ForEachDirection(whichZero)
-					readSoFar[whichZero] = 0;
-			}
+	ctx.responseFilter = arena.own(
+		new (arena) ResponseLineFilter (parasock, ServerToClient)
+	);
 
-			// we actually want to kick in the client data filter here...
-			DeadFilter deadClientFilter (parasock, ClientToServer);
-			Filter* filter[FlowDirectionMax] = {
-				&deadClientFilter,
-				&responseFilter
-			};
-			parasock.doBidirectionalFilteredProxy(
-				readSoFar,
-				conf.timeouts[CONNECTION_L],
-				filter
-			);
+	// We want to read the HTTP response, it's just one line.
+	// Followed by key/value pairs
+
+	// we actually want to kick in the client data filter here...
+	AWAIT_STAGE(ResponseLine, proxyStage(
+		NULL,
+		ctx.responseFilter,
+		conf.timeouts[CONNECTION_L]
+	));
+
+	// okay now we have the key value pairs coming up...
+	ctx.serverHeaderFilter = arena.own(new (arena) ServerHeaderFilter (
+		parasock,
+		ServerToClient,
+		isconnect,
+		redirect,
+		&ctx.clientHeaderFilter->getHostRules()->response
+	));
+
+	// we actually want to kick in the client data filter here...
+	AWAIT_STAGE(ServerHeader, proxyStage(
+		NULL,
+		ctx.serverHeaderFilter,
+		conf.timeouts[CONNECTION_L]
+	));
+
+	/* EndSockWatch(parasock.sockbuf[Parasock::ClientConnection]->sock); */
+
+	ctx.httpStatusCode = ctx.responseFilter->httpStatusCode;
+	ctx.authenticate = ctx.serverHeaderFilter->authenticate;
+	ctx.keepaliveServer = ctx.serverHeaderFilter->shouldKeepAlive();
+	ctx.persistentServer = ctx.responseFilter->persistentByDefault
+		? !ctx.serverHeaderFilter->connectionClose
+		: ctx.serverHeaderFilter->connectionKeepAlive;
+
+	// Media, archives and compressed bodies have nothing in them for the
+	// rules, so they go to the client as they come, and only the others
+	// get a data filter
+	if (srv->bodyTypes.handlingFor(
+		ctx.serverHeaderFilter->contentType,
+		ctx.serverHeaderFilter->contentEncoding
+	) == BodyPassthru) {
+		Knowable<size_t> length =
+			ctx.serverHeaderFilter->getContentLengthUnfiltered();
+		Filter * filter = NULL; // nothing to read for an empty body
+		if (ctx.serverHeaderFilter->getChunkedUnfiltered()) {
+			filter = new (arena) ChunkedPassthruFilter (parasock, ServerToClient);
+		} else if (!length.isKnownToBe(0)) {
+			filter = new (arena) PassthruFilter (parasock, ServerToClient, length);
 		}
-
-		// okay now we have the key value pairs coming up...
-		ServerHeaderFilter serverHeaderFilter (
+		ctx.passthruFilter = stageFilter(ServerToClient, filter);
+	} else {
+		ctx.serverDataFilter = arena.own(new (arena) PcreDataFilter (
 			parasock,
 			ServerToClient,
-			isconnect,
-			redirect
-		);
-		{
-			size_t readSoFar[FlowDirectionMax];
-			{
-				FlowDirection whichZero;
-				ForEachDirection(whichZero)
-					readSoFar[whichZero] = 0;
-			}
+			*ctx.serverHeaderFilter,
+			srv->dataRules
+		));
+	}
 
-			// we actually want to kick in the client data filter here...
-			DeadFilter deadClientFilter (parasock, ClientToServer);
-			Filter* filter[FlowDirectionMax] = {
-				&deadClientFilter,
-				&serverHeaderFilter
-			}; 
-			parasock.doBidirectionalFilteredProxy(
-				readSoFar,
-				conf.timeouts[CONNECTION_L],
-				filter);
-		}
+	if ((ctx.httpStatusCode < 200) || (ctx.httpStatusCode > 499)) {
+		ckeepalive = 0;
+	} else if (
+		ctx.responseLength().isUnknown()
+		|| ctx.clientDataFilter->getContentLengthFiltered().isUnknown()
+	) {
+		// we have to close the connection if we don't know how long...
+		// but... this could be tweaked with chunking, I think!
+		ckeepalive = 0;
+	} else {
+		ckeepalive += (ctx.keepaliveClient || ctx.keepaliveServer) ? 1 : 0;
+	}
 
-		/* EndSockWatch(parasock.sockbuf[Parasock::ClientConnection]->sock); */
+	// Handle 204, 304, and HEAD.
+	//
+	// 204 is No Content:
+	//
+	// "The server has fulfilled the request but does not need to return
+	// an entity-body, and might want to return updated metainformation.
+	// The response MAY include new or updated metainformation in the
+	// form of entity-headers, which if present SHOULD be associated with
+	// the requested variant.
+	//
+	// If the client is a user agent, it SHOULD NOT change its document
+	// view from that which caused the request to be sent. This response
+	// is primarily intended to allow input for actions to take place
+	// without causing a change to the user agent's active document view,
+	// although any new or updated metainformation SHOULD be applied to
+	// the document currently in the user agent's active view.
+	//
+	// The 204 response MUST NOT include a message-body, and thus is
+	// always terminated by the first empty line after the header fields."
+	//
+	// 304 is Not Modified:
+	//
+	// "If the client has performed a conditional GET request and access
+	// is allowed, but the document has not been modified, the server
+	// SHOULD respond with this status code. The 304 response MUST NOT
+	// contain a message-body, and thus is always terminated by the first
+	// empty line after the header fields."
+	//
+	// HEAD is defined thusly:
+	//
+	// "The HEAD method is identical to GET except that the server MUST
+	// NOT return a message-body in the response. The metainformation
+	// contained in the HTTP headers in response to a HEAD request SHOULD
+	// be identical to the information sent in response to a GET request.
+	// This method can be used for obtaining metainformation about the
+	// entity implied by the request without transferring the entity-body
+	// itself. This method is often used for testing hypertext links for
+	// validity, accessibility, and recent modification."
+	ctx.headerOnly = (ctx.operation == HTTP_HEAD)
+		|| (ctx.httpStatusCode == 204)
+		|| (ctx.httpStatusCode == 304);
+
+	// If we know the content lengths, go ahead and read the data from
+	// the server and the client (a body passed through keeps its length,
+	// and is sent after the header instead)
+	if (!ctx.headerOnly && (ctx.passthruFilter == NULL)) {
+		// NOTE: until we change to a chunked mode or something that
+		// doesn't require reading all the client data, the statements
+		// above have already sent the data-- there is no more!
+
+		// Server wouldn't respond until we sent the client header.
+		// So we had to read client data earlier if we intended to fill
+		// in the size, but if we didn't do that then now we attach
+		// the client filter
+		//
+		// (can't do that until we have filter pre-empting of some kind.
+		// will wait indefinitely on a keep alive conn.)
 
-		int httpStatusCode = responseFilter.httpStatusCode;
-	 	bool authenticate = serverHeaderFilter.authenticate;
-		bool keepaliveServer = serverHeaderFilter.shouldKeepAlive();
+		// only read the client data here if we didn't already.
+		// Don't do chunking!
+		//
+		// A body read here waits in full behind the header that will
+		// carry its length, where the output water marks can't pause
+		// it.  None is yet: no filter knows its output length before
+		// reading, so a filtered body goes after the header instead,
+		// without a Content-Length, and is throttled like any other.
+		AWAIT_STAGE(ServerBody, proxyStage(
+			NULL,
+			ctx.serverDataFilter->getContentLengthFiltered().isKnown()
+				? ctx.serverDataFilter
+				: NULL,
+			conf.timeouts[CONNECTION_S]
+		));
+
+		if (ctx.serverDataFilter->getContentLengthFiltered().isKnown()) {
+			Assert(
+				parasock.getReadSoFar(ServerToClient)
+				== ctx.serverDataFilter->getContentLengthFiltered().getKnownValue()
+			);
+		}
+	}
 
-		PcreDataFilter serverDataFilter(
-			parasock,
-			ServerToClient,
-			serverHeaderFilter,
-			"\\b[Tt]he\\b",
-			"Flatworm"
+	// Touch up server headers after filtering, before passing on to client
+	if (ctx.responseLength().isKnown()) {
+		ctx.serverHeaderFilter->fulfillContentLength(
+			ctx.responseLength().getKnownValue(),
+			false
 		);
+	} else {
+		ctx.serverHeaderFilter->fulfillContentLength(
+			UNKNOWN,
+			ctx.responseChunked()
+		);
+	}
 
-		if ((httpStatusCode < 200) || (httpStatusCode > 499)) {
-			ckeepalive = 0;
-		} else if (
-			serverDataFilter.getContentLengthFiltered().isUnknown()
-			|| clientDataFilter.getContentLengthFiltered().isUnknown()
-		) {
-			// we have to close the connection if we don't know how long...
-			// but... this could be tweaked with chunking, I think!
-			ckeepalive = 0; 
+	{
+		std::string & header = ctx.serverHeaderFilter->getHeaderString();
+		if (ctx.authenticate && !transparent) {
+			header += "Proxy-support: Session-Based-Authentication\r\n"
+				"Connection: Proxy-support\r\n";
+		}
+		if (transparent) {
+			header += "Connection";
+		} else {
+			header += "Proxy-Connection";
+		}
+		header += ": ";
+		if (ctx.responseLength().isKnown() && ctx.keepaliveServer) {
+			header += "Keep-Alive";
 		} else {
-			ckeepalive += (keepaliveClient || keepaliveServer) ? 1 : 0;
+			header += "Close";
 		}
+		header += "\r\n";
+	}
 
-		// If we know the content lengths, go ahead and read the data from 
-		// the server and the client
-		{ 
-			if (
-				(operation != HTTP_HEAD)
-				&& (httpStatusCode != 204)
-				&& (httpStatusCode != 304)
-			) {
-				size_t readSoFar[FlowDirectionMax];
-				{
-					FlowDirection whichZero;
-					ForEachDirection(whichZero)
-						readSoFar[whichZero] = 0;
-				}
+	// Transmit header received from server to client socket.
+	ctx.serverHeaderFilter->fullfillHeaderString();
+
+	if (ctx.headerOnly) {
+		// no more to read, don't try.  a kept alive connection would then
+		// block indefinitely!
+
+		// I thought GET could have client data.  But on a keep alive
+		// connection, I got subsequent GETs with naught but a line feed
+		/* PassthruFilter passClient (parasock, ClientToServer, UNKNOWN); */
+		AWAIT_STAGE(HeaderOnly, proxyStage(
+			NULL,
+			NULL,
+			conf.timeouts[CONNECTION_L]
+		));
+		parasock.cleanCheckpoint();
+		serverReusable = ctx.persistentServer && !parasock.hasTimedOut();
+		return true;
+	}
 
-				DeadFilter deadServerFilter (parasock, ServerToClient);
-				DeadFilter deadClientFilter (parasock, ClientToServer);
-
-				// NOTE: until we change to a chunked mode or something that
-				// doesn't require reading all the client data, the statements
-				// above have already sent the data-- there is no more!
-				Filter* filterData[FlowDirectionMax];
-				if (serverDataFilter.getContentLengthFiltered().isKnown()) {
-					filterData[Parasock::ServerConnection] = &serverDataFilter;
-				} else {
-					filterData[Parasock::ServerConnection] = &deadServerFilter;
-				}
+	if (ctx.passthruFilter != NULL) {
+		// Straight from one socket to the other, spliced where that's
+		// possible.  The header goes out first.
+		AWAIT_STAGE(PassthruBody, proxyStage(
+			NULL,
+			ctx.passthruFilter,
+			conf.timeouts[CONNECTION_L]
+		));
+	} else if (!ctx.serverDataFilter->getContentLengthFiltered().isKnown()) {
+		// Now if we have chunking to take care of we will
+		// we actually want to kick in the client data filter here...
+		AWAIT_STAGE(ChunkedBody, proxyStage(
+			NULL,
+			ctx.serverDataFilter,
+			conf.timeouts[CONNECTION_L]
+		));
+	}
 
-				// Server wouldn't respond until we sent the client header.
-				// So we had to read client data earlier if we intended to fill
-				// in the size, but if we didn't do that then now we attach
-				// the client filter
-				if (clientDataFilter.getContentLengthFiltered().isUnknown()) {
-					// can't do this until we have filter pre-empting of 
-					// some kind.  will wait indefinitely on a keep alive conn.
-					/* filterData[Parasock::ClientConnection] = &clientDataFilter; */
-
-					filterData[Parasock::ClientConnection] = &deadClientFilter;
-				} else {
-					filterData[Parasock::ClientConnection] = &deadClientFilter;
-				}
+	// only necessary if we filled a placeholder and didn't map and filter?
+	AWAIT_STAGE(Flush, flushStage(conf.timeouts[STRING_S]));
+	parasock.cleanCheckpoint();
 
-				// only read the client data here if we didn't already.
-				// Don't do chunking!
-				parasock.doBidirectionalFilteredProxy(
-					readSoFar,
-					conf.timeouts[CONNECTION_S],
-					filterData
-				);
-
-				if (serverDataFilter.getContentLengthFiltered().isKnown()) {
-					Assert(
-						readSoFar[Parasock::ServerConnection]
-						== serverDataFilter.getContentLengthFiltered().getKnownValue()
-					);
-				}
-			}
-		}
+	// A body that ran to the server closing can't be followed by another
+	serverReusable = ctx.persistentServer
+		&& (
+			ctx.serverHeaderFilter->getContentLengthUnfiltered().isKnown()
+			|| ctx.serverHeaderFilter->getChunkedUnfiltered()
+		)
+		&& !parasock.hasTimedOut();
 
-		// Touch up server headers after filtering, before passing on to client
-		{	
-			if (serverDataFilter.getContentLengthFiltered().isKnown()) {
-				serverHeaderFilter.fulfillContentLength(
-					serverDataFilter.getContentLengthFiltered().getKnownValue(),
-					false
-				);
-			} else {
-				serverHeaderFilter.fulfillContentLength(
-					UNKNOWN,
-					serverDataFilter.getChunkedFiltered()
-				);
-			}
+	RESUMABLE_END(ctx.stage)
 
-			std::ostringstream bufStream;
-			if (authenticate && !transparent) {
-				bufStream << "Proxy-support: Session-Based-Authentication\r\n"
-					<< "Connection: Proxy-support\r\n";
-			}
-			if (transparent) {
-				bufStream << "Connection";
-			} else {
-				bufStream << "Proxy-Connection";
-			}
-			bufStream << ": ";
-			if (
-				serverDataFilter.getContentLengthFiltered().isKnown()
-				&& keepaliveServer
-			) {
-				bufStream << "Keep-Alive";
-			} else {
-				bufStream << "Close";
-			}
-			bufStream << "\r\n";
-			serverHeaderFilter.getHeaderString() += bufStream.str();
-		}
+	return true;
+}
 
-		// Transmit header received from server to client socket.
-		{
-			serverHeaderFilter.fullfillHeaderString();
-		}
+#undef AWAIT_STAGE
 
-		// Handle 204, 304, and HEAD.
-		//
-		// 204 is No Content:
-		//
-		// "The server has fulfilled the request but does not need to return 
-		// an entity-body, and might want to return updated metainformation. 
-		// The response MAY include new or updated metainformation in the
-		// form of entity-headers, which if present SHOULD be associated with
-		// the requested variant.
-		//
-		// If the client is a user agent, it SHOULD NOT change its document
-		// view from that which caused the request to be sent. This response
-		// is primarily intended to allow input for actions to take place
-		// without causing a change to the user agent's active document view,
-		// although any new or updated metainformation SHOULD be applied to
-		// the document currently in the user agent's active view.
-		// 
-		// The 204 response MUST NOT include a message-body, and thus is
-		// always terminated by the first empty line after the header fields."
-		//
-		// 304 is Not Modified:
-		//
-		// "If the client has performed a conditional GET request and access
-		// is allowed, but the document has not been modified, the server
-		// SHOULD respond with this status code. The 304 response MUST NOT
-		// contain a message-body, and thus is always terminated by the first
-		// empty line after the header fields."
-		//
-		// HEAD is defined thusly:
-		// 
-		// "The HEAD method is identical to GET except that the server MUST
-		// NOT return a message-body in the response. The metainformation
-		// contained in the HTTP headers in response to a HEAD request SHOULD
-		// be identical to the information sent in response to a GET request.
-		// This method can be used for obtaining metainformation about the
-		// entity implied by the request without transferring the entity-body
-		// itself. This method is often used for testing hypertext links for
-		// validity, accessibility, and recent modification."
 
-		if (
-			(httpStatusCode == 204)
-			|| (httpStatusCode == 304)
-			|| (operation == HTTP_HEAD)
-		) {
-			size_t readSoFar[FlowDirectionMax];
-			{
-				FlowDirection whichZero;
-				ForEachDirection(whichZero)
-					readSoFar[whichZero] = 0;
-			}
+void ProxyWorker::finishRequest() {
+	lastRequest = context->request;
+	lastRequestOriginal = context->requestOriginal;
+	if (!firstRequest) {
+		// first request has an implicit keepalive, if we bump ckeepalive
+		// then we'll keep it open...
+		ckeepalive--;
+	} else {
+		firstRequest = false;
+	}
 
-			// no more to read, don't try.  a kept alive connection would then
-			// block indefinitely!
-			DeadFilter deadServerFilter (parasock, ServerToClient);
-
-			// I thought GET could have client data.  But on a keep alive
-			// connection, I got subsequent GETs with naught but a line feed
-			/* PassthruFilter passClient (parasock, ClientToServer, UNKNOWN); */ 
-			DeadFilter deadClientFilter (parasock, ClientToServer);
-
-			Filter* filter[FlowDirectionMax] = {
-				/* passClient */ &deadClientFilter,
-				&deadServerFilter
-			};
-			parasock.doBidirectionalFilteredProxy(
-				readSoFar,
-				conf.timeouts[CONNECTION_L],
-				filter
-			);
+	std::cout <<
+		"REQUEST END shouldKeepAlive(" << ckeepalive << ")" <<
+		" w/requestOriginal: " <<
+		(lastRequestOriginal.empty() ? "(empty)" : lastRequestOriginal) <<
+		"\r\n" <<
+		" w/request: " <<
+		(lastRequest.empty() ? "(empty)" : lastRequest) <<
+		"\r\n" <<
+		" reads/wakeups client: " <<
+		parasock.getReceiveCalls(ClientToServer) << "/" <<
+		parasock.getReceiveWakeups(ClientToServer) <<
+		" server: " <<
+		parasock.getReceiveCalls(ServerToClient) << "/" <<
+		parasock.getReceiveWakeups(ServerToClient) <<
+		"\r\n";
+
+	// everything the request made goes in one step, ready for the next
+	context = NULL;
+	arena.reset();
+}
 
-			parasock.cleanCheckpoint();
-			return true;
-		}
 
-		// Now if we have chunking to take care of we will
-		{
-			if (!serverDataFilter.getContentLengthFiltered().isKnown()) {
-				size_t readSoFar[FlowDirectionMax];
-				{
-					FlowDirection whichZero;
-					ForEachDirection(whichZero)
-						readSoFar[whichZero] = 0;
-				}
+bool ProxyWorker::resumeRequest(short const (&revents)[FlowDirectionMax]) {
+	// On an event loop we can't stop and wait for the error page to go out
+	Timeout failureTimeout =
+		parasock.isAttached() ? Timeout (0) : conf.timeouts[STRING_S];
 
-				DeadFilter deadClientFilter (parasock, ClientToServer);
-				Filter* filter[FlowDirectionMax];
-				// we actually want to kick in the client data filter here...
-				filter[Parasock::ServerConnection] = &serverDataFilter;
-				filter[Parasock::ClientConnection] = &deadClientFilter;
-				parasock.doBidirectionalFilteredProxy(
-					readSoFar,
-					conf.timeouts[CONNECTION_L],
-					filter
-				);
+	try {
+		// the resolver may be back for a connect that was to start early
+		beginEarlyConnect();
+
+		if (!parasock.isProxying() || parasock.pumpFilteredProxy(revents)) {
+			while (advanceRequest()) {
+				finishRequest();
+				if (!ckeepalive) {
+					return false;
+				}
 			}
 		}
 
-		// only necessary if we filled a placeholder and didn't map and filter?
-		{
-			size_t bytesSentClient = parasock.doUnidirectionalProxy(
-				ClientToServer,
-				conf.timeouts[STRING_S]
-			);  
-			size_t bytesSentServer = parasock.doUnidirectionalProxy(
-				ServerToClient,
-				conf.timeouts[STRING_S]
-			);
+		if (parasock.isAttached()) {
+			parasock.updateWatches();
+			updateDeadline();
 		}
 
-		parasock.cleanCheckpoint();
-
 	} catch (char const * str) {
 		// string error.  improve feedback, wrap as a bug report?
 		// "Click here to report bug"
@@ -1128,10 +1441,12 @@ bool ProxyWorker::handleIncomingRequest(
 		/* EndSockWatch(parasock.sockbuf[Parasock::ClientConnection]->sock); */
 
 		parasock.sockbuf[Parasock::ClientConnection]->failureShutdown(
-			str, conf.timeouts[STRING_S]
+			str, failureTimeout
 		);
-		std::cout << "Exception thrown during [" << requestOriginalNonConst
+		std::cout << "Exception thrown during ["
+			<< ((context != NULL) ? context->requestOriginal : "")
 			<< ": " << str << "\n";
+		dumpCapture();
 		return false;
 
 	} catch (const ProxyWorkerError * proxyerror) { // bigger error page
@@ -1154,8 +1469,9 @@ bool ProxyWorker::handleIncomingRequest(
 
 		parasock.sockbuf[Parasock::ClientConnection]->failureShutdown(
 			proxyerror->html,
-			conf.timeouts[STRING_S]
+			failureTimeout
 		);
+		dumpCapture();
 		return false;
 	}
 
@@ -1163,32 +1479,124 @@ bool ProxyWorker::handleIncomingRequest(
 }
 
 
-ProxyWorker::~ProxyWorker() {
+void ProxyWorker::dumpCapture() {
+	if (!parasock.isCapturing())
+		return;
+
+	// named so that a directory listing sorts them by when they happened
+	std::ostringstream filename;
+	filename << "flatworm-" << time(NULL) << "-"
+		<< ntohs(parasock.sockbuf[Parasock::ClientConnection]->sin.sin_port)
+		<< ".pcap";
+
+	if (parasock.dumpCapture(filename.str()))
+		std::cout << "Traffic capture written to " << filename.str() << "\n";
+	else
+		std::cout << "Could not write traffic capture " << filename.str() << "\n";
+}
+
+
+//
+// When running on an event loop, these get called on the loop's thread
+// instead of the ProxyWorker having one of its own.
+//
+
+void ProxyWorker::handleStart() {
+	parasock.attachHandler(this);
+
+	short revents[FlowDirectionMax] = {0, 0};
+	if (!resumeRequest(revents)) {
+		eventLoop()->retire(this);
+	}
+}
+
+
+void ProxyWorker::handleEvents(int which, short revents) {
+	short reventsBoth[FlowDirectionMax] = {0, 0};
+	reventsBoth[which] = revents;
+	if (!resumeRequest(reventsBoth)) {
+		eventLoop()->retire(this);
+	}
+}
+
+
+void ProxyWorker::resolved(unsigned long address) {
+	// this is the resolver's thread
+	resolvedAddress = address;
+	eventLoop()->notify(this);
+}
+
+
+void ProxyWorker::handleNotified() {
+	Assert(resolving);
+	resolving = false;
+	req.sin_addr.s_addr = resolvedAddress;
+
+	if (!active) {
+		// retired while the lookup was out, and only kept for this
+		leaveLoop();
+		recycle();
+		return;
+	}
+	if (isRetired()) {
+		// handleRetired is still to come, and will see to it
+		return;
+	}
+
+	short revents[FlowDirectionMax] = {0, 0};
+	if (!resumeRequest(revents)) {
+		eventLoop()->retire(this);
+	}
+}
+
+
+void ProxyWorker::updateDeadline() {
+	if (!parasock.isProxying()) {
+		eventLoop()->setDeadline(this, 0);
+		return;
+	}
+
+	// Progress only ever moves the deadline later, and it would be a shame
+	// to refile the timer for every read.  So it is left to go off early,
+	// and set again for the real deadline then.
+	time_t deadline = parasock.getDeadline();
+	if (isScheduled() && (getDeadline() <= deadline)) {
+		return;
+	}
+	eventLoop()->setDeadline(this, deadline);
+}
+
+
+void ProxyWorker::handleDeadline(time_t now) {
+	parasock.checkFilteredProxyTimeout(now);
+	if (!parasock.isProxying()) {
+		return;
+	}
+	if (!parasock.hasTimedOut()) {
+		eventLoop()->setDeadline(this, parasock.getDeadline());
+		return;
+	}
+
+	short revents[FlowDirectionMax] = {0, 0};
+	if (!resumeRequest(revents)) {
+		eventLoop()->retire(this);
+	}
+}
+
+
+void ProxyWorker::release() {
+	if (!active) {
+		return;
+	}
+	active = false;
+
 	// We used to do this inside the handler when ckeepalive is 0, 
 	// but it's actually sensible here.
 	//
-	// You kill a ProxyWorker when the connection dies I think; which
+	// You're done with a ProxyWorker when the connection dies I think; which
 	// further makes it seem like it may be the right class to consider
 	// "the" proxying object...
 
-	if (parasock.sockbuf[Parasock::ServerConnection]->sock != INVALID_SOCKET) {
-		parasock.sockbuf[Parasock::ServerConnection].reset();
-	}
-
-	if (srv) {
-		pthread_mutex_lock(&srv->counter_mutex);
-		if (prev) {
-			prev->next = next;
-		} else {
-			srv->child = next;
-		}
-		if (next) {
-			next->prev = prev;
-		}
-		(srv->childcount)--;
-		pthread_mutex_unlock(&srv->counter_mutex);
-	}
-
 	if (
 		(ctrlsock != INVALID_SOCKET)
 		&& (parasock.sockbuf[Parasock::ClientConnection].get() != NULL)
@@ -1197,4 +1605,218 @@ ProxyWorker::~ProxyWorker() {
 		shutdown(ctrlsock, SHUT_RDWR);
 		closesocket(ctrlsock);
 	}
+	ctrlsock = INVALID_SOCKET;
+
+	// A server connection that's between requests can outlive the client's
+	poolServerConnection();
+
+	// Closes the sockets.  This goes before the arena is reset, as a failed
+	// request can leave placeholders its filters still own in the sockbufs.
+	parasock.recycle();
+
+	context = NULL;
+	arena.reset();
+
+	if (srv) {
+		srv->releaseChild();
+	}
+}
+
+
+void ProxyWorker::recycle() {
+	release();
+	if (srv == NULL) {
+		delete this;
+		return;
+	}
+	srv->spareWorkers.push(this);
+}
+
+
+void ProxyWorker::handleRetired() {
+	// the sockets have to be closed while the loop is still ours
+	release();
+
+	// The resolver can't be stopped from notifying us, so a worker it still
+	// has waits on the loop for that before it can be used again
+	if (resolving)
+		return;
+
+	leaveLoop();
+	recycle();
+}
+
+
+ProxyWorker::~ProxyWorker() {
+	release();
+}
+
+
+void ProxyWorkerFreelist::push(ProxyWorker * worker) {
+	void * top;
+	do {
+		top = this->top;
+		worker->next = static_cast<ProxyWorker *>(top);
+	} while (InterlockedCompareExchangePointer(&this->top, worker, top) != top);
+}
+
+
+ProxyWorker * ProxyWorkerFreelist::pop() {
+	void * top;
+	ProxyWorker * worker = NULL;
+	pthread_mutex_lock(&popMutex);
+	do {
+		top = this->top;
+		if (top == NULL)
+			break;
+		worker = static_cast<ProxyWorker *>(top);
+	} while (
+		InterlockedCompareExchangePointer(&this->top, worker->next, top) != top
+	);
+	pthread_mutex_unlock(&popMutex);
+
+	if (top == NULL)
+		return NULL;
+	worker->next = NULL;
+	return worker;
+}
+
+
+ProxyWorkerFreelist::~ProxyWorkerFreelist() {
+	ProxyWorker * worker;
+	while ((worker = pop()) != NULL) {
+		delete worker;
+	}
+	DeleteCriticalSection(&popMutex);
+}
+
+
+bool SRVPARAM::reserveChild() {
+	LONG count = childcount;
+	while (count < maxchild) {
+		LONG seen = InterlockedCompareExchange(&childcount, count + 1, count);
+		if (seen == count)
+			return true;
+		count = seen;
+	}
+	return false;
+}
+
+
+void SRVPARAM::releaseChild() {
+	InterlockedDecrement(&childcount);
+
+	// Both sides change one count with an interlocked operation before
+	// looking at the other.  So either this sees a waiter that's on its way
+	// onto the list, or the waiter sees the place that was just given back.
+	if (waitingCount == 0)
+		return;
+
+	std::vector<Admittable *> admitted;
+	pthread_mutex_lock(&admissionMutex);
+	admitted.swap(waitingAdmission);
+	InterlockedExchange(&waitingCount, 0);
+	pthread_mutex_unlock(&admissionMutex);
+
+	// All of them, as the next connection may come in on any of their
+	// listeners; those that lose the race for the place just wait again
+	std::vector<Admittable *>::iterator it = admitted.begin();
+	while (it != admitted.end()) {
+		(*it)->admit();
+		it++;
+	}
+}
+
+
+bool SRVPARAM::waitForChild(Admittable * waiter) {
+	pthread_mutex_lock(&admissionMutex);
+	waitingAdmission.push_back(waiter);
+	InterlockedIncrement(&waitingCount);
+
+	if (childcount < maxchild) {
+		waitingAdmission.pop_back();
+		InterlockedDecrement(&waitingCount);
+		pthread_mutex_unlock(&admissionMutex);
+		return false;
+	}
+	pthread_mutex_unlock(&admissionMutex);
+	return true;
+}
+
+
+ProxyAcceptor::ProxyAcceptor (
+	ProxyWorker * defaults,
+	SOCKET sock,
+	Reactor * reactor,
+	size_t home
+) :
+	defaults (defaults),
+	sock (sock),
+	reactor (reactor),
+	home (home)
+{
+	watch.pollOnly = true;
+}
+
+
+void ProxyAcceptor::handleStart() {
+	watch.handler = this;
+	eventLoop()->setInterest(watch, sock, POLLIN);
+}
+
+
+void ProxyAcceptor::handleEvents(int which, short revents) {
+	(void)which;
+	(void)revents;
+
+	SRVPARAM * srv = defaults->srv;
+	for (int count = 0; count < ACCEPTBATCH; count++) {
+		if (!srv->reserveChild()) {
+			// off the loop until there's room, see handleRetired
+			eventLoop()->retire(this);
+			return;
+		}
+
+		struct sockaddr_in peer;
+		SOCKET accepted = sockacceptready(sock, &peer);
+		if (accepted == INVALID_SOCKET) {
+			int errorno = WSAGetLastError();
+			srv->releaseChild();
+			if ((errorno != EAGAIN) && !srv->silent) {
+				char buf[256];
+				sprintf(buf, "accept(): %s", strerror(errorno));
+				(*srv->logfunc)(defaults, buf);
+			}
+			return;
+		}
+
+		// the worker stays on this loop, so its first events come to the
+		// thread that already has the socket warm
+		eventLoop()->adopt(ProxyWorker::forConnection(defaults, accepted, peer));
+	}
+}
+
+
+void ProxyAcceptor::handleDeadline(time_t now) {
+	(void)now;
+}
+
+
+void ProxyAcceptor::handleRetired() {
+	// Connections keep queueing in the listener's backlog meanwhile
+	eventLoop()->unwatch(watch);
+	leaveLoop();
+	if (!defaults->srv->waitForChild(this)) {
+		admit();
+	}
+}
+
+
+void ProxyAcceptor::admit() {
+	reactor->adoptOn(home, this);
+}
+
+
+ProxyAcceptor::~ProxyAcceptor() {
+	// The listening socket is Main's
 }
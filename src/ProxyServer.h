@@ -22,8 +22,10 @@
 #define MAXUSERNAME 128
 #define PASSWORD_LEN 256
 #define MAXNSERVERS 5
+#define DNSCACHESIZE 4096
 
 
+#ifdef _WIN32
 #include <io.h>
 #include <process.h>
 #include <winsock2.h>
@@ -36,13 +38,21 @@
 #define socket(x, y, z) WSASocket(x, y, z, NULL, 0, 0)
 #define accept(x, y, z) WSAAccept(x, y, z, NULL, 0)
 #define ftruncate chsize
+#else
+#include <unistd.h>
+#include <strings.h>
+#include <pthread.h>
+#include "parasock/NetUtils.h"
+#endif
 
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
+#ifdef _WIN32
 #define strcasecmp stricmp
 #define strncasecmp strnicmp
+#endif
 
 #ifndef SOCKET_ERROR
 #define SOCKET_ERROR -1
@@ -73,11 +83,20 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
+#ifdef _WIN32
 #include <winsock2.h>
+#endif
 
 #include "ProxyServerErrors.h"
 #include "parasock/Filter.h"
+#include "parasock/Arena.h"
+#include "parasock/OriginPool.h"
+#include "parasock/Resolver.h"
+#include "HeaderRules.h"
+#include "RuleSet.h"
+#include "ContentTypes.h"
 
 #define CONNECT 	0x00000001
 #define BIND		0x00000002
@@ -158,7 +177,7 @@ typedef enum {
 
 
 struct EXTPARAM {
-	Timeout timeouts[10];
+	Timeout timeouts[11];
 	char * conffile;
 	SRVPARAM *services;
 	int threadinit, counterd, haveerror, paused,
@@ -184,8 +203,9 @@ public:
 		timeouts[5] = Timeout(1800);
 		timeouts[6] = Timeout(15);
 		timeouts[7] = Timeout(60);
-		timeouts[8] = Timeout(0);
+		timeouts[8] = Timeout(60);
 		timeouts[9] = Timeout(0);
+		timeouts[10] = Timeout(15);
 
 		conffile = NULL;
 		services = NULL;
@@ -230,31 +250,115 @@ typedef enum {
 	CONNECTION_S,
 	CONNECTION_L,
 	DNS_TO,
-	CHAIN_TO
+	CHAIN_TO,
+	HEADER_TO, // request line and header, however fast they trickle in
+	REQUEST_TO, // the whole request, zero for no limit
+	ORIGINIDLE_TO // an origin connection kept for reuse
 }Timeout_TYPES;
 
 
 typedef void * (* ProxyWorkerFUNC)(ProxyWorker *);
 
+
+// ProxyWorkers whose connections are done, kept so whoever is accepting can
+// hand them out again instead of making new ones.  Putting a worker back is
+// a compare-and-swap with no lock.  Taking one out holds a lock against
+// other takers, because a pop racing with another that takes the top and
+// puts it back again would swap in a stale next pointer.  Pushes alone
+// can't do that to it.
+class ProxyWorkerFreelist {
+private:
+	void * volatile top; // linked through ProxyWorker::next
+	CRITICAL_SECTION popMutex;
+
+public:
+	ProxyWorkerFreelist () :
+		top (NULL)
+	{
+		InitializeCriticalSection(&popMutex);
+	}
+
+private:
+	// Disable copying C++98 style
+	ProxyWorkerFreelist (ProxyWorkerFreelist const & other);
+
+public:
+	void push(ProxyWorker * worker);
+
+	// NULL if there are none
+	ProxyWorker * pop();
+
+	virtual ~ProxyWorkerFreelist();
+};
+
+
+// Something accepting connections that has had to stop, because there were
+// as many as srv allows.
+class Admittable {
+public:
+	// Made once, from whichever thread let a connection go
+	virtual void admit() = 0;
+
+	virtual ~Admittable() {}
+};
+
+
+// For a thread that can simply block until it's admitted
+class AdmissionWait : public Admittable {
+private:
+	HANDLE semaphore;
+
+public:
+	AdmissionWait () {
+		semaphore = CreateSemaphore(NULL, 0, 1, NULL);
+	}
+
+private:
+	// Disable copying C++98 style
+	AdmissionWait (AdmissionWait const & other);
+
+public:
+	void admit() /* override */ {
+		ReleaseSemaphore(semaphore, 1, NULL);
+	}
+
+	void wait() {
+		WaitForSingleObject(semaphore, INFINITE);
+	}
+
+	virtual ~AdmissionWait() {
+		CloseHandle(semaphore);
+	}
+};
+
+
 struct SRVPARAM {
 	SRVPARAM *next;
 	SRVPARAM *prev;
-	ProxyWorker *child;
+	ProxyWorkerFreelist spareWorkers;
 	ProxyWorkerSERVICE service;
 	LOGFUNC logfunc;
 	ProxyWorkerFUNC pf;
 	SOCKET srvsock;
-	int childcount;
+	LONG volatile childcount; // connections, accepted or about to be
 	int maxchild;
+	CRITICAL_SECTION admissionMutex;
+	std::vector<Admittable *> waitingAdmission;
+	LONG volatile waitingCount;
+	OriginPool origins;
+	HeaderRules headerRules;
+	RuleSet dataRules; // what the data filters substitute
+	ContentTypes bodyTypes; // which response bodies they see
 	int version;
 	int usentlm;
 	int nouser;
 	int silent;
 	unsigned bufsize;
+	unsigned highwater;
+	unsigned capturesize;
 	unsigned logdumpsrv, logdumpcli;
 	unsigned long intip;
 	unsigned long extip;
-	CRITICAL_SECTION counter_mutex;
 	MYPOLLFD fds;
 	FILE *stdlog;
 	std::string target;
@@ -270,23 +374,25 @@ public:
 	SRVPARAM() {
 		next = NULL;
 		prev = NULL;
-		child = NULL;
 		service = S_NOSERVICE;
 		logfunc = NULL;
 		pf = NULL;
 		srvsock = 0;
 		childcount = 0;
 		maxchild = 0;
+		InitializeCriticalSection(&admissionMutex);
+		waitingCount = 0;
 		version = 0;
 		usentlm = 0;
 		nouser = 0;
 		silent = 0;
 		bufsize = 0;
+		highwater = 0;
+		capturesize = 0;
 		logdumpsrv = 0;
 		logdumpcli = 0;
 		intip = 0;
 		extip = 0;
-		InitializeCriticalSection(&counter_mutex);
 		// fds
 		stdlog = NULL;
 		srvfds = NULL;
@@ -296,13 +402,26 @@ public:
 		replace = 0;
 		time_start = (time_t)0;
 	}
+
+	// A place among the maxchild connections, taken before accepting one.
+	// It goes back with releaseChild, which ProxyWorker does when released.
+	bool reserveChild();
+	void releaseChild();
+
+	// Rather than polling while reserveChild fails, whoever is accepting
+	// waits to be admitted when a place is given back.  Returns false, and
+	// doesn't wait, if one was given back in the meantime.
+	bool waitForChild(Admittable * waiter);
+
 	virtual ~SRVPARAM() {
-		DeleteCriticalSection(&counter_mutex);
+		DeleteCriticalSection(&admissionMutex);
 	}
 };
 
 
-struct ProxyWorker {
+struct RequestContext;
+
+struct ProxyWorker : public ReactorHandler, public Resolution {
 	ProxyWorker * next;
 	ProxyWorker * prev;
 	SRVPARAM *srv;
@@ -339,32 +458,161 @@ struct ProxyWorker {
 	unsigned short extport;
 
 	time_t time_start;
+
+// What carries over from one request to the next on a kept alive connection.
+// (These used to be locals of proxychild.)
+private:
+	std::string lastRequest;
+	std::string lastRequestOriginal;
+	unsigned ckeepalive;
+	size_t prefix;
+	bool isconnect;
+	bool transparent;
+	bool redirect;
+	bool firstRequest;
+
+// Set when a response leaves the server connection fit to carry a request
+// from some other connection.  Whoever drops the connection hands it to
+// srv's origin pool instead of closing it.
+private:
+	bool serverReusable;
+
+// On an event loop, a name that isn't in the resolver's cache is waited for
+// like the network.  The address comes from the resolver's thread, and the
+// loop's thread picks it up when notified.
+private:
+	bool resolving;
+	unsigned long volatile resolvedAddress;
+
+// Whether the worker has a connection, and is counted in srv's childcount
+private:
+	bool active;
+
+// The request in progress.  It gets handled in stages, each of which is one
+// filtered proxy operation on the parasock, so that it can be suspended
+// whenever an operation has to wait on the network.  The context and its
+// filters are made in the arena, which is reset when the request is done.
+private:
+	Arena arena;
+	RequestContext * context;
+
 public:
 	ProxyWorker();
 
 	// review how initialization of defaults is done here
 	ProxyWorker(ProxyWorker const * other);
 
+	// Takes on the defaults for a new connection, as the constructor above
+	// does, for a worker that's been recycled
+	void setup(ProxyWorker const * other);
+
+	// A worker for a newly accepted connection, recycled if srv has one
+	// spare.  A place for it has to have been reserved with srv.
+	static ProxyWorker * forConnection(
+		ProxyWorker const * defaults,
+		SOCKET sock,
+		struct sockaddr_in const & peer
+	);
+
+	// Done with the connection.  Unless there's no srv (in which case it is
+	// deleted), the worker goes on srv's freelist to be set up again.
+	void recycle();
+
 private:
+	void release();
+	void resolveStage();
 	void connectToServer(const int operation);
 
-public:
+	// Connects before the header's in, once the context says the host is
+	// known and the resolver (if it was needed) is done
+	void beginEarlyConnect();
+	void poolServerConnection();
+
+	// Stages time out after the timeout without progress, or at the deadline
+	// (if not zero) regardless, or when the request is out of time
+	void proxyStage(
+		Filter * clientFilter,
+		Filter * serverFilter,
+		Timeout timeout,
+		time_t deadline = 0
+	);
+	void flushStage(Timeout timeout);
+	// Waits out a connect that's still going on the server socket
+	void connectStage(Timeout timeout);
+	// The filter has to have been made in the arena; NULL gets a DeadFilter
+	Filter * stageFilter(FlowDirection which, Filter * filter);
+	time_t stageDeadline(time_t deadline) const;
+
+	// Bring the loop's timer in line with the parasock's deadline
+	void updateDeadline();
+
 	// When this is called, requisite information must already be established
-	// (e.g. client socket)
-	bool handleIncomingRequest(
-		std::string &requestNonConst,
-		std::string &requestOriginalNonConst,
-		unsigned& ckeepalive,
-		size_t& prefix,
-		bool & isconnect,
-		bool & transparent,
-		bool & redirect,
-		std::string const lastRequest,
-		std::string const lastRequestOriginal
-	); 
+	// (e.g. client socket).  Returns true when the request is finished, and
+	// false if it's waiting on the network.
+	bool advanceRequest();
+	void finishRequest();
+
+	// If traffic is being captured, write it out for a post-mortem
+	void dumpCapture();
+
+public:
+	// Picks up where the request left off, given the readiness of the
+	// sockets.  Returns true if there's more to do once the parasock has
+	// something for it, and false when the connection is done with.
+	bool resumeRequest(short const (&revents)[FlowDirectionMax]);
+
+public:
+	void handleStart() /* override */;
+	void handleEvents(int which, short revents) /* override */;
+	void handleDeadline(time_t now) /* override */;
+	void handleRetired() /* override */;
+	void handleNotified() /* override */;
+
+	void resolved(unsigned long address) /* override */;
+
 	virtual ~ProxyWorker();
 };
 
+
+// Most connections taken off a listening socket at a time, so that a busy
+// listener doesn't keep everything else waiting
+#define ACCEPTBATCH 64
+
+// Accepts connections from an event loop, on a listening socket of the
+// loop's own where the system can spread them over several (SO_REUSEPORT),
+// and has each one handled by a ProxyWorker on the same loop.  While srv
+// has all the connections it allows, the acceptor takes itself off the
+// loop until it's admitted again.
+class ProxyAcceptor : public ReactorHandler, public Admittable {
+private:
+	ProxyWorker * defaults;
+	SOCKET sock;
+	ReactorWatch watch;
+	Reactor * reactor;
+	size_t home;
+
+public:
+	ProxyAcceptor (
+		ProxyWorker * defaults,
+		SOCKET sock,
+		Reactor * reactor,
+		size_t home
+	);
+
+private:
+	// Disable copying C++98 style
+	ProxyAcceptor (ProxyAcceptor const & other);
+
+public:
+	void handleStart() /* override */;
+	void handleEvents(int which, short revents) /* override */;
+	void handleDeadline(time_t now) /* override */;
+	void handleRetired() /* override */;
+	void admit() /* override */;
+
+	virtual ~ProxyAcceptor();
+};
+
 extern RESOLVFUNC resolvfunc;
 
 extern int wday;
@@ -386,11 +634,16 @@ void trafcountfunc(ProxyWorker *param);
 
 int scanaddr(char const *s, unsigned long * ip, unsigned long * mask);
 int myinet_ntoa(struct in_addr in, char * buf);
-extern unsigned long nservers[MAXNSERVERS];
+extern struct sockaddr_in nservers[MAXNSERVERS];
+extern Resolver * dnsresolver;
 unsigned long getip(char const *name);
-unsigned long myresolver(char *);
+unsigned long getnumericip(char const *name);
+unsigned long myresolver(char const *name);
 unsigned long fakeresolver (char *name);
-int initdnshashtable(unsigned nhashsize);
+
+// Starts dnsresolver on whichever nservers are set, and has resolvfunc use
+// it.  Nonzero if there are none or it can't be started.
+int initresolver(unsigned cachesize);
 
 int reload (void);
 extern int paused;
@@ -398,15 +651,19 @@ extern int paused;
 char * mycrypt(char const *key, char const *salt, char *buf);
 char * ntpwdhash (char *szHash, char const *szPassword, int tohex);
 
-struct hashtable;
-void hashadd(
-	struct hashtable *ht, char const* name, unsigned long value, time_t expires
+// Without resolve, the name is left for the request to look up later
+int parsehostname(
+	TextSpan const & hostname, ProxyWorker *param, unsigned short port,
+	bool resolve = true
+);
+int parsehostname(
+	std::string const & hostname, ProxyWorker *param, unsigned short port,
+	bool resolve = true
 );
-
-int parsehostname(std::string const hostname, ProxyWorker *param, unsigned short port);
 int parseusername(const  std::string & username, ProxyWorker *param, int extpasswd);
 int parseconnusername(
-	std::string const & username, ProxyWorker *param, int extpasswd, unsigned short port
+	std::string const & username, ProxyWorker *param, int extpasswd, unsigned short port,
+	bool resolve = true
 );
 
 void freeconf(EXTPARAM *confp);
@@ -415,8 +672,6 @@ void freeconf(EXTPARAM *confp);
 
 void * proxychild(ProxyWorker * proxy);
 
-extern struct hashtable dns_table;
-
 inline void debugInfoDetail(char const* message) {
 #if DEBUGLEVEL > 2
 	(*param->srv->logfunc)(param, message);
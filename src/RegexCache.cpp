@@ -0,0 +1,145 @@
+//
+// RegexCache.cpp
+//
+// Compiling and studying patterns for the cache.
+//
+
+#include <ctype.h>
+
+#include "RegexCache.h"
+#include "parasock/Helpers.h"
+
+RegexCache regexes;
+
+
+CompiledRegex::CompiledRegex (pcre * re, pcre_extra * extra) :
+	re (re),
+	extra (extra),
+	captures (0),
+	lookbehind (0)
+{
+	pcre_fullinfo(re, extra, PCRE_INFO_CAPTURECOUNT, &captures);
+	pcre_fullinfo(re, extra, PCRE_INFO_MAXLOOKBEHIND, &lookbehind);
+}
+
+
+int CompiledRegex::exec(
+	char const * subject,
+	int length,
+	int startOffset,
+	int options,
+	int * ovector,
+	int ovecsize
+) const {
+	return pcre_exec(
+		re, extra, subject, length, startOffset, options, ovector, ovecsize
+	);
+}
+
+
+CompiledRegex::~CompiledRegex() {
+	if (extra != NULL)
+		pcre_free_study(extra);
+	pcre_free(re);
+}
+
+
+void ReplaceTemplate::set(std::string const & replace) {
+	literals.clear();
+	segments.clear();
+	literals.reserve(replace.length());
+
+	size_t index = 0;
+	while (index < replace.length()) {
+		char c = replace[index];
+		if ((c == '$') && (index + 1 < replace.length()) && isdigit(
+			static_cast<unsigned char>(replace[index + 1])
+		)) {
+			int group = 0;
+			index++;
+			while (
+				(index < replace.length())
+				&& isdigit(static_cast<unsigned char>(replace[index]))
+			) {
+				group = (group < 10000) ? group * 10 + (replace[index] - '0') : group;
+				index++;
+			}
+			Segment segment = { group, 0, 0 };
+			segments.push_back(segment);
+			continue;
+		}
+
+		if ((c == '\\') && (index + 1 < replace.length())) {
+			index++;
+			c = replace[index];
+		}
+
+		// runs of literal text go in one segment
+		if (segments.empty() || (segments.back().group != -1)) {
+			Segment segment = { -1, literals.length(), 0 };
+			segments.push_back(segment);
+		}
+		literals += c;
+		segments.back().length++;
+		index++;
+	}
+}
+
+
+void ReplaceTemplate::appendTo(
+	std::string & out,
+	char const * subject,
+	int const * ovector,
+	int count
+) const {
+	for (size_t index = 0; index < segments.size(); index++) {
+		Segment const & segment = segments[index];
+		if (segment.group == -1) {
+			out.append(literals, segment.offset, segment.length);
+		} else if (
+			(segment.group < count)
+			&& (ovector[segment.group * 2] >= 0)
+		) {
+			out.append(
+				subject + ovector[segment.group * 2],
+				ovector[segment.group * 2 + 1] - ovector[segment.group * 2]
+			);
+		}
+	}
+}
+
+
+RegexCache::RegexCache () {
+}
+
+
+CompiledRegex const & RegexCache::get(std::string const & pattern, int options) {
+	Key key (pattern, options);
+
+	std::map<Key, CompiledRegex *>::iterator it = patterns.find(key);
+	if (it != patterns.end())
+		return *it->second;
+
+	char const * errptr = NULL;
+	int offset = 0;
+	pcre * re = pcre_compile(pattern.c_str(), options, &errptr, &offset, NULL);
+	if (re == NULL)
+		throw "Regular expression compilation error";
+
+	pcre_extra * extra = pcre_study(re, 0, &errptr);
+
+	CompiledRegex * compiled = new CompiledRegex (re, extra);
+	patterns[key] = compiled;
+	return *compiled;
+}
+
+
+RegexCache::~RegexCache() {
+	for (
+		std::map<Key, CompiledRegex *>::iterator it = patterns.begin();
+		it != patterns.end();
+		++it
+	) {
+		delete it->second;
+	}
+}
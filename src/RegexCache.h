@@ -0,0 +1,123 @@
+//
+// RegexCache.h
+//
+// Regular expressions compiled once for the whole process, and shared by
+// every filter that uses the same pattern.  Each is studied when it's
+// compiled, so the work of getting a pattern ready to match is done once
+// and not for every request.
+//
+// The cache is filled while the rules are loaded, before any connection
+// is taken, and isn't added to after that, so it has no lock.  A compiled
+// pattern never changes once it's in the cache, and the cache is never
+// emptied, so the handles it gives out can be kept and used from any
+// thread.
+//
+
+#ifndef __FLATWORM_REGEXCACHE_H__
+#define __FLATWORM_REGEXCACHE_H__
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "pcre/pcre.h"
+
+// pcre_exec's ovector for a match with its groups, which is room for 15
+#define REGEXOVECTOR 48
+
+class CompiledRegex {
+private:
+	pcre * re;
+	pcre_extra * extra; // NULL if studying found nothing worth keeping
+	int captures;
+	int lookbehind;
+
+	friend class RegexCache;
+
+private:
+	CompiledRegex (pcre * re, pcre_extra * extra);
+
+	// Disable copying C++98 style
+	CompiledRegex (CompiledRegex const & other);
+
+public:
+	// As pcre_exec, with the study data
+	int exec(
+		char const * subject,
+		int length,
+		int startOffset,
+		int options,
+		int * ovector,
+		int ovecsize
+	) const;
+
+	// Capturing subpatterns, not counting the whole match
+	int captureCount() const {
+		return captures;
+	}
+
+	// Most characters before a match that it looks at (one for \b)
+	int maxLookbehind() const {
+		return lookbehind;
+	}
+
+	~CompiledRegex();
+};
+
+
+// A replacement string, with its backslash escapes and $n references to
+// captured groups worked out ahead of time.  A reference to a group the
+// match didn't capture adds nothing.
+class ReplaceTemplate {
+private:
+	struct Segment {
+		int group; // or -1 for literal text
+		size_t offset; // into literals
+		size_t length;
+	};
+
+	std::string literals;
+	std::vector<Segment> segments;
+
+public:
+	ReplaceTemplate () {}
+
+	void set(std::string const & replace);
+
+	// count is what pcre_exec returned for the match
+	void appendTo(
+		std::string & out,
+		char const * subject,
+		int const * ovector,
+		int count
+	) const;
+
+};
+
+
+class RegexCache {
+private:
+	typedef std::pair<std::string, int> Key; // pattern and options
+
+	std::map<Key, CompiledRegex *> patterns;
+
+public:
+	RegexCache ();
+
+private:
+	// Disable copying C++98 style
+	RegexCache (RegexCache const & other);
+
+public:
+	// The pattern compiled with those options, which is done the first time
+	// it's asked for.  Throws if it doesn't compile.  Only to be called
+	// before the threads handling connections start.
+	CompiledRegex const & get(std::string const & pattern, int options = 0);
+
+	virtual ~RegexCache();
+};
+
+extern RegexCache regexes;
+
+#endif
@@ -99,18 +99,20 @@ public:
 		fulfillPlaceholder(placeholder, "");
 	}
 
-	void processTheLine(std::string const & line) /* override */
+	void processTheLine(InputSpan const & line) /* override */
 	{
-		request = line;
-		requestOriginal = line;
+		// Everything's found in place; the only copies made are the two
+		// strings kept, and the host name
+		TextSpan text (line.data(), line.length());
+		requestOriginal.assign(line.data(), line.length());
 
-		if (request.length() < 10) {
+		if (text.length < 10) {
 			throw "Insufficient character count in request from client";
 		}
-		if (!strncasecmplen(request, "CONNECT", 0, NULL)) {
+		if (text.beginsNoCase("connect")) {
 			isconnect = true;
 		}
-		size_t sb = request.find(' ');
+		size_t sb = text.find(' ');
 		if (sb == std::string::npos) {
 			throw "Can't find space in CONNECT string of request from client.";
 		}
@@ -118,25 +120,28 @@ public:
 		size_t se = std::string::npos;
 
 		if (!isconnect) {
-			if (!strncasecmplen(request, "http://", sb, &sb)) {
-				// nothing, just increment sb?
-			} else if (request[sb] == '/') {
+			if (TextSpan (text.data + sb, text.length - sb).beginsNoCase("http://")) {
+				sb += 7;
+			} else if (text.data[sb] == '/') {
 				transparent = true;
 			} else {
 				throw "Not an http address in request, we only do http.";
 			}
 		} else {
-			// we only damage string if IS CONNECT
-			se = request.find(' ', sb);
+			se = text.find(' ', sb);
 			if (se == std::string::npos || sb==se) {
 				throw "Malformed spaces in your request string";
 			}
 		}
 
+		if (transparent || isconnect) {
+			request.assign(line.data(), line.length());
+		}
+
 		if (!transparent) {
 			size_t sg = std::string::npos;
 			if (!isconnect) {
-				se = request.find('/', sb);
+				se = text.find('/', sb);
 				if (se == std::string::npos) {
 					throw "Second slash not found in request";
 				}
@@ -145,7 +150,7 @@ public:
 					// I have a hard time following 3Proxy's parsing logic :-/
 					throw "Second and first slash positions equal (how!?)";
 				}
-				sg = request.find(' ', sb);
+				sg = text.find(' ', sb);
 				if (sg == std::string::npos) {
 					throw "No space found in request string.";
 				}
@@ -153,37 +158,35 @@ public:
 					se = sg;
 			}
 			prefix = se; // we carry this around to the next cycle
-			if (request.find_last_of('@', sb) != std::string::npos) {
-				std::string su = request.substr(sb, se - sb);
+
+			// REVIEW: this looks for an @ up to the host, not in it, as the
+			// original did
+			if (memchr(text.data, '@', sb + 1) != NULL) {
+				std::string su (text.data + sb, se - sb);
 				decodeurl(su, 0);
-				parseconnusername(su, proxy, 1, 80);
+				parseconnusername(su, proxy, 1, 80, false);
 			} else {
-				std::string su = request.substr(sb, se - sb);
-				parsehostname(su, proxy, 80);
+				parsehostname(TextSpan (text.data + sb, se - sb), proxy, 80, false);
 			}
 			if (!isconnect) {
-				if (se==sg)
-					request[se--] = ' ';
-				request[se] = '/';
-
-				std::string replString = request.substr(
-					se, request.length() - (se - sb)
-				);
-				
-				request.resize(ss);
-				request += replString;
+				// the method and the path, with "/" for none
+				request.reserve(text.length - (se - ss) + 1);
+				request.assign(text.data, ss);
+				if (se == sg)
+					request += '/';
+				request.append(text.data + se, text.length - se);
 			}
 		}
 
-		if (!strncasecmplen(request, "CONNECT", 0, NULL))
+		if (text.beginsNoCase("connect"))
 			operation = HTTP_CONNECT;
-		else if (!strncasecmplen(request, "GET", 0, NULL))
+		else if (text.beginsNoCase("get"))
 			operation = HTTP_GET;
-		else if (!strncasecmplen(request, "PUT", 0, NULL))
+		else if (text.beginsNoCase("put"))
 			operation = HTTP_PUT;
-		else if (!strncasecmplen(request, "POST", 0, NULL))
+		else if (text.beginsNoCase("post"))
 			operation = HTTP_POST;
-		else if (!strncasecmplen(request, "HEAD", 0, NULL))
+		else if (text.beginsNoCase("head"))
 			operation = HTTP_HEAD;
 		else
 			operation = HTTP_OTHER;
@@ -22,22 +22,27 @@ public:
 	// http://www.w3.org/Protocols/rfc2616/rfc2616-sec10.html
 	int httpStatusCode; 
 
+	// HTTP/1.1 servers keep the connection open unless they say otherwise
+	bool persistentByDefault;
+
 public:
 	ResponseLineFilter (Parasock & parasock, FlowDirection whichInput) : 
 		OneLineFilter (parasock, whichInput),
-		httpStatusCode (0)
+		httpStatusCode (0),
+		persistentByDefault (false)
 	{
 	}
 
-	void processTheLine(std::string const & line) /* override */
+	void processTheLine(InputSpan const & line) /* override */
 	{
 		if (line.length() <= 9) {
 			throw "Too few chars in response for HTTP version and code.";
 		}
 
-		response = line;
+		response.assign(line.data(), line.length());
 
 		httpStatusCode = atoi(response.c_str() + 9);
+		persistentByDefault = (response.compare(0, 8, "HTTP/1.0") != 0);
 
 		outputString(response);
 	}
@@ -0,0 +1,629 @@
+//
+// RuleSet.cpp
+//
+// The literal prefilter, finding the literal in a pattern, and making the
+// substitutions for a set of rules.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+#include "RuleSet.h"
+#include "parasock/Helpers.h"
+
+// Longest line in a rules file
+#define RULESETLINE 4096
+
+
+static inline unsigned char LowerByte(unsigned char c) {
+	return ((c >= 'A') && (c <= 'Z')) ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+}
+
+
+LiteralMatcher::LiteralMatcher () :
+	classCount (1)
+{
+	memset(classOf, 0, sizeof(classOf));
+	trie.push_back(Node ());
+}
+
+
+int LiteralMatcher::add(std::string const & literal) {
+	Assert(!literal.empty());
+	Assert(!trie.empty()); // not after compiling
+
+	int state = 0;
+	for (size_t index = 0; index < literal.length(); index++) {
+		unsigned char c = LowerByte(static_cast<unsigned char>(literal[index]));
+		int child = -1;
+		std::vector<std::pair<unsigned char, int> > const & children =
+			trie[state].children;
+		for (size_t which = 0; which < children.size(); which++) {
+			if (children[which].first == c) {
+				child = children[which].second;
+				break;
+			}
+		}
+		if (child == -1) {
+			child = static_cast<int>(trie.size());
+			trie.push_back(Node ());
+			trie[state].children.push_back(std::make_pair(c, child));
+		}
+		state = child;
+	}
+
+	int id = static_cast<int>(lengths.size());
+	lengths.push_back(literal.length());
+	trie[state].ends.push_back(id);
+	return id;
+}
+
+
+void LiteralMatcher::compile() {
+	memset(classOf, 0, sizeof(classOf));
+	classCount = 1;
+	for (size_t state = 0; state < trie.size(); state++) {
+		for (size_t which = 0; which < trie[state].children.size(); which++) {
+			unsigned char c = trie[state].children[which].first;
+			if (classOf[c] == 0)
+				classOf[c] = static_cast<unsigned char>(classCount++);
+		}
+	}
+	for (int c = 'A'; c <= 'Z'; c++) {
+		classOf[c] = classOf[c + ('a' - 'A')];
+	}
+
+	// Breadth first, so a state's failure link (which is always shallower)
+	// has its transitions and outputs done before the state's are
+	size_t states = trie.size();
+	transitions.assign(states * classCount, 0);
+	std::vector<int> failure (states, 0);
+	std::vector<std::vector<int> > matched (states);
+	std::vector<int> queue;
+	queue.reserve(states);
+
+	for (size_t which = 0; which < trie[0].children.size(); which++) {
+		int child = trie[0].children[which].second;
+		transitions[classOf[trie[0].children[which].first]] = child;
+		queue.push_back(child);
+	}
+	for (size_t next = 0; next < queue.size(); next++) {
+		int state = queue[next];
+		int fail = failure[state];
+
+		matched[state] = trie[state].ends;
+		matched[state].insert(
+			matched[state].end(), matched[fail].begin(), matched[fail].end()
+		);
+
+		std::copy(
+			transitions.begin() + fail * classCount,
+			transitions.begin() + (fail + 1) * classCount,
+			transitions.begin() + state * classCount
+		);
+		for (size_t which = 0; which < trie[state].children.size(); which++) {
+			size_t c = classOf[trie[state].children[which].first];
+			int child = trie[state].children[which].second;
+			failure[child] = transitions[fail * classCount + c];
+			transitions[state * classCount + c] = child;
+			queue.push_back(child);
+		}
+	}
+
+	outputStart.assign(states + 1, 0);
+	outputs.clear();
+	for (size_t state = 0; state < states; state++) {
+		outputStart[state] = static_cast<int>(outputs.size());
+		outputs.insert(outputs.end(), matched[state].begin(), matched[state].end());
+	}
+	outputStart[states] = static_cast<int>(outputs.size());
+
+	std::vector<Node> ().swap(trie);
+}
+
+
+void LiteralMatcher::scan(
+	char const * text,
+	size_t length,
+	size_t offset,
+	std::vector<Found> & found
+) const {
+	int state = 0;
+	for (size_t index = 0; index < length; index++) {
+		state = transitions[
+			state * classCount + classOf[static_cast<unsigned char>(text[index])]
+		];
+		for (int output = outputStart[state]; output < outputStart[state + 1]; output++) {
+			Found literal = { offset + index + 1, outputs[output] };
+			found.push_back(literal);
+		}
+	}
+}
+
+
+//
+// Finding a pattern's literal
+//
+
+// A | outside of any group means a match needn't contain anything in
+// particular from the front
+static bool HasTopLevelAlternation(std::string const & pattern) {
+	int depth = 0;
+	for (size_t index = 0; index < pattern.length(); index++) {
+		char c = pattern[index];
+		if (c == '\\') {
+			index++;
+		} else if (c == '[') {
+			index++;
+			if ((index < pattern.length()) && (pattern[index] == '^'))
+				index++;
+			if ((index < pattern.length()) && (pattern[index] == ']'))
+				index++;
+			while ((index < pattern.length()) && (pattern[index] != ']')) {
+				if (pattern[index] == '\\')
+					index++;
+				index++;
+			}
+		} else if (c == '(') {
+			depth++;
+		} else if (c == ')') {
+			depth--;
+		} else if ((c == '|') && (depth == 0)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+bool RuleSet::requiredLiteral(
+	std::string const & pattern,
+	std::string & literal,
+	size_t & offset
+) {
+	enum ItemKind {
+		ItemChar, // one character, which is ch
+		ItemOne, // one character, could be any of several
+		ItemZero, // an assertion like \b, which doesn't move along
+		ItemStop // anything else, which ends the search
+	};
+
+	literal.clear();
+	offset = 0;
+	if (HasTopLevelAlternation(pattern))
+		return false;
+
+	size_t length = pattern.length();
+	size_t index = 0;
+
+	// options set at the front don't matter, except extended syntax
+	if (pattern.compare(0, 2, "(?") == 0) {
+		size_t close = 2;
+		while ((close < length) && strchr("imsJU-", pattern[close])) {
+			close++;
+		}
+		if ((close < length) && (pattern[close] == ')'))
+			index = close + 1;
+	}
+
+	std::string run;
+	size_t runOffset = 0;
+	size_t width = 0; // of the match up to here
+	bool more = true;
+
+	while (more && (index < length)) {
+		char c = pattern[index];
+		ItemKind kind = ItemStop;
+		char ch = 0;
+		size_t next = index + 1;
+
+		if (c == '\\') {
+			if (index + 1 < length) {
+				char escaped = pattern[index + 1];
+				next = index + 2;
+				if (strchr("bBAG", escaped)) {
+					kind = ItemZero;
+				} else if (strchr("dDwWsShHvV", escaped)) {
+					kind = ItemOne;
+				} else if (strchr("tnrfea", escaped)) {
+					kind = ItemChar;
+					ch = "\t\n\r\f\x1b\x07"[strchr("tnrfea", escaped) - "tnrfea"];
+				} else if (!isalnum(static_cast<unsigned char>(escaped))) {
+					kind = ItemChar;
+					ch = escaped;
+				}
+			}
+		} else if (c == '[') {
+			size_t end = index + 1;
+			bool negated = (end < length) && (pattern[end] == '^');
+			if (negated)
+				end++;
+			size_t first = end;
+			if ((end < length) && (pattern[end] == ']'))
+				end++;
+			while ((end < length) && (pattern[end] != ']')) {
+				if (pattern[end] == '\\') {
+					end += 2;
+				} else if ((pattern[end] == '[') && (end + 1 < length) && (pattern[end + 1] == ':')) {
+					size_t close = pattern.find(":]", end + 2);
+					end = (close == std::string::npos) ? length : close + 2;
+				} else {
+					end++;
+				}
+			}
+			if (end < length) {
+				next = end + 1;
+				std::string members = pattern.substr(first, end - first);
+				kind = ItemOne;
+				if (!negated && (members.length() == 1) && (members[0] != '\\')) {
+					kind = ItemChar;
+					ch = members[0];
+				} else if (
+					!negated
+					&& (members.length() == 2)
+					&& isalpha(static_cast<unsigned char>(members[0]))
+					&& (members[0] != members[1])
+					&& (LowerByte(members[0]) == LowerByte(members[1]))
+				) {
+					// [Tt], which the matcher treats the same as t
+					kind = ItemChar;
+					ch = members[0];
+				}
+			}
+		} else if (c == '.') {
+			kind = ItemOne;
+		} else if (c == '^') {
+			kind = ItemZero;
+		} else if (!strchr("$|()*+?{", c)) {
+			kind = ItemChar;
+			ch = c;
+		}
+
+		if (kind == ItemStop)
+			break;
+
+		// A quantifier means what follows is at no fixed place, but a +
+		// still leaves one of the character where it is
+		if ((next < length) && strchr("?*+{", pattern[next])) {
+			more = false;
+			if ((kind == ItemChar) && (pattern[next] == '+')) {
+				if (run.empty())
+					runOffset = width;
+				run += static_cast<char>(LowerByte(ch));
+			}
+			break;
+		}
+
+		if (kind == ItemChar) {
+			if (run.empty())
+				runOffset = width;
+			run += static_cast<char>(LowerByte(ch));
+			width++;
+		} else if (kind == ItemOne) {
+			if (run.length() > literal.length()) {
+				literal = run;
+				offset = runOffset;
+			}
+			run.clear();
+			width++;
+		}
+		index = next;
+	}
+
+	if (run.length() > literal.length()) {
+		literal = run;
+		offset = runOffset;
+	}
+	return !literal.empty();
+}
+
+
+//
+// The set
+//
+
+RuleSet::RuleSet () :
+	literalReach (0),
+	lookbehind (0)
+{
+}
+
+
+void RuleSet::add(std::string const & pattern, std::string const & replace) {
+	Rule rule;
+	rule.pattern = &regexes.get(pattern);
+	rule.replace.set(replace);
+	rule.literal = -1;
+	rule.literalOffset = 0;
+
+	std::string literal;
+	size_t offset;
+	if (requiredLiteral(pattern, literal, offset)) {
+		rule.literal = literals.add(literal);
+		rule.literalOffset = offset;
+		literalRules.push_back(rules.size());
+	}
+	rules.push_back(rule);
+}
+
+
+void RuleSet::compile() {
+	unfiltered.clear();
+	literalReach = 0;
+	lookbehind = 0;
+	for (size_t index = 0; index < rules.size(); index++) {
+		Rule const & rule = rules[index];
+		if (rule.literal == -1) {
+			unfiltered.push_back(index);
+		} else {
+			literalReach = std::max(
+				literalReach,
+				rule.literalOffset + literals.length(rule.literal) - 1
+			);
+		}
+		lookbehind = std::max(
+			lookbehind,
+			static_cast<size_t>(rule.pattern->maxLookbehind())
+		);
+	}
+	literals.compile();
+}
+
+
+bool RuleSet::load(char const * filename, std::string & error) {
+	FILE * file = fopen(filename, "r");
+	if (file == NULL) {
+		error = "could not open the file";
+		return false;
+	}
+
+	char buf[RULESETLINE];
+	unsigned lineNumber = 0;
+	char const * complaint = NULL;
+
+	while ((complaint == NULL) && fgets(buf, sizeof(buf), file)) {
+		lineNumber++;
+		size_t length = strlen(buf);
+		if ((length == sizeof(buf) - 1) && (buf[length - 1] != '\n')) {
+			complaint = "line too long";
+			break;
+		}
+		while ((length > 0) && ((buf[length - 1] == '\n') || (buf[length - 1] == '\r'))) {
+			buf[--length] = '\0';
+		}
+		if ((length == 0) || (buf[0] == '#'))
+			continue;
+
+		char * tab = strchr(buf, '\t');
+		if ((tab == NULL) || (tab == buf)) {
+			complaint = "expected a pattern, a tab, and the replacement";
+			continue;
+		}
+		std::string pattern (buf, tab - buf);
+		while (*tab == '\t') {
+			tab++;
+		}
+
+		try {
+			add(pattern, tab);
+		} catch (char const * message) {
+			complaint = message;
+		}
+	}
+	fclose(file);
+
+	if (complaint != NULL) {
+		char problem[64];
+		sprintf(problem, "line %u: ", lineNumber);
+		error = std::string (problem) + complaint;
+		return false;
+	}
+
+	compile();
+	return true;
+}
+
+
+size_t RuleSet::substitute(
+	std::string & out,
+	char const * subject,
+	size_t length,
+	size_t & context,
+	bool final,
+	RuleScratch & scratch
+) const {
+	size_t before = out.length();
+	size_t contextBefore = context;
+	size_t commit = substituteOnce(
+		out, subject, length, context, final, !final, scratch
+	);
+
+	if (!final && (length - commit > REGEXMAXPENDING)) {
+		// A partial match is holding back too much.  Only whole matches
+		// are looked for in this piece instead, and it's let go.
+		out.resize(before);
+		context = contextBefore;
+		commit = substituteOnce(
+			out, subject, length, context, final, false, scratch
+		);
+	}
+	return commit;
+}
+
+
+size_t RuleSet::substituteOnce(
+	std::string & out,
+	char const * subject,
+	size_t length,
+	size_t & context,
+	bool final,
+	bool partial,
+	RuleScratch & scratch
+) const {
+	Assert(context <= length);
+	size_t copied = context; // subject up to here is in out already
+	size_t position = context;
+	int options = partial ? PCRE_PARTIAL_HARD : 0;
+
+	// Nothing can be decided from here on, which a literal might not all
+	// be in yet (until it's final) or a partial match might start at
+	size_t limit = length;
+	if (!final) {
+		limit = (length - position > literalReach) ? length - literalReach : position;
+	}
+
+	// Where each literal rule might match, in order
+	std::vector<RuleCandidate> & candidates = scratch.candidates;
+	candidates.clear();
+	if (!literals.empty()) {
+		std::vector<LiteralMatcher::Found> & found = scratch.found;
+		found.clear();
+		literals.scan(subject + position, length - position, position, found);
+		for (size_t index = 0; index < found.size(); index++) {
+			size_t rule = literalRules[found[index].id];
+			size_t literalStart = found[index].end - literals.length(found[index].id);
+			if (literalStart >= position + rules[rule].literalOffset) {
+				RuleCandidate candidate = {
+					literalStart - rules[rule].literalOffset, rule
+				};
+				candidates.push_back(candidate);
+			}
+		}
+		std::sort(candidates.begin(), candidates.end());
+	}
+
+	std::vector<RuleUpcoming> & upcoming = scratch.upcoming;
+	upcoming.resize(unfiltered.size());
+	for (size_t index = 0; index < upcoming.size(); index++) {
+		upcoming[index].known = false;
+	}
+	std::vector<int> & upcomingOvector = scratch.upcomingOvector;
+	upcomingOvector.resize(unfiltered.size() * REGEXOVECTOR);
+
+	out.reserve(out.length() + length - context);
+	int ovector[REGEXOVECTOR];
+	size_t nextCandidate = 0;
+	while (position <= length) {
+		size_t bestStart = std::string::npos;
+		size_t bestEnd = 0;
+		size_t bestRule = std::string::npos;
+		int const * bestOvector = NULL;
+		int bestCount = 0;
+
+		// the first place a literal rule really matches
+		while (nextCandidate < candidates.size()) {
+			RuleCandidate const & candidate = candidates[nextCandidate];
+			if (candidate.start < position) {
+				nextCandidate++;
+				continue;
+			}
+			if (candidate.start >= limit)
+				break;
+
+			int count = rules[candidate.rule].pattern->exec(
+				subject,
+				static_cast<int>(length),
+				static_cast<int>(candidate.start),
+				PCRE_ANCHORED | options,
+				ovector,
+				REGEXOVECTOR
+			);
+			if (count == PCRE_ERROR_PARTIAL) {
+				limit = candidate.start;
+				break;
+			}
+			if (count < 0) {
+				nextCandidate++;
+				continue;
+			}
+
+			bestStart = candidate.start;
+			bestEnd = static_cast<size_t>(ovector[1]);
+			bestRule = candidate.rule;
+			bestOvector = ovector;
+			bestCount = (count == 0) ? REGEXOVECTOR / 3 : count;
+			break;
+		}
+
+		// and the first match of each of the others, if it's before that
+		for (size_t index = 0; index < unfiltered.size(); index++) {
+			RuleUpcoming & next = upcoming[index];
+			int * nextOvector = &upcomingOvector[index * REGEXOVECTOR];
+			if (!next.known || ((next.start != std::string::npos) && (next.start < position))) {
+				int count = rules[unfiltered[index]].pattern->exec(
+					subject,
+					static_cast<int>(length),
+					static_cast<int>(position),
+					options,
+					nextOvector,
+					REGEXOVECTOR
+				);
+				next.known = true;
+				next.partial = (count == PCRE_ERROR_PARTIAL);
+				if (next.partial) {
+					next.start = static_cast<size_t>(nextOvector[2]);
+				} else if (count < 0) {
+					next.start = std::string::npos;
+				} else {
+					next.start = static_cast<size_t>(nextOvector[0]);
+					next.end = static_cast<size_t>(nextOvector[1]);
+					next.count = (count == 0) ? REGEXOVECTOR / 3 : count;
+				}
+			}
+
+			if (next.start == std::string::npos)
+				continue;
+			if (next.partial) {
+				limit = std::min(limit, next.start);
+				continue;
+			}
+			size_t rule = unfiltered[index];
+			if ((next.start < bestStart) || ((next.start == bestStart) && (rule < bestRule))) {
+				bestStart = next.start;
+				bestEnd = next.end;
+				bestRule = rule;
+				bestOvector = nextOvector;
+				bestCount = next.count;
+			}
+		}
+
+		// (an empty match at the very end is only made once it's final, or
+		// the next piece would find it again)
+		if (
+			(bestRule == std::string::npos)
+			|| (bestStart > limit)
+			|| ((bestStart == limit) && !final)
+		) {
+			break;
+		}
+
+		out.append(subject + copied, bestStart - copied);
+		rules[bestRule].replace.appendTo(out, subject, bestOvector, bestCount);
+		copied = bestEnd;
+		position = bestEnd;
+
+		// an empty match would be found again at the same place
+		if (bestEnd == bestStart) {
+			if (bestEnd < length) {
+				out += subject[bestEnd];
+				copied = bestEnd + 1;
+			}
+			position = bestEnd + 1;
+		}
+	}
+
+	if (final) {
+		out.append(subject + copied, length - copied);
+		context = 0;
+		return length;
+	}
+
+	// Nothing before the limit could start a match, so it can go out; the
+	// rest waits for the next piece, after what it needs to look behind
+	size_t held = std::max(limit, copied);
+	out.append(subject + copied, held - copied);
+	context = std::min(held, lookbehind);
+	return held - context;
+}
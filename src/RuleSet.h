@@ -0,0 +1,221 @@
+//
+// RuleSet.h
+//
+// Any number of regular expression substitutions, made together in one
+// pass over a body.  Where two rules match, the one whose match starts
+// first wins, and the one that comes first in the set if they start at the
+// same place.  Nothing a rule puts in is matched again.
+//
+// Running every pattern over every byte would make each rule cost as much
+// as the whole set did, so most rules are never run over the body at all.
+// The literal text each pattern has to match (the "the" in \b[Tt]he\b) is
+// worked out when it's added, and all of those are looked for at once with
+// an Aho-Corasick automaton.  A rule's pattern is only run, anchored, where
+// its literal turns up.  That needs the literal to be a fixed distance into
+// the match, so it's taken from the front of the pattern, up to the first
+// thing that isn't one character wide (a group, a quantifier, and so on).
+// A rule where no such literal can be found is matched the plain way, over
+// the whole body, so those are best kept few.
+//
+// Bodies come in pieces, and partial matching (PCRE_PARTIAL_HARD) finds
+// where a match might be running past the end of one.  Everything from
+// there on is held back, to be looked at again with the next piece, and
+// so is anything a literal might have started in.  What's held back is
+// limited to REGEXMAXPENDING, and a match longer than that which runs
+// across the end of a piece is missed.
+//
+// The rules file has a rule on each line, the pattern and replacement
+// separated by a tab.  The replacement can use $1 and so on for groups,
+// and a backslash to take the next character as it is.  Lines starting
+// with # are comments.
+//
+
+#ifndef __FLATWORM_RULESET_H__
+#define __FLATWORM_RULESET_H__
+
+#include <string>
+#include <vector>
+
+#include "RegexCache.h"
+
+// Most of a stream held back, waiting to see whether a match that started in
+// it carries on into the next piece
+#define REGEXMAXPENDING 16384
+
+
+// Finds every occurrence of any of a set of strings, ignoring ASCII case,
+// in one pass
+class LiteralMatcher {
+private:
+	struct Node {
+		std::vector<std::pair<unsigned char, int> > children;
+		std::vector<int> ends; // ids of the literals ending here
+	};
+
+	std::vector<Node> trie; // only while literals are being added
+	std::vector<size_t> lengths; // of each literal, by id
+
+	// Bytes that don't appear in any literal all share class zero, which
+	// keeps the table small
+	unsigned char classOf[256];
+	size_t classCount;
+
+	// The next state for each state and class of byte, with the failure
+	// links already followed
+	std::vector<int> transitions;
+
+	// The ids matched on reaching each state, including those from
+	// suffixes: outputs[outputStart[state]] up to outputStart[state + 1]
+	std::vector<int> outputStart;
+	std::vector<int> outputs;
+
+public:
+	struct Found {
+		size_t end; // just past the literal
+		int id;
+	};
+
+	LiteralMatcher ();
+
+	// The id is the literal's place in the order they were added
+	int add(std::string const & literal);
+
+	// Builds the automaton, once all the literals are in
+	void compile();
+
+	bool empty() const {
+		return lengths.empty();
+	}
+
+	size_t length(int id) const {
+		return lengths[id];
+	}
+
+	// In the order they end; offset is added to every end
+	void scan(
+		char const * text,
+		size_t length,
+		size_t offset,
+		std::vector<Found> & found
+	) const;
+};
+
+
+// Where a literal rule might match, from where its literal was found
+struct RuleCandidate {
+	size_t start;
+	size_t rule;
+
+	bool operator<(RuleCandidate const & other) const {
+		return (start < other.start)
+			|| ((start == other.start) && (rule < other.rule));
+	}
+};
+
+// The next match (or partial match) of a rule with no literal, from
+// wherever it was last looked for
+struct RuleUpcoming {
+	bool known;
+	bool partial;
+	size_t start; // npos for none
+	size_t end;
+	int count;
+};
+
+// What substituting works with along the way.  A set of rules is shared by
+// every stream, so each stream keeps one of these to hand it, and the
+// vectors keep their memory from one piece to the next.
+class RuleScratch {
+private:
+	std::vector<LiteralMatcher::Found> found;
+	std::vector<RuleCandidate> candidates;
+	std::vector<RuleUpcoming> upcoming;
+	std::vector<int> upcomingOvector;
+
+	friend class RuleSet;
+
+public:
+	RuleScratch () {}
+};
+
+
+class RuleSet {
+private:
+	struct Rule {
+		CompiledRegex const * pattern;
+		ReplaceTemplate replace;
+		int literal; // -1 if it has to be matched everywhere
+		size_t literalOffset; // from the start of any match
+	};
+
+	std::vector<Rule> rules;
+	std::vector<size_t> unfiltered; // the rules with no literal
+
+	LiteralMatcher literals;
+	std::vector<size_t> literalRules; // the rule for each literal's id
+
+	// The most at the end of a piece that a literal rule's match could
+	// start in without its literal being all there yet
+	size_t literalReach;
+
+	size_t lookbehind; // the most any pattern has
+
+public:
+	RuleSet ();
+
+private:
+	// Disable copying C++98 style
+	RuleSet (RuleSet const & other);
+
+public:
+	// Throws if the pattern doesn't compile.  Nothing is used until the
+	// set is compiled.
+	void add(std::string const & pattern, std::string const & replace);
+	void compile();
+
+	// Adds (and compiles) the rules in a file.  False with a message saying
+	// what was wrong, if something was.
+	bool load(char const * filename, std::string & error);
+
+	bool empty() const {
+		return rules.empty();
+	}
+
+	// Every match replaced, with the result appended to out.
+	//
+	// Unless it's final, the subject is a piece of a stream that goes on
+	// after it.  What might be the start of a match running on past the end
+	// isn't output, and neither is anything after it; nor is the context at
+	// the front, which a previous call already did.  Returns how much of
+	// the front the next piece needn't start with, and sets context to how
+	// much of what it should start with is just there to be looked behind.
+	size_t substitute(
+		std::string & out,
+		char const * subject,
+		size_t length,
+		size_t & context,
+		bool final,
+		RuleScratch & scratch
+	) const;
+
+private:
+	size_t substituteOnce(
+		std::string & out,
+		char const * subject,
+		size_t length,
+		size_t & context,
+		bool final,
+		bool partial,
+		RuleScratch & scratch
+	) const;
+
+	// Where in a match the literal is to be found, if there's one the
+	// matcher can look for
+	static bool requiredLiteral(
+		std::string const & pattern,
+		std::string & literal,
+		size_t & offset
+	);
+};
+
+#endif
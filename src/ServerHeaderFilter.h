@@ -14,45 +14,66 @@
 class ServerHeaderFilter : public HeaderFilter {
 private:
 	bool redirect;
+	HeaderRuleTable const * rules;
 
 public:
 	bool authenticate;
 
+	// What the server's own Connection header says about the connection
+	// to it, as opposed to what it says for the client's benefit
+	bool connectionClose;
+	bool connectionKeepAlive;
+
+	// As the server sent them, for choosing what to do with the body
+	std::string contentType;
+	std::string contentEncoding;
+
 public:
 	ServerHeaderFilter (
 		Parasock & parasock,
 		FlowDirection whichInput,
 		bool isconnect,
-		bool redirect
+		bool redirect,
+		HeaderRuleTable const * rules
 	) : 
 		HeaderFilter (parasock, whichInput, isconnect),
 		redirect (redirect),
-		authenticate (false)
+		rules (rules),
+		authenticate (false),
+		connectionClose (false),
+		connectionKeepAlive (false)
 	{
 	}
 
+	HeaderRuleTable const * rulesFor(HeaderBlock const & block) /* override */ {
+		return rules;
+	}
+
 	void processHeaderLine(
 		std::string & header,
-		std::string const key,
-		std::string const value
+		HeaderLine const & line
 	) /* override */ {
-		size_t sb = 0;
-		if (!strncasecmplen(key, "proxy-", 0, NULL)) {
+		if (line.key.beginsNoCase("proxy-")) {
 
-		} else if (!strncasecmplen(key, "www-authenticate", 0, NULL)) {
+		} else if (line.name == HeaderWwwAuthenticate) {
 
 			authenticate = true;
-			header += key;
-			header += ": ";
-			header += value;
-			header += "\r\n";
+			line.appendTo(header);
 
 		} else {
 
-			header += key;
-			header += ": ";
-			header += value;
-			header += "\r\n";
+			if (line.name == HeaderConnection) {
+				if (line.value.beginsNoCase("close"))
+					connectionClose = true;
+				else if (line.value.beginsNoCase("keep-alive"))
+					connectionKeepAlive = true;
+			} else if (line.name == HeaderContentType) {
+				contentType = line.value.str();
+			} else if (line.name == HeaderContentEncoding) {
+				contentEncoding = line.value.str();
+			}
+
+			line.appendTo(header);
 		}
 	}
 
@@ -8,6 +8,7 @@
 
 #include <string>
 #include <sstream>
+#include <string.h>
 
 #include "base64.h"
 
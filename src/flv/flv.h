@@ -12,7 +12,11 @@
 // 0x2C0x01; as a UI16 in FLV file format, the byte sequence that represents the number300 is 
 // 0x010x2C. Also, FLV files use a 3-byte integer type, UI24, that is not used in SWF files.
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+typedef unsigned char BYTE;
+#endif
 
 typedef BYTE uint32_be[4];
 typedef BYTE uint24_be[3];
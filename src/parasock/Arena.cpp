@@ -0,0 +1,84 @@
+//
+// Arena.cpp
+//
+// Monotonic allocation for objects that share a lifetime, see Arena.h
+//
+
+#include "Arena.h"
+
+// Chunks start with their header, and the allocations come after
+#define CHUNKHEADER \
+	((sizeof(Chunk) + ARENAALIGN - 1) & ~static_cast<size_t>(ARENAALIGN - 1))
+
+
+Arena::Arena () :
+	chunks (NULL),
+	spares (NULL),
+	position (NULL),
+	limit (NULL),
+	cleanups (NULL)
+{
+}
+
+
+void * Arena::allocateSlow(size_t size) {
+	Chunk * chunk;
+	if ((spares != NULL) && (size <= ARENACHUNK - CHUNKHEADER)) {
+		chunk = spares;
+		spares = spares->next;
+	} else {
+		// big allocations get a chunk to themselves
+		size_t chunkSize = CHUNKHEADER + size;
+		if (chunkSize < ARENACHUNK)
+			chunkSize = ARENACHUNK;
+		chunk = static_cast<Chunk *>(::operator new(chunkSize));
+		chunk->size = chunkSize;
+	}
+
+	chunk->next = chunks;
+	chunks = chunk;
+	position = reinterpret_cast<char *>(chunk) + CHUNKHEADER;
+	limit = reinterpret_cast<char *>(chunk) + chunk->size;
+
+	void * result = position;
+	position += size;
+	return result;
+}
+
+
+void Arena::reset() {
+	while (cleanups != NULL) {
+		// a destructor could conceivably allocate, so unhook it first
+		Cleanup * cleanup = cleanups;
+		cleanups = cleanup->next;
+		cleanup->destroy(cleanup->object);
+	}
+
+	size_t kept = 0;
+	for (Chunk * spare = spares; spare != NULL; spare = spare->next)
+		kept++;
+
+	while (chunks != NULL) {
+		Chunk * chunk = chunks;
+		chunks = chunk->next;
+		if ((chunk->size == ARENACHUNK) && (kept < ARENAKEEPCHUNKS)) {
+			chunk->next = spares;
+			spares = chunk;
+			kept++;
+		} else {
+			::operator delete(chunk);
+		}
+	}
+
+	position = limit = NULL;
+}
+
+
+Arena::~Arena() {
+	reset();
+	while (spares != NULL) {
+		Chunk * spare = spares;
+		spares = spare->next;
+		::operator delete(spare);
+	}
+}
@@ -0,0 +1,108 @@
+//
+// Arena.h
+//
+// Memory for things that all go away at the same moment, like the filters
+// and bookkeeping of one HTTP request.  Allocation just moves a pointer
+// along a chunk, and there is no freeing things one at a time: reset()
+// destroys everything at once and rewinds, keeping the chunks to be used
+// again.  So once a connection has handled a request or two, the next ones
+// on it get their objects without going to the heap.
+//
+// Objects are made with placement new and handed to own(), which arranges
+// for their destructors to be run (last made, first destroyed) on reset:
+//
+//     Foo * foo = arena.own(new (arena) Foo (bar, baz));
+//
+
+#ifndef __PARASOCK_ARENA_H__
+#define __PARASOCK_ARENA_H__
+
+#include <stddef.h>
+#include <new>
+
+#include "Helpers.h"
+
+// Size of each chunk, which covers the objects of a typical request
+#define ARENACHUNK 8192
+
+// How many chunks are held onto over a reset; one pathological request
+// shouldn't leave the connection sitting on its memory for good
+#define ARENAKEEPCHUNKS 4
+
+
+class Arena {
+public:
+	// Alignment of everything allocated, as for malloc
+	enum {
+		ARENAALIGN = 2 * sizeof(void *)
+	};
+
+private:
+	struct Chunk {
+		Chunk * next;
+		size_t size;
+	};
+
+	struct Cleanup {
+		Cleanup * next;
+		void (*destroy)(void * object);
+		void * object;
+	};
+
+	template <class T> static void Destroy(void * object) {
+		static_cast<T *>(object)->~T();
+	}
+
+	Chunk * chunks; // the one being allocated from is first
+	Chunk * spares;
+	char * position;
+	char * limit;
+	Cleanup * cleanups;
+
+private:
+	void * allocateSlow(size_t size);
+
+public:
+	Arena ();
+
+private:
+	// Disable copying C++98 style
+	Arena (Arena const & other);
+
+public:
+	// Good until the next reset
+	void * allocate(size_t size) {
+		size = (size + ARENAALIGN - 1) & ~static_cast<size_t>(ARENAALIGN - 1);
+		if (static_cast<size_t>(limit - position) < size)
+			return allocateSlow(size);
+		void * result = position;
+		position += size;
+		return result;
+	}
+
+	template <class T> T * own(T * object) {
+		Cleanup * cleanup = static_cast<Cleanup *>(allocate(sizeof(Cleanup)));
+		cleanup->next = cleanups;
+		cleanup->destroy = &Destroy<T>;
+		cleanup->object = object;
+		cleanups = cleanup;
+		return object;
+	}
+
+	void reset();
+
+	virtual ~Arena();
+};
+
+
+inline void * operator new (size_t size, Arena & arena) {
+	return arena.allocate(size);
+}
+
+// Only called if a constructor throws; the memory goes back on reset
+inline void operator delete (void * memory, Arena & arena) {
+	(void)memory;
+	(void)arena;
+}
+
+#endif
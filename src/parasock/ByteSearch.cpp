@@ -0,0 +1,102 @@
+//
+// ByteSearch.cpp
+//
+// Searching buffers for delimiters.
+//
+
+#include <string.h>
+
+#include "Helpers.h"
+#include "ByteSearch.h"
+
+#ifdef WITH_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+
+#ifdef WITH_SSE2
+static inline unsigned LowestBit(unsigned mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+
+char const * FindBytes(
+	char const * haystack,
+	size_t length,
+	char const * needle,
+	size_t needleLength
+) {
+	Assert(needleLength > 0);
+	if (needleLength > length)
+		return NULL;
+
+	size_t last = length - needleLength; // last place it could start
+	size_t pos = 0;
+
+#ifdef WITH_SSE2
+	if (needleLength >= 2) {
+		__m128i const first = _mm_set1_epi8(needle[0]);
+		__m128i const second = _mm_set1_epi8(needle[1]);
+
+		// the second load reaches one byte further than the first
+		while (pos + 16 < length) {
+			__m128i const here = _mm_loadu_si128(
+				reinterpret_cast<__m128i const *>(haystack + pos)
+			);
+			__m128i const next = _mm_loadu_si128(
+				reinterpret_cast<__m128i const *>(haystack + pos + 1)
+			);
+			unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(here, first),
+				_mm_cmpeq_epi8(next, second)
+			));
+
+			while (mask != 0) {
+				size_t candidate = pos + LowestBit(mask);
+				if (candidate > last)
+					return NULL;
+				if (
+					memcmp(
+						haystack + candidate + 2,
+						needle + 2,
+						needleLength - 2
+					) == 0
+				) {
+					return haystack + candidate;
+				}
+				mask &= mask - 1;
+			}
+			pos += 16;
+		}
+	}
+#endif
+
+	while (pos <= last) {
+		void const * hit = memchr(haystack + pos, needle[0], last - pos + 1);
+		if (hit == NULL)
+			return NULL;
+
+		size_t candidate = static_cast<char const *>(hit) - haystack;
+		if (
+			memcmp(
+				haystack + candidate + 1,
+				needle + 1,
+				needleLength - 1
+			) == 0
+		) {
+			return haystack + candidate;
+		}
+		pos = candidate + 1;
+	}
+	return NULL;
+}
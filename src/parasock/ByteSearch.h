@@ -0,0 +1,30 @@
+//
+// ByteSearch.h
+//
+// Finding a short run of bytes (like the "\r\n" at the end of a header line)
+// in a buffer.  Where SSE2 is available, sixteen positions are checked at a
+// time by comparing for the first two bytes of the needle at once, which
+// skips over nearly all the candidates memchr on the first byte would stop
+// at in text full of '\r's.
+//
+
+#ifndef __PARASOCK_BYTESEARCH_H__
+#define __PARASOCK_BYTESEARCH_H__
+
+#include <stddef.h>
+
+#if (defined(__SSE2__) || defined(_M_X64) \
+	|| (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))) \
+	&& !defined(WITHOUT_SSE2)
+#define WITH_SSE2
+#endif
+
+// Like memmem: the first place the needle occurs, or NULL
+char const * FindBytes(
+	char const * haystack,
+	size_t length,
+	char const * needle,
+	size_t needleLength
+);
+
+#endif
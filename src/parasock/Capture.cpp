@@ -0,0 +1,153 @@
+//
+// Capture.cpp
+//
+// Bounded traffic capture, and writing it out as pcap.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Capture.h"
+
+// pcap's file header and per-packet header, which are always 32-bit fields
+// in the byte order of whoever wrote the file
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_LINKTYPE_USER0 147
+#define PCAP_SNAPLEN 0x40000
+
+struct PcapFileHeader {
+	unsigned int magic;
+	unsigned short versionMajor;
+	unsigned short versionMinor;
+	int thiszone;
+	unsigned int sigfigs;
+	unsigned int snaplen;
+	unsigned int linktype;
+};
+
+struct PcapRecordHeader {
+	unsigned int seconds;
+	unsigned int microseconds;
+	unsigned int includedLength;
+	unsigned int originalLength;
+};
+
+
+CaptureRing::CaptureRing (size_t capacity) :
+	ring (capacity),
+	start (0),
+	used (0),
+	dropped (0)
+{
+}
+
+
+void CaptureRing::put(size_t offset, void const * data, size_t len) {
+	char const * bytes = static_cast<char const *>(data);
+	offset %= ring.size();
+	size_t chunk = ring.size() - offset;
+	if (chunk > len)
+		chunk = len;
+	memcpy(&ring[offset], bytes, chunk);
+	if (len > chunk)
+		memcpy(&ring[0], bytes + chunk, len - chunk);
+}
+
+
+void CaptureRing::get(size_t offset, void * data, size_t len) const {
+	char * bytes = static_cast<char *>(data);
+	offset %= ring.size();
+	size_t chunk = ring.size() - offset;
+	if (chunk > len)
+		chunk = len;
+	memcpy(bytes, &ring[offset], chunk);
+	if (len > chunk)
+		memcpy(bytes + chunk, &ring[0], len - chunk);
+}
+
+
+void CaptureRing::dropOldest() {
+	Assert(used > 0);
+	Record oldest;
+	get(start, &oldest, sizeof(Record));
+	size_t size = sizeof(Record) + oldest.length;
+	start = (start + size) % ring.size();
+	used -= size;
+	dropped++;
+}
+
+
+void CaptureRing::record(
+	int connection,
+	CaptureDirection direction,
+	char const * data,
+	size_t len
+) {
+	if ((len == 0) || (ring.size() <= sizeof(Record)))
+		return;
+
+	if (len > ring.size() - sizeof(Record)) {
+		data += len - (ring.size() - sizeof(Record));
+		len = ring.size() - sizeof(Record);
+	}
+
+	while (ring.size() - used < sizeof(Record) + len)
+		dropOldest();
+
+	Record header;
+	header.when = time(NULL);
+	header.connection = static_cast<unsigned char>(connection);
+	header.direction = static_cast<unsigned char>(direction);
+	header.length = len;
+
+	put(start + used, &header, sizeof(Record));
+	put(start + used + sizeof(Record), data, len);
+	used += sizeof(Record) + len;
+}
+
+
+bool CaptureRing::dump(std::string const & filename) const {
+	FILE * file = fopen(filename.c_str(), "wb");
+	if (file == NULL)
+		return false;
+
+	PcapFileHeader fileHeader;
+	fileHeader.magic = PCAP_MAGIC;
+	fileHeader.versionMajor = 2;
+	fileHeader.versionMinor = 4;
+	fileHeader.thiszone = 0;
+	fileHeader.sigfigs = 0;
+	fileHeader.snaplen = PCAP_SNAPLEN;
+	fileHeader.linktype = PCAP_LINKTYPE_USER0;
+	bool ok = (fwrite(&fileHeader, sizeof(fileHeader), 1, file) == 1);
+
+	std::vector<char> data;
+	size_t offset = 0;
+	while (ok && (offset < used)) {
+		Record header;
+		get(start + offset, &header, sizeof(Record));
+		data.resize(header.length + 2);
+		data[0] = header.connection;
+		data[1] = header.direction;
+		get(start + offset + sizeof(Record), &data[2], header.length);
+
+		// pcap readers refuse packets bigger than the snapshot length
+		size_t included = data.size();
+		if (included > PCAP_SNAPLEN)
+			included = PCAP_SNAPLEN;
+
+		PcapRecordHeader recordHeader;
+		recordHeader.seconds = static_cast<unsigned int>(header.when);
+		recordHeader.microseconds = 0;
+		recordHeader.includedLength = static_cast<unsigned int>(included);
+		recordHeader.originalLength = static_cast<unsigned int>(data.size());
+		ok = (fwrite(&recordHeader, sizeof(recordHeader), 1, file) == 1)
+			&& (fwrite(&data[0], 1, included, file) == included);
+
+		offset += sizeof(Record) + header.length;
+	}
+
+	if (fclose(file) != 0)
+		ok = false;
+	return ok;
+}
@@ -0,0 +1,80 @@
+//
+// Capture.h
+//
+// A record of the most recent traffic on a Parasock's sockets, for finding
+// out what led up to a failure.  It is a ring of fixed size: once full, the
+// oldest records are thrown away to make room, so a long download costs no
+// more than a short one.  Capture is off unless a size is asked for, in
+// which case nothing is recorded and the only cost is a pointer check.
+//
+// The ring can be written out as a pcap file (link type USER0), so it can
+// be looked at in Wireshark.  Each packet starts with two bytes saying
+// which connection it was on (0 client, 1 server) and whether it was
+// received (0) or sent (1), followed by the data.
+//
+
+#ifndef __PARASOCK_CAPTURE_H__
+#define __PARASOCK_CAPTURE_H__
+
+#include <vector>
+#include <string>
+#include <time.h>
+
+#include "Helpers.h"
+
+enum CaptureDirection {
+	CaptureReceived = 0,
+	CaptureSent = 1
+};
+
+
+class CaptureRing {
+private:
+	struct Record {
+		time_t when;
+		unsigned char connection;
+		unsigned char direction;
+		size_t length;
+	};
+
+	std::vector<char> ring;
+	size_t start; // where the oldest record begins
+	size_t used;
+	size_t dropped; // records thrown out to make room
+
+private:
+	void put(size_t offset, void const * data, size_t len);
+	void get(size_t offset, void * data, size_t len) const;
+	void dropOldest();
+
+public:
+	explicit CaptureRing (size_t capacity);
+
+private:
+	// Disable copying C++98 style
+	CaptureRing (CaptureRing const & other);
+
+public:
+	// Data bigger than the whole ring keeps only its end
+	void record(
+		int connection,
+		CaptureDirection direction,
+		char const * data,
+		size_t len
+	);
+
+	size_t getDropped() const {
+		return dropped;
+	}
+
+	void clear() {
+		start = 0;
+		used = 0;
+		dropped = 0;
+	}
+
+	// Returns false if the file couldn't be written
+	bool dump(std::string const & filename) const;
+};
+
+#endif
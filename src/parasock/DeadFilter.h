@@ -18,18 +18,18 @@ public:
 	{
 	}
 
-	std::auto_ptr<Instruction> firstInstruction() /* override */ {
-		return std::auto_ptr<Instruction>(new QuitFilterInstruction(0));
+	Instruction firstInstruction() /* override */ {
+		return QuitFilterInstruction(0);
 	}
 
-	std::auto_ptr<Instruction> runFilter(
-		std::string const & uncommittedBytes,
+	Instruction runFilter(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
 	) /* override */ {
 		NotReached();
-		return std::auto_ptr<Instruction>(new QuitFilterInstruction(0));
+		return QuitFilterInstruction(0);
 	}
 
 	~DeadFilter () /* override */ {
@@ -40,6 +40,7 @@ Filter::Filter(Parasock & parasock, FlowDirection whichInput) :
 	running (false)
 {
 	uncommittedChars = 0;
+	instructed = false;
 }
 
 
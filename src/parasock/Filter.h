@@ -12,6 +12,7 @@
 #include <string>
 #include <memory>
 #include <algorithm>
+#include <string.h>
 
 #include "Helpers.h"
 #include "NetUtils.h"
@@ -27,6 +28,13 @@ void EndSockWatch(SOCKET sock);
 
 class Filter;
 
+// Longest delimiter a ThruDelimiterInstruction can wait for
+#define INSTRUCTIONDELIMITERMAX 8
+
+// What a filter wants next from the socket.  A filter hands one back every
+// time it runs, so it is a plain value with room for every kind of
+// instruction inline, and not something allocated to be looked at with
+// dynamic_cast.  The classes below are just the ways to construct one.
 class Instruction {
 
 	friend class SockBuf;
@@ -46,19 +54,33 @@ public:
 	InstructionType type;
 	size_t commitSize;
 
+	union {
+		size_t maxByteCount; // BytesMax
+		size_t exactByteCount; // BytesExact
+	};
+
+	// ThruDelimiter
+	char delimiter[INSTRUCTIONDELIMITERMAX];
+	size_t delimiterLength;
+
+public:
+	// So a variable can be declared before it's decided what goes in it
+	Instruction () :
+		type (QuitFilter),
+		commitSize (0),
+		maxByteCount (0),
+		delimiterLength (0)
+	{
+	}
+
 protected:
 	Instruction (InstructionType type, size_t commitSize) :
+		type (type),
 		commitSize (commitSize),
-		type (type)
+		maxByteCount (0),
+		delimiterLength (0)
 	{
 	}
-
-private:
-	// Disable copying, C++98 style
-	Instruction(Instruction const & other);
-
-public:
-	virtual ~Instruction() { }
 };
 
 
@@ -75,17 +97,17 @@ public:
 // read until delimiter is reached
 // (delimiter will be last of uncommittedBytes characters)
 class ThruDelimiterInstruction : public Instruction {
-public:
-	std::string delimiter;
-
 public:
 	ThruDelimiterInstruction(
-		std::string const delimiter,
+		char const * delimiterIn,
 		size_t commitSize
 	) :
-		Instruction (Instruction::ThruDelimiter, commitSize),
-		delimiter (delimiter)
+		Instruction (Instruction::ThruDelimiter, commitSize)
 	{
+		delimiterLength = strlen(delimiterIn);
+		Assert(delimiterLength > 0);
+		Assert(delimiterLength <= INSTRUCTIONDELIMITERMAX);
+		memcpy(delimiter, delimiterIn, delimiterLength);
 	}
 };
 
@@ -95,14 +117,11 @@ public:
 // a minimum too.
 class BytesMaxInstruction : public Instruction {
 public:
-	size_t maxByteCount;
-
-public:
-	BytesMaxInstruction(size_t maxByteCount, size_t commitSize) :
-		Instruction (Instruction::BytesMax, commitSize),
-		maxByteCount (maxByteCount)
+	BytesMaxInstruction(size_t maxByteCountIn, size_t commitSize) :
+		Instruction (Instruction::BytesMax, commitSize)
 	{
-		Assert(maxByteCount > 0);
+		Assert(maxByteCountIn > 0);
+		maxByteCount = maxByteCountIn;
 	}
 };
 
@@ -111,14 +130,11 @@ public:
 // (or a disconnect?)
 class BytesExactInstruction : public Instruction {
 public:
-	size_t exactByteCount;
-
-public:
-	BytesExactInstruction(size_t exactByteCount, size_t commitSize) :
-		Instruction (Instruction::BytesExact, commitSize),
-		exactByteCount (exactByteCount)
+	BytesExactInstruction(size_t exactByteCountIn, size_t commitSize) :
+		Instruction (Instruction::BytesExact, commitSize)
 	{
-		Assert(exactByteCount > 0);
+		Assert(exactByteCountIn > 0);
+		exactByteCount = exactByteCountIn;
 	}
 };
 
@@ -144,20 +160,19 @@ class Filter {
 private:
 	Knowable<size_t> lastReadSoFar;
 	size_t uncommittedChars;
-	std::auto_ptr<Instruction> instruction;
+	Instruction instruction;
+	bool instructed;
 	SockBuf& sockbufInput;
 	SockBuf& sockbufOutput;
 	bool running;
 
-private:
-	std::string bytesRead; // DEBUG
-
 public:
 	Filter(Parasock & parasock, FlowDirection whichInput);
 
 protected:
-	Instruction const * currentInstruction() {
-		return this->instruction.get();
+	Instruction const & currentInstruction() {
+		Assert(instructed);
+		return this->instruction;
 	}
 
 // only derived class may call these.  Must be from within a run method!
@@ -171,21 +186,29 @@ public:
 	);
 
 private:
-	virtual std::auto_ptr<Instruction> runFilter(
-		std::string const & uncommittedBytes,
+	virtual Instruction runFilter(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
 	) = 0;
-	virtual std::auto_ptr<Instruction> firstInstruction() = 0;
+	virtual Instruction firstInstruction() = 0;
+
+	// A filter that would output exactly what it's given, for as long as
+	// the socket keeps giving, can say so here.  If both directions agree
+	// then the Parasock is free to move the data without running them.
+	virtual bool passesThrough() const {
+		return false;
+	}
 
 private:
 	void setupfirstInstruction() {
-		Assert(instruction.get() == NULL);
+		Assert(!instructed);
 		Assert(!running);
 		running = true;
 		instruction = firstInstruction();
-		Assert(instruction->commitSize == 0);
+		instructed = true;
+		Assert(instruction.commitSize == 0);
 		running = false;
 	}
 
@@ -193,7 +216,7 @@ private:
 	// Putting this all here in the base class interface so the somewhat
 	// complex invariants are documented more easily
 	void runWrapper(
-		std::string const & uncommittedBytes,
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
@@ -208,11 +231,10 @@ private:
 		size_t newChars = uncommittedBytes.length() - newDataOffset;
 		uncommittedChars += newChars;
 		Assert(uncommittedBytes.length() == uncommittedChars);
-		bytesRead += uncommittedBytes.substr(newDataOffset, std::string::npos);
 
 		Assert(!running);
 		running = true;
-		std::auto_ptr<Instruction> newInstruction = runFilter(
+		Instruction newInstruction = runFilter(
 			uncommittedBytes,
 			newDataOffset,
 			readSoFar,
@@ -221,11 +243,11 @@ private:
 		running = false;
 
 		if (disconnected) {
-			Assert(newInstruction->type == Instruction::QuitFilter);
+			Assert(newInstruction.type == Instruction::QuitFilter);
 		}
 
-		Assert(newInstruction->commitSize <= uncommittedChars);
-		uncommittedChars -= newInstruction->commitSize;
+		Assert(newInstruction.commitSize <= uncommittedChars);
+		uncommittedChars -= newInstruction.commitSize;
 
 		instruction = newInstruction;
 	}
@@ -7,10 +7,204 @@
 #ifndef __PARASOCK_HELPERS_H__
 #define __PARASOCK_HELPERS_H__
 
+#ifdef _WIN32
 #include <winsock2.h>
+#else
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#endif
 #include <string>
 #include <memory>
 
+#ifndef _WIN32
+// The code is written against the Win32 threading calls.  Elsewhere they
+// are done with pthreads, POSIX semaphores and the gcc atomic builtins.
+
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef void * HANDLE;
+typedef void * LPSECURITY_ATTRIBUTES;
+#define INFINITE 0xFFFFFFFF
+#define __stdcall
+#define _strnicmp strncasecmp
+#define _stricmp strcasecmp
+
+inline void DebugBreak() {
+	raise(SIGTRAP);
+}
+
+// Milliseconds, as Win32 counts them
+inline void Sleep(DWORD milliseconds) {
+	struct timespec wait;
+	wait.tv_sec = milliseconds / 1000;
+	wait.tv_nsec = (milliseconds % 1000) * 1000000L;
+	while ((nanosleep(&wait, &wait) == -1) && (errno == EINTR)) {}
+}
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+inline void InitializeCriticalSection(CRITICAL_SECTION * section) {
+	pthread_mutex_init(section, NULL);
+}
+
+inline void DeleteCriticalSection(CRITICAL_SECTION * section) {
+	pthread_mutex_destroy(section);
+}
+
+inline void EnterCriticalSection(CRITICAL_SECTION * section) {
+	pthread_mutex_lock(section);
+}
+
+inline void LeaveCriticalSection(CRITICAL_SECTION * section) {
+	pthread_mutex_unlock(section);
+}
+
+inline LONG InterlockedIncrement(LONG volatile * value) {
+	return __sync_add_and_fetch(value, 1);
+}
+
+inline LONG InterlockedDecrement(LONG volatile * value) {
+	return __sync_sub_and_fetch(value, 1);
+}
+
+inline LONG InterlockedExchange(LONG volatile * target, LONG value) {
+	__sync_synchronize(); // test_and_set alone is only an acquire barrier
+	return __sync_lock_test_and_set(target, value);
+}
+
+inline LONG InterlockedCompareExchange(
+	LONG volatile * destination,
+	LONG exchange,
+	LONG comparand
+) {
+	return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+
+inline void * InterlockedCompareExchangePointer(
+	void * volatile * destination,
+	void * exchange,
+	void * comparand
+) {
+	return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+
+// A HANDLE is one of these: a semaphore, or a thread that was started
+// detached and only ever has its handle closed
+struct PosixHandle {
+	bool isThread;
+	sem_t semaphore;
+};
+
+inline HANDLE CreateSemaphore(
+	LPSECURITY_ATTRIBUTES attributes,
+	LONG initialCount,
+	LONG maximumCount,
+	char const * name
+) {
+	PosixHandle * handle = new PosixHandle;
+	handle->isThread = false;
+	if (sem_init(&handle->semaphore, 0, initialCount) != 0) {
+		delete handle;
+		return NULL;
+	}
+	return handle;
+}
+
+// The maximum count isn't enforced; nothing here releases past it
+inline int ReleaseSemaphore(HANDLE semaphore, LONG count, LONG * previous) {
+	while (count-- > 0)
+		sem_post(&static_cast<PosixHandle *>(semaphore)->semaphore);
+	return 1;
+}
+
+// Only ever used to wait forever, so the timeout isn't looked at
+inline DWORD WaitForSingleObject(HANDLE semaphore, DWORD milliseconds) {
+	while (
+		(sem_wait(&static_cast<PosixHandle *>(semaphore)->semaphore) == -1)
+		&& (errno == EINTR)
+	) {}
+	return 0;
+}
+
+inline int CloseHandle(HANDLE object) {
+	PosixHandle * handle = static_cast<PosixHandle *>(object);
+	if (!handle->isThread)
+		sem_destroy(&handle->semaphore);
+	delete handle;
+	return 1;
+}
+
+inline DWORD TlsAlloc() {
+	pthread_key_t key;
+	pthread_key_create(&key, NULL);
+	return static_cast<DWORD>(key);
+}
+
+inline void * TlsGetValue(DWORD slot) {
+	return pthread_getspecific(static_cast<pthread_key_t>(slot));
+}
+
+inline int TlsSetValue(DWORD slot, void * value) {
+	return pthread_setspecific(static_cast<pthread_key_t>(slot), value) == 0;
+}
+
+typedef unsigned (__stdcall *BEGINTHREADFUNC)(void *);
+
+struct PosixThreadStart {
+	BEGINTHREADFUNC function;
+	void * argument;
+
+	static void * run(void * start) {
+		PosixThreadStart copy = *static_cast<PosixThreadStart *>(start);
+		delete static_cast<PosixThreadStart *>(start);
+		copy.function(copy.argument);
+		return NULL;
+	}
+};
+
+// The thread is detached, as nothing here joins one.  The stack size is
+// left to the system: on Windows it's a size to commit out of a much
+// larger reservation, not a limit.
+inline uintptr_t _beginthreadex(
+	void * security,
+	unsigned stackSize,
+	BEGINTHREADFUNC function,
+	void * argument,
+	unsigned flags,
+	unsigned * threadId
+) {
+	PosixThreadStart * start = new PosixThreadStart;
+	start->function = function;
+	start->argument = argument;
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	pthread_t thread;
+	int error = pthread_create(
+		&thread, &attributes, PosixThreadStart::run, start
+	);
+	pthread_attr_destroy(&attributes);
+	if (error != 0) {
+		delete start;
+		return 0;
+	}
+
+	if (threadId != NULL)
+		*threadId = 0;
+	PosixHandle * handle = new PosixHandle;
+	handle->isThread = true;
+	return reinterpret_cast<uintptr_t>(handle);
+}
+#endif
+
 inline void Assert(bool condition) {
 	if (!condition)
 		DebugBreak();
@@ -20,7 +214,17 @@ inline void NotReached() {
 	Assert(false);
 }
 
-#define FallThrough() ;
+// Says a case is meant to run on into the next, where the compiler would
+// otherwise warn that it does
+#if defined(__has_attribute)
+#if __has_attribute(fallthrough)
+#define FallThrough() __attribute__((fallthrough))
+#endif
+#endif
+#ifndef FallThrough
+#define FallThrough()
+#endif
+
 #define Noop() ;
 
 inline size_t SafeSubtractSize(size_t bigger, size_t smaller) {
@@ -30,19 +234,18 @@ inline size_t SafeSubtractSize(size_t bigger, size_t smaller) {
 
 
 inline int strncasecmplen(
-	std::string const buf,
+	std::string const & buf,
 	char const * cmp,
 	size_t offset = 0,
 	size_t * newOffset = NULL
 ) {
 	// no really easy way to do this with std::string due to case insensitity
-	// had to write this using strncasecmp
+	// had to write this using strncasecmp, on the buffer where it lies
 
 	size_t len = strlen(cmp);
-	if (buf.length() - offset < len)
+	if ((offset > buf.length()) || (buf.length() - offset < len))
 		return -1; // not long enough for substring to exist
-	std::string substring = buf.substr(offset, len);
-	int ret = _strnicmp(cmp, substring.c_str(), len);
+	int ret = _strnicmp(cmp, buf.data() + offset, len);
 	if (ret == 0 && newOffset != NULL)
 		*newOffset = offset + len;
 	return ret;
@@ -85,6 +288,7 @@ private:
 	T t;
 	bool known;
 public:
+	Knowable() : known (false) {} // so arrays of them can be members
 	Knowable(T t) : t (t), known (true) {}
 	Knowable(UnknownType& dummy) : known (false) {}
 	bool isKnown() const { return known; }
@@ -108,9 +312,11 @@ public:
 };
 
 
+#ifdef _WIN32
 #define pthread_mutex_lock(x) EnterCriticalSection(x)
 #define pthread_mutex_unlock(x) LeaveCriticalSection(x)
 typedef unsigned (__stdcall *BEGINTHREADFUNC)(void *);
 #pragma warning (disable : 4996)
+#endif
 
 #endif
@@ -0,0 +1,85 @@
+//
+// InputSpan.h
+//
+// What a filter is handed: the bytes it hasn't committed yet.  They're the
+// tail of a std::string the SockBuf keeps, starting just past whatever
+// earlier calls committed, so the bytes a filter holds back don't have to
+// be moved up to the front of that string every time it commits some.
+// Being a tail, it always ends at the string's terminating NUL.
+//
+// It's only good until the string it looks into is changed, which doesn't
+// happen while the filter runs.
+//
+
+#ifndef __PARASOCK_INPUTSPAN_H__
+#define __PARASOCK_INPUTSPAN_H__
+
+#include <string>
+#include <string.h>
+
+#include "Helpers.h"
+#include "ByteSearch.h"
+
+class InputSpan {
+private:
+	char const * bytes;
+	size_t count;
+
+public:
+	InputSpan (std::string const & whole) :
+		bytes (whole.c_str()),
+		count (whole.length())
+	{
+	}
+
+	InputSpan (std::string const & whole, size_t start) :
+		bytes (whole.c_str() + start),
+		count (whole.length() - start)
+	{
+		Assert(start <= whole.length());
+	}
+
+	char const * data() const {
+		return bytes;
+	}
+
+	// NUL terminated, as the string it's the tail of is
+	char const * c_str() const {
+		return bytes;
+	}
+
+	size_t length() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	char operator[](size_t index) const {
+		return bytes[index];
+	}
+
+	size_t find(char const * needle, size_t from = 0) const {
+		if (from > count)
+			return std::string::npos;
+		char const * found = FindBytes(
+			bytes + from, count - from, needle, strlen(needle)
+		);
+		return (found == NULL) ? std::string::npos : found - bytes;
+	}
+
+	bool operator==(char const * other) const {
+		return (strlen(other) == count) && (memcmp(bytes, other, count) == 0);
+	}
+
+	void appendTo(std::string & target) const {
+		target.append(bytes, count);
+	}
+
+	std::string str() const {
+		return std::string(bytes, count);
+	}
+};
+
+#endif
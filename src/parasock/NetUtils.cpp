@@ -9,10 +9,15 @@
 #include <memory>
 #include <sstream>
 #include <iostream>
+#include <stdio.h>
 
 #include "Helpers.h"
 #include "NetUtils.h"
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
 
 // 
 // Socket routines for cross-platform and error handling
@@ -129,6 +134,81 @@ int sockrecvfrom(
 }
 
 
+int socksendvready(SOCKET sock, SendPiece const * pieces, int count) {
+	Assert((count > 0) && (count <= SENDPIECESMAX));
+
+#ifdef _WIN32
+	WSABUF bufs[SENDPIECESMAX];
+	for (int index = 0; index < count; index++) {
+		bufs[index].buf = const_cast<char *>(pieces[index].data);
+		bufs[index].len = static_cast<ULONG>(pieces[index].length);
+	}
+
+	DWORD sent = 0;
+	if (WSASend(sock, bufs, count, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+		return -1;
+	return static_cast<int>(sent);
+#else
+	struct iovec iov[SENDPIECESMAX];
+	for (int index = 0; index < count; index++) {
+		iov[index].iov_base = const_cast<char *>(pieces[index].data);
+		iov[index].iov_len = pieces[index].length;
+	}
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL; // a dropped peer is an error code, not a SIGPIPE
+#endif
+
+	int res;
+	do {
+		res = static_cast<int>(sendmsg(sock, &msg, flags));
+	} while ((res < 0) && (WSAGetLastError() == EINTR));
+
+	return res;
+#endif
+}
+
+
+int sockrecvready(SOCKET sock, char * buf, int bufsize) {
+	int res;
+	do {
+		res = recv(sock, buf, bufsize, 0);
+	} while ((res < 0) && (WSAGetLastError() == EINTR));
+
+	return res;
+}
+
+
+SOCKET sockacceptready(SOCKET listener, struct sockaddr_in * peer) {
+	SASIZETYPE size = sizeof(*peer);
+	SOCKET sock;
+#ifdef SOCK_NONBLOCK
+	// one system call instead of an accept and an ioctl after it
+	do {
+		sock = accept4(
+			listener,
+			(struct sockaddr *)peer,
+			&size,
+			SOCK_NONBLOCK | SOCK_CLOEXEC
+		);
+	} while ((sock == INVALID_SOCKET) && (WSAGetLastError() == EINTR));
+#else
+	sock = accept(listener, (struct sockaddr *)peer, &size);
+	if (sock != INVALID_SOCKET) {
+		unsigned long ul = 1;
+		ioctlsocket(sock, FIONBIO, &ul);
+	}
+#endif
+	return sock;
+}
+
+
 inline int mypoll(MYPOLLFD *fds, unsigned int nfds, Timeout timeout){
 
 	fd_set readfd;
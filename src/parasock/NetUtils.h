@@ -9,7 +9,37 @@
 #ifndef __PARASOCK_NETUTILS_H__
 #define __PARASOCK_NETUTILS_H__
 
+#ifdef _WIN32
 #include <winsock2.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+#include "Helpers.h"
+
+#ifndef _WIN32
+// Winsock names for the BSD socket calls the rest of the code uses
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define ioctlsocket ioctl
+#define WSAGetLastError() (errno)
+#define WSAEWOULDBLOCK EWOULDBLOCK
+#define WSAECONNRESET ECONNRESET
+#define WSAECONNABORTED ECONNABORTED
+#define WSAENOTCONN ENOTCONN
+#endif
 
 
 // There are many different ways of specifying timeouts
@@ -68,11 +98,23 @@ public:
 #define EINTR WSAEWOULDBLOCK
 #endif
 
+#ifndef EINPROGRESS
+#define EINPROGRESS WSAEWOULDBLOCK
+#endif
+
+#ifndef ENOTCONN
+#define ENOTCONN WSAENOTCONN
+#endif
+
 #define SLEEPTIME 1
-#define usleep Sleep
+#define usleep Sleep // callers pass milliseconds, everywhere
 
+#ifdef _WIN32
 #define SASIZETYPE int
 #define SHUT_RDWR SD_BOTH
+#else
+#define SASIZETYPE socklen_t
+#endif
 
 #define UDPBUFSIZE 16384
 #define TCPBUFSIZE  4096
@@ -125,4 +167,22 @@ int sockrecvfrom(
 	Timeout timeout
 );
 
+// One of the buffers handed to a gathering send
+struct SendPiece {
+	char const * data;
+	size_t length;
+};
+#define SENDPIECESMAX 64
+
+// For when poll (or an event loop) has already said the socket is ready.
+// These make a single non-blocking attempt; a send may take less than was
+// offered, and a spurious wakeup comes back as -1 with EAGAIN.  The send
+// gathers up to SENDPIECESMAX pieces into one system call.
+int socksendvready(SOCKET sock, SendPiece const * pieces, int count);
+int sockrecvready(SOCKET sock, char * buf, int bufsize);
+
+// Takes a connection off a non-blocking listening socket, itself already
+// non-blocking.  INVALID_SOCKET with EAGAIN when there are none waiting.
+SOCKET sockacceptready(SOCKET listener, struct sockaddr_in * peer);
+
 #endif
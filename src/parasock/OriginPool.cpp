@@ -0,0 +1,149 @@
+//
+// OriginPool.cpp
+//
+// Idle origin server connections, kept for reuse.
+//
+
+#include "OriginPool.h"
+
+
+OriginPool::OriginPool () :
+	maxIdle (0),
+	idleTimeout (0),
+	lastSweep (0)
+{
+	InitializeCriticalSection(&mutex);
+}
+
+
+void OriginPool::configure(size_t maxIdle, time_t idleTimeout) {
+	pthread_mutex_lock(&mutex);
+	this->maxIdle = maxIdle;
+	this->idleTimeout = idleTimeout;
+	pthread_mutex_unlock(&mutex);
+}
+
+
+SOCKET OriginPool::take(struct sockaddr_in const & origin) {
+	Origin key (origin.sin_addr.s_addr, origin.sin_port);
+	time_t now = time(NULL);
+	std::vector<SOCKET> closing;
+	SOCKET sock = INVALID_SOCKET;
+
+	while (sock == INVALID_SOCKET) {
+		pthread_mutex_lock(&mutex);
+		if (now - lastSweep > 0)
+			sweepLocked(now, closing);
+		IdleMap::iterator it = idle.find(key);
+		if (it == idle.end()) {
+			pthread_mutex_unlock(&mutex);
+			break;
+		}
+		sock = it->second.back().sock;
+		it->second.pop_back();
+		if (it->second.empty())
+			idle.erase(it);
+		pthread_mutex_unlock(&mutex);
+
+		// The probe is made without the lock, since the socket is ours now
+		MYPOLLFD fds;
+		fds.fd = sock;
+		fds.events = POLLIN;
+		if (poll(&fds, 1, Timeout (0)) != 0) {
+			closing.push_back(sock);
+			sock = INVALID_SOCKET;
+		}
+	}
+
+	closeAll(closing);
+	return sock;
+}
+
+
+void OriginPool::give(struct sockaddr_in const & origin, SOCKET sock) {
+	Origin key (origin.sin_addr.s_addr, origin.sin_port);
+	time_t now = time(NULL);
+	std::vector<SOCKET> closing;
+
+	pthread_mutex_lock(&mutex);
+	if (now - lastSweep > 0)
+		sweepLocked(now, closing);
+	if (maxIdle == 0) {
+		closing.push_back(sock);
+	} else {
+		std::deque<IdleConnection> & connections = idle[key];
+		if (connections.size() >= maxIdle) {
+			// the oldest is the likeliest to have been closed on us
+			closing.push_back(connections.front().sock);
+			connections.pop_front();
+		}
+		IdleConnection connection;
+		connection.sock = sock;
+		connection.since = now;
+		connections.push_back(connection);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	closeAll(closing);
+}
+
+
+void OriginPool::sweep(time_t now) {
+	std::vector<SOCKET> closing;
+
+	pthread_mutex_lock(&mutex);
+	sweepLocked(now, closing);
+	pthread_mutex_unlock(&mutex);
+
+	closeAll(closing);
+}
+
+
+void OriginPool::sweepLocked(time_t now, std::vector<SOCKET> & closing) {
+	lastSweep = now;
+
+	IdleMap::iterator it = idle.begin();
+	while (it != idle.end()) {
+		std::deque<IdleConnection> & connections = it->second;
+		while (
+			!connections.empty()
+			&& (now - connections.front().since >= idleTimeout)
+		) {
+			closing.push_back(connections.front().sock);
+			connections.pop_front();
+		}
+		if (connections.empty())
+			idle.erase(it++);
+		else
+			it++;
+	}
+}
+
+
+void OriginPool::closeAll(std::vector<SOCKET> const & closing) {
+	std::vector<SOCKET>::const_iterator it = closing.begin();
+	while (it != closing.end()) {
+		shutdown(*it, SHUT_RDWR);
+		closesocket(*it);
+		it++;
+	}
+}
+
+
+OriginPool::~OriginPool() {
+	std::vector<SOCKET> closing;
+
+	IdleMap::iterator it = idle.begin();
+	while (it != idle.end()) {
+		std::deque<IdleConnection>::iterator connection = it->second.begin();
+		while (connection != it->second.end()) {
+			closing.push_back(connection->sock);
+			connection++;
+		}
+		it++;
+	}
+	idle.clear();
+	closeAll(closing);
+
+	DeleteCriticalSection(&mutex);
+}
@@ -0,0 +1,77 @@
+//
+// OriginPool.h
+//
+// Connections to origin servers that are between requests, kept open after
+// a response that left them usable so that the next request for the same
+// address and port, from whichever client, can skip the handshake.  Each
+// origin keeps only so many, and none for longer than the idle timeout.
+//
+// A server is free to close a kept-alive connection whenever it likes, so
+// one is only handed out after a zero-timeout poll says there's nothing to
+// read on it.  Anything readable on an idle connection is either the close
+// or bytes nobody asked for, and it is no good to us either way.
+//
+
+#ifndef __PARASOCK_ORIGINPOOL_H__
+#define __PARASOCK_ORIGINPOOL_H__
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <time.h>
+
+#include "NetUtils.h"
+#include "Helpers.h"
+
+class OriginPool {
+private:
+	struct IdleConnection {
+		SOCKET sock;
+		time_t since;
+	};
+
+	// address and port, in network order as they are in a sockaddr_in
+	typedef std::pair<unsigned long, unsigned short> Origin;
+
+	// newest at the back, which is where they're taken from
+	typedef std::map<Origin, std::deque<IdleConnection> > IdleMap;
+
+	CRITICAL_SECTION mutex;
+	IdleMap idle;
+	size_t maxIdle;
+	time_t idleTimeout;
+	time_t lastSweep;
+
+public:
+	OriginPool ();
+
+private:
+	// Disable copying C++98 style
+	OriginPool (OriginPool const & other);
+
+public:
+	// maxIdle is per origin, and zero keeps nothing
+	void configure(size_t maxIdle, time_t idleTimeout);
+
+	// A connected socket to the origin that looks to still be open, or
+	// INVALID_SOCKET if there isn't one
+	SOCKET take(struct sockaddr_in const & origin);
+
+	// For a connected socket with nothing outstanding in either direction.
+	// The pool owns it after this, and closes it if it has enough already.
+	void give(struct sockaddr_in const & origin, SOCKET sock);
+
+	// Closes what has been idle too long.  Taking and giving do this as
+	// they go, at most once a second.
+	void sweep(time_t now);
+
+private:
+	void sweepLocked(time_t now, std::vector<SOCKET> & closing);
+	static void closeAll(std::vector<SOCKET> const & closing);
+
+public:
+	virtual ~OriginPool();
+};
+
+#endif
@@ -14,86 +14,129 @@
 #include "Filter.h"
 #include "DeadFilter.h"
 
-void Parasock::doBidirectionalFilteredProxyEx(
-	size_t (&readSoFar)[FlowDirectionMax],
-	Timeout timeo,
-	Filter* (&filter)[FlowDirectionMax]
-) {
-	size_t readInitial[FlowDirectionMax];
-	size_t sentSoFar[FlowDirectionMax];
-	{
-		FlowDirection which;
-		ForEachDirection(which) {
-			readInitial[which] = readSoFar[which];
-			sentSoFar[which] = 0;
-		}
+// Most to read from a socket in one wakeup, and the least to ask for in a
+// single read
+#define RECEIVEBUDGET (16 * BUFSIZE)
+#define RECEIVEMIN 1024
+
+// Default point at which output waiting to go to one socket stops reads
+// from the other, and where they start again
+#define OUTPUTHIGHWATER (64 * BUFSIZE)
+#define OUTPUTLOWWATER (16 * BUFSIZE)
+
+#ifdef WITH_SPLICE
+#include <fcntl.h>
+#include <unistd.h>
+
+// How much is let into a tunnel's pipe before waiting for it to drain;
+// it's also the default capacity of a pipe
+#define SPLICEMAX (16 * BUFSIZE)
+#endif
+
+Parasock::Parasock () :
+	proxying (false),
+	timedOut (false),
+	pollFailed (false),
+	lastProgress (0),
+	deadline (0),
+	outputHighWater (OUTPUTHIGHWATER),
+	outputLowWater (OUTPUTLOWWATER),
+	receiveLimit (SEGMENTSIZE)
+#ifdef WITH_SPLICE
+	, splicing (false)
+#endif
+{
+	FlowDirection which;
+	ForEachDirection(which) {
+#ifdef WITH_SPLICE
+		pipefd[which][0] = pipefd[which][1] = -1;
+		inPipe[which] = 0;
+#endif
+		watch[which].which = which;
 	}
+	clearState();
+}
 
-	bool timedOut;
-	bool socketClosed[FlowDirectionMax];
-	bool readAZero[FlowDirectionMax];
-	doBidirectionalFilteredProxyCore(
-		readSoFar,
-		sentSoFar,
-		socketClosed,
-		readAZero,
-		timedOut,
-		timeo,
-		filter
-	);
 
-	{
-		FlowDirection which;
-		ForEachDirection(which) {
-			if (
-				socketClosed[which]
-				&& (
-					filter[which]->currentInstruction()->type
-					!= Instruction::QuitFilter
-				)
-			) {
-				throw "Socket closed during communication";
-			}
-		}
+void Parasock::clearState() {
+	connectWait = false;
+
+	FlowDirection which;
+	ForEachDirection(which) {
+		filter[which] = NULL;
+		readSoFar[which] = 0;
+		sentSoFar[which] = 0;
+		socketClosed[which] = false;
+		readAZero[which] = false;
+		needToRead[which] = UNKNOWN;
+		needToWrite[which] = 0;
+		interest[which] = 0;
+		delimiterScanned[which] = 0;
+		throttled[which] = false;
+		receiveSize[which] = std::min(static_cast<size_t>(BUFSIZE), receiveLimit);
+		receiveWakeups[which] = 0;
+		receiveCalls[which] = 0;
 	}
 }
 
 
-size_t Parasock::doUnidirectionalProxyCore(
-	FlowDirection which,
-	bool & timedOut,
-	bool & socketClosed,
-	Timeout timeout
-) {
-	// If you don't know how much you want, just read while data is available
+void Parasock::recycle() {
+#ifdef WITH_SPLICE
+	endSplice();
+#endif
 
-	size_t readSoFar[FlowDirectionMax];
-	size_t sentSoFar[FlowDirectionMax];
-	{
-		FlowDirection whichZero;
-		ForEachDirection(whichZero) {
-			readSoFar[whichZero] = 0;
-			sentSoFar[whichZero] = 0;
-		}
+	// a failed operation may have been left partway through
+	proxying = false;
+	timedOut = false;
+	pollFailed = false;
+	lastProgress = 0;
+	deadline = 0;
+
+	FlowDirection which;
+	ForEachDirection(which) {
+		if (sockbuf[which].get() != NULL)
+			sockbuf[which]->recycle();
+		ownedFilter[which].reset();
+
+		Assert(watch[which].sock == INVALID_SOCKET);
+		watch[which].handler = NULL;
 	}
+	clearState();
 
-	DeadFilter deadFilterClient (*this, ClientToServer);
-	DeadFilter deadFilterServer (*this, ServerToClient);
-	Filter* filter[FlowDirectionMax] = { &deadFilterClient, &deadFilterServer };
+	if (capture.get() != NULL) {
+		capture->clear();
+		attachCapture();
+	}
+}
+
+
+void Parasock::doBidirectionalFilteredProxyEx(
+	size_t (&readSoFarOut)[FlowDirectionMax],
+	Timeout timeo,
+	Filter* (&filter)[FlowDirectionMax]
+) {
+	bool done = beginFilteredProxy(filter, timeo);
+	while (!done) {
+		short revents[FlowDirectionMax];
+		pollFilteredProxy(revents);
+		done = pumpFilteredProxy(revents);
+	}
+
+	FlowDirection which;
+	ForEachDirection(which) {
+		readSoFarOut[which] += readSoFar[which];
+	}
+}
 
-	bool readAZero[FlowDirectionMax];
-	bool socketClosedPair[FlowDirectionMax];
-	doBidirectionalFilteredProxyCore(
-		readSoFar,
-		sentSoFar,
-		socketClosedPair,
-		readAZero,
-		timedOut,
-		timeout,
-		filter
-	);
-	socketClosed = socketClosedPair[which];
 
+size_t Parasock::doUnidirectionalProxy(FlowDirection which, Timeout timeout) {
+	// If you don't know how much you want, just read while data is available
+	bool done = beginUnidirectionalProxy(timeout);
+	while (!done) {
+		short revents[FlowDirectionMax];
+		pollFilteredProxy(revents);
+		done = pumpFilteredProxy(revents);
+	}
 	return sentSoFar[which];
 }
 
@@ -106,32 +149,58 @@ void Parasock::filterHelper(
 	bool disconnected
 ) {
 
-	size_t length = sockbuf[which]->uncommittedBytes.length();
-	size_t newChars = length - newDataOffset;
+	size_t length = sockbuf[which]->uncommittedLength();
 
 	filter.runWrapper(
-		sockbuf[which]->uncommittedBytes,
+		sockbuf[which]->uncommitted(),
 		newDataOffset,
 		readSoFar,
 		disconnected
 	);
 
-	Instruction const * instruction = filter.currentInstruction();
+	Instruction const & instruction = filter.currentInstruction();
+	delimiterScanned[which] = 0;
 
 	if (disconnected) {
 		// can't read from not yet connected or closed socket
-		Assert(instruction->type == Instruction::QuitFilter);
+		Assert(instruction.type == Instruction::QuitFilter);
 	}
 
 	// new concept is that you always have a filter attached for safety
 
-	if (instruction->commitSize > 0) {
-		Assert(length >= instruction->commitSize);
-		sockbuf[which]->uncommittedBytes.erase(0, instruction->commitSize);
+	if (instruction.commitSize > 0) {
+		Assert(length >= instruction.commitSize);
+		sockbuf[which]->commitInput(instruction.commitSize);
 	}
 }
 
 
+// Where the current delimiter starts in the unfilteredBytes, if it's there
+size_t Parasock::findDelimiter(
+	FlowDirection which,
+	Instruction const & instruction
+) {
+	Assert(instruction.type == Instruction::ThruDelimiter);
+	SegmentBuffer const & unfiltered = sockbuf[which]->unfilteredBytes;
+
+	size_t delimPos = unfiltered.find(
+		instruction.delimiter,
+		instruction.delimiterLength,
+		delimiterScanned[which]
+	);
+	if (delimPos == std::string::npos) {
+		// the last few bytes could be the start of a delimiter that's split
+		// across reads
+		size_t length = unfiltered.length();
+		delimiterScanned[which] =
+			(length >= instruction.delimiterLength)
+			? length - instruction.delimiterLength + 1
+			: 0;
+	}
+	return delimPos;
+}
+
+
 // Simultaneously read and filter multiple buffered sockets
 // This is so that if you have a long response from a server and a long
 // send from a client, they may not hold each other up.  A 1GB upload and
@@ -146,571 +215,1061 @@ void Parasock::filterHelper(
 //
 // If you know the socket has already disconnected, PASS IN ZERO
 //
-void Parasock::doBidirectionalFilteredProxyCore(
-	size_t (&readSoFar)[FlowDirectionMax],
-	size_t (&sentSoFar)[FlowDirectionMax],
-	bool (&socketClosed)[FlowDirectionMax],
-	bool (&readAZero)[FlowDirectionMax],
-	bool & timedOut,
-	Timeout timeout,
-	Filter* (&filter)[FlowDirectionMax]
+bool Parasock::beginFilteredProxy(
+	Filter* (&filterIn)[FlowDirectionMax],
+	Timeout timeoutIn,
+	time_t deadlineIn
 ) {
+	Assert(!proxying);
+
+	// the server connection may have been replaced since the last operation
+	if (capture.get() != NULL)
+		attachCapture();
+
+	proxying = true;
 	timedOut = false;
+	pollFailed = false;
+	timeout = timeoutIn;
+	lastProgress = time(NULL);
+	deadline = deadlineIn;
+
+	FlowDirection which;
+	ForEachDirection(which) {
+		filter[which] = filterIn[which];
+
+		// must always attach a filter.
+		// when filter quits, we stop and return...
+		Assert(filter[which] != NULL);
+
+		readSoFar[which] = 0;
+		sentSoFar[which] = 0;
+		readAZero[which] = false;
+		needToRead[which] = UNKNOWN;
+		needToWrite[which] = 0;
+		interest[which] = 0;
+		delimiterScanned[which] = 0;
+		filter[which]->setupfirstInstruction();
+		if (sockbuf[which]->sock == INVALID_SOCKET) {
+			socketClosed[which] = true;
+			if (
+				filter[which]->currentInstruction().type
+				!= Instruction::QuitFilter
+			) {
+				// nothing.  so if that's cool with you, fine...
+				filterHelper(which, 0, 0, *filter[which], true);
+			}
+		} else
+			socketClosed[which] = false;
+	}
 
-	size_t received[FlowDirectionMax];
-	size_t sent[FlowDirectionMax];
-	{
-		FlowDirection which;
-		ForEachDirection(which) {
-			readAZero[which] = false;
-			received[which] = 0;
-			sent[which] = 0;
-			filter[which]->setupfirstInstruction();
-			if (sockbuf[which]->sock == INVALID_SOCKET) {
-				socketClosed[which] = true;	
-				if (
-					filter[which]->currentInstruction()->type 
-					!= Instruction::QuitFilter
-				) {
-					// nothing.  so if that's cool with you, fine...
-					filterHelper(which, 0, 0, *filter[which], true);
-				}
-			} else
-				socketClosed[which] = false;
+	return planFilteredProxy();
+}
+
+
+bool Parasock::beginUnidirectionalProxy(Timeout timeout, time_t deadline) {
+	// A filter can only be run for one operation, so these are made fresh
+	// each time and kept until the operation is finished
+	ownedFilter[ClientToServer].reset(new DeadFilter (*this, ClientToServer));
+	ownedFilter[ServerToClient].reset(new DeadFilter (*this, ServerToClient));
+	Filter* filter[FlowDirectionMax] = {
+		ownedFilter[ClientToServer].get(),
+		ownedFilter[ServerToClient].get()
+	};
+
+	return beginFilteredProxy(filter, timeout, deadline);
+}
+
+
+bool Parasock::beginConnectWait(Timeout timeout, time_t deadline) {
+	connectWait = true;
+	return beginUnidirectionalProxy(timeout, deadline);
+}
+
+
+bool Parasock::connectPending() const {
+	FlowDirection which;
+	ForEachDirection(which) {
+		if (
+			(sockbuf[which]->sock != INVALID_SOCKET)
+			&& sockbuf[which]->isConnecting()
+		) {
+			return true;
 		}
 	}
+	return false;
+}
 
-	// We loop until an exit condition is reached
-	size_t sleeptime = 0;
-	Knowable<size_t> needToRead[FlowDirectionMax] = { UNKNOWN, UNKNOWN };
-	size_t needToWrite[FlowDirectionMax];
-	do {
 
-		// start by saying we read nothing
+// Figure out what each side of the operation is waiting on, giving the
+// filters whatever is already buffered.  If nothing is left to wait for
+// then the operation is finished and this returns true.
+bool Parasock::planFilteredProxy() {
+
+#ifdef WITH_SPLICE
+	if (splicing)
+		return planSplice();
+#endif
+
+	// start by saying we read nothing
 LTryAgain:
-		{
-			FlowDirection which;
-			ForEachDirection(which) {
-				// must always attach a filter.
-				// when filter quits, we stop and return...
-				Assert(filter[which] != NULL);
-
-				if (sockbuf[which]->sock == INVALID_SOCKET)
-					needToWrite[which] = 0;
-				else if (sockbuf[which]->placeholders.empty())
-					needToWrite[which] = 0;
-				else {
-					needToWrite[which] = 0;
-					if (sockbuf[which]->placeholders.front()->contentsKnown) {
-						std::deque<Placeholder *>::iterator it =
-							sockbuf[which]->placeholders.begin();
-						while (
-							(it != sockbuf[which]->placeholders.end())
-							&& ((*it)->contentsKnown))
-						{
-							Assert(!(*it)->contents.empty());
-							needToWrite[which] += (*it)->contents.length();
-							it++;
-						}
-					}
-				}
+	{
+		FlowDirection which;
+		ForEachDirection(which) {
+			if (sockbuf[which]->sock == INVALID_SOCKET)
+				needToWrite[which] = 0;
+			else
+				needToWrite[which] = sockbuf[which]->getKnownWriteBytes();
 
-				Instruction const * instruction;
-				instruction = filter[which]->currentInstruction();
+			Instruction const & instruction =
+				filter[which]->currentInstruction();
 
-				if ((sockbuf[which]->sock == INVALID_SOCKET) || readAZero[which]) {
+			if ((sockbuf[which]->sock == INVALID_SOCKET) || readAZero[which]) {
 
-					needToRead[which] = 0;
+				needToRead[which] = 0;
 
-				} else if (instruction->type == Instruction::QuitFilter) {
+			} else if (instruction.type == Instruction::QuitFilter) {
 
-					// if we don't know what filter we're using we shouldn't
-					// read data.  In the future, you will always have to 
-					// supply a filter I think.
-					needToRead[which] = 0;
+				// if we don't know what filter we're using we shouldn't
+				// read data.  In the future, you will always have to
+				// supply a filter I think.
+				needToRead[which] = 0;
 
-				} else {
-					size_t buflen = sockbuf[which]->uncommittedBytes.length();
-					size_t rawlen = sockbuf[which]->unfilteredBytes.length();
-					size_t buflenInitial = buflen;
-
-					switch(instruction->type) {
-					case Instruction::ThruDelimiter: {
-						ThruDelimiterInstruction const * inst =
-							dynamic_cast<ThruDelimiterInstruction const *>(instruction);
-
-						size_t delimPos = sockbuf[which]->unfilteredBytes.find(inst->delimiter);
-						if (delimPos != std::string::npos) {
-							sockbuf[which]->uncommittedBytes +=
-								sockbuf[which]->unfilteredBytes.substr(0, delimPos + inst->delimiter.length());
-							sockbuf[which]->unfilteredBytes.erase(0, delimPos + inst->delimiter.length());
-							buflen += delimPos+inst->delimiter.length();
-							needToRead[which] = 0;
-						} else {
-							/* sockbuf[which]->uncommittedBytes = sockbuf[which]->unfilteredBytes;
-							sockbuf[which]->unfilteredBytes.clear(); */  // try leaving the unfilteredBytes data
+			} else {
+				size_t buflen = sockbuf[which]->uncommittedLength();
+				size_t rawlen = sockbuf[which]->unfilteredBytes.length();
+				size_t buflenInitial = buflen;
 
-							// don't know how much we need, but let the later bit take care of it
-							needToRead[which] = UNKNOWN;
-						}
-						break;
+				switch(instruction.type) {
+				case Instruction::ThruDelimiter: {
+					size_t delimPos = findDelimiter(which, instruction);
+					if (delimPos != std::string::npos) {
+						sockbuf[which]->unfilteredBytes.moveTo(
+							sockbuf[which]->uncommittedBytes,
+							delimPos + instruction.delimiterLength
+						);
+						buflen += delimPos+instruction.delimiterLength;
+						needToRead[which] = 0;
+					} else {
+						/* sockbuf[which]->uncommittedBytes = sockbuf[which]->unfilteredBytes;
+						sockbuf[which]->unfilteredBytes.clear(); */  // try leaving the unfilteredBytes data
+
+						// don't know how much we need, but let the later bit take care of it
+						needToRead[which] = UNKNOWN;
 					}
+					break;
+				}
+
+				case Instruction::BytesExact: {
+					if (buflen + rawlen >= instruction.exactByteCount) {
+						// just take enough unfilteredBytes data to get up to size
+						size_t difference = instruction.exactByteCount - buflen;
+						sockbuf[which]->unfilteredBytes.moveTo(
+							sockbuf[which]->uncommittedBytes,
+							difference
+						);
+						buflen += difference;
+						rawlen -= difference;
 
-					case Instruction::BytesExact: {
-						BytesExactInstruction const * inst =
-							dynamic_cast<BytesExactInstruction const *>(instruction);
-						if (buflen + rawlen >= inst->exactByteCount) {
+						needToRead[which] = 0;
+					} else {
+						needToRead[which] = instruction.exactByteCount - (buflen + rawlen);
+					}
+					break;
+				}
+
+				case Instruction::BytesMax: {
+					if (instruction.maxByteCount <= buflen) {
+						needToRead[which] = 0;
+					} else {
+						// not enough uncommittedBytes data in buffer already
+						// but try unfilteredBytes source first...
+
+						if (buflen + rawlen>= instruction.maxByteCount) {
 							// just take enough unfilteredBytes data to get up to size
-							size_t difference = inst->exactByteCount - buflen;
-							sockbuf[which]->uncommittedBytes +=
-								sockbuf[which]->unfilteredBytes.substr(0, difference);
+							size_t difference = instruction.maxByteCount - buflen;
+							sockbuf[which]->unfilteredBytes.moveTo(
+								sockbuf[which]->uncommittedBytes,
+								difference
+							);
 							buflen += difference;
-							sockbuf[which]->unfilteredBytes.erase(0, difference);
 							rawlen -= difference;
 
 							needToRead[which] = 0;
 						} else {
-							needToRead[which] = inst->exactByteCount - (buflen + rawlen);
+							// the unfilteredBytes data couldn't satisfy
+							// might as well take it all...
+							sockbuf[which]->unfilteredBytes.moveTo(
+								sockbuf[which]->uncommittedBytes,
+								rawlen
+							);
+							buflen += rawlen;
+							rawlen = 0;
+
+							needToRead[which] = instruction.maxByteCount - buflen;
 						}
-						break;
 					}
+					break;
+				}
 
-					case Instruction::BytesMax: {
-						BytesMaxInstruction const * inst =
-							dynamic_cast<BytesMaxInstruction const *>(instruction);
-
-						if (inst->maxByteCount <= buflen) {
-							needToRead[which] = 0;
-						} else {
-							// not enough uncommittedBytes data in buffer already
-							// but try unfilteredBytes source first...
-
-							if (buflen + rawlen>= inst->maxByteCount) {
-								// just take enough unfilteredBytes data to get up to size
-								size_t difference = inst->maxByteCount - buflen;
-								sockbuf[which]->uncommittedBytes +=
-									sockbuf[which]->unfilteredBytes.substr(0, difference);
-								buflen += difference;
-								sockbuf[which]->unfilteredBytes.erase(0, difference);
-								rawlen -= difference;
-
-								needToRead[which] = 0;
-							} else {
-								// the unfilteredBytes data couldn't satisfy
-								// might as well take it all...
-								sockbuf[which]->uncommittedBytes += sockbuf[which]->unfilteredBytes;
-								buflen += rawlen;
-
-								sockbuf[which]->unfilteredBytes.clear();
-								rawlen = 0;
-
-								needToRead[which] = inst->maxByteCount - buflen;
-							}
-						}
-						break;
-					}
-							
-					case Instruction::BytesUnknown: {
-						// the unfilteredBytes data won't satisfy
-						// might as well take it all...
-						sockbuf[which]->uncommittedBytes += sockbuf[which]->unfilteredBytes;
-						buflen += rawlen;
-
-						sockbuf[which]->unfilteredBytes.clear();
-						rawlen = 0;
-						needToRead[which] = UNKNOWN;
+				case Instruction::BytesUnknown: {
+					// the unfilteredBytes data won't satisfy
+					// might as well take it all...
+					sockbuf[which]->unfilteredBytes.moveTo(
+						sockbuf[which]->uncommittedBytes,
+						rawlen
+					);
+					buflen += rawlen;
+					rawlen = 0;
+					needToRead[which] = UNKNOWN;
 
-						break;
-					}
+					break;
+				}
 
-					default:
-						NotReached();
-						break;
-					}
+				default:
+					NotReached();
+					break;
+				}
 
-					// filter the uncommittedBytes data that we just "read"
-					// we currently don't queue writing it yet
-					received[which] = buflen;
-					readSoFar[which] += buflen - buflenInitial;
-					if (buflen - buflenInitial > 0) {
-						filterHelper(
-							which,
-							buflenInitial,
-							readSoFar[which],
-							*filter[which],
-							false
-						);
+				// filter the uncommittedBytes data that we just "read"
+				// we currently don't queue writing it yet
+				readSoFar[which] += buflen - buflenInitial;
+				if (buflen - buflenInitial > 0) {
+					filterHelper(
+						which,
+						buflenInitial,
+						readSoFar[which],
+						*filter[which],
+						false
+					);
 
-						// okay, there's got to be a better way to do this...
-						// but now we have a new instruction,
-						// so we might need to recompute...
-						goto LTryAgain; 
-					}
+					// okay, there's got to be a better way to do this...
+					// but now we have a new instruction,
+					// so we might need to recompute...
+					goto LTryAgain;
 				}
 			}
 		}
+	}
+
+	if (
+		(needToRead[ServerConnection].isKnownToBe(0))
+		&& (needToWrite[ServerConnection] == 0)
+		&& (needToWrite[ClientConnection] == 0)
+		&& (needToRead[ClientConnection].isKnownToBe(0))
+		&& !sockbuf[ServerConnection]->hasSendsInFlight()
+		&& !sockbuf[ClientConnection]->hasSendsInFlight()
+		&& !(connectWait && connectPending())
+	) {
+		finishFilteredProxy();
+		return true;
+	}
 
+#ifdef WITH_SPLICE
+	if (beginSplice())
+		return planSplice();
+#endif
+
+	// Okay, now we know what we're doing.  We reset the sizes each time which is
+	// somewhat inefficient but I'm trying this angle...
+	FlowDirection which;
+	ForEachDirection(which) {
+		interest[which] = 0;
+
+		// don't read more while what the last reads turned into is still
+		// piling up waiting for the other side to take it
+		size_t queued = needToWrite[OtherDirection(which)];
+		if (sockbuf[OtherDirection(which)]->sock == INVALID_SOCKET)
+			throttled[which] = false;
+		else if (queued >= outputHighWater)
+			throttled[which] = true;
+		else if (queued <= outputLowWater)
+			throttled[which] = false;
+
+		if (!needToRead[which].isKnown() || (needToRead[which].getKnownValue() > 0)) {
+			if (!throttled[which])
+				interest[which] |= POLLIN;
+		}
+
+		// (a send the event loop is still working on counts, so we hear
+		// when it's done)
+		if ((needToWrite[which] > 0) || sockbuf[which]->hasSendsInFlight())
+			interest[which] |= POLLOUT;
+
+		// a socket still connecting is only good for hearing that it's done
 		if (
-			(needToRead[ServerConnection].isKnownToBe(0))
-			&& (needToWrite[ServerConnection] == 0)
-			&& (needToWrite[ClientConnection] == 0)
-			&& (needToRead[ClientConnection].isKnownToBe(0))
+			(sockbuf[which]->sock != INVALID_SOCKET)
+			&& sockbuf[which]->isConnecting()
 		) {
-			break;
+			interest[which] = ((interest[which] != 0) || connectWait) ? POLLOUT : 0;
 		}
+	}
+	return false;
+}
+
 
-		// Okay, now we know what we're doing.  We reset the sizes each time which is 
-		// somewhat inefficient but I'm trying this angle...
+bool Parasock::pumpFilteredProxy(short const (&revents)[FlowDirectionMax]) {
+	Assert(proxying);
 
-		Knowable<size_t> needToReadLast[FlowDirectionMax] = { UNKNOWN, UNKNOWN };
-		size_t needToWriteLast[FlowDirectionMax];
+	if (pollFailed) {
+		proxying = false;
+		throw "Poll error not EINTR or EAGAIN";
+	}
 
-		MYPOLLFD fds[FlowDirectionMax];
-		{
-			FlowDirection which;
-			ForEachDirection(which) {
-				needToReadLast[which] = needToRead[which];
-				needToWriteLast[which] = needToWrite[which];
+	if (timedOut) {
+		// timeout period elapsed without necessary data being fulfilled
+		finishFilteredProxy();
+		return true;
+	}
 
-				fds[which].fd = sockbuf[which]->sock;
-				fds[which].events = 0;
+	// An error or hangup counts as readiness for whatever we were waiting
+	// on, so that the send or recv can come back with the real story.
+	short const ready = POLLERR | POLLHUP;
 
-				if (!needToRead[which].isKnown() || (needToRead[which].getKnownValue() > 0))
-					fds[which].events |= POLLIN;
-				
-				if (needToWrite[which] > 0)
-					fds[which].events |= POLLOUT;
+	{
+		FlowDirection which;
+		ForEachDirection(which) {
+			if (revents[which] & POLLNVAL) {
+				proxying = false;
+				throw "POLLERR|POLLHUP|POLLNVAL";
 			}
 		}
+	}
 
-		// do the poll of the sockets and check the result
-		{
-			int pollRes = poll(fds, FlowDirectionMax, timeout);
-			if (pollRes == SOCKET_ERROR) {
-				int errorno = WSAGetLastError();
-				if (errorno == EINTR) {
-					usleep(SLEEPTIME);
-	 				continue;
-				}
-				if (errorno == EAGAIN)
-					continue;
-				throw "Poll error not EINTR or EAGAIN";
+#ifdef WITH_SPLICE
+	if (splicing) {
+		FlowDirection which;
+		ForEachDirection(which) {
+			// sends first, they make room in the pipes
+			if (
+				(revents[OtherDirection(which)] & (POLLOUT | ready))
+				&& (interest[OtherDirection(which)] & POLLOUT)
+				&& (inPipe[which] > 0)
+			) {
+				spliceOut(which);
 			}
-			if (pollRes == 0) {
-				// timeout period elapsed without necessary data being fulfilled
-				timedOut = true;
-				return;
+		}
+		ForEachDirection(which) {
+			if (
+				(revents[which] & (POLLIN | ready))
+				&& (interest[which] & POLLIN)
+			) {
+				spliceIn(which);
 			}
+		}
+		return planSplice();
+	}
+#endif
 
-			FlowDirection which;
-			ForEachDirection(which) {
-			if ( fds[which].revents & (POLLERR|POLLHUP|POLLNVAL ))
-				throw "POLLERR|POLLHUP|POLLNVAL";
+	{ // see to connects that were waiting to be writable
+		FlowDirection which;
+		ForEachDirection(which) {
+			if (
+				(revents[which] & (POLLOUT | ready))
+				&& (interest[which] & POLLOUT)
+				&& sockbuf[which]->isConnecting()
+			) {
+				completeConnect(which);
 			}
 		}
+	}
 
-		{ // do the sends, small chunks so we can time out?
-			FlowDirection which;
-			ForEachDirection(which) {
-				if (fds[which].revents & POLLOUT) {
-					Assert(needToWrite[which] > 0);
-
-					size_t bytesSent = 0;
-
-					while (
-						!sockbuf[which]->placeholders.empty()
-						&& sockbuf[which]->placeholders.front()->contentsKnown
-					) {
-						Placeholder * placeholder = sockbuf[which]->placeholders.front();
-						Assert(!placeholder->contents.empty());
-
-						size_t len = placeholder->contents.length();
-
-						int res;
-						std::string soFar;
-						if (true) {
-							// is same as send on bound socket?
-							// Should it be okay that we pass in the sin at all times?
-							res = socksendto(
-								sockbuf[which]->sock,
-								&sockbuf[which]->sin,
-								placeholder->contents.c_str(),
-								static_cast<int>(len), timeout
-							); 
-						} else {
-							for (size_t index = 0; index < len; index++) {
-								res = socksendto(
-									sockbuf[which]->sock,
-									&sockbuf[which]->sin,
-									placeholder->contents.c_str() + index,
-									static_cast<int>(1),
-									timeout
-								);
-								if (res != 1)
-									break;
-								soFar += placeholder->contents[index];
-							}
-							if (res == 1)
-								res = static_cast<int>(len);
-						}
+	{ // do the sends
+		FlowDirection which;
+		ForEachDirection(which) {
+			if (
+				(revents[which] & (POLLOUT | ready))
+				&& (interest[which] & POLLOUT)
+				&& (needToWrite[which] > 0)
+				&& !sockbuf[which]->isConnecting()
+			) {
+				sendFilteredProxy(which);
+			}
+		}
+	}
 
-						if (res < 0) {
-							int errcode = WSAGetLastError();
+	{ // do the receives
+		FlowDirection which;
+		ForEachDirection(which) {
+			if (
+				(revents[which] & (POLLIN | ready))
+				&& (interest[which] & POLLIN)
+			) {
+				receiveFilteredProxy(which);
+			}
+		}
+	}
 
-							if (errcode == WSAECONNABORTED) {
-								socketClosed[which] = true;
-								sockbuf[which]->shutdownAndClose(); // cleanup
-								break;
-							}
+	return planFilteredProxy();
+}
 
-							if (errcode == WSAECONNRESET) {
-								socketClosed[which] = true;
-								sockbuf[which]->shutdownAndClose(); // cleanup
-								break;
-							}
 
-							// Not simply a connection closed by server or client :-(
-							throw "General socket writing exception.";
-						}
+void Parasock::completeConnect(FlowDirection which) {
+	int error = sockbuf[which]->completeConnect();
+	if (error == EINPROGRESS)
+		return;
 
-						sockbuf[which]->bytesWrittenSoFar += placeholder->contents;
-						Assert(res == len);
-						sent[which] += static_cast<size_t>(res);
-						sentSoFar[which] += static_cast<size_t>(res);
-						Assert(static_cast<size_t>(res) <= needToWrite[which]);
-						needToWrite[which] -= res;
-						
-						delete placeholder;
+	if (error != 0) {
+		proxying = false;
+		connectWait = false;
+		throw "Could not connect socket";
+	}
+	lastProgress = time(NULL);
+}
 
-						sockbuf[which]->placeholders.pop_front();
-					}
-				}
+
+void Parasock::sendFilteredProxy(FlowDirection which) {
+	Assert(needToWrite[which] > 0);
+
+	while (sockbuf[which]->getKnownWriteBytes() > 0) {
+		size_t offered;
+		int res = sockbuf[which]->sendKnownWrites(offered);
+
+		if (res < 0) {
+			int errcode = WSAGetLastError();
+
+			// the socket buffer is full, we'll get the rest out next time
+			if (errcode == EAGAIN)
+				break;
+
+			if (errcode == WSAECONNABORTED) {
+				socketClosed[which] = true;
+				sockbuf[which]->shutdownAndClose(); // cleanup
+				break;
+			}
+
+			if (errcode == WSAECONNRESET) {
+				socketClosed[which] = true;
+				sockbuf[which]->shutdownAndClose(); // cleanup
+				break;
 			}
+
+			// Not simply a connection closed by server or client :-(
+			throw "General socket writing exception.";
 		}
 
-		{ // do the receives
-			FlowDirection which;
-			ForEachDirection(which) {
-				if ((fds[which].revents & POLLIN)) {
-					Assert(
-						!needToRead[which].isKnown()
-						|| (needToRead[which].getKnownValue() > 0)
-					);
+		lastProgress = time(NULL);
+		sentSoFar[which] += static_cast<size_t>(res);
+		Assert(static_cast<size_t>(res) <= needToWrite[which]);
+		needToWrite[which] -= res;
 
-					
-					size_t buflen = sockbuf[which]->uncommittedBytes.length();
-					if (
-						(filter[which]->currentInstruction()->type == Instruction::ThruDelimiter)
-						|| (filter[which]->currentInstruction()->type == Instruction::BytesExact)
-					) {
-						// we put the unfilteredBytes data in when it is ready...
-						// so then we know the proper offset to tell the filter
-					} else {
-						// why read a socket when we have unfilteredBytes data?
-						Assert(sockbuf[which]->unfilteredBytes.empty());
-					}
+		if (static_cast<size_t>(res) < offered) {
+			// only took part of it, so the socket is full for now
+			break;
+		}
+	}
+}
 
-					while (
-						true
-						/* !needToRead[which].isKnown() || (needToRead[which].getKnownValue() > 0) */
-					) {
-						char buffer[BUFSIZE];
-						int len = sockrecvfrom(
-							sockbuf[which]->sock,
-							&sockbuf[which]->sin,
-							buffer,
-							BUFSIZE,
-							timeout
-						);
 
-						if (len == 0) {
-							readAZero[which] = true;
-							needToRead[which] = 0;
+void Parasock::receiveFilteredProxy(FlowDirection which) {
+	Assert(
+		!needToRead[which].isKnown()
+		|| (needToRead[which].getKnownValue() > 0)
+	);
 
-							// is disconnect the right semantics?
-							filterHelper(
-								which,
-								buflen,
-								readSoFar[which],
-								*filter[which],
-								true
-							); 
-
-							// we got all the currently available data, we will
-							// poll again later... (unless we were waiting)
-							break; 
-
-						} else if (len < 0) { 
-
-							// error, or possibly we just need to retry later?
-							int errorno = WSAGetLastError();
-							if ((errorno == EAGAIN) || (errorno == EINTR))
-								break;
-							
-							if (errorno == WSAECONNABORTED) {
-								socketClosed[which] = true;
-								sockbuf[which]->shutdownAndClose();
-								filterHelper(
-									which,
-									buflen,
-									readSoFar[which],
-									*filter[which],
-									true
-								);
-								break;
-							}
-
-							if (errorno == WSAECONNRESET) {
-								socketClosed[which] = true;
-								sockbuf[which]->shutdownAndClose();
-								filterHelper(
-									which,
-									buflen,
-									readSoFar[which],
-									*filter[which],
-									true
-								);
-								break;
-							}
-
-							// Neither client nor server reset. :-/
-							throw "Socket reading exception not due to reset.";
+	size_t buflen = sockbuf[which]->uncommittedLength();
+	if (
+		(filter[which]->currentInstruction().type == Instruction::ThruDelimiter)
+		|| (filter[which]->currentInstruction().type == Instruction::BytesExact)
+	) {
+		// we put the unfilteredBytes data in when it is ready...
+		// so then we know the proper offset to tell the filter
+	} else {
+		// why read a socket when we have unfilteredBytes data?
+		Assert(sockbuf[which]->unfilteredBytes.empty());
+	}
 
-						} else {
+	// Read straight into the end of the unfilteredBytes chain, then move
+	// along however much of it the instruction says the filter should see
+	SegmentBuffer & unfiltered = sockbuf[which]->unfilteredBytes;
+	size_t rawlen = unfiltered.length();
+	size_t received = 0;
+	int len;
+	receiveWakeups[which]++;
+	for (;;) {
+		size_t available;
+		char * space = unfiltered.reserve(receiveSize[which], available);
+		size_t asked = std::min(available, receiveSize[which]);
+		len = sockbuf[which]->receiveReady(space, static_cast<int>(asked));
+		receiveCalls[which]++;
+		if (len <= 0)
+			break;
 
-							sockbuf[which]->bytesReadSoFar.append(buffer, len);
-							received[which] += len;
-
-							// better timeout handling?  will be easier when code is tightened
-							// here we got data
-							size_t buflenInitial = buflen;
-							Instruction const * instruction = filter[which]->currentInstruction();
-							Assert(instruction->type != Instruction::QuitFilter);
-							if (instruction->type == Instruction::BytesUnknown) {
-
-								// If we don't know how much data we're expecting, any amount is fine
-								sockbuf[which]->uncommittedBytes.append(buffer, len);
-								buflen += len;
-
-							} else if (instruction->type == Instruction::BytesMax) {
-								if (static_cast<size_t>(len) <= needToRead[which].getKnownValue()) {
-
-									// not enough data to fulfill our entire request
-									// we should still offer the filter the opportunity to run, though...
-									sockbuf[which]->uncommittedBytes.append(buffer, len);
-									buflen += len;
-
-								} else {
-
-									// too much data received, we don't want the filter to see it all
-									// because we might want a different filter to run
-									sockbuf[which]->uncommittedBytes.append(
-										buffer,
-										needToRead[which].getKnownValue()
-									);
-									buflen += needToRead[which].getKnownValue();
-									sockbuf[which]->unfilteredBytes.append(
-										buffer + needToRead[which].getKnownValue(),
-										len - needToRead[which].getKnownValue()
-									);
-								}
-
-							} else if (instruction->type == Instruction::ThruDelimiter) {
-								ThruDelimiterInstruction const * inst =
-									dynamic_cast<ThruDelimiterInstruction const *>(instruction);
-
-								sockbuf[which]->unfilteredBytes.append(buffer, len);
-								size_t delimPos = sockbuf[which]->unfilteredBytes.find(inst->delimiter);
-								if (delimPos != std::string::npos) {
-									sockbuf[which]->uncommittedBytes += 
-										sockbuf[which]->unfilteredBytes.substr(
-											0, delimPos + inst->delimiter.length()
-										);
-									sockbuf[which]->unfilteredBytes.erase(
-										0,
-										delimPos + inst->delimiter.length()
-									);
-									buflen += delimPos + inst->delimiter.length();
-								}
-							} else if (instruction->type == Instruction::BytesExact) {
-								ThruDelimiterInstruction const * inst =
-									dynamic_cast<ThruDelimiterInstruction const *>(instruction);
-
-								if (static_cast<size_t>(len) >= needToRead[which].getKnownValue()) {
-									sockbuf[which]->uncommittedBytes += sockbuf[which]->unfilteredBytes;
-									buflen += sockbuf[which]->unfilteredBytes.length();
-									sockbuf[which]->unfilteredBytes.clear();
-									sockbuf[which]->uncommittedBytes.append(
-										buffer,
-										needToRead[which].getKnownValue()
-									);
-									buflen += needToRead[which].getKnownValue();
-									sockbuf[which]->unfilteredBytes.append(
-										buffer + needToRead[which].getKnownValue(),
-										len - needToRead[which].getKnownValue()
-									);
-								} else {
-									sockbuf[which]->unfilteredBytes.append(buffer, len);
-								}
-
-							} else {
-								NotReached();
-							}
-
-							size_t difference = buflen - buflenInitial;
-							readSoFar[which] += difference;
-
-							if (difference > 0) {
-								filterHelper(which, buflenInitial, readSoFar[which], *filter[which], false);
-							}
-
-							instruction = filter[which]->currentInstruction();
-							if (instruction->type == Instruction::BytesMax) {
-								BytesMaxInstruction const * inst =
-									dynamic_cast<BytesMaxInstruction const*>(instruction);
-
-								needToRead[which] = inst->maxByteCount;
-							} else if (instruction->type == Instruction::ThruDelimiter) {
-								ThruDelimiterInstruction const * inst =
-									dynamic_cast<ThruDelimiterInstruction const *>(instruction);
-
-								if (difference > 0)
-									needToRead[which] = 0;
-							} else if (instruction->type == Instruction::QuitFilter) {
-								needToRead[which] = 0;
-							}
-						}
+		if (capture.get() != NULL)
+			capture->record(which, CaptureReceived, space, len);
+		unfiltered.commit(len);
+		received += len;
+
+		// reads that fill what they're given mean a fast sender, so ask
+		// for more next time; ones that come back mostly empty, less
+		if (static_cast<size_t>(len) == asked) {
+			receiveSize[which] = std::min(receiveSize[which] * 2, receiveLimit);
+		} else if (static_cast<size_t>(len) < asked / 4) {
+			receiveSize[which] = std::max(
+				receiveSize[which] / 2,
+				std::min(static_cast<size_t>(RECEIVEMIN), receiveLimit)
+			);
+		}
 
-						// TEMPORARY, WE DO NOT LOOP DUE TO POSSIBLE 
-						// DEPENDENCIES OF SENDS/READS
-						break; 
-					}
-				}
-			}
+		// a short read means the socket has nothing more for now
+		if (static_cast<size_t>(len) < asked)
+			break;
+		if (received >= RECEIVEBUDGET)
+			break;
+		if (
+			needToRead[which].isKnown()
+			&& (received >= needToRead[which].getKnownValue())
+		) {
+			break;
 		}
+	}
 
-		if (sleeptime > 0) {
-			if (sleeptime > timeout.getMilliseconds()) {
-				throw "Sleep exceeds timeout in sock mapping.";
-			}
-			usleep(static_cast<DWORD>(sleeptime * SLEEPTIME));
-			sleeptime = 0;
+	int errorno = (len < 0) ? WSAGetLastError() : 0;
+
+	if (received > 0) {
+		filterReceived(which, buflen, rawlen, received);
+
+		// A disconnect after the data can wait for the next wakeup, since
+		// the socket will still be readable.  But an error is only reported
+		// once, so it has to be dealt with now if the filter still cares.
+		if (len >= 0)
+			return;
+		if ((errorno == EAGAIN) || (errorno == EINTR))
+			return;
+		if (filter[which]->currentInstruction().type == Instruction::QuitFilter)
+			return;
+		buflen = sockbuf[which]->uncommittedLength();
+	}
+
+	if (len == 0) {
+		readAZero[which] = true;
+		needToRead[which] = 0;
+
+		// is disconnect the right semantics?
+		filterHelper(
+			which,
+			buflen,
+			readSoFar[which],
+			*filter[which],
+			true
+		);
+
+		// we got all the currently available data, we will
+		// poll again later... (unless we were waiting)
+		return;
+
+	} else if (len < 0) {
+
+		// error, or possibly we just need to retry later?
+		if ((errorno == EAGAIN) || (errorno == EINTR))
+			return;
+
+		if (errorno == WSAECONNABORTED) {
+			socketClosed[which] = true;
+			sockbuf[which]->shutdownAndClose();
+			filterHelper(
+				which,
+				buflen,
+				readSoFar[which],
+				*filter[which],
+				true
+			);
+			return;
+		}
+
+		if (errorno == WSAECONNRESET) {
+			socketClosed[which] = true;
+			sockbuf[which]->shutdownAndClose();
+			filterHelper(
+				which,
+				buflen,
+				readSoFar[which],
+				*filter[which],
+				true
+			);
+			return;
+		}
+
+		// Neither client nor server reset. :-/
+		throw "Socket reading exception not due to reset.";
+	}
+
+	NotReached();
+}
+
+
+// Hand what receiveFilteredProxy read to the filter, as much of it as the
+// instruction says it should see
+void Parasock::filterReceived(
+	FlowDirection which,
+	size_t buflen,
+	size_t rawlen,
+	size_t len
+) {
+	SegmentBuffer & unfiltered = sockbuf[which]->unfilteredBytes;
+	lastProgress = time(NULL);
+
+	// better timeout handling?  will be easier when code is tightened
+	// here we got data
+	size_t buflenInitial = buflen;
+	Instruction const & instruction = filter[which]->currentInstruction();
+	Assert(instruction.type != Instruction::QuitFilter);
+	if (instruction.type == Instruction::BytesUnknown) {
+
+		// If we don't know how much data we're expecting, any amount is fine
+		unfiltered.moveTo(sockbuf[which]->uncommittedBytes, len);
+		buflen += len;
+
+	} else if (instruction.type == Instruction::BytesMax) {
+		if (static_cast<size_t>(len) <= needToRead[which].getKnownValue()) {
+
+			// not enough data to fulfill our entire request
+			// we should still offer the filter the opportunity to run, though...
+			unfiltered.moveTo(sockbuf[which]->uncommittedBytes, len);
+			buflen += len;
+
+		} else {
+
+			// too much data received, we don't want the filter to see it all
+			// because we might want a different filter to run.  The rest
+			// stays in unfilteredBytes.
+			unfiltered.moveTo(
+				sockbuf[which]->uncommittedBytes,
+				needToRead[which].getKnownValue()
+			);
+			buflen += needToRead[which].getKnownValue();
 		}
-	} while (true);
 
+	} else if (instruction.type == Instruction::ThruDelimiter) {
+		size_t delimPos = findDelimiter(which, instruction);
+		if (delimPos != std::string::npos) {
+			unfiltered.moveTo(
+				sockbuf[which]->uncommittedBytes,
+				delimPos + instruction.delimiterLength
+			);
+			buflen += delimPos + instruction.delimiterLength;
+		}
+	} else if (instruction.type == Instruction::BytesExact) {
+		if (static_cast<size_t>(len) >= needToRead[which].getKnownValue()) {
+			unfiltered.moveTo(
+				sockbuf[which]->uncommittedBytes,
+				rawlen + needToRead[which].getKnownValue()
+			);
+			buflen += rawlen + needToRead[which].getKnownValue();
+		}
+
+	} else {
+		NotReached();
+	}
+
+	size_t difference = buflen - buflenInitial;
+	readSoFar[which] += difference;
+
+	if (difference > 0) {
+		filterHelper(which, buflenInitial, readSoFar[which], *filter[which], false);
+	}
+
+	// planFilteredProxy works out what we need to read next from the new
+	// instruction, so there's no bookkeeping of needToRead to do here.
+}
+
+
+void Parasock::pollFilteredProxy(short (&revents)[FlowDirectionMax]) {
+	Assert(proxying);
+
+	// only pass along the sockets we're waiting on
+	MYPOLLFD fds[FlowDirectionMax];
+	FlowDirection polled[FlowDirectionMax];
+	unsigned int count = 0;
 	{
 		FlowDirection which;
 		ForEachDirection(which) {
-			Assert(filter[which]->currentInstruction()->type == Instruction::QuitFilter);
+			revents[which] = 0;
+			if ((interest[which] == 0) || (sockbuf[which]->sock == INVALID_SOCKET))
+				continue;
+			fds[count].fd = sockbuf[which]->sock;
+			fds[count].events = interest[which];
+			fds[count].revents = 0;
+			polled[count] = which;
+			count++;
+		}
+	}
+
+	// don't wait past the deadline, if it comes first
+	Timeout wait = timeout;
+	if (deadline != 0) {
+		time_t remaining = deadline - time(NULL);
+		if (remaining <= 0) {
+			timedOut = true;
+			return;
+		}
+		if (remaining < static_cast<time_t>(timeout.getSeconds()))
+			wait = Timeout (static_cast<int>(remaining));
+	}
+
+	// do the poll of the sockets and check the result
+	int pollRes = poll(fds, count, wait);
+	if (pollRes == SOCKET_ERROR) {
+		int errorno = WSAGetLastError();
+		if (errorno == EINTR) {
+			usleep(SLEEPTIME);
+			return;
+		}
+		if (errorno == EAGAIN)
+			return;
+		pollFailed = true;
+		return;
+	}
+	if (pollRes == 0) {
+		timedOut = true;
+		return;
+	}
+
+	for (unsigned int index = 0; index < count; index++) {
+		revents[polled[index]] = fds[index].revents;
+	}
+}
+
+
+void Parasock::checkFilteredProxyTimeout(time_t now) {
+	if (!proxying)
+		return;
+
+	if (now >= getDeadline())
+		timedOut = true;
+}
+
+
+time_t Parasock::getDeadline() const {
+	time_t idle = lastProgress + static_cast<time_t>(timeout.getSeconds());
+	if ((deadline != 0) && (deadline < idle))
+		return deadline;
+	return idle;
+}
+
+
+void Parasock::finishFilteredProxy() {
+	proxying = false;
+	connectWait = false;
+
+#ifdef WITH_SPLICE
+	endSplice();
+#endif
+
+	FlowDirection which;
+	if (!timedOut) {
+		ForEachDirection(which) {
+			Assert(filter[which]->currentInstruction().type == Instruction::QuitFilter);
 			if (sockbuf[which]->definitelyHasFutureWrites()) {
 				if (sockbuf[which]->disconnected) {
 					throw "Socket dropped with pending write operations.";
 				} else {
 					// we should have proxied all the ready data in the loop,
 					// only excuse is a dead socket...
-					Assert(!sockbuf[which]->hasKnownWritesPending()); 
+					Assert(!sockbuf[which]->hasKnownWritesPending());
 				}
 			}
 		}
 	}
+
+	ForEachDirection(which) {
+		if (
+			socketClosed[which]
+			&& (
+				filter[which]->currentInstruction().type
+				!= Instruction::QuitFilter
+			)
+		) {
+			throw "Socket closed during communication";
+		}
+	}
+}
+
+
+#ifdef WITH_SPLICE
+// Switch over to splicing if everything is lined up for it: the filters
+// just pass data through (or have quit, and want nothing more from their
+// socket), and nothing is buffered in either direction (such as a
+// "Connection established" or a header that hasn't gone out yet).  A
+// direction whose filter has quit isn't spliced, so a response body can be
+// spliced while the client's side sits idle.
+bool Parasock::beginSplice() {
+	Assert(!splicing);
+
+	bool anySpliced = false;
+	FlowDirection which;
+	ForEachDirection(which) {
+		SockBuf & buf = *sockbuf[which];
+		if (!buf.placeholders.empty())
+			return false;
+		if (buf.isConnecting())
+			return false;
+
+		// an io_uring loop has I/O of its own outstanding on the socket
+		if (buf.loopCompletesIo())
+			return false;
+
+		Instruction const & instruction = filter[which]->currentInstruction();
+		if (instruction.type == Instruction::QuitFilter)
+			continue;
+
+		if (!filter[which]->passesThrough())
+			return false;
+		if (
+			(instruction.type != Instruction::BytesUnknown)
+			&& (instruction.type != Instruction::BytesMax)
+		) {
+			return false;
+		}
+		if ((buf.sock == INVALID_SOCKET) || readAZero[which])
+			return false;
+		if (!buf.unfilteredBytes.empty() || !buf.uncommittedBytes.empty())
+			return false;
+		anySpliced = true;
+	}
+	if (!anySpliced)
+		return false;
+
+	ForEachDirection(which) {
+		inPipe[which] = 0;
+		Instruction const & instruction = filter[which]->currentInstruction();
+		if (instruction.type == Instruction::QuitFilter)
+			continue;
+
+		if (pipe2(pipefd[which], O_NONBLOCK | O_CLOEXEC) == -1) {
+			endSplice();
+			return false;
+		}
+
+		// with nothing buffered, BytesMax is what's left to come
+		if (instruction.type == Instruction::BytesMax)
+			needToRead[which] = instruction.maxByteCount;
+		else
+			needToRead[which] = UNKNOWN;
+	}
+
+	splicing = true;
+	return true;
+}
+
+
+// Data for a direction is read from sockbuf[which] into its pipe, and
+// sent on out of the pipe to the other socket.
+bool Parasock::planSplice() {
+	Assert(splicing);
+
+	bool finished = true;
+
+	FlowDirection which;
+	ForEachDirection(which) {
+		interest[which] = 0;
+	}
+
+	ForEachDirection(which) {
+		FlowDirection other = OtherDirection(which);
+		if (sockbuf[other]->sock == INVALID_SOCKET)
+			continue; // nowhere for anything to go
+
+		bool sourceOpen =
+			(pipefd[which][0] != -1)
+			&& (sockbuf[which]->sock != INVALID_SOCKET)
+			&& !readAZero[which]
+			&& !needToRead[which].isKnownToBe(0);
+
+		if (sourceOpen && (inPipe[which] < SPLICEMAX))
+			interest[which] |= POLLIN;
+
+		if (inPipe[which] > 0)
+			interest[other] |= POLLOUT;
+
+		if (sourceOpen || (inPipe[which] > 0))
+			finished = false;
+	}
+
+	if (finished) {
+		finishFilteredProxy();
+		return true;
+	}
+	return false;
+}
+
+
+void Parasock::spliceIn(FlowDirection which) {
+	Assert(inPipe[which] < SPLICEMAX);
+
+	// not a byte past what the filter said was coming, which could be the
+	// start of the next response on the same connection
+	size_t most = SPLICEMAX - inPipe[which];
+	if (needToRead[which].isKnown())
+		most = std::min(most, needToRead[which].getKnownValue());
+	Assert(most > 0);
+
+	ssize_t len = splice(
+		sockbuf[which]->sock,
+		NULL,
+		pipefd[which][1],
+		NULL,
+		most,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+	);
+
+	if (len < 0) {
+		int errorno = WSAGetLastError();
+		if ((errorno == EAGAIN) || (errorno == EINTR))
+			return;
+
+		if ((errorno != WSAECONNABORTED) && (errorno != WSAECONNRESET))
+			throw "Socket reading exception not due to reset.";
+
+		socketClosed[which] = true;
+		sockbuf[which]->shutdownAndClose();
+		len = 0;
+	}
+
+	if (len == 0) {
+		// same as any other disconnect, the filter gets to hear about it
+		readAZero[which] = true;
+		needToRead[which] = 0;
+		filterHelper(which, 0, readSoFar[which], *filter[which], true);
+		return;
+	}
+
+	lastProgress = time(NULL);
+	inPipe[which] += len;
+	readSoFar[which] += len;
+
+	if (needToRead[which].isKnown()) {
+		needToRead[which] = needToRead[which].getKnownValue() - len;
+		if (needToRead[which].isKnownToBe(0)) {
+			// that's everything, and the filter gets to say it's done
+			filterHelper(which, 0, readSoFar[which], *filter[which], false);
+		}
+	}
+}
+
+
+void Parasock::spliceOut(FlowDirection which) {
+	FlowDirection other = OtherDirection(which);
+	Assert(inPipe[which] > 0);
+
+	ssize_t len = splice(
+		pipefd[which][0],
+		NULL,
+		sockbuf[other]->sock,
+		NULL,
+		inPipe[which],
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+	);
+
+	if (len < 0) {
+		int errcode = WSAGetLastError();
+		if ((errcode == EAGAIN) || (errcode == EINTR))
+			return;
+
+		if (
+			(errcode == WSAECONNABORTED)
+			|| (errcode == WSAECONNRESET)
+			|| (errcode == EPIPE)
+		) {
+			socketClosed[other] = true;
+			sockbuf[other]->shutdownAndClose(); // cleanup
+			return;
+		}
+
+		throw "General socket writing exception.";
+	}
+
+	lastProgress = time(NULL);
+	inPipe[which] -= len;
+	sentSoFar[other] += len;
+}
+
+
+void Parasock::endSplice() {
+	splicing = false;
+
+	FlowDirection which;
+	ForEachDirection(which) {
+		for (int end = 0; end < 2; end++) {
+			if (pipefd[which][end] != -1) {
+				close(pipefd[which][end]);
+				pipefd[which][end] = -1;
+			}
+		}
+		inPipe[which] = 0;
+	}
+}
+#endif
+
+
+Parasock::~Parasock() {
+#ifdef WITH_SPLICE
+	endSplice();
+#endif
+}
+
+
+void Parasock::setOutputWaterMarks(size_t high, size_t low) {
+	Assert(high > 0);
+	Assert(low < high);
+	outputHighWater = high;
+	outputLowWater = low;
+}
+
+
+void Parasock::setReceiveLimit(size_t limit) {
+	Assert(limit > 0);
+	receiveLimit = std::min(limit, static_cast<size_t>(SEGMENTSIZE));
+
+	FlowDirection which;
+	ForEachDirection(which) {
+		receiveSize[which] = std::min(receiveSize[which], receiveLimit);
+	}
+}
+
+
+void Parasock::startCapture(size_t capacity) {
+	capture.reset(new CaptureRing (capacity));
+	attachCapture();
+}
+
+
+void Parasock::attachCapture() {
+	FlowDirection which;
+	ForEachDirection(which) {
+		if (sockbuf[which].get() != NULL) {
+			sockbuf[which]->capture = capture.get();
+			sockbuf[which]->captureConnection = which;
+		}
+	}
+}
+
+
+bool Parasock::dumpCapture(std::string const & filename) const {
+	if (capture.get() == NULL)
+		return false;
+	return capture->dump(filename);
+}
+
+
+void Parasock::attachHandler(ReactorHandler * handler) {
+	FlowDirection which;
+	ForEachDirection(which) {
+		watch[which].handler = handler;
+	}
+}
+
+
+void Parasock::updateWatches() {
+	Assert(isAttached());
+	EventLoop * loop = watch[ClientConnection].handler->eventLoop();
+
+	FlowDirection which;
+	ForEachDirection(which) {
+		SOCKET sock = INVALID_SOCKET;
+		if (sockbuf[which].get() != NULL) {
+			sockbuf[which]->watch = &watch[which];
+			sock = sockbuf[which]->sock;
+		}
+		loop->setInterest(watch[which], sock, proxying ? interest[which] : 0);
+	}
 }
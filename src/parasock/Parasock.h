@@ -12,8 +12,14 @@
 #define __PARASOCK_PARASOCK_H__
 
 #include "SockBuf.h"
+#include "Reactor.h"
+
+#if defined(__linux__) && !defined(WITHOUT_SPLICE)
+#define WITH_SPLICE
+#endif
 
 class Filter;
+class Instruction;
 
 enum FlowDirection {
 	ClientToServer,
@@ -40,16 +46,110 @@ public:
 		WhichConnectionMax
 	};
 
+private:
+	// Declared ahead of the sockbufs so it outlives them; a SockBuf that is
+	// closing takes its socket back out of the event loop.
+	ReactorWatch watch[WhichConnectionMax];
+
+	// The same goes for the capture, which the sockbufs record into
+	std::auto_ptr<CaptureRing> capture;
+
+	void attachCapture();
+
 public: // Need to work on this to make it private, 3Proxy startup is wily
 	std::auto_ptr<SockBuf> sockbuf[WhichConnectionMax];
-	Parasock () {
-	}
+	Parasock ();
 
 private:
 	// Disable copying C++98 style
 	Parasock (Parasock const & other);
 
+// The state of a filtered proxy operation.  This used to live on the stack
+// of doBidirectionalFilteredProxyCore, but it is kept here so an operation
+// can be started, fed readiness one poll at a time, and finished later.
+// A thread can do that by blocking in poll, or an event loop can do it for
+// many Parasocks at once.
+private:
+	bool proxying;
+	Filter * filter[FlowDirectionMax];
+	std::auto_ptr<Filter> ownedFilter[FlowDirectionMax];
+	size_t readSoFar[FlowDirectionMax];
+	size_t sentSoFar[FlowDirectionMax];
+	bool socketClosed[FlowDirectionMax];
+	bool readAZero[FlowDirectionMax];
+	Knowable<size_t> needToRead[FlowDirectionMax];
+	size_t needToWrite[FlowDirectionMax];
+	short interest[FlowDirectionMax];
+
+	// How much of the unfilteredBytes is known not to hold the start of a
+	// ThruDelimiter instruction's delimiter, so a slow sender's long line
+	// isn't searched again from the beginning every time more arrives
+	size_t delimiterScanned[FlowDirectionMax];
+
+	// The operation times out when it goes the timeout without progress, or
+	// when it reaches the deadline no matter what (if there is one)
+	bool timedOut;
+	bool pollFailed;
+	Timeout timeout;
+	time_t lastProgress;
+	time_t deadline;
+
+// A socket whose connect is still going is waited on by an operation with
+// something to send it or read from it, and otherwise left to it.  An
+// operation begun with beginConnectWait waits on it regardless.
+private:
+	bool connectWait;
+
+	bool connectPending() const;
+	void completeConnect(FlowDirection which);
+
+// Filters can turn what they read into output far faster than a slow
+// receiver takes it.  So once the output known and waiting for one socket
+// reaches the high water mark, the other socket isn't read from until the
+// output has drained to the low water mark.  throttled is indexed like
+// needToRead, by the socket that isn't being read.
+//
+// Output behind a placeholder that isn't filled in yet isn't counted, as
+// it may need more input before it can go; pausing the read that would
+// fill it in would stall.  Whatever piles up there isn't bounded by this.
 private:
+	size_t outputHighWater;
+	size_t outputLowWater;
+	bool throttled[FlowDirectionMax];
+
+// A readable socket is read until it runs dry (or the filter has all it
+// asked for), up to a budget per wakeup, so a fast sender doesn't cost a
+// trip through poll every few kilobytes.  The size asked for in each read
+// grows while reads keep filling it and shrinks when they don't, but never
+// past receiveLimit.  These persist from one operation to the next.
+private:
+	size_t receiveLimit;
+	size_t receiveSize[FlowDirectionMax];
+	size_t receiveWakeups[FlowDirectionMax];
+	size_t receiveCalls[FlowDirectionMax];
+
+#ifdef WITH_SPLICE
+// When the filters would pass everything through untouched (both ways for a
+// CONNECT tunnel, say, or one way for a body that isn't being filtered),
+// the data is moved from socket to socket through a pipe with splice() and
+// never copied into our memory.  inPipe is indexed like readSoFar, by the
+// direction the data flows.  A filter that knows how much is coming is
+// spliced no further than that, and run again to quit when it's all in.
+private:
+	bool splicing;
+	int pipefd[FlowDirectionMax][2];
+	size_t inPipe[FlowDirectionMax];
+
+	bool beginSplice();
+	bool planSplice();
+	void spliceIn(FlowDirection which);
+	void spliceOut(FlowDirection which);
+	void endSplice();
+#endif
+
+private:
+	size_t findDelimiter(FlowDirection which, Instruction const & instruction);
+
 	void filterHelper(
 		FlowDirection which,
 		size_t offsetAmount,
@@ -58,38 +158,90 @@ private:
 		bool disconnected
 	);
 
-private:
-	// sends FILTERED data from OtherDirection(which) to which
-	size_t doUnidirectionalProxyCore(
+	void clearState();
+	bool planFilteredProxy();
+	void sendFilteredProxy(FlowDirection which);
+	void receiveFilteredProxy(FlowDirection which);
+	void filterReceived(
 		FlowDirection which,
-		bool & timedOut,
-		bool & socketClosed,
-		Timeout timeout
-	); 
+		size_t buflen,
+		size_t rawlen,
+		size_t len
+	);
+	void finishFilteredProxy();
 
 public:
-	size_t doUnidirectionalProxy(FlowDirection which, Timeout timeout) {
-		bool timedOut;
-		bool socketClosed;
-		size_t bytesSent = doUnidirectionalProxyCore(
-			which,
-			timedOut,
-			socketClosed,
-			timeout
-		);
-		return bytesSent;
-	}
-
-private:
-	void doBidirectionalFilteredProxyCore(
-		size_t (&readSoFar)[FlowDirectionMax],
-		size_t (&sentSoFar)[FlowDirectionMax],
-		bool (&socketClosed)[FlowDirectionMax],
-		bool (&readAZero)[FlowDirectionMax],
-		bool & timedOut,
+	// Starts the filters running.  Returns true if they could finish without
+	// having to wait on the network.  A deadline of zero means only the
+	// timeout (which is restarted by progress) applies.
+	bool beginFilteredProxy(
+		Filter * (&filter)[FlowDirectionMax],
 		Timeout timeout,
-		Filter* (&filter)[FlowDirectionMax]
+		time_t deadline = 0
 	);
+
+	// Just sends what's been queued, with no interest in reading
+	bool beginUnidirectionalProxy(Timeout timeout, time_t deadline = 0);
+
+	// The same, but not finished until any connect started on either socket
+	// is done.  A connect that fails throws.
+	bool beginConnectWait(Timeout timeout, time_t deadline = 0);
+
+	// Hand over the readiness of the sockets (from poll or an event loop)
+	// and whatever I/O is possible gets done.  Returns true when finished.
+	bool pumpFilteredProxy(short const (&revents)[FlowDirectionMax]);
+
+	// The blocking way of getting readiness to pump with
+	void pollFilteredProxy(short (&revents)[FlowDirectionMax]);
+
+	// Event loops don't poll with our timeout, so they check in with this
+	void checkFilteredProxyTimeout(time_t now);
+
+	// When the operation in progress times out if nothing more happens
+	time_t getDeadline() const;
+
+	bool isProxying() const {
+		return proxying;
+	}
+
+	bool hasTimedOut() const {
+		return timedOut;
+	}
+
+	size_t getReadSoFar(FlowDirection which) const {
+		return readSoFar[which];
+	}
+
+	// Bounds on the output waiting for either socket, see throttled
+	void setOutputWaterMarks(size_t high, size_t low);
+
+	// Caps the size of a single read from either socket
+	void setReceiveLimit(size_t limit);
+
+	// Times the socket was found readable, and the reads done for them
+	size_t getReceiveWakeups(FlowDirection which) const {
+		return receiveWakeups[which];
+	}
+
+	size_t getReceiveCalls(FlowDirection which) const {
+		return receiveCalls[which];
+	}
+
+public:
+	// Lets an event loop watch the sockets on behalf of a handler
+	void attachHandler(ReactorHandler * handler);
+
+	bool isAttached() const {
+		return watch[ClientConnection].handler != NULL;
+	}
+
+	// Bring the loop's registrations in line with what the operation in
+	// progress is waiting for (and with any sockets that have changed)
+	void updateWatches();
+
+public:
+	size_t doUnidirectionalProxy(FlowDirection which, Timeout timeout);
+
 public:
 	void doBidirectionalFilteredProxyEx(
 		size_t (&readSoFar)[FlowDirectionMax],
@@ -110,9 +262,28 @@ public:
 		sockbuf[ServerConnection]->cleanCheckpoint();
 	}
 
+	// Keep the last capacity bytes of traffic (plus some bookkeeping) on
+	// both connections, so it can be dumped if something goes wrong
+	void startCapture(size_t capacity);
+
+	bool isCapturing() const {
+		return capture.get() != NULL;
+	}
+
+	// Writes the capture out as a pcap file.  Returns false if there isn't
+	// one or it couldn't be written.
+	bool dumpCapture(std::string const & filename) const;
+
 	void failureShutdown(std::string const message, Timeout timeout) {
 		sockbuf[ClientConnection]->failureShutdown(message, timeout);
 	}
+
+	// Closes the sockets and forgets about them, along with any operation
+	// that was in progress, so the Parasock (with its buffers and settings)
+	// can be used for another pair of connections
+	void recycle();
+
+	virtual ~Parasock();
 };
 
 #endif
@@ -32,21 +32,19 @@ public:
 			Assert(!totalSize.isKnownToBe(0));
 	}
 
-	std::auto_ptr<Instruction> firstInstruction() /* override */ {
+	Instruction firstInstruction() /* override */ {
 		if (!sendFirst.empty())
 			outputString(sendFirst);
 
 		if (!totalSize.isKnown()) {
-			return std::auto_ptr<Instruction>(new BytesUnknownInstruction(0));
+			return BytesUnknownInstruction(0);
 		} else {
-			return std::auto_ptr<Instruction>(
-				new BytesMaxInstruction(totalSize.getKnownValue(), 0)
-			);
+			return BytesMaxInstruction(totalSize.getKnownValue(), 0);
 		}
 	}
 
-	std::auto_ptr<Instruction> runFilter(
-		std::string const & uncommittedBytes,
+	Instruction runFilter(
+		InputSpan const & uncommittedBytes,
 		size_t newDataOffset,
 		size_t readSoFar,
 		bool disconnected
@@ -64,29 +62,31 @@ public:
 
 		Assert(!totalSize.isKnown() || (readSoFar <= totalSize.getKnownValue()));
 
-		outputString(uncommittedBytes);
+		// (nothing, when it's spliced and this is just to hear the end)
+		if (!uncommittedBytes.empty())
+			outputString(uncommittedBytes.str());
 
-		std::auto_ptr<Instruction> instruction;
+		Instruction instruction;
 		if (totalSize.isKnownToBe(readSoFar)) {
-			instruction = std::auto_ptr<Instruction>(
-				new QuitFilterInstruction(uncommittedBytes.length())
-			);
+			instruction = QuitFilterInstruction(uncommittedBytes.length());
 		} else {
 			if (totalSize.isKnown()) {
-				instruction = std::auto_ptr<Instruction>(
-					new BytesMaxInstruction(
-						totalSize.getKnownValue() - readSoFar,
-						uncommittedBytes.length()
-					)
+				instruction = BytesMaxInstruction(
+					totalSize.getKnownValue() - readSoFar,
+					uncommittedBytes.length()
 				);
 			} else {
-				instruction = std::auto_ptr<Instruction>(
-					new BytesUnknownInstruction(uncommittedBytes.length()));
+				instruction = BytesUnknownInstruction(uncommittedBytes.length());
 			}
 		}
 		return instruction;
 	}
 
+	bool passesThrough() const /* override */ {
+		// a known size is kept to by the Parasock, see needToRead
+		return true;
+	}
+
 	~PassthruFilter() /* override */ {
 	}
 };
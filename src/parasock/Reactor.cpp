@@ -0,0 +1,595 @@
+//
+// Reactor.cpp
+//
+// Event loops for driving many Parasocks from a few threads.
+//
+
+#ifdef _WIN32
+#include <process.h>
+#endif
+#include <algorithm>
+
+#include "Reactor.h"
+#include "Uring.h"
+
+#ifdef WITH_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#define MAXEVENTS 256
+
+
+#ifdef WITH_EPOLL
+static unsigned int EpollEventsFromPoll(short events) {
+	unsigned int result = 0;
+	if (events & POLLIN)
+		result |= EPOLLIN;
+	if (events & POLLOUT)
+		result |= EPOLLOUT;
+	return result;
+}
+
+static short PollEventsFromEpoll(unsigned int events) {
+	short result = 0;
+	if (events & EPOLLIN)
+		result |= POLLIN;
+	if (events & EPOLLOUT)
+		result |= POLLOUT;
+	if (events & EPOLLERR)
+		result |= POLLERR;
+	if (events & EPOLLHUP)
+		result |= POLLHUP;
+	return result;
+}
+#endif
+
+
+EventLoop::EventLoop (bool useUring) :
+	handlers (NULL),
+	handlerCount (0),
+	timers (time(NULL)),
+	lastTick (0),
+	stopping (false)
+{
+	InitializeCriticalSection(&adoptMutex);
+	(void)useUring;
+
+#ifdef WITH_EPOLL
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd == -1)
+		throw "Could not create epoll instance for event loop";
+
+	wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakefd == -1)
+		throw "Could not create eventfd for event loop";
+
+	// a NULL data pointer is how the loop recognizes its own wakeups
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev) == -1)
+		throw "Could not watch eventfd for event loop";
+
+#ifdef WITH_IO_URING
+	if (useUring)
+		uring.reset(UringEngine::open(wakefd));
+#endif
+#else
+	// There's no eventfd or pipe we can select on under winsock, so the
+	// loop wakes itself by sending a datagram to a loopback socket.
+	doorbell = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (doorbell == INVALID_SOCKET)
+		throw "Could not create doorbell socket for event loop";
+
+	memset(&doorbellAddress, 0, sizeof(doorbellAddress));
+	doorbellAddress.sin_family = AF_INET;
+	doorbellAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	doorbellAddress.sin_port = 0;
+	if (-1 == bind(
+		doorbell,
+		(struct sockaddr *)&doorbellAddress,
+		sizeof(doorbellAddress)
+	)) {
+		throw "Could not bind doorbell socket for event loop";
+	}
+
+	SASIZETYPE size = sizeof(doorbellAddress);
+	if (-1 == getsockname(
+		doorbell,
+		(struct sockaddr *)&doorbellAddress,
+		&size
+	)) {
+		throw "getsockname on event loop doorbell did not work";
+	}
+
+	unsigned long ul = 1;
+	ioctlsocket(doorbell, FIONBIO, &ul);
+#endif
+}
+
+
+void EventLoop::adopt(ReactorHandler * handler) {
+	Assert(handler->loop == NULL);
+
+	pthread_mutex_lock(&adoptMutex);
+	adoptions.push_back(handler);
+	pthread_mutex_unlock(&adoptMutex);
+
+	wake();
+}
+
+
+void EventLoop::notify(ReactorHandler * handler) {
+	pthread_mutex_lock(&adoptMutex);
+	notifications.push_back(handler);
+	pthread_mutex_unlock(&adoptMutex);
+
+	wake();
+}
+
+
+void EventLoop::stop() {
+	stopping = true;
+	wake();
+}
+
+
+void EventLoop::wake() {
+#ifdef WITH_EPOLL
+	unsigned long long one = 1;
+	ssize_t res = write(wakefd, &one, sizeof(one));
+	(void)res; // if the counter is already nonzero we're awake anyway
+#else
+	char bell = 0;
+	sendto(
+		doorbell,
+		&bell,
+		1,
+		0,
+		(struct sockaddr *)&doorbellAddress,
+		sizeof(doorbellAddress)
+	);
+#endif
+}
+
+
+void EventLoop::setInterest(ReactorWatch & watch, SOCKET sock, short events) {
+	Assert(watch.handler != NULL);
+	Assert(watch.handler->loop == this);
+
+	if ((watch.sock != INVALID_SOCKET) && (watch.sock != sock))
+		unwatch(watch);
+
+	// Sockets we have no interest in are taken out of the set entirely.
+	// Otherwise a hangup on an idle socket would wake us over and over.
+	if (sock == INVALID_SOCKET) {
+		unwatch(watch);
+		return;
+	}
+
+#ifdef WITH_IO_URING
+	if (uring.get() != NULL) {
+		// No interest doesn't mean unwatching here.  The engine may have
+		// received data for the socket already, which mustn't be lost, and
+		// it only reports a watch it has been asked about anyway.
+		if (watch.sock != sock)
+			uring->watch(watch, sock);
+		watch.sock = sock;
+		watch.events = events;
+		uring->interestChanged(watch);
+		return;
+	}
+#endif
+
+	if (events == 0) {
+		unwatch(watch);
+		return;
+	}
+
+	if ((watch.sock == sock) && (watch.events == events))
+		return;
+
+#ifdef WITH_EPOLL
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EpollEventsFromPoll(events);
+	ev.data.ptr = &watch;
+	int op = (watch.sock == INVALID_SOCKET) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	int res = epoll_ctl(epollfd, op, sock, &ev);
+	if ((res == -1) && (op == EPOLL_CTL_MOD) && (errno == ENOENT)) {
+		// closed without telling us, and the number has been handed out
+		// again; epoll dropped it at the close
+		res = epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev);
+	}
+	if (res == -1)
+		throw "Could not register socket with event loop";
+#else
+	if (watch.sock == INVALID_SOCKET)
+		watches.push_back(&watch);
+#endif
+
+	watch.sock = sock;
+	watch.events = events;
+}
+
+
+void EventLoop::unwatch(ReactorWatch & watch) {
+	if (watch.sock == INVALID_SOCKET)
+		return;
+
+#ifdef WITH_EPOLL
+#ifdef WITH_IO_URING
+	if (uring.get() != NULL) {
+		uring->unwatch(watch);
+		watch.sock = INVALID_SOCKET;
+		watch.events = 0;
+		return;
+	}
+#endif
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, watch.sock, &ev);
+#else
+	std::vector<ReactorWatch *>::iterator it = std::find(
+		watches.begin(),
+		watches.end(),
+		&watch
+	);
+	Assert(it != watches.end());
+	watches.erase(it);
+#endif
+
+	watch.sock = INVALID_SOCKET;
+	watch.events = 0;
+}
+
+
+bool EventLoop::completesIo() const {
+#ifdef WITH_IO_URING
+	return uring.get() != NULL;
+#else
+	return false;
+#endif
+}
+
+
+int EventLoop::sendQueued(ReactorWatch & watch, SendPiece const * pieces, int count) {
+	Assert(completesIo());
+#ifdef WITH_IO_URING
+	return uring->send(watch, pieces, count);
+#else
+	NotReached();
+	return -1;
+#endif
+}
+
+
+int EventLoop::receiveQueued(ReactorWatch & watch, char * buf, int bufsize) {
+	Assert(completesIo());
+#ifdef WITH_IO_URING
+	return uring->receive(watch, buf, bufsize);
+#else
+	NotReached();
+	return -1;
+#endif
+}
+
+
+bool EventLoop::hasQueuedSends(ReactorWatch const & watch) const {
+#ifdef WITH_IO_URING
+	if (uring.get() != NULL)
+		return uring->hasSendInFlight(watch);
+#endif
+	return false;
+}
+
+
+bool EventLoop::hasQueuedReceives(ReactorWatch const & watch) {
+#ifdef WITH_IO_URING
+	if (uring.get() != NULL)
+		return uring->hasReceived(watch);
+#endif
+	return false;
+}
+
+
+void EventLoop::retire(ReactorHandler * handler) {
+	Assert(handler->loop == this);
+	Assert(!handler->retired);
+
+	if (handler->loopPrev != NULL)
+		handler->loopPrev->loopNext = handler->loopNext;
+	else
+		handlers = handler->loopNext;
+	if (handler->loopNext != NULL)
+		handler->loopNext->loopPrev = handler->loopPrev;
+	handler->loopPrev = handler->loopNext = NULL;
+	handlerCount--;
+	timers.cancel(*handler);
+
+	// We may be partway through a batch of events that still mentions this
+	// handler, so it can't be deleted until the batch is done.
+	handler->retired = true;
+	retirements.push_back(handler);
+}
+
+
+void EventLoop::setDeadline(ReactorHandler * handler, time_t deadline) {
+	Assert(handler->loop == this);
+	Assert(!handler->retired);
+
+	if (deadline == 0)
+		timers.cancel(*handler);
+	else
+		timers.schedule(*handler, deadline);
+}
+
+
+void EventLoop::dispatch(ReactorWatch * watch, short revents) {
+	// An earlier event in the same batch may have closed or replaced the
+	// socket, or finished off the handler entirely.
+	if (watch->sock == INVALID_SOCKET)
+		return;
+	if (watch->handler->retired)
+		return;
+
+	watch->handler->handleEvents(watch->which, revents);
+}
+
+
+void EventLoop::drainAdoptions() {
+	std::deque<ReactorHandler *> adopted;
+	pthread_mutex_lock(&adoptMutex);
+	adopted.swap(adoptions);
+	pthread_mutex_unlock(&adoptMutex);
+
+	std::deque<ReactorHandler *>::iterator it = adopted.begin();
+	while (it != adopted.end()) {
+		ReactorHandler * handler = *it;
+		handler->loop = this;
+		handler->retired = false;
+		handler->loopPrev = NULL;
+		handler->loopNext = handlers;
+		if (handlers != NULL)
+			handlers->loopPrev = handler;
+		handlers = handler;
+		handlerCount++;
+
+		handler->handleStart();
+		it++;
+	}
+}
+
+
+void EventLoop::drainNotifications() {
+	std::deque<ReactorHandler *> notified;
+	pthread_mutex_lock(&adoptMutex);
+	notified.swap(notifications);
+	pthread_mutex_unlock(&adoptMutex);
+
+	std::deque<ReactorHandler *>::iterator it = notified.begin();
+	while (it != notified.end()) {
+		Assert((*it)->loop == this);
+		(*it)->handleNotified();
+		it++;
+	}
+}
+
+
+void EventLoop::tick() {
+	time_t now = time(NULL);
+	if (now == lastTick)
+		return;
+	lastTick = now;
+
+	// Only handlers whose deadlines have come up hear about it, so the cost
+	// doesn't go up with the number of connections sitting idle
+	timers.advance(now);
+}
+
+
+void EventLoop::reapRetirements() {
+	std::vector<ReactorHandler *>::iterator it = retirements.begin();
+	while (it != retirements.end()) {
+		(*it)->handleRetired();
+		it++;
+	}
+	retirements.clear();
+}
+
+
+#ifdef WITH_IO_URING
+void EventLoop::runUring() {
+	std::vector<UringReady> ready;
+	while (!stopping) {
+		ready.clear();
+		uring->wait(1000, ready);
+
+		std::vector<UringReady>::iterator it = ready.begin();
+		while (it != ready.end()) {
+			dispatch(it->watch, it->revents);
+
+			// Whatever the handler didn't take is still there; if it is
+			// still wanted the watch goes back on the ready list
+			if (it->watch->sock != INVALID_SOCKET)
+				uring->interestChanged(*it->watch);
+			it++;
+		}
+
+		drainAdoptions();
+		drainNotifications();
+		tick();
+		reapRetirements();
+	}
+}
+#endif
+
+
+void EventLoop::run() {
+#ifdef WITH_IO_URING
+	if (uring.get() != NULL) {
+		runUring();
+		return;
+	}
+#endif
+
+	while (!stopping) {
+
+#ifdef WITH_EPOLL
+		struct epoll_event events[MAXEVENTS];
+		int count = epoll_wait(epollfd, events, MAXEVENTS, 1000);
+		if (count == -1) {
+			if (errno != EINTR)
+				throw "epoll_wait error not EINTR";
+			count = 0;
+		}
+
+		for (int index = 0; index < count; index++) {
+			ReactorWatch * watch =
+				static_cast<ReactorWatch *>(events[index].data.ptr);
+
+			if (watch == NULL) {
+				unsigned long long counter;
+				ssize_t res = read(wakefd, &counter, sizeof(counter));
+				(void)res; // just draining it
+				continue;
+			}
+
+			dispatch(watch, PollEventsFromEpoll(events[index].events));
+		}
+#else
+		// take a snapshot, since the handlers will be changing the watches
+		std::vector<ReactorWatch *> polled (watches);
+		std::vector<MYPOLLFD> fds (polled.size() + 1);
+		fds[0].fd = doorbell;
+		fds[0].events = POLLIN;
+		for (size_t index = 0; index < polled.size(); index++) {
+			fds[index + 1].fd = polled[index]->sock;
+			fds[index + 1].events = polled[index]->events;
+		}
+
+		int count = poll(
+			&fds[0],
+			static_cast<unsigned int>(fds.size()),
+			Timeout (1)
+		);
+		if (count == SOCKET_ERROR) {
+			int errorno = WSAGetLastError();
+			if ((errorno != EINTR) && (errorno != EAGAIN))
+				throw "Poll error not EINTR or EAGAIN";
+			count = 0;
+		}
+
+		if ((count > 0) && (fds[0].revents & POLLIN)) {
+			char bell[16];
+			while (recv(doorbell, bell, sizeof(bell), 0) > 0) {
+				Noop();
+			}
+		}
+
+		for (size_t index = 0; (count > 0) && (index < polled.size()); index++) {
+			if (fds[index + 1].revents == 0)
+				continue;
+			if (polled[index]->sock != fds[index + 1].fd)
+				continue; // rewatched by an earlier handler in this batch
+			dispatch(polled[index], fds[index + 1].revents);
+		}
+#endif
+
+		drainAdoptions();
+		drainNotifications();
+		tick();
+		reapRetirements();
+	}
+}
+
+
+unsigned __stdcall EventLoop::threadMain(void * loop) {
+	static_cast<EventLoop *>(loop)->run();
+	return 0;
+}
+
+
+EventLoop::~EventLoop() {
+#ifdef WITH_EPOLL
+	close(wakefd);
+	close(epollfd);
+#else
+	closesocket(doorbell);
+#endif
+	DeleteCriticalSection(&adoptMutex);
+}
+
+
+
+int Reactor::defaultThreadCount() {
+#ifdef WITH_EPOLL
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cores > 0) ? static_cast<int>(cores) : 1;
+#else
+	return 0;
+#endif
+}
+
+
+bool Reactor::uringSupported() {
+#ifdef WITH_IO_URING
+	std::auto_ptr<UringEngine> engine (UringEngine::open(-1));
+	return engine.get() != NULL;
+#else
+	return false;
+#endif
+}
+
+
+bool Reactor::start(int threadCount, bool useUring) {
+	Assert(loops.empty());
+
+	for (int index = 0; index < threadCount; index++) {
+		EventLoop * loop = new EventLoop(useUring);
+
+		unsigned thread;
+		HANDLE h = (HANDLE)_beginthreadex(
+			(LPSECURITY_ATTRIBUTES)NULL,
+			0,
+			(BEGINTHREADFUNC)EventLoop::threadMain,
+			(void *)loop,
+			0,
+			&thread
+		);
+		if (!h) {
+			delete loop;
+			return false;
+		}
+		CloseHandle(h);
+
+		loops.push_back(loop);
+	}
+	return true;
+}
+
+
+void Reactor::adopt(ReactorHandler * handler) {
+	Assert(!loops.empty());
+	loops[nextLoop % loops.size()]->adopt(handler);
+	nextLoop++;
+}
+
+
+void Reactor::adoptOn(size_t loop, ReactorHandler * handler) {
+	Assert(loop < loops.size());
+	loops[loop]->adopt(handler);
+}
+
+
+Reactor::~Reactor() {
+	// The loop threads are never joined; they go away with the process.
+	std::vector<EventLoop *>::iterator it = loops.begin();
+	while (it != loops.end()) {
+		(*it)->stop();
+		it++;
+	}
+}
@@ -0,0 +1,264 @@
+//
+// Reactor.h
+//
+// Event loops that let one thread service the sockets of many Parasocks,
+// instead of every connection having a thread of its own that sits blocked
+// in poll.  On Linux this is built on epoll.  Elsewhere it falls back on the
+// same poll() the blocking code uses, which is only good for modest numbers
+// of connections (the select underneath is bounded by FD_SETSIZE).
+//
+
+#ifndef __PARASOCK_REACTOR_H__
+#define __PARASOCK_REACTOR_H__
+
+#include <deque>
+#include <vector>
+#include <time.h>
+
+#include "NetUtils.h"
+#include "Helpers.h"
+#include "TimerWheel.h"
+
+#if defined(__linux__) && !defined(WITHOUT_EPOLL)
+#define WITH_EPOLL
+#endif
+
+// The io_uring engine is built wherever the kernel headers know about it,
+// but it's only used when asked for (and the running kernel supports it)
+#if defined(WITH_EPOLL) && !defined(WITHOUT_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define WITH_IO_URING
+#endif
+#endif
+
+#include <memory>
+
+class EventLoop;
+class UringEngine;
+struct UringSocket;
+
+
+// Anything that wants readiness notifications from an EventLoop.  All the
+// callbacks for a handler are made on the thread of the loop that adopted
+// it, so a handler never has to lock its own state.
+class ReactorHandler : public WheelTimer {
+
+	friend class EventLoop;
+
+private:
+	EventLoop * loop;
+	ReactorHandler * loopPrev;
+	ReactorHandler * loopNext;
+	bool retired;
+
+public:
+	ReactorHandler () :
+		loop (NULL),
+		loopPrev (NULL),
+		loopNext (NULL),
+		retired (false)
+	{
+	}
+
+	EventLoop * eventLoop() const {
+		return loop;
+	}
+
+	// Between the loop's retire() and the handleRetired that follows
+	bool isRetired() const {
+		return retired;
+	}
+
+public:
+	// First call made on the loop's thread after adopt()
+	virtual void handleStart() = 0;
+
+	// revents is in terms of POLLIN, POLLOUT, POLLERR and POLLHUP
+	virtual void handleEvents(int which, short revents) = 0;
+
+	// Made once the deadline given to the loop's setDeadline has passed
+	virtual void handleDeadline(time_t now) = 0;
+
+	// Made for each notify() of the handler, which came from another thread
+	virtual void handleNotified() {
+	}
+
+	// The last call, once the loop is done with a retired handler.  It is
+	// deleted if this isn't overridden.  The loop is still set during the
+	// call so that sockets can be closed; a handler that is to be adopted
+	// again calls leaveLoop() first, and is untouched by the loop after.
+	virtual void handleRetired() {
+		delete this;
+	}
+
+protected:
+	void leaveLoop() {
+		loop = NULL;
+	}
+
+private:
+	void timerExpired(time_t now) /* override */ {
+		handleDeadline(now);
+	}
+
+public:
+	virtual ~ReactorHandler() {}
+};
+
+
+// One socket's registration with a loop.  The loop gives the address of
+// this to the kernel and gets it back with each event, so it has to live
+// at least as long as the handler does.
+struct ReactorWatch {
+	ReactorHandler * handler;
+	int which;
+	SOCKET sock; // INVALID_SOCKET when not registered
+	short events;
+
+	// Only readiness is wanted, even from a loop that does the receiving
+	// itself.  For a listening socket, whose connections the handler accepts.
+	bool pollOnly;
+#ifdef WITH_IO_URING
+	UringSocket * uringSocket;
+#endif
+
+	ReactorWatch () :
+		handler (NULL),
+		which (0),
+		sock (INVALID_SOCKET),
+		events (0),
+		pollOnly (false)
+#ifdef WITH_IO_URING
+		, uringSocket (NULL)
+#endif
+	{
+	}
+};
+
+
+class EventLoop {
+private:
+#ifdef WITH_EPOLL
+	int epollfd;
+	int wakefd;
+#ifdef WITH_IO_URING
+	std::auto_ptr<UringEngine> uring;
+#endif
+#else
+	SOCKET doorbell;
+	struct sockaddr_in doorbellAddress;
+	std::vector<ReactorWatch *> watches;
+#endif
+
+	CRITICAL_SECTION adoptMutex;
+	std::deque<ReactorHandler *> adoptions;
+	std::deque<ReactorHandler *> notifications;
+	std::vector<ReactorHandler *> retirements;
+	ReactorHandler * handlers;
+	size_t handlerCount;
+	TimerWheel timers;
+	time_t lastTick;
+	volatile bool stopping;
+
+public:
+	// With useUring, the loop tries for an io_uring engine and settles for
+	// epoll if it can't get one
+	EventLoop (bool useUring = false);
+
+private:
+	// Disable copying C++98 style
+	EventLoop (EventLoop const & other);
+
+public:
+	// May be called from any thread.  A handler that is to be notified
+	// mustn't be retired until its handleNotified has been made.
+	void adopt(ReactorHandler * handler);
+	void notify(ReactorHandler * handler);
+	void stop();
+
+	// Only from the loop's own thread
+	void setInterest(ReactorWatch & watch, SOCKET sock, short events);
+	void unwatch(ReactorWatch & watch);
+	void retire(ReactorHandler * handler);
+
+	// Asks for the handler's handleDeadline once this time has passed,
+	// instead of at any time it was asked for before (zero for never)
+	void setDeadline(ReactorHandler * handler, time_t deadline);
+
+	size_t getHandlerCount() const {
+		return handlerCount;
+	}
+
+	// True when this loop does the sends and receives itself (io_uring), in
+	// which case sockets it watches must go through sendQueued and
+	// receiveQueued rather than calling send and recv directly
+	bool completesIo() const;
+	int sendQueued(ReactorWatch & watch, SendPiece const * pieces, int count);
+	int receiveQueued(ReactorWatch & watch, char * buf, int bufsize);
+	bool hasQueuedSends(ReactorWatch const & watch) const;
+	bool hasQueuedReceives(ReactorWatch const & watch);
+
+	void run();
+	static unsigned __stdcall threadMain(void * loop);
+
+private:
+	void wake();
+#ifdef WITH_IO_URING
+	void runUring();
+#endif
+	void dispatch(ReactorWatch * watch, short revents);
+	void drainAdoptions();
+	void drainNotifications();
+	void tick();
+	void reapRetirements();
+
+public:
+	virtual ~EventLoop();
+};
+
+
+// A set of event loops, each running on its own thread.  New handlers are
+// spread over the loops round robin and stay on that loop for life.
+class Reactor {
+private:
+	std::vector<EventLoop *> loops;
+	size_t nextLoop;
+
+public:
+	Reactor () :
+		nextLoop (0)
+	{
+	}
+
+private:
+	// Disable copying C++98 style
+	Reactor (Reactor const & other);
+
+public:
+	// One loop per core where there is a scalable backend, otherwise zero
+	// (meaning: stick with a thread per connection)
+	static int defaultThreadCount();
+
+	// Whether the running kernel can give us an io_uring engine
+	static bool uringSupported();
+
+	bool start(int threadCount, bool useUring = false);
+
+	bool isRunning() const {
+		return !loops.empty();
+	}
+
+	size_t getLoopCount() const {
+		return loops.size();
+	}
+
+	void adopt(ReactorHandler * handler);
+
+	// For a handler that belongs with a particular loop, like the acceptor
+	// for that loop's own listening socket
+	void adoptOn(size_t loop, ReactorHandler * handler);
+
+	virtual ~Reactor();
+};
+
+#endif
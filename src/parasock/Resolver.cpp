@@ -0,0 +1,596 @@
+//
+// Resolver.cpp
+//
+// DNS over UDP, with a cache in front of it.
+//
+
+#include <memory>
+#include <ctype.h>
+#ifdef _WIN32
+#include <process.h>
+#endif
+
+#include "Resolver.h"
+
+// Biggest reply there can be without EDNS, which we don't ask for
+#define DNSREPLYMAX 512
+
+#define DNSTYPE_A 1
+#define DNSTYPE_SOA 6
+#define DNSCLASS_IN 1
+
+#define DNSRCODE_NXDOMAIN 3
+
+
+DnsCache::DnsCache (size_t maxEntries) :
+	maxPerShard (maxEntries / RESOLVERSHARDS)
+{
+	if (maxPerShard == 0)
+		maxPerShard = 1;
+	for (int index = 0; index < RESOLVERSHARDS; index++)
+		InitializeCriticalSection(&shards[index].mutex);
+}
+
+
+DnsCache::Shard & DnsCache::shardFor(std::string const & name) {
+	// FNV-1a
+	unsigned long hash = 2166136261UL;
+	for (size_t index = 0; index < name.length(); index++) {
+		hash ^= static_cast<unsigned char>(name[index]);
+		hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return shards[hash % RESOLVERSHARDS];
+}
+
+
+bool DnsCache::find(
+	std::string const & name,
+	unsigned long & address,
+	time_t now
+) {
+	Shard & shard = shardFor(name);
+	bool found = false;
+
+	pthread_mutex_lock(&shard.mutex);
+	std::map<std::string, Entry>::iterator it = shard.entries.find(name);
+	if (it != shard.entries.end()) {
+		if (it->second.expires > now) {
+			address = it->second.address;
+			found = true;
+		} else {
+			shard.entries.erase(it);
+		}
+	}
+	pthread_mutex_unlock(&shard.mutex);
+
+	return found;
+}
+
+
+void DnsCache::add(
+	std::string const & name,
+	unsigned long address,
+	time_t expires
+) {
+	Shard & shard = shardFor(name);
+
+	pthread_mutex_lock(&shard.mutex);
+	if (
+		(shard.entries.size() >= maxPerShard)
+		&& (shard.entries.find(name) == shard.entries.end())
+	) {
+		// make room, with what's expired if there is any
+		time_t now = time(NULL);
+		std::map<std::string, Entry>::iterator it = shard.entries.begin();
+		while (it != shard.entries.end()) {
+			if (it->second.expires <= now)
+				shard.entries.erase(it++);
+			else
+				it++;
+		}
+		if (shard.entries.size() >= maxPerShard)
+			shard.entries.erase(shard.entries.begin());
+	}
+	Entry & entry = shard.entries[name];
+	entry.address = address;
+	entry.expires = expires;
+	pthread_mutex_unlock(&shard.mutex);
+}
+
+
+DnsCache::~DnsCache() {
+	for (int index = 0; index < RESOLVERSHARDS; index++)
+		DeleteCriticalSection(&shards[index].mutex);
+}
+
+
+// For a thread that can wait for its lookup
+class BlockingResolution : public Resolution {
+private:
+	HANDLE semaphore;
+
+public:
+	unsigned long address;
+
+public:
+	BlockingResolution () :
+		address (0)
+	{
+		semaphore = CreateSemaphore(NULL, 0, 1, NULL);
+	}
+
+private:
+	// Disable copying C++98 style
+	BlockingResolution (BlockingResolution const & other);
+
+public:
+	void resolved(unsigned long address) /* override */ {
+		this->address = address;
+		ReleaseSemaphore(semaphore, 1, NULL);
+	}
+
+	void wait() {
+		WaitForSingleObject(semaphore, INFINITE);
+	}
+
+	virtual ~BlockingResolution() {
+		CloseHandle(semaphore);
+	}
+};
+
+
+Resolver::Resolver (size_t cacheEntries, time_t timeout) :
+	cache (cacheEntries),
+	timeout (timeout),
+	sock (INVALID_SOCKET),
+	running (false)
+{
+	InitializeCriticalSection(&mutex);
+
+	// Query ids are what stops a forged reply being taken for a real one,
+	// so they shouldn't follow on from each other
+	idState = static_cast<unsigned long>(time(NULL))
+		^ static_cast<unsigned long>(reinterpret_cast<size_t>(this));
+	if (idState == 0)
+		idState = 1;
+}
+
+
+bool Resolver::start(std::vector<struct sockaddr_in> const & nameservers) {
+	Assert(!running);
+
+	servers = nameservers;
+	if (servers.empty())
+		return false;
+	std::vector<struct sockaddr_in>::iterator it = servers.begin();
+	while (it != servers.end()) {
+		it->sin_family = AF_INET;
+		if (it->sin_port == 0)
+			it->sin_port = htons(53);
+		it++;
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == INVALID_SOCKET)
+		return false;
+
+	struct sockaddr_in bindsa;
+	memset(&bindsa, 0, sizeof(bindsa));
+	bindsa.sin_family = AF_INET;
+	if (-1 == bind(sock, (struct sockaddr *)&bindsa, sizeof(bindsa))) {
+		closesocket(sock);
+		sock = INVALID_SOCKET;
+		return false;
+	}
+
+	unsigned long ul = 1;
+	ioctlsocket(sock, FIONBIO, &ul);
+
+	running = true;
+
+	unsigned thread;
+	HANDLE h = (HANDLE)_beginthreadex(
+		(LPSECURITY_ATTRIBUTES)NULL,
+		0,
+		(BEGINTHREADFUNC)Resolver::threadMain,
+		(void *)this,
+		0,
+		&thread
+	);
+	if (!h) {
+		running = false;
+		closesocket(sock);
+		sock = INVALID_SOCKET;
+		return false;
+	}
+	CloseHandle(h);
+	return true;
+}
+
+
+bool Resolver::lookup(
+	char const * name,
+	unsigned long & address,
+	Resolution * waiter
+) {
+	Assert(running);
+
+	std::string key (name);
+	for (size_t index = 0; index < key.length(); index++)
+		key[index] = tolower(static_cast<unsigned char>(key[index]));
+	if (!key.empty() && (key[key.length() - 1] == '.'))
+		key.resize(key.length() - 1);
+
+	time_t now = time(NULL);
+	if (cache.find(key, address, now))
+		return true;
+
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, Query *>::iterator it = queries.find(key);
+	if (it != queries.end()) {
+		it->second->waiting.push_back(waiter);
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	unsigned short id = newId();
+	while (queriesById.find(id) != queriesById.end())
+		id = newId();
+
+	std::auto_ptr<Query> query (new Query);
+	if (!encodeQuery(key, id, query->packet)) {
+		pthread_mutex_unlock(&mutex);
+		address = 0;
+		return true;
+	}
+	query->name = key;
+	query->id = id;
+	query->server = 0;
+	query->givesUp = now + timeout;
+	query->waiting.push_back(waiter);
+
+	queries[key] = query.get();
+	queriesById[id] = query.get();
+	send(query.release());
+	pthread_mutex_unlock(&mutex);
+
+	return false;
+}
+
+
+unsigned long Resolver::resolve(char const * name) {
+	BlockingResolution resolution;
+	unsigned long address;
+	if (lookup(name, address, &resolution))
+		return address;
+	resolution.wait();
+	return resolution.address;
+}
+
+
+unsigned __stdcall Resolver::threadMain(void * resolver) {
+	static_cast<Resolver *>(resolver)->run();
+	return 0;
+}
+
+
+void Resolver::run() {
+	for (;;) {
+		MYPOLLFD fds;
+		fds.fd = sock;
+		fds.events = POLLIN;
+		if (poll(&fds, 1, Timeout (1)) > 0)
+			receive();
+		retry(time(NULL));
+	}
+}
+
+
+void Resolver::receive() {
+	unsigned char reply[DNSREPLYMAX];
+	struct sockaddr_in from;
+	std::vector<std::pair<Query *, unsigned long> > finished;
+
+	for (;;) {
+		SASIZETYPE fromSize = sizeof(from);
+		int length = recvfrom(
+			sock,
+			(char *)reply,
+			sizeof(reply),
+			0,
+			(struct sockaddr *)&from,
+			&fromSize
+		);
+		if (length <= 0)
+			break;
+
+		bool fromServer = false;
+		std::vector<struct sockaddr_in>::const_iterator server = servers.begin();
+		while (server != servers.end()) {
+			if (
+				(server->sin_addr.s_addr == from.sin_addr.s_addr)
+				&& (server->sin_port == from.sin_port)
+			) {
+				fromServer = true;
+				break;
+			}
+			server++;
+		}
+		if (!fromServer || (length < 12))
+			continue;
+
+		unsigned short id = (reply[0] << 8) | reply[1];
+
+		pthread_mutex_lock(&mutex);
+		std::map<unsigned short, Query *>::iterator it = queriesById.find(id);
+		if (it == queriesById.end()) {
+			pthread_mutex_unlock(&mutex);
+			continue;
+		}
+		Query * query = it->second;
+
+		// The question comes back as it was asked, give or take case
+		std::string const & packet = query->packet;
+		bool matches = (static_cast<size_t>(length) >= packet.length())
+			&& (reply[4] == 0) && (reply[5] == 1);
+		for (size_t index = 12; matches && (index < packet.length()); index++) {
+			matches = tolower(reply[index])
+				== tolower(static_cast<unsigned char>(packet[index]));
+		}
+		if (!matches) {
+			pthread_mutex_unlock(&mutex);
+			continue;
+		}
+
+		unsigned long address;
+		long ttl;
+		parseReply(reply, length, address, ttl);
+		if (ttl < 0) {
+			// no use; the next nameserver gets asked without waiting
+			query->sent = 0;
+			pthread_mutex_unlock(&mutex);
+			continue;
+		}
+
+		finish(query, address, ttl);
+		finished.push_back(std::make_pair(query, address));
+		pthread_mutex_unlock(&mutex);
+	}
+
+	// The waiters hear about it outside the lock, since one may look
+	// something else up as soon as it does
+	std::vector<std::pair<Query *, unsigned long> >::iterator it = finished.begin();
+	while (it != finished.end()) {
+		std::vector<Resolution *>::iterator waiter = it->first->waiting.begin();
+		while (waiter != it->first->waiting.end()) {
+			(*waiter)->resolved(it->second);
+			waiter++;
+		}
+		delete it->first;
+		it++;
+	}
+}
+
+
+void Resolver::retry(time_t now) {
+	std::vector<Query *> expired;
+
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, Query *>::iterator it = queries.begin();
+	while (it != queries.end()) {
+		Query * query = it->second;
+		it++;
+		if (now >= query->givesUp) {
+			// nothing is cached, so the next lookup asks again
+			forget(query);
+			expired.push_back(query);
+		} else if (now - query->sent >= RESOLVERRETRY) {
+			query->server = (query->server + 1) % servers.size();
+			send(query);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	std::vector<Query *>::iterator query = expired.begin();
+	while (query != expired.end()) {
+		std::vector<Resolution *>::iterator waiter = (*query)->waiting.begin();
+		while (waiter != (*query)->waiting.end()) {
+			(*waiter)->resolved(0);
+			waiter++;
+		}
+		delete *query;
+		query++;
+	}
+}
+
+
+void Resolver::send(Query * query) {
+	query->sent = time(NULL);
+	sendto(
+		sock,
+		query->packet.data(),
+		static_cast<int>(query->packet.length()),
+		0,
+		(struct sockaddr *)&servers[query->server],
+		sizeof(servers[query->server])
+	);
+}
+
+
+void Resolver::finish(Query * query, unsigned long address, time_t ttl) {
+	if (ttl < RESOLVERMINTTL)
+		ttl = RESOLVERMINTTL;
+	if (ttl > RESOLVERMAXTTL)
+		ttl = RESOLVERMAXTTL;
+	cache.add(query->name, address, time(NULL) + ttl);
+	forget(query);
+}
+
+
+void Resolver::forget(Query * query) {
+	queries.erase(query->name);
+	queriesById.erase(query->id);
+}
+
+
+unsigned short Resolver::newId() {
+	// xorshift
+	idState ^= (idState << 13) & 0xFFFFFFFFUL;
+	idState ^= idState >> 17;
+	idState ^= (idState << 5) & 0xFFFFFFFFUL;
+	return static_cast<unsigned short>(idState >> 8);
+}
+
+
+bool Resolver::encodeQuery(
+	std::string const & name,
+	unsigned short id,
+	std::string & packet
+) {
+	if (name.empty() || (name.length() > 253))
+		return false;
+
+	// id, recursion desired, one question
+	char const header[12] = {
+		static_cast<char>(id >> 8), static_cast<char>(id & 0xFF),
+		1, 0,
+		0, 1,
+		0, 0,
+		0, 0,
+		0, 0
+	};
+	packet.assign(header, sizeof(header));
+
+	size_t start = 0;
+	while (start <= name.length()) {
+		size_t end = name.find('.', start);
+		if (end == std::string::npos)
+			end = name.length();
+		size_t labelLength = end - start;
+		if ((labelLength == 0) || (labelLength > 63))
+			return false;
+		packet += static_cast<char>(labelLength);
+		packet.append(name, start, labelLength);
+		start = end + 1;
+	}
+
+	char const question[5] = { 0, 0, DNSTYPE_A, 0, DNSCLASS_IN };
+	packet.append(question, sizeof(question));
+	return true;
+}
+
+
+// Moves past a name, which may end in a pointer to one elsewhere in the
+// message.  False if it runs off the end.
+static bool SkipDnsName(
+	unsigned char const * reply,
+	size_t length,
+	size_t & offset
+) {
+	while (offset < length) {
+		unsigned char labelLength = reply[offset];
+		if ((labelLength & 0xC0) == 0xC0) {
+			offset += 2;
+			return offset <= length;
+		}
+		offset++;
+		if (labelLength == 0)
+			return true;
+		offset += labelLength;
+	}
+	return false;
+}
+
+
+static unsigned long DnsLong(unsigned char const * at) {
+	return (static_cast<unsigned long>(at[0]) << 24)
+		| (static_cast<unsigned long>(at[1]) << 16)
+		| (static_cast<unsigned long>(at[2]) << 8)
+		| static_cast<unsigned long>(at[3]);
+}
+
+
+void Resolver::parseReply(
+	unsigned char const * reply,
+	size_t length,
+	unsigned long & address,
+	long & ttl
+) {
+	address = 0;
+	ttl = -1;
+
+	if ((length < 12) || !(reply[2] & 0x80))
+		return;
+	int rcode = reply[3] & 0x0F;
+	if ((rcode != 0) && (rcode != DNSRCODE_NXDOMAIN))
+		return;
+
+	unsigned questions = (reply[4] << 8) | reply[5];
+	unsigned answers = (reply[6] << 8) | reply[7];
+	unsigned authorities = (reply[8] << 8) | reply[9];
+
+	size_t offset = 12;
+	for (unsigned index = 0; index < questions; index++) {
+		if (!SkipDnsName(reply, length, offset))
+			return;
+		offset += 4;
+	}
+
+	// The answer may come by way of CNAMEs, and holds for as long as the
+	// shortest lived of them
+	unsigned long shortest = RESOLVERMAXTTL;
+	for (unsigned index = 0; index < answers; index++) {
+		if (!SkipDnsName(reply, length, offset) || (offset + 10 > length))
+			return;
+		unsigned type = (reply[offset] << 8) | reply[offset + 1];
+		unsigned rclass = (reply[offset + 2] << 8) | reply[offset + 3];
+		unsigned long recordTtl = DnsLong(reply + offset + 4);
+		size_t dataLength = (reply[offset + 8] << 8) | reply[offset + 9];
+		offset += 10;
+		if (offset + dataLength > length)
+			return;
+
+		if (rclass == DNSCLASS_IN) {
+			if (recordTtl < shortest)
+				shortest = recordTtl;
+			if ((type == DNSTYPE_A) && (dataLength == 4) && (address == 0))
+				memcpy(&address, reply + offset, 4);
+		}
+		offset += dataLength;
+	}
+
+	if (address != 0) {
+		ttl = static_cast<long>(shortest);
+		return;
+	}
+
+	// No such name, or no address for it.  How long that holds is the SOA
+	// minimum, or the SOA's own TTL if that's less.
+	ttl = RESOLVERNEGATIVETTL;
+	for (unsigned index = 0; index < authorities; index++) {
+		if (!SkipDnsName(reply, length, offset) || (offset + 10 > length))
+			return;
+		unsigned type = (reply[offset] << 8) | reply[offset + 1];
+		unsigned long recordTtl = DnsLong(reply + offset + 4);
+		size_t dataLength = (reply[offset + 8] << 8) | reply[offset + 9];
+		offset += 10;
+		if (offset + dataLength > length)
+			return;
+
+		if ((type == DNSTYPE_SOA) && (dataLength >= 20)) {
+			unsigned long minimum = DnsLong(reply + offset + dataLength - 4);
+			if (recordTtl < minimum)
+				minimum = recordTtl;
+			if (minimum > RESOLVERMAXTTL)
+				minimum = RESOLVERMAXTTL;
+			ttl = static_cast<long>(minimum);
+			return;
+		}
+		offset += dataLength;
+	}
+}
+
+
+Resolver::~Resolver() {
+	DeleteCriticalSection(&mutex);
+}
@@ -0,0 +1,176 @@
+//
+// Resolver.h
+//
+// Looks up host names by asking nameservers directly over UDP, so that the
+// thread wanting an address needn't sit in gethostbyname while it's found.
+// A lookup is answered at once from the cache when it can be.  Otherwise the
+// query goes out and whoever asked hears about it later, from the resolver's
+// own thread, which receives the answers and sends again when one is late.
+// Any number of lookups for the same name share one query.
+//
+// Answers are cached for as long as their TTL says, and names that don't
+// resolve are cached too (for the SOA minimum the nameserver sends with
+// the denial, per RFC 2308), so a page full of links to a dead host costs
+// one query.  The cache is split into shards by name, each with its own
+// lock, so the threads looking things up don't all queue on one.
+//
+// Only IPv4 (A records) for now, as with everything else here.
+//
+
+#ifndef __PARASOCK_RESOLVER_H__
+#define __PARASOCK_RESOLVER_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "NetUtils.h"
+#include "Helpers.h"
+
+// How long a nameserver gets to answer before the next one is asked
+#define RESOLVERRETRY 2
+
+// Bounds on how long an answer or a denial is cached, whatever the TTL
+// says.  A lookup that gets no usable answer in time isn't cached at all,
+// so the next one for the name asks again.
+#define RESOLVERMINTTL 5
+#define RESOLVERMAXTTL 86400
+
+// For a denial that came without an SOA to say how long it holds
+#define RESOLVERNEGATIVETTL 60
+
+#define RESOLVERSHARDS 16
+
+
+// Something waiting on a lookup that wasn't in the cache
+class Resolution {
+public:
+	// Made once, from the resolver's thread.  Zero if the name didn't
+	// resolve.
+	virtual void resolved(unsigned long address) = 0;
+
+	virtual ~Resolution() {}
+};
+
+
+class DnsCache {
+private:
+	struct Entry {
+		unsigned long address; // zero for a name known not to resolve
+		time_t expires;
+	};
+
+	struct Shard {
+		CRITICAL_SECTION mutex;
+		std::map<std::string, Entry> entries;
+	};
+
+	Shard shards[RESOLVERSHARDS];
+	size_t maxPerShard;
+
+public:
+	DnsCache (size_t maxEntries);
+
+private:
+	// Disable copying C++98 style
+	DnsCache (DnsCache const & other);
+
+public:
+	// Names are expected in lower case.  True if the name is cached and
+	// hasn't expired, with its address (which may be zero).
+	bool find(std::string const & name, unsigned long & address, time_t now);
+	void add(std::string const & name, unsigned long address, time_t expires);
+
+private:
+	Shard & shardFor(std::string const & name);
+
+public:
+	virtual ~DnsCache();
+};
+
+
+class Resolver {
+private:
+	struct Query {
+		std::string name;
+		std::string packet;
+		unsigned short id;
+		size_t server; // the one last asked
+		time_t sent;
+		time_t givesUp;
+		std::vector<Resolution *> waiting;
+	};
+
+	DnsCache cache;
+	std::vector<struct sockaddr_in> servers;
+	time_t timeout;
+	SOCKET sock;
+
+	CRITICAL_SECTION mutex;
+	std::map<std::string, Query *> queries;
+	std::map<unsigned short, Query *> queriesById;
+	unsigned long idState;
+
+	volatile bool running;
+
+public:
+	// timeout is how long a lookup goes on, across all the nameservers,
+	// before it's given up as not resolving
+	Resolver (size_t cacheEntries, time_t timeout);
+
+private:
+	// Disable copying C++98 style
+	Resolver (Resolver const & other);
+
+public:
+	// Opens the socket and starts the thread.  The addresses are in network
+	// order, port 53 unless given.
+	bool start(std::vector<struct sockaddr_in> const & nameservers);
+
+	bool isRunning() const {
+		return running;
+	}
+
+	// True with the address (zero for a name that doesn't resolve) when it
+	// is known already.  Otherwise false, and the waiter's resolved will be
+	// made when the answer comes; possibly before this returns.
+	bool lookup(char const * name, unsigned long & address, Resolution * waiter);
+
+	// The same, for a thread that can block until it knows
+	unsigned long resolve(char const * name);
+
+	static unsigned __stdcall threadMain(void * resolver);
+
+private:
+	void run();
+	void receive();
+	void retry(time_t now);
+	void send(Query * query);
+	// Caches the answer (zero for no such name) and forgets the query
+	void finish(Query * query, unsigned long address, time_t ttl);
+	void forget(Query * query);
+	unsigned short newId();
+
+	static bool encodeQuery(
+		std::string const & name,
+		unsigned short id,
+		std::string & packet
+	);
+
+	// Zero address and a negative ttl for a reply that settles nothing and
+	// should be left for another nameserver (a SERVFAIL, say)
+	static void parseReply(
+		unsigned char const * reply,
+		size_t length,
+		unsigned long & address,
+		long & ttl
+	);
+
+public:
+	// The thread is never stopped or joined; like the event loops, a
+	// Resolver is expected to last as long as the process
+	virtual ~Resolver();
+};
+
+#endif
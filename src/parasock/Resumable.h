@@ -0,0 +1,57 @@
+//
+// Resumable.h
+//
+// For writing something that runs on an event loop top to bottom, as if it
+// could sit and wait for each network operation it starts, rather than as a
+// state machine of stages that each say which one comes next.
+//
+// Nothing is kept between calls but a resume point, an enum the caller
+// stores wherever the rest of its state is.  The body goes between
+// RESUMABLE_BEGIN and RESUMABLE_END, and each RESUMABLE_AWAIT names its
+// point, starts an operation and returns false if that has to wait.  The
+// next call jumps straight back in after the AWAIT that returned:
+//
+//     RESUMABLE_BEGIN(state.point)
+//     state.filter = ...;
+//     RESUMABLE_AWAIT(state.point, ReadHeader, beginRead(), isReading());
+//     if (state.filter->... )
+//     ...
+//     RESUMABLE_END(state.point)
+//     return true;
+//
+// It is a switch underneath, so the usual limits of one apply.  Locals
+// don't survive an AWAIT, and the compiler won't allow one to be declared
+// in a scope an AWAIT is in unless it's inside braces of its own.  Zero is
+// where the body starts, so it can't name an AWAIT, and a bare break leaves
+// the whole body.
+//
+
+#ifndef __PARASOCK_RESUMABLE_H__
+#define __PARASOCK_RESUMABLE_H__
+
+#include "Helpers.h"
+
+#define RESUMABLE_BEGIN(point) \
+	switch (point) { \
+	case 0:
+
+// Only for functions returning bool, false meaning not done yet
+#define RESUMABLE_AWAIT(point, label, operation, waiting) \
+	do { \
+		(point) = (label); \
+		operation; \
+		if (waiting) \
+			return false; \
+		FallThrough(); \
+	case label: \
+		; \
+	} while (0)
+
+#define RESUMABLE_END(point) \
+		break; \
+	default: \
+		NotReached(); \
+		break; \
+	}
+
+#endif
@@ -0,0 +1,312 @@
+//
+// SegmentBuffer.cpp
+//
+// Chained block buffer, and the pool the blocks come from.
+//
+
+#include <string.h>
+
+#include "SegmentBuffer.h"
+#include "ByteSearch.h"
+
+// Free blocks beyond this go back to the heap
+#define SEGMENTPOOLMAX 1024
+
+
+// Connections come and go constantly, and each one's buffers would be
+// allocating and freeing the same size of block.  So spare blocks are
+// kept on a free list shared by all the threads.
+class SegmentPool {
+private:
+	CRITICAL_SECTION mutex;
+	SegmentBlock * free;
+	size_t freeCount;
+
+public:
+	SegmentPool () :
+		free (NULL),
+		freeCount (0)
+	{
+		InitializeCriticalSection(&mutex);
+	}
+
+private:
+	// Disable copying C++98 style
+	SegmentPool (SegmentPool const & other);
+
+public:
+	SegmentBlock * take() {
+		SegmentBlock * block = NULL;
+		pthread_mutex_lock(&mutex);
+		if (free != NULL) {
+			block = free;
+			free = block->nextFree;
+			freeCount--;
+		}
+		pthread_mutex_unlock(&mutex);
+
+		if (block == NULL)
+			block = new SegmentBlock;
+		block->refs = 1;
+		block->used = 0;
+		block->nextFree = NULL;
+		return block;
+	}
+
+	void give(SegmentBlock * block) {
+		pthread_mutex_lock(&mutex);
+		if (freeCount < SEGMENTPOOLMAX) {
+			block->nextFree = free;
+			free = block;
+			freeCount++;
+			block = NULL;
+		}
+		pthread_mutex_unlock(&mutex);
+
+		if (block != NULL)
+			delete block;
+	}
+};
+
+// Never torn down: buffers in other static objects may still be handing
+// blocks back while the process exits
+static SegmentPool pool;
+
+
+SegmentBlock * SegmentBuffer::allocateBlock() {
+	return pool.take();
+}
+
+
+void SegmentBuffer::releaseBlock(SegmentBlock * block) {
+	Assert(block->refs > 0);
+	block->refs--;
+	if (block->refs == 0)
+		pool.give(block);
+}
+
+
+SegmentBuffer::SegmentBuffer (SegmentBuffer const & other) :
+	totalLength (0)
+{
+	append(other, 0, other.length());
+}
+
+
+SegmentBuffer & SegmentBuffer::operator= (SegmentBuffer const & other) {
+	if (this != &other) {
+		clear();
+		append(other, 0, other.length());
+	}
+	return *this;
+}
+
+
+char * SegmentBuffer::reserve(size_t minimum, size_t & available) {
+	Assert(minimum <= SEGMENTSIZE);
+
+	if (!segments.empty()) {
+		Segment & tail = segments.back();
+		SegmentBlock * block = tail.block;
+
+		// we can only write after the tail if nobody else can see there
+		if (
+			(block->refs == 1)
+			&& (tail.offset + tail.length == block->used)
+			&& (SEGMENTSIZE - block->used >= minimum)
+		) {
+			available = SEGMENTSIZE - block->used;
+			return block->data + block->used;
+		}
+	}
+
+	Segment segment;
+	segment.block = allocateBlock();
+	segment.offset = 0;
+	segment.length = 0;
+	segments.push_back(segment);
+
+	available = SEGMENTSIZE;
+	return segment.block->data;
+}
+
+
+void SegmentBuffer::commit(size_t len) {
+	Assert(!segments.empty());
+	Segment & tail = segments.back();
+	Assert(tail.block->used + len <= SEGMENTSIZE);
+
+	tail.block->used += len;
+	tail.length += len;
+	totalLength += len;
+}
+
+
+void SegmentBuffer::append(char const * data, size_t len) {
+	while (len > 0) {
+		size_t available;
+		char * space = reserve(1, available);
+		size_t chunk = (len < available) ? len : available;
+		memcpy(space, data, chunk);
+		commit(chunk);
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+
+void SegmentBuffer::append(SegmentBuffer const & other, size_t offset, size_t len) {
+	Assert(this != &other);
+	Assert(offset + len <= other.totalLength);
+
+	std::deque<Segment>::const_iterator it = other.segments.begin();
+	while ((len > 0) && (it != other.segments.end())) {
+		if (offset >= it->length) {
+			offset -= it->length;
+			it++;
+			continue;
+		}
+
+		Segment segment;
+		segment.block = it->block;
+		segment.offset = it->offset + offset;
+		segment.length = it->length - offset;
+		if (segment.length > len)
+			segment.length = len;
+		segment.block->refs++;
+		segments.push_back(segment);
+		totalLength += segment.length;
+
+		len -= segment.length;
+		offset = 0;
+		it++;
+	}
+	Assert(len == 0);
+}
+
+
+void SegmentBuffer::consume(size_t len) {
+	Assert(len <= totalLength);
+	totalLength -= len;
+
+	while (len > 0) {
+		Segment & head = segments.front();
+		if (len < head.length) {
+			head.offset += len;
+			head.length -= len;
+			return;
+		}
+		len -= head.length;
+		releaseBlock(head.block);
+		segments.pop_front();
+	}
+
+	// an empty block reserved at the end isn't worth holding on to
+	if (totalLength == 0)
+		clear();
+}
+
+
+void SegmentBuffer::clear() {
+	std::deque<Segment>::iterator it = segments.begin();
+	while (it != segments.end()) {
+		releaseBlock(it->block);
+		it++;
+	}
+	segments.clear();
+	totalLength = 0;
+}
+
+
+bool SegmentBuffer::matchesAt(
+	std::deque<Segment>::const_iterator it,
+	size_t offset,
+	char const * needle,
+	size_t needleLength
+) const {
+	size_t matched = 0;
+	while (matched < needleLength) {
+		if (it == segments.end())
+			return false;
+		if (offset >= it->length) {
+			offset = 0;
+			it++;
+			continue;
+		}
+		if (it->block->data[it->offset + offset] != needle[matched])
+			return false;
+		matched++;
+		offset++;
+	}
+	return true;
+}
+
+
+size_t SegmentBuffer::find(
+	char const * needle,
+	size_t needleLength,
+	size_t from
+) const {
+	if (needleLength == 0)
+		return (from <= totalLength) ? from : std::string::npos;
+
+	size_t base = 0; // position of the current segment in the buffer
+	std::deque<Segment>::const_iterator it = segments.begin();
+	while (it != segments.end()) {
+		if (from < base + it->length) {
+			char const * data = it->block->data + it->offset;
+			size_t start = (from > base) ? from - base : 0;
+
+			// matches that lie entirely within the segment
+			char const * hit = FindBytes(
+				data + start,
+				it->length - start,
+				needle,
+				needleLength
+			);
+			if (hit != NULL)
+				return base + (hit - data);
+
+			// then ones that run on into the next segment
+			if (it->length - start >= needleLength)
+				start = it->length - needleLength + 1;
+			while (start < it->length) {
+				if (matchesAt(it, start, needle, needleLength))
+					return base + start;
+				start++;
+			}
+		}
+		base += it->length;
+		it++;
+	}
+	return std::string::npos;
+}
+
+
+void SegmentBuffer::copyTo(std::string & out, size_t offset, size_t len) const {
+	Assert(offset + len <= totalLength);
+
+	std::deque<Segment>::const_iterator it = segments.begin();
+	while ((len > 0) && (it != segments.end())) {
+		if (offset >= it->length) {
+			offset -= it->length;
+			it++;
+			continue;
+		}
+
+		size_t chunk = it->length - offset;
+		if (chunk > len)
+			chunk = len;
+		out.append(it->block->data + it->offset + offset, chunk);
+
+		len -= chunk;
+		offset = 0;
+		it++;
+	}
+	Assert(len == 0);
+}
+
+
+SegmentBuffer::~SegmentBuffer() {
+	clear();
+}
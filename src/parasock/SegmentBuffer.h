@@ -0,0 +1,119 @@
+//
+// SegmentBuffer.h
+//
+// A byte buffer kept as a chain of fixed-size blocks instead of one big
+// std::string.  Appending never moves what's already there, and consuming
+// from the front just drops blocks (or moves an offset), so a buffer that
+// bytes stream through costs the same no matter how far behind the reader
+// is.  Reads from the network can go straight into the free space at the
+// end of the last block.
+//
+// Blocks are reference counted, so a slice of one buffer can be appended
+// to another without copying.  Only a block's sole owner ever writes into
+// its free space.  That counting isn't thread safe: a buffer and its slices
+// must stay on one thread (as a Parasock's do), although the pool of free
+// blocks is shared.
+//
+
+#ifndef __PARASOCK_SEGMENTBUFFER_H__
+#define __PARASOCK_SEGMENTBUFFER_H__
+
+#include <deque>
+#include <string>
+
+#include "NetUtils.h"
+#include "Helpers.h"
+
+#define SEGMENTSIZE (4 * BUFSIZE)
+
+
+struct SegmentBlock {
+	size_t refs;
+	size_t used; // how far the owner has written
+	SegmentBlock * nextFree;
+	char data[SEGMENTSIZE];
+};
+
+
+class SegmentBuffer {
+private:
+	struct Segment {
+		SegmentBlock * block;
+		size_t offset;
+		size_t length;
+	};
+
+	std::deque<Segment> segments;
+	size_t totalLength;
+
+public:
+	SegmentBuffer () :
+		totalLength (0)
+	{
+	}
+
+	// Copies share the blocks
+	SegmentBuffer (SegmentBuffer const & other);
+	SegmentBuffer & operator= (SegmentBuffer const & other);
+
+private:
+	static SegmentBlock * allocateBlock();
+	static void releaseBlock(SegmentBlock * block);
+
+	bool matchesAt(
+		std::deque<Segment>::const_iterator it,
+		size_t offset,
+		char const * needle,
+		size_t needleLength
+	) const;
+
+public:
+	size_t length() const {
+		return totalLength;
+	}
+
+	bool empty() const {
+		return totalLength == 0;
+	}
+
+	// Room for at least minimum bytes at the end of the buffer, which may
+	// be written and then made part of the buffer with commit()
+	char * reserve(size_t minimum, size_t & available);
+	void commit(size_t len);
+
+	void append(char const * data, size_t len);
+	void append(std::string const & data) {
+		append(data.data(), data.length());
+	}
+
+	// Shares the blocks of the given range of another buffer
+	void append(SegmentBuffer const & other, size_t offset, size_t len);
+
+	// Drop bytes from the front
+	void consume(size_t len);
+	void clear();
+
+	// Like std::string::find
+	size_t find(
+		char const * needle,
+		size_t needleLength,
+		size_t from = 0
+	) const;
+	size_t find(std::string const & needle, size_t from = 0) const {
+		return find(needle.data(), needle.length(), from);
+	}
+
+	// Append a range of the buffer to a string, for code that needs to see
+	// it all in one piece
+	void copyTo(std::string & out, size_t offset, size_t len) const;
+
+	// Take bytes off the front and append them to a string
+	void moveTo(std::string & out, size_t len) {
+		copyTo(out, 0, len);
+		consume(len);
+	}
+
+	virtual ~SegmentBuffer();
+};
+
+#endif
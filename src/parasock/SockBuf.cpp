@@ -5,11 +5,15 @@
 // Buffered socket abstraction.
 //
 
+#include <stdio.h>
+
 #include "SockBuf.h"
+#include "Reactor.h"
 
 
 void SockBuf::shutdownAndClose() {
 	disconnected = true;
+	connecting = false;
 
 #ifdef SOCKWATCH
 	std::deque<SOCKET>::iterator it = std::find(
@@ -19,6 +23,9 @@ void SockBuf::shutdownAndClose() {
 		DebugBreak();
 #endif
 
+	if ((watch != NULL) && (watch->sock == sock))
+		watch->handler->eventLoop()->unwatch(*watch);
+
 	printf("SHUT DOWN SOCKET (%d)\n", sock);
 	shutdown(sock, SHUT_RDWR);
 	closesocket(sock);
@@ -26,6 +33,198 @@ void SockBuf::shutdownAndClose() {
 }
 
 
+int SockBuf::completeConnect() {
+	Assert(connecting);
+
+	int error = 0;
+	SASIZETYPE size = sizeof(error);
+	if (-1 == getsockopt(
+		sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &size
+	)) {
+		error = WSAGetLastError();
+	}
+
+	if (error == 0) {
+		// with no error yet, having a peer is what says it's connected
+		struct sockaddr_in peer;
+		SASIZETYPE peersize = sizeof(peer);
+		if (-1 == getpeername(sock, (struct sockaddr *)&peer, &peersize)) {
+			error = WSAGetLastError();
+			if (error == ENOTCONN) {
+				// A loop that does the socket's I/O calls it writable whenever
+				// no send is in flight, so it can't tell us when the connect
+				// is done.  Its sends and receives wait for that themselves.
+				if (!loopCompletesIo())
+					return EINPROGRESS;
+				error = 0;
+			}
+		}
+	}
+
+	if (error == 0)
+		connecting = false;
+	return error;
+}
+
+
+bool SockBuf::loopCompletesIo() const {
+	return (watch != NULL)
+		&& (sock != INVALID_SOCKET)
+		&& (watch->sock == sock)
+		&& watch->handler->eventLoop()->completesIo();
+}
+
+
+int SockBuf::sendReady(SendPiece const * pieces, int count) {
+	if (loopCompletesIo())
+		return watch->handler->eventLoop()->sendQueued(*watch, pieces, count);
+	return socksendvready(sock, pieces, count);
+}
+
+
+void SockBuf::commitInput(size_t count) {
+	Assert(count <= uncommittedLength());
+	uncommittedStart += count;
+
+	if (uncommittedStart == uncommittedBytes.length()) {
+		uncommittedBytes.clear();
+		uncommittedStart = 0;
+	} else if (
+		(uncommittedStart >= UNCOMMITTEDCOMPACT)
+		&& (uncommittedStart >= uncommittedLength())
+	) {
+		// moving what's left costs no more than what was committed
+		uncommittedBytes.erase(0, uncommittedStart);
+		uncommittedStart = 0;
+	}
+}
+
+
+void SockBuf::extendKnownWrites() {
+	while (
+		(knownCount < placeholders.size())
+		&& placeholders[knownCount]->contentsKnown
+	) {
+		knownBytes += placeholders[knownCount]->contents.length();
+		knownCount++;
+	}
+
+	// placeholders fulfilled with nothing have nothing to wait for
+	while ((knownCount > 0) && placeholders.front()->contents.empty()) {
+		Assert(frontSent == 0);
+		recyclePlaceholder(placeholders.front());
+		placeholders.pop_front();
+		knownCount--;
+	}
+}
+
+
+void SockBuf::consumeKnownWrites(size_t len) {
+	Assert(len <= knownBytes);
+	knownBytes -= len;
+
+	while (len > 0) {
+		Placeholder * placeholder = placeholders.front();
+		size_t remaining = placeholder->contents.length() - frontSent;
+		if (len < remaining) {
+			if (capture != NULL)
+				capture->record(
+					captureConnection,
+					CaptureSent,
+					placeholder->contents.data() + frontSent,
+					len
+				);
+			frontSent += len;
+			return;
+		}
+
+		if (capture != NULL)
+			capture->record(
+				captureConnection,
+				CaptureSent,
+				placeholder->contents.data() + frontSent,
+				remaining
+			);
+		len -= remaining;
+		frontSent = 0;
+		recyclePlaceholder(placeholder);
+		placeholders.pop_front();
+		knownCount--;
+	}
+
+	extendKnownWrites();
+}
+
+
+void SockBuf::recyclePlaceholder(Placeholder * placeholder) {
+	if (sparePlaceholders.size() >= PLACEHOLDERSPARES) {
+		delete placeholder;
+		return;
+	}
+
+	if (placeholder->contents.capacity() > PLACEHOLDERKEEP)
+		std::string().swap(placeholder->contents);
+	else
+		placeholder->contents.clear();
+	placeholder->contentsKnown = false;
+	placeholder->owner = NULL;
+	sparePlaceholders.push_back(placeholder);
+}
+
+
+int SockBuf::sendKnownWrites(size_t & offered) {
+	Assert(knownBytes > 0);
+
+	// Everything contiguous and known goes in one call, so a header, its
+	// content length, the CRLF and some body can all leave together
+	SendPiece pieces[SENDPIECESMAX];
+	int count = 0;
+	size_t offset = frontSent;
+	offered = 0;
+	for (
+		size_t index = 0;
+		(index < knownCount) && (count < SENDPIECESMAX);
+		index++
+	) {
+		std::string const & contents = placeholders[index]->contents;
+		if (contents.length() > offset) {
+			pieces[count].data = contents.data() + offset;
+			pieces[count].length = contents.length() - offset;
+			offered += pieces[count].length;
+			count++;
+		}
+		offset = 0;
+	}
+	Assert(count > 0);
+
+	int res = sendReady(pieces, count);
+	if (res > 0)
+		consumeKnownWrites(static_cast<size_t>(res));
+	return res;
+}
+
+
+int SockBuf::receiveReady(char * buf, int bufsize) {
+	if (loopCompletesIo())
+		return watch->handler->eventLoop()->receiveQueued(*watch, buf, bufsize);
+	return sockrecvready(sock, buf, bufsize);
+}
+
+
+bool SockBuf::hasSendsInFlight() const {
+	if (loopCompletesIo())
+		return watch->handler->eventLoop()->hasQueuedSends(*watch);
+	return false;
+}
+
+
+bool SockBuf::hasReceivesQueued() const {
+	if (loopCompletesIo())
+		return watch->handler->eventLoop()->hasQueuedReceives(*watch);
+	return false;
+}
+
+
 void SockBuf::failureShutdown(std::string const message, Timeout timeout) {
 	// failure, possibly send a message, don't trigger assertions
 
@@ -62,6 +261,67 @@ SockBuf::SockBuf() {
 	  
 	this->sin.sin_family = AF_INET;
 	disconnected = false;
+	connecting = false;
+	watch = NULL;
+	capture = NULL;
+	captureConnection = 0;
+	uncommittedStart = 0;
+	knownCount = 0;
+	knownBytes = 0;
+	frontSent = 0;
+}
+
+
+void SockBuf::recycle() {
+	if (sock != INVALID_SOCKET) {
+		shutdownAndClose();
+	}
+	memset(&sin, 0, sizeof(sockaddr_in));
+	sin.sin_family = AF_INET;
+	disconnected = false;
+	connecting = false;
+	watch = NULL;
+	capture = NULL;
+	captureConnection = 0;
+
+	unfilteredBytes.clear();
+	uncommittedBytes.clear();
+	uncommittedStart = 0;
+
+	// The ones with contents known are ours.  Any others are still owned
+	// by whatever filter asked for them.
+	while (!placeholders.empty()) {
+		Placeholder * placeholder = placeholders.front();
+		placeholders.pop_front();
+		if (placeholder->contentsKnown)
+			recyclePlaceholder(placeholder);
+	}
+	knownCount = 0;
+	knownBytes = 0;
+	frontSent = 0;
+}
+
+
+SOCKET SockBuf::detachIdle() {
+	if (
+		(sock == INVALID_SOCKET)
+		|| disconnected
+		|| connecting
+		|| !unfilteredBytes.empty()
+		|| !uncommittedBytes.empty()
+		|| !placeholders.empty()
+		|| hasSendsInFlight()
+		|| hasReceivesQueued() // unwatching would throw it away
+	) {
+		return INVALID_SOCKET;
+	}
+
+	if ((watch != NULL) && (watch->sock == sock))
+		watch->handler->eventLoop()->unwatch(*watch);
+
+	SOCKET detached = sock;
+	sock = INVALID_SOCKET;
+	return detached;
 }
 
 
@@ -72,4 +332,10 @@ SockBuf::~SockBuf() {
 	this->sin.sin_addr.s_addr = 0;
 	this->sin.sin_port = 0;
 	this->sock = INVALID_SOCKET;
+
+	std::vector<Placeholder *>::iterator it = sparePlaceholders.begin();
+	while (it != sparePlaceholders.end()) {
+		delete *it;
+		it++;
+	}
 }
@@ -10,12 +10,29 @@
 #define __PARASOCK_SOCKBUF_H__
 
 #include <deque>
+#include <vector>
 #include <algorithm>
 
 #include "NetUtils.h"
 #include "Helpers.h"
+#include "SegmentBuffer.h"
+#include "InputSpan.h"
+#include "Capture.h"
+
+// Placeholders that have gone out are kept for reuse, up to this many, so
+// steady traffic doesn't go to the heap for every piece of output
+#define PLACEHOLDERSPARES 16
+
+// ...but one that held more than this gives the memory back first
+#define PLACEHOLDERKEEP BUFSIZE
+
+// Committed input is only counted off the front of uncommittedBytes until
+// there's at least this much of it, and no less than what's still to come
+#define UNCOMMITTEDCOMPACT BUFSIZE
 
 class Parasock;
+class SockBuf;
+struct ReactorWatch;
 
 //
 // You pass a std::auto_ptr<Placeholder> into an output stream
@@ -52,28 +69,75 @@ public:
 private:
 	bool disconnected;
 
-// Debugging information!
+// Set while a connect that was started without waiting for it is still
+// going.  Nothing is sent or received until it's done, which the socket
+// says by becoming writable.
+private:
+	bool connecting;
+
+// If an event loop is watching the socket, it has to be told before the
+// socket is closed (or a new socket could show up under the same number)
 private:
-	std::string bytesWrittenSoFar;
-	std::string bytesReadSoFar;
+	ReactorWatch * watch;
+
+	bool loopCompletesIo() const;
+
+// If the Parasock is capturing traffic, what goes through the socket is
+// recorded there, tagged with which of its connections this is
+private:
+	CaptureRing * capture;
+	int captureConnection;
 
 // We read data in chunks into unfilteredBytes until we have enough to
 // satisfy the filter.  When we do, enough bytes are moved to the
 // uncommittedBytes buffer and the filter is called.  The filter decides how
 // many of those it wishes to "consume", but if they are not consumed
-// they will still be there for the next call
+// they will still be there for the next call.  unfilteredBytes is where the
+// bulk of the data waits, so it is a block chain that is cheap to read into
+// and consume from; uncommittedBytes is what the filter sees, in one piece.
+// What the filter commits is counted off its front by uncommittedStart,
+// and only erased once that's worth the move.
 private:
-	std::string unfilteredBytes;
+	SegmentBuffer unfilteredBytes;
 	std::string uncommittedBytes;
+	size_t uncommittedStart;
 
+	size_t uncommittedLength() const {
+		return uncommittedBytes.length() - uncommittedStart;
+	}
+
+	InputSpan uncommitted() const {
+		return InputSpan(uncommittedBytes, uncommittedStart);
+	}
+
+	void commitInput(size_t count);
+
+// The placeholders run from the front of the deque to as far as contents
+// are known; that stretch is ready to go out.  Its size is kept as things
+// are fulfilled and sent, rather than added up every time it's asked for.
+// frontSent is how much of the front placeholder has already been sent.
 private:
 	std::deque<Placeholder *> placeholders;
+	size_t knownCount;
+	size_t knownBytes;
+	size_t frontSent;
+	std::vector<Placeholder *> sparePlaceholders;
+
+	void extendKnownWrites();
+	void consumeKnownWrites(size_t len);
+	void recyclePlaceholder(Placeholder * placeholder);
 
 public:
 	SockBuf();
 
 	std::auto_ptr<Placeholder> outputPlaceholder() {
-		std::auto_ptr<Placeholder> placeholder (new Placeholder());
+		std::auto_ptr<Placeholder> placeholder;
+		if (sparePlaceholders.empty()) {
+			placeholder.reset(new Placeholder());
+		} else {
+			placeholder.reset(sparePlaceholders.back());
+			sparePlaceholders.pop_back();
+		}
 		Assert(placeholder->owner == NULL);
 		placeholder->owner = this;
 		placeholders.push_back(placeholder.get());
@@ -87,20 +151,13 @@ public:
 		Assert(placeholder.get() != NULL);
 		Assert(!placeholder->contentsKnown);
 		Assert(placeholder->owner == this);
-		std::deque<Placeholder *>::iterator it = std::find(
-			placeholders.begin(),
-			placeholders.end(),
-			placeholder.get()
-		);
-		Assert(it != placeholders.end());
+
+		// hold onto placeholder until its time (empty ones are dropped once
+		// they reach the front, so there's no need to find it here)
 		placeholder->contentsKnown = true;
-		if (contents.empty()) {	
-			placeholders.erase(it);
-		} else {
-			// hold onto placeholder until its time
-			placeholder->contents = contents;
-			placeholder.release(); // will free later
-		}
+		placeholder->contents = contents;
+		placeholder.release(); // will free later
+		extendKnownWrites();
 	}
 
 	void outputString(std::string const sendMe) {
@@ -112,6 +169,8 @@ public:
 
 			// merge if contents known of last placeholder
 			addToContents += sendMe; 
+			if (knownCount == placeholders.size())
+				knownBytes += sendMe.length();
 		} else {
 			std::auto_ptr<Placeholder> placeholder = outputPlaceholder();
 			fulfillPlaceholder(placeholder, sendMe);
@@ -119,16 +178,18 @@ public:
 	}
 
 	bool hasKnownWritesPending() {
-		if (placeholders.empty()) {
-			return false;
-		}
-		return placeholders.front()->contentsKnown;
+		return knownCount > 0;
+	}
+
+	// How much could be sent right now
+	size_t getKnownWriteBytes() const {
+		return knownBytes;
 	}
 
 	bool definitelyHasFutureWrites() {
 		std::deque<Placeholder *>::iterator it = placeholders.begin();
 		while (it != placeholders.end()) {
-			if ((*it)->contentsKnown) {
+			if ((*it)->contentsKnown && !(*it)->contents.empty()) {
 				return true;
 			}
 			it++;
@@ -136,8 +197,48 @@ public:
 		return false;
 	}
 
+	// Send as much of the known writes as the socket will take, gathered
+	// into one call.  Returns what sendReady does, and says how much was
+	// offered to it.
+	int sendKnownWrites(size_t & offered);
+
+	// Non-blocking send and recv for a socket that's been reported ready.
+	// When the socket is watched by a loop that does its own I/O these go
+	// through the loop, and a send may still be in flight after it returns.
+	int sendReady(SendPiece const * pieces, int count);
+	int receiveReady(char * buf, int bufsize);
+	bool hasSendsInFlight() const;
+
+	// True when the loop does the receiving, and has taken something off
+	// the socket that hasn't been handed over yet
+	bool hasReceivesQueued() const;
+
 	void cleanCheckpoint();
 	void shutdownAndClose();
+
+	// For whoever started a non-blocking connect on the socket
+	void setConnecting() {
+		connecting = true;
+	}
+
+	bool isConnecting() const {
+		return connecting;
+	}
+
+	// Once a connecting socket reports ready: zero when it has connected (or
+	// the loop watching it will see to that), EINPROGRESS if it hasn't yet,
+	// or the error the connect failed with
+	int completeConnect();
+
+	// Closes the socket and empties the buffers, but keeps their memory for
+	// the next connection
+	void recycle();
+
+	// Gives the socket up without closing it, so it can carry another
+	// connection's requests, if nothing is left unread or unsent on it.
+	// Otherwise the socket stays, and this returns INVALID_SOCKET.
+	SOCKET detachIdle();
+
 	void failureShutdown(std::string const message, Timeout timeout);
 
 	virtual ~SockBuf();
@@ -0,0 +1,139 @@
+//
+// TimerWheel.cpp
+//
+// Two level hashed timer wheel, see TimerWheel.h
+//
+
+#include "TimerWheel.h"
+
+
+// Moves the whole of one list onto the end of another
+static void AppendAll(TimerLink & from, TimerLink & to) {
+	if (!from.isLinked())
+		return;
+
+	TimerLink * first = from.next;
+	TimerLink * last = from.prev;
+	first->prev = to.prev;
+	to.prev->next = first;
+	last->next = &to;
+	to.prev = last;
+	from.prev = from.next = &from;
+}
+
+
+WheelTimer::~WheelTimer() {
+	if (wheel != NULL)
+		wheel->cancel(*this);
+}
+
+
+TimerWheel::TimerWheel (time_t now) :
+	current (now),
+	count (0)
+{
+}
+
+
+void TimerWheel::file(WheelTimer & timer) {
+	time_t due = timer.deadline;
+	if (due <= current)
+		due = current + 1;
+
+	if (due - current < NearSlots) {
+		timer.linkBefore(near[due & NearMask]);
+		return;
+	}
+
+	// it'll get refiled when its slot comes up, and again if need be
+	if (due - current >= Span)
+		due = current + Span - 1;
+	timer.linkBefore(far[(due >> NearBits) & FarMask]);
+}
+
+
+void TimerWheel::cascade() {
+	TimerLink pending;
+	AppendAll(far[(current >> NearBits) & FarMask], pending);
+	while (pending.isLinked()) {
+		WheelTimer & timer = static_cast<WheelTimer &>(*pending.next);
+		timer.unlink();
+		file(timer);
+	}
+}
+
+
+void TimerWheel::expire(TimerLink & list) {
+	// The callbacks may schedule and cancel timers, including ones still
+	// waiting their turn here, so work from a list of our own
+	TimerLink pending;
+	AppendAll(list, pending);
+	while (pending.isLinked()) {
+		WheelTimer & timer = static_cast<WheelTimer &>(*pending.next);
+		timer.unlink();
+		if (timer.deadline > current) {
+			file(timer);
+			continue;
+		}
+		timer.wheel = NULL;
+		count--;
+		timer.timerExpired(current);
+	}
+}
+
+
+void TimerWheel::schedule(WheelTimer & timer, time_t deadline) {
+	cancel(timer);
+	timer.deadline = deadline;
+	timer.wheel = this;
+	count++;
+	file(timer);
+}
+
+
+void TimerWheel::cancel(WheelTimer & timer) {
+	if (timer.wheel == NULL)
+		return;
+	Assert(timer.wheel == this);
+
+	timer.unlink();
+	timer.wheel = NULL;
+	count--;
+}
+
+
+void TimerWheel::advance(time_t now) {
+	if (now - current > Span) {
+		// Away long enough for the wheel to have come all the way around,
+		// so there's no telling what's due without looking at everything
+		TimerLink pending;
+		for (int slot = 0; slot < NearSlots; slot++)
+			AppendAll(near[slot], pending);
+		for (int slot = 0; slot < FarSlots; slot++)
+			AppendAll(far[slot], pending);
+		current = now;
+		expire(pending);
+		return;
+	}
+
+	while (current < now) {
+		current++;
+		if ((current & NearMask) == 0)
+			cascade();
+		expire(near[current & NearMask]);
+	}
+}
+
+
+TimerWheel::~TimerWheel() {
+	TimerLink pending;
+	for (int slot = 0; slot < NearSlots; slot++)
+		AppendAll(near[slot], pending);
+	for (int slot = 0; slot < FarSlots; slot++)
+		AppendAll(far[slot], pending);
+	while (pending.isLinked()) {
+		WheelTimer & timer = static_cast<WheelTimer &>(*pending.next);
+		timer.unlink();
+		timer.wheel = NULL;
+	}
+}
@@ -0,0 +1,142 @@
+//
+// TimerWheel.h
+//
+// Deadlines for large numbers of connections, to the second.  Rather than
+// looking at every connection once a second to see if it has run out of
+// time, each deadline is filed in a slot by when it falls due, and only the
+// slot for the current second is looked at.  Setting, moving and cancelling
+// a deadline is a matter of unlinking and relinking one node.
+//
+// There are two levels to the wheel.  The first has a slot for each of the
+// next 256 seconds.  The second has a slot for each 256 second stretch
+// after that (out to about four and a half hours); as the first level comes
+// around, the next of these stretches gets spread out over it.  Anything
+// further off than the second level reaches is filed in its last slot, and
+// refiled when that slot comes due.
+//
+
+#ifndef __PARASOCK_TIMERWHEEL_H__
+#define __PARASOCK_TIMERWHEEL_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#include "Helpers.h"
+
+class TimerWheel;
+
+
+// Links for the circular lists hanging off each slot
+struct TimerLink {
+	TimerLink * prev;
+	TimerLink * next;
+
+	TimerLink () {
+		prev = next = this;
+	}
+
+	bool isLinked() const {
+		return next != this;
+	}
+
+	void unlink() {
+		prev->next = next;
+		next->prev = prev;
+		prev = next = this;
+	}
+
+	void linkBefore(TimerLink & other) {
+		prev = other.prev;
+		next = &other;
+		other.prev->next = this;
+		other.prev = this;
+	}
+};
+
+
+// Something that wants to be called back when its deadline passes.  It
+// lives inside the object it's for, so the wheel never allocates.
+class WheelTimer : private TimerLink {
+
+	friend class TimerWheel;
+
+private:
+	TimerWheel * wheel; // NULL when not scheduled
+	time_t deadline;
+
+public:
+	WheelTimer () :
+		wheel (NULL),
+		deadline (0)
+	{
+	}
+
+private:
+	// Disable copying C++98 style
+	WheelTimer (WheelTimer const & other);
+
+public:
+	bool isScheduled() const {
+		return wheel != NULL;
+	}
+
+	time_t getDeadline() const {
+		return deadline;
+	}
+
+protected:
+	// Called on the wheel's thread once the deadline has passed; the timer
+	// is no longer scheduled by then, and may be scheduled again
+	virtual void timerExpired(time_t now) = 0;
+
+public:
+	virtual ~WheelTimer();
+};
+
+
+class TimerWheel {
+private:
+	enum {
+		NearBits = 8,
+		NearSlots = 1 << NearBits,
+		NearMask = NearSlots - 1,
+		FarBits = 6,
+		FarSlots = 1 << FarBits,
+		FarMask = FarSlots - 1,
+		Span = NearSlots * FarSlots
+	};
+
+	TimerLink near[NearSlots];
+	TimerLink far[FarSlots];
+	time_t current; // every deadline up to here has been handled
+	size_t count;
+
+private:
+	void file(WheelTimer & timer);
+	void cascade();
+	void expire(TimerLink & list);
+
+public:
+	explicit TimerWheel (time_t now);
+
+private:
+	// Disable copying C++98 style
+	TimerWheel (TimerWheel const & other);
+
+public:
+	// A deadline that's already passed goes off on the next advance
+	void schedule(WheelTimer & timer, time_t deadline);
+	void cancel(WheelTimer & timer);
+
+	// Calls back everything due by now.  If the clock goes backwards, the
+	// deadlines go off late by that much rather than early.
+	void advance(time_t now);
+
+	size_t getCount() const {
+		return count;
+	}
+
+	virtual ~TimerWheel();
+};
+
+#endif
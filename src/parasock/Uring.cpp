@@ -0,0 +1,642 @@
+//
+// Uring.cpp
+//
+// io_uring engine for the event loops.
+//
+
+#include "Uring.h"
+
+#ifdef WITH_IO_URING
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URINGENTRIES 256
+#define BUFFERCOUNT 256
+#define BUFFERGROUP 0
+
+// Stop receiving for a socket that nobody is reading from once this much
+// is waiting in its inbox; the rest can wait in the kernel
+#define INBOXMAX (16 * BUFSIZE)
+
+// What kind of operation a completion is for goes in the low bits of the
+// user data, with the UringSocket pointer (which new aligns to at least
+// eight) in the rest
+#define OP_RECEIVE 1
+#define OP_SEND 2
+#define OP_CANCEL 3
+#define OP_POLL 4
+#define OP_MASK 7
+
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params * p) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int io_uring_enter(
+	int fd,
+	unsigned int toSubmit,
+	unsigned int minComplete,
+	unsigned int flags,
+	void * arg,
+	size_t argsz
+) {
+	return static_cast<int>(
+		syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argsz)
+	);
+}
+
+static int io_uring_register(
+	int fd,
+	unsigned int opcode,
+	void * arg,
+	unsigned int nrArgs
+) {
+	return static_cast<int>(
+		syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs)
+	);
+}
+
+
+UringEngine::UringEngine () :
+	ringfd (-1),
+	features (0),
+	sqRing (MAP_FAILED),
+	sqRingSize (0),
+	sqes (static_cast<struct io_uring_sqe *>(MAP_FAILED)),
+	sqesSize (0),
+	sqPending (0),
+	bufferRing (static_cast<struct io_uring_buf_ring *>(MAP_FAILED)),
+	bufferRingSize (0),
+	buffers (NULL),
+	bufferTail (0),
+	multishot (true),
+	wakefd (-1)
+{
+}
+
+
+UringEngine * UringEngine::open(int wakefd) {
+	std::auto_ptr<UringEngine> engine (new UringEngine());
+	if (!engine->setup(URINGENTRIES))
+		return NULL;
+
+	engine->wakefd = wakefd;
+	if (wakefd != -1)
+		engine->armWake();
+	return engine.release();
+}
+
+
+bool UringEngine::setup(unsigned int entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ringfd = io_uring_setup(entries, &params);
+	if (ringfd < 0)
+		return false;
+	features = params.features;
+
+	// Waiting with a timeout needs EXT_ARG (5.11), and one mapping for both
+	// queues keeps this simple (5.4)
+	if (!(features & IORING_FEAT_EXT_ARG) || !(features & IORING_FEAT_SINGLE_MMAP))
+		return false;
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqRingSize =
+		params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (cqRingSize > sqRingSize)
+		sqRingSize = cqRingSize;
+
+	sqRing = mmap(
+		NULL,
+		sqRingSize,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		ringfd,
+		IORING_OFF_SQ_RING
+	);
+	if (sqRing == MAP_FAILED)
+		return false;
+
+	char * ring = static_cast<char *>(sqRing);
+	sqHead = reinterpret_cast<unsigned *>(ring + params.sq_off.head);
+	sqTail = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+	sqMask = reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+	sqArray = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+	cqHead = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+	cqTail = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+	cqMask = reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe *>(ring + params.cq_off.cqes);
+
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = static_cast<struct io_uring_sqe *>(mmap(
+		NULL,
+		sqesSize,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		ringfd,
+		IORING_OFF_SQES
+	));
+	if (sqes == MAP_FAILED)
+		return false;
+
+	// Provided buffer rings showed up in 5.19
+	bufferRingSize = BUFFERCOUNT * sizeof(struct io_uring_buf);
+	bufferRing = static_cast<struct io_uring_buf_ring *>(mmap(
+		NULL,
+		bufferRingSize,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS,
+		-1,
+		0
+	));
+	if (bufferRing == MAP_FAILED)
+		return false;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<unsigned long>(bufferRing);
+	reg.ring_entries = BUFFERCOUNT;
+	reg.bgid = BUFFERGROUP;
+	if (io_uring_register(ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return false;
+
+	buffers = new char[BUFFERCOUNT * BUFSIZE];
+	for (unsigned short bid = 0; bid < BUFFERCOUNT; bid++) {
+		recycleBuffer(bid);
+	}
+
+	return true;
+}
+
+
+void UringEngine::recycleBuffer(unsigned short bid) {
+	// The entries start at the top of the ring, with the tail tucked into
+	// the first one.  Not using the bufs member, because the way the header
+	// declares it puts it at a different offset when compiled as C++.
+	struct io_uring_buf * bufs = reinterpret_cast<struct io_uring_buf *>(bufferRing);
+	struct io_uring_buf * buf = &bufs[bufferTail & (BUFFERCOUNT - 1)];
+	buf->addr = reinterpret_cast<unsigned long>(buffers + bid * BUFSIZE);
+	buf->len = BUFSIZE;
+	buf->bid = bid;
+	bufferTail++;
+	__atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+}
+
+
+struct io_uring_sqe * UringEngine::getSqe() {
+	unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	unsigned tail = *sqTail;
+	if (tail - head > *sqMask) {
+		// full up; hand what we have to the kernel without waiting
+		enter(0, 0);
+		head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		if (tail - head > *sqMask)
+			throw "io_uring submission queue is full";
+	}
+
+	unsigned index = tail & *sqMask;
+	struct io_uring_sqe * sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray[index] = index;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	sqPending++;
+	return sqe;
+}
+
+
+int UringEngine::enter(unsigned int minComplete, int milliseconds) {
+	struct __kernel_timespec ts;
+	ts.tv_sec = milliseconds / 1000;
+	ts.tv_nsec = (milliseconds % 1000) * 1000000LL;
+
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<unsigned long>(&ts);
+
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	if (minComplete > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	int res = io_uring_enter(ringfd, sqPending, minComplete, flags, &arg, sizeof(arg));
+	if (res >= 0) {
+		sqPending -= (static_cast<unsigned>(res) < sqPending) ? res : sqPending;
+		return res;
+	}
+
+	// ETIME is just the timeout running out, EINTR a signal
+	if ((errno != ETIME) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+		throw "io_uring_enter error";
+	return 0;
+}
+
+
+void UringEngine::armWake() {
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = wakefd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = 0; // how wakeups are recognized
+}
+
+
+void UringEngine::armReceive(UringSocket * socket) {
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = socket->sock;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFERGROUP;
+	if (multishot)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = reinterpret_cast<unsigned long>(socket) | OP_RECEIVE;
+
+	socket->receiving = true;
+	socket->inFlight++;
+}
+
+
+void UringEngine::armSend(UringSocket * socket) {
+	Assert(socket->outboxSent < socket->outbox.length());
+
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = socket->sock;
+	sqe->addr = reinterpret_cast<unsigned long>(
+		socket->outbox.data() + socket->outboxSent
+	);
+	sqe->len = static_cast<unsigned>(socket->outbox.length() - socket->outboxSent);
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = reinterpret_cast<unsigned long>(socket) | OP_SEND;
+
+	socket->sending = true;
+	socket->inFlight++;
+}
+
+
+void UringEngine::armPoll(UringSocket * socket) {
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = socket->sock;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = reinterpret_cast<unsigned long>(socket) | OP_POLL;
+
+	socket->polling = true;
+	socket->inFlight++;
+}
+
+
+void UringEngine::cancel(UringSocket * socket, int op) {
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = reinterpret_cast<unsigned long>(socket) | op;
+	sqe->user_data = reinterpret_cast<unsigned long>(socket) | OP_CANCEL;
+
+	socket->inFlight++;
+}
+
+
+// Keep a receive going for the socket as long as there's room for what it
+// brings in, and nothing has ended it
+void UringEngine::maintain(UringSocket * socket) {
+	if (socket->watch == NULL)
+		return;
+	if (socket->pollOnly) {
+		// one poll at a time, armed again once the last has been reported
+		if (!socket->polling && !socket->polled)
+			armPoll(socket);
+		return;
+	}
+	if (socket->receiving || socket->receivedEnd || (socket->receiveError != 0))
+		return;
+	if (socket->inbox.length() >= INBOXMAX)
+		return;
+
+	armReceive(socket);
+}
+
+
+short UringEngine::readyEvents(UringSocket const * socket) const {
+	short revents = 0;
+	if (socket->watch == NULL)
+		return revents;
+
+	if (socket->pollOnly) {
+		if ((socket->watch->events & POLLIN) && socket->polled)
+			revents |= POLLIN;
+		return revents;
+	}
+
+	if (
+		(socket->watch->events & POLLIN)
+		&& (
+			!socket->inbox.empty()
+			|| socket->receivedEnd
+			|| (socket->receiveError != 0)
+		)
+	) {
+		revents |= POLLIN;
+	}
+
+	if ((socket->watch->events & POLLOUT) && !socket->sending)
+		revents |= POLLOUT;
+
+	return revents;
+}
+
+
+void UringEngine::markReady(UringSocket * socket) {
+	if (socket->queued || (readyEvents(socket) == 0))
+		return;
+	socket->queued = true;
+	ready.push_back(socket);
+}
+
+
+void UringEngine::watch(ReactorWatch & watch, SOCKET sock) {
+	Assert(watch.uringSocket == NULL);
+
+	UringSocket * socket = new UringSocket;
+	socket->watch = &watch;
+	socket->sock = sock;
+	socket->receiving = false;
+	socket->receivedEnd = false;
+	socket->receiveError = 0;
+	socket->outboxSent = 0;
+	socket->sending = false;
+	socket->sendError = 0;
+	socket->pollOnly = watch.pollOnly;
+	socket->polling = false;
+	socket->polled = false;
+	socket->inFlight = 0;
+	socket->queued = false;
+	watch.uringSocket = socket;
+
+	maintain(socket);
+}
+
+
+void UringEngine::unwatch(ReactorWatch & watch) {
+	UringSocket * socket = watch.uringSocket;
+	if (socket == NULL)
+		return;
+
+	watch.uringSocket = NULL;
+	socket->watch = NULL;
+
+	if (socket->receiving)
+		cancel(socket, OP_RECEIVE);
+	if (socket->sending)
+		cancel(socket, OP_SEND);
+	if (socket->polling)
+		cancel(socket, OP_POLL);
+
+	// The socket is about to be closed, and its number may be reused right
+	// away.  Anything queued that names it has to reach the kernel first.
+	enter(0, 0);
+
+	release(socket);
+}
+
+
+void UringEngine::release(UringSocket * socket) {
+	if ((socket->watch == NULL) && (socket->inFlight == 0) && !socket->queued)
+		delete socket;
+}
+
+
+void UringEngine::interestChanged(ReactorWatch & watch) {
+	if (watch.uringSocket != NULL) {
+		maintain(watch.uringSocket);
+		markReady(watch.uringSocket);
+	}
+}
+
+
+int UringEngine::send(ReactorWatch & watch, SendPiece const * pieces, int count) {
+	UringSocket * socket = watch.uringSocket;
+	Assert(socket != NULL);
+
+	if (socket->sendError != 0) {
+		errno = socket->sendError;
+		return -1;
+	}
+	if (socket->sending) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	// Our own copy, since the kernel will be reading it after we return.
+	// The pieces go out together in one SEND.
+	socket->outbox.clear();
+	for (int index = 0; index < count; index++) {
+		socket->outbox.append(pieces[index].data, pieces[index].length);
+	}
+	socket->outboxSent = 0;
+	armSend(socket);
+	return static_cast<int>(socket->outbox.length());
+}
+
+
+int UringEngine::receive(ReactorWatch & watch, char * buf, int bufsize) {
+	UringSocket * socket = watch.uringSocket;
+	Assert(socket != NULL);
+
+	if (!socket->inbox.empty()) {
+		size_t len = std::min(socket->inbox.length(), static_cast<size_t>(bufsize));
+		memcpy(buf, socket->inbox.data(), len);
+		socket->inbox.erase(0, len);
+		maintain(socket);
+		return static_cast<int>(len);
+	}
+
+	if (socket->receiveError != 0) {
+		errno = socket->receiveError;
+		return -1;
+	}
+
+	if (socket->receivedEnd)
+		return 0;
+
+	errno = EAGAIN;
+	return -1;
+}
+
+
+bool UringEngine::hasSendInFlight(ReactorWatch const & watch) const {
+	return (watch.uringSocket != NULL) && watch.uringSocket->sending;
+}
+
+
+bool UringEngine::hasReceived(ReactorWatch const & watch) {
+	// what the kernel has finished with but we haven't looked at yet counts
+	reap();
+
+	UringSocket const * socket = watch.uringSocket;
+	return (socket != NULL) && (
+		!socket->inbox.empty()
+		|| socket->receivedEnd
+		|| (socket->receiveError != 0)
+	);
+}
+
+
+void UringEngine::completion(struct io_uring_cqe const & cqe) {
+	if (cqe.user_data == 0) {
+		// the event loop's eventfd; we just need to drain it
+		unsigned long long counter;
+		ssize_t res = read(wakefd, &counter, sizeof(counter));
+		(void)res;
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+			armWake();
+		return;
+	}
+
+	UringSocket * socket = reinterpret_cast<UringSocket *>(
+		cqe.user_data & ~static_cast<unsigned long long>(OP_MASK)
+	);
+	int op = static_cast<int>(cqe.user_data & OP_MASK);
+	bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+	switch (op) {
+	case OP_RECEIVE: {
+		if (!more) {
+			socket->receiving = false;
+			socket->inFlight--;
+		}
+
+		bool wasFull = (socket->inbox.length() >= INBOXMAX);
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+			if (cqe.res > 0)
+				socket->inbox.append(buffers + bid * BUFSIZE, cqe.res);
+			recycleBuffer(bid);
+		}
+
+		if (cqe.res == 0) {
+			socket->receivedEnd = true;
+		} else if (cqe.res == -EINVAL && multishot) {
+			// kernel predates multishot receive (6.0); one at a time then
+			multishot = false;
+		} else if ((cqe.res == -ENOBUFS) || (cqe.res == -ECANCELED)) {
+			// out of buffers or called off, maintain() decides on rearming
+		} else if (cqe.res < 0) {
+			socket->receiveError = -cqe.res;
+		}
+
+		// a full inbox means no more receiving until someone reads it
+		if (more && !wasFull && (socket->inbox.length() >= INBOXMAX))
+			cancel(socket, OP_RECEIVE);
+		break;
+	}
+
+	case OP_SEND: {
+		socket->sending = false;
+		socket->inFlight--;
+
+		if (cqe.res < 0) {
+			socket->sendError = -cqe.res;
+			socket->outbox.clear();
+		} else {
+			socket->outboxSent += cqe.res;
+			if (socket->outboxSent < socket->outbox.length()) {
+				if (socket->watch != NULL)
+					armSend(socket); // short send, go again with the rest
+			} else {
+				socket->outbox.clear();
+				socket->outboxSent = 0;
+			}
+		}
+		break;
+	}
+
+	case OP_POLL:
+		socket->polling = false;
+		socket->inFlight--;
+		if (cqe.res != -ECANCELED)
+			socket->polled = true;
+		break;
+
+	case OP_CANCEL:
+		socket->inFlight--;
+		break;
+
+	default:
+		NotReached();
+		break;
+	}
+
+	if (socket->watch != NULL) {
+		maintain(socket);
+		markReady(socket);
+	} else {
+		release(socket);
+	}
+}
+
+
+void UringEngine::reap() {
+	unsigned head = *cqHead;
+	unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		completion(cqes[head & *cqMask]);
+		head++;
+		if (head == tail) {
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+			tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		}
+	}
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+
+void UringEngine::wait(int milliseconds, std::vector<UringReady> & result) {
+	// If something is already ready, just submit and pick up what's there
+	enter(ready.empty() ? 1 : 0, milliseconds);
+	reap();
+
+	std::vector<UringSocket *> readyNow;
+	readyNow.swap(ready);
+	std::vector<UringSocket *>::iterator it = readyNow.begin();
+	while (it != readyNow.end()) {
+		UringSocket * socket = *it;
+		socket->queued = false;
+		short revents = readyEvents(socket);
+		if (revents != 0) {
+			// readiness from a poll is passed on once; the handler takes
+			// what it's going to and the poll is armed again
+			if (socket->pollOnly)
+				socket->polled = false;
+
+			UringReady r;
+			r.watch = socket->watch;
+			r.revents = revents;
+			result.push_back(r);
+		} else {
+			release(socket);
+		}
+		it++;
+	}
+}
+
+
+UringEngine::~UringEngine() {
+	// UringSockets still waiting on the kernel are leaked; the loops live as
+	// long as the process does
+	if (buffers != NULL)
+		delete[] buffers;
+	if (bufferRing != MAP_FAILED)
+		munmap(bufferRing, bufferRingSize);
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqesSize);
+	if (sqRing != MAP_FAILED)
+		munmap(sqRing, sqRingSize);
+	if (ringfd >= 0)
+		close(ringfd);
+}
+
+#endif
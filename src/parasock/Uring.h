@@ -0,0 +1,147 @@
+//
+// Uring.h
+//
+// An io_uring engine for the event loops.  Rather than being told a socket
+// is readable and then making a recv call, the kernel does the receiving
+// into a ring of buffers we've provided and the data is waiting for us in
+// an inbox.  Sends are handed over the same way.  Everything that has been
+// queued up is submitted in the same system call that waits for results,
+// so a trip around the loop costs one syscall instead of a poll plus a
+// recv or send for each socket.
+//
+// Parasock still asks for data in terms of readiness (POLLIN, POLLOUT),
+// so the engine reports a watch as "readable" while its inbox has data in
+// it, and "writable" while it doesn't have a send in flight.
+//
+// Talks to the kernel with raw system calls, liburing is not required.
+//
+
+#ifndef __PARASOCK_URING_H__
+#define __PARASOCK_URING_H__
+
+#include "Reactor.h"
+
+#ifdef WITH_IO_URING
+
+#include <string>
+#include <linux/io_uring.h>
+
+// Each socket's half of the conversation with the kernel.  This outlives
+// the watch it was made for when there are operations still in flight,
+// since the kernel has its address and will be giving it back.
+struct UringSocket {
+	ReactorWatch * watch; // NULL once unwatched
+	SOCKET sock;
+
+	std::string inbox;
+	bool receiving;
+	bool receivedEnd;
+	int receiveError;
+
+	std::string outbox;
+	size_t outboxSent;
+	bool sending;
+	int sendError;
+
+	// A listening socket just gets polled, see ReactorWatch::pollOnly
+	bool pollOnly;
+	bool polling;
+	bool polled;
+
+	int inFlight;
+	bool queued;
+};
+
+
+struct UringReady {
+	ReactorWatch * watch;
+	short revents;
+};
+
+
+class UringEngine {
+private:
+	int ringfd;
+	unsigned int features;
+
+	// submission queue
+	void * sqRing;
+	size_t sqRingSize;
+	unsigned * sqHead;
+	unsigned * sqTail;
+	unsigned * sqMask;
+	unsigned * sqArray;
+	struct io_uring_sqe * sqes;
+	size_t sqesSize;
+	unsigned sqPending;
+
+	// completion queue, which shares its mapping with the submissions
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned * cqMask;
+	struct io_uring_cqe * cqes;
+
+	// the buffers the kernel picks from when it receives
+	struct io_uring_buf_ring * bufferRing;
+	size_t bufferRingSize;
+	char * buffers;
+	unsigned short bufferTail;
+
+	bool multishot;
+
+	int wakefd;
+	std::vector<UringSocket *> ready;
+
+private:
+	UringEngine ();
+
+	// Disable copying C++98 style
+	UringEngine (UringEngine const & other);
+
+	bool setup(unsigned int entries);
+
+	struct io_uring_sqe * getSqe();
+	int enter(unsigned int minComplete, int milliseconds);
+	void recycleBuffer(unsigned short bid);
+
+	void armReceive(UringSocket * socket);
+	void armSend(UringSocket * socket);
+	void armPoll(UringSocket * socket);
+	void armWake();
+	void cancel(UringSocket * socket, int op);
+
+	void maintain(UringSocket * socket);
+	short readyEvents(UringSocket const * socket) const;
+	void markReady(UringSocket * socket);
+	void completion(struct io_uring_cqe const & cqe);
+	void reap();
+	void release(UringSocket * socket);
+
+public:
+	// NULL if the kernel isn't up to it (too old, or io_uring disabled)
+	static UringEngine * open(int wakefd);
+
+	void watch(ReactorWatch & watch, SOCKET sock);
+	void unwatch(ReactorWatch & watch);
+	void interestChanged(ReactorWatch & watch);
+
+	// Stand-ins for send and recv on a watched socket.  Same conventions as
+	// socksendvready and sockrecvready: -1 with EAGAIN if it would block.
+	int send(ReactorWatch & watch, SendPiece const * pieces, int count);
+	int receive(ReactorWatch & watch, char * buf, int bufsize);
+	bool hasSendInFlight(ReactorWatch const & watch) const;
+
+	// True when something's been received for the socket that hasn't been
+	// taken with receive yet: data, or its end, or an error
+	bool hasReceived(ReactorWatch const & watch);
+
+	// Submit what's been queued and wait (unless something is already
+	// ready) for completions.  Hands back the watches with something to do.
+	void wait(int milliseconds, std::vector<UringReady> & result);
+
+	virtual ~UringEngine();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,188 @@
+//
+// WorkerPool.cpp
+//
+// Pre-started threads fed from a lock-free ring, see WorkerPool.h
+//
+
+#ifdef _WIN32
+#include <process.h>
+#endif
+
+#include "WorkerPool.h"
+
+// Smallest ring, whatever the thread limit
+#define WORKERPOOLRING 64
+
+
+WorkerPool::WorkerPool () :
+	mask (0),
+	enqueuePos (0),
+	dequeuePos (0),
+	queued (NULL),
+	idle (0),
+	threadCount (0),
+	maxThreads (0),
+	stackSize (0),
+	func (NULL)
+{
+}
+
+
+bool WorkerPool::start(
+	int threads,
+	int maxThreadsIn,
+	unsigned stackSizeIn,
+	WORKERPOOLFUNC funcIn
+) {
+	Assert(threadCount == 0);
+	Assert((threads > 0) && (threads <= maxThreadsIn));
+
+	// a power of two, so positions wrap onto slots with a mask
+	LONG size = WORKERPOOLRING;
+	while (size < maxThreadsIn)
+		size *= 2;
+	ring.resize(size);
+	for (LONG index = 0; index < size; index++) {
+		ring[index].sequence = index;
+		ring[index].job = NULL;
+	}
+	mask = size - 1;
+
+	queued = CreateSemaphore(NULL, 0, size, NULL);
+	if (queued == NULL)
+		return false;
+
+	maxThreads = maxThreadsIn;
+	stackSize = stackSizeIn;
+	func = funcIn;
+	for (int index = 0; index < threads; index++) {
+		if (!addThread())
+			return false;
+	}
+	return true;
+}
+
+
+bool WorkerPool::addThread() {
+	unsigned thread;
+	HANDLE h = (HANDLE)_beginthreadex(
+		(LPSECURITY_ATTRIBUTES)NULL,
+		stackSize,
+		(BEGINTHREADFUNC)WorkerPool::threadMain,
+		(void *)this,
+		0,
+		&thread
+	);
+	if (!h)
+		return false;
+	CloseHandle(h);
+	InterlockedIncrement(&threadCount);
+	return true;
+}
+
+
+// Positions only ever count up, so they wrap; the arithmetic on them is
+// done unsigned, where wrapping is defined, and the distance between two
+// is read back as signed.
+bool WorkerPool::enqueue(void * job) {
+	ULONG pos = enqueuePos;
+	for (;;) {
+		Slot & slot = ring[pos & mask];
+		LONG diff = static_cast<LONG>(static_cast<ULONG>(slot.sequence) - pos);
+		if (diff == 0) {
+			if (
+				InterlockedCompareExchange(
+					&enqueuePos,
+					static_cast<LONG>(pos + 1),
+					static_cast<LONG>(pos)
+				) == static_cast<LONG>(pos)
+			) {
+				slot.job = job;
+				InterlockedExchange(&slot.sequence, static_cast<LONG>(pos + 1));
+				return true;
+			}
+			pos = enqueuePos;
+		} else if (diff < 0) {
+			return false; // the consumers are a whole ring behind
+		} else {
+			pos = enqueuePos;
+		}
+	}
+}
+
+
+void * WorkerPool::dequeue() {
+	ULONG pos = dequeuePos;
+	for (;;) {
+		Slot & slot = ring[pos & mask];
+		LONG diff = static_cast<LONG>(
+			static_cast<ULONG>(slot.sequence) - (pos + 1)
+		);
+		if (diff == 0) {
+			if (
+				InterlockedCompareExchange(
+					&dequeuePos,
+					static_cast<LONG>(pos + 1),
+					static_cast<LONG>(pos)
+				) == static_cast<LONG>(pos)
+			) {
+				void * job = slot.job;
+				InterlockedExchange(
+					&slot.sequence, static_cast<LONG>(pos + mask + 1)
+				);
+				return job;
+			}
+			pos = dequeuePos;
+		} else if (diff < 0) {
+			return NULL; // nothing there yet
+		} else {
+			pos = dequeuePos;
+		}
+	}
+}
+
+
+bool WorkerPool::submit(void * job) {
+	Assert(job != NULL);
+
+	// Not exact, since a thread may be just about to go idle, but the worst
+	// that happens is a thread more than was needed
+	if ((idle == 0) && (threadCount < maxThreads))
+		addThread();
+
+	if (!enqueue(job))
+		return false;
+	ReleaseSemaphore(queued, 1, NULL);
+	return true;
+}
+
+
+void WorkerPool::run() {
+	for (;;) {
+		InterlockedIncrement(&idle);
+		WaitForSingleObject(queued, INFINITE);
+		InterlockedDecrement(&idle);
+
+		// The semaphore is only released once a job is in place, but with
+		// more than one thread submitting, an earlier slot may still be
+		// being filled in
+		void * job = dequeue();
+		while (job == NULL) {
+			Sleep(0);
+			job = dequeue();
+		}
+		(*func)(job);
+	}
+}
+
+
+unsigned __stdcall WorkerPool::threadMain(void * pool) {
+	static_cast<WorkerPool *>(pool)->run();
+	return 0;
+}
+
+
+WorkerPool::~WorkerPool() {
+	// As with the event loops, the threads are never joined; they go away
+	// with the process.  The pool has to outlast any jobs in progress.
+}
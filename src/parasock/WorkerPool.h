@@ -0,0 +1,81 @@
+//
+// WorkerPool.h
+//
+// Threads started ahead of time for the blocking (thread per connection)
+// way of running, so that taking on a connection doesn't mean creating a
+// thread for it.  Jobs are handed over through a fixed ring that is safe
+// for any number of threads to put into and take from without a lock, and
+// a semaphore counts what's waiting so that idle threads can sleep.
+//
+// The pool starts out with some threads and adds more when a job arrives
+// and none are idle, up to a limit.  Threads don't go away once started;
+// they wait for the next job.
+//
+
+#ifndef __PARASOCK_WORKERPOOL_H__
+#define __PARASOCK_WORKERPOOL_H__
+
+#include <vector>
+
+#include "NetUtils.h"
+#include "Helpers.h"
+
+typedef void * (* WORKERPOOLFUNC)(void * job);
+
+
+class WorkerPool {
+private:
+	// A slot's sequence says whose turn it is: equal to the position when
+	// it's free for the producer there, one past it once filled
+	struct Slot {
+		LONG volatile sequence;
+		void * job;
+	};
+
+	std::vector<Slot> ring;
+	ULONG mask;
+	LONG volatile enqueuePos;
+	LONG volatile dequeuePos;
+
+	HANDLE queued;
+	LONG volatile idle;
+	LONG volatile threadCount;
+	LONG maxThreads;
+	unsigned stackSize;
+	WORKERPOOLFUNC func;
+
+private:
+	bool enqueue(void * job);
+	void * dequeue();
+	bool addThread();
+	void run();
+
+public:
+	WorkerPool ();
+
+private:
+	// Disable copying C++98 style
+	WorkerPool (WorkerPool const & other);
+
+public:
+	bool start(
+		int threads,
+		int maxThreads,
+		unsigned stackSize,
+		WORKERPOOLFUNC func
+	);
+
+	bool isRunning() const {
+		return threadCount > 0;
+	}
+
+	// Returns false if the job couldn't be queued (the ring is sized for
+	// maxThreads waiting jobs, so that takes a burst beyond the limit)
+	bool submit(void * job);
+
+	static unsigned __stdcall threadMain(void * pool);
+
+	virtual ~WorkerPool();
+};
+
+#endif